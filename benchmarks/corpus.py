@@ -0,0 +1,115 @@
+"""Seeded corpus generators for the benchmarks
+
+Every generator takes a random.Random and a scale factor and returns the
+same document for the same seed and scale, so results can be compared
+between runs and releases.
+"""
+import random
+import string
+
+__author__ = 'Scott Maxwell'
+
+WORDS = ('toast', 'jelly', 'jam', 'butter', 'burned', 'crust', 'rye', 'sourdough', 'bagel', 'muffin',
+         'honey', 'marmalade', 'peanut', 'almond', 'cinnamon', 'raisin', 'wheat', 'oat', 'barley', 'spelt')
+TEXT = string.ascii_letters + string.digits + ' ' * 10 + u'éüñ中文Ж'
+
+
+def _word(rng):
+    return rng.choice(WORDS)
+
+
+def _text(rng, length):
+    return u''.join(rng.choice(TEXT) for _ in range(length))
+
+
+def readme_simple(rng, scale):
+    """The first example from README.md, for checking its size claims"""
+    return {
+        "toast": True,
+        "burned": False,
+        "name": "the best",
+        "toppings": ["jelly", "jam", "butter"],
+        "dimensions": {
+            "thickness": 0.7,
+            "width": 4.5
+        }
+    }
+
+
+def readme_countries(rng, scale):
+    """The second example from README.md"""
+    return {
+        "countries": [
+            {"code": "us", "name": "United States"},
+            {"code": "ca", "name": "Canada"},
+            {"code": "mx", "name": "Mexico"}
+        ],
+        "region": 3,
+    }
+
+
+def records(rng, scale):
+    """Rows of a typical API response: a few short fields of mixed types"""
+    return [
+        {
+            'id': i,
+            'name': '{} {}'.format(_word(rng), _word(rng)),
+            'email': '{}{}@example.com'.format(_word(rng), rng.randint(1, 9999)),
+            'active': rng.random() < 0.8,
+            'score': round(rng.uniform(0, 100), 2),
+            'tags': [_word(rng) for _ in range(rng.randint(0, 4))],
+            'parent': rng.choice((None, rng.randint(0, 1000))),
+        }
+        for i in range(500 * scale)
+    ]
+
+
+def wide(rng, scale):
+    """Rows with a couple of hundred columns, more than the key table holds"""
+    columns = ['{}_{}'.format(_word(rng), i) for i in range(200)]
+    return [dict((column, rng.randint(-1000, 1000)) for column in columns) for _ in range(25 * scale)]
+
+
+def deep(rng, scale):
+    """Narrow trees nested a hundred levels deep"""
+    def node(depth):
+        if depth == 0:
+            return _word(rng)
+        if rng.random() < 0.5:
+            return {'name': _word(rng), 'child': node(depth - 1), 'size': rng.randint(0, 100)}
+        return [node(depth - 1), rng.randint(0, 100)]
+    return [node(100) for _ in range(10 * scale)]
+
+
+def floats(rng, scale):
+    """Vectors of full precision doubles"""
+    return [[rng.uniform(-1e6, 1e6) for _ in range(100)] for _ in range(20 * scale)]
+
+
+def blobs(rng, scale):
+    """Binary payloads of a few KB each (not representable in JSON)"""
+    return [
+        {'name': _word(rng), 'data': bytes(bytearray(rng.getrandbits(8) for _ in range(rng.randint(256, 4096))))}
+        for _ in range(10 * scale)
+    ]
+
+
+def strings(rng, scale):
+    """Free text with some non-ASCII characters"""
+    return [_text(rng, rng.randint(5, 500)) for _ in range(200 * scale)]
+
+
+CORPORA = {
+    'readme_simple': readme_simple,
+    'readme_countries': readme_countries,
+    'records': records,
+    'wide': wide,
+    'deep': deep,
+    'floats': floats,
+    'blobs': blobs,
+    'strings': strings,
+}
+
+
+def generate(name, seed=0, scale=1):
+    return CORPORA[name](random.Random(seed), scale)
@@ -0,0 +1,193 @@
+#!/usr/bin/env python
+"""Benchmark pbjson against json, marshal and pickle
+
+    python benchmarks/run.py [--corpus records ...] [--codec pbjson-c ...]
+                             [--scale N] [--repeat N] [--seed N]
+                             [--output results.json] [--compare old.json]
+
+For every corpus and codec this measures the encoded size, encode and
+decode latency percentiles and throughput, and the peak memory allocated
+while encoding and decoding. Results are printed as a table and, with
+--output, written as JSON so runs can be compared with --compare.
+"""
+from __future__ import print_function
+
+import argparse
+import gc
+import json
+import marshal
+import os
+import pickle
+import platform
+import sys
+import time
+import tracemalloc
+from decimal import Decimal
+
+sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+
+import pbjson
+from pbjson import decoder, encoder
+from pbjson.compat import Mapping
+from benchmarks.corpus import CORPORA, generate
+
+__author__ = 'Scott Maxwell'
+
+
+def _pbjson_codec(iterencoder, decode):
+    if iterencoder is None or decode is None:
+        return None
+
+    def dumps(obj):
+        return b''.join(iterencoder(obj, Decimal, Mapping, False, True, None, None, encoder.default_converter, False))
+
+    def loads(data):
+        return decode(data, None, None, None, 'strict')
+    return dumps, loads
+
+
+CODECS = {
+    'pbjson-c': _pbjson_codec(encoder.c_iterencoder, decoder.c_decoder),
+    'pbjson-py': _pbjson_codec(encoder.py_iterencoder, decoder.py_decoder),
+    'json': (lambda obj: json.dumps(obj, separators=(',', ':')).encode('utf-8'), lambda data: json.loads(data.decode('utf-8'))),
+    'marshal': (marshal.dumps, marshal.loads),
+    'pickle': (lambda obj: pickle.dumps(obj, pickle.HIGHEST_PROTOCOL), pickle.loads),
+}
+
+
+def percentile(ordered, fraction):
+    return ordered[min(len(ordered) - 1, int(len(ordered) * fraction))]
+
+
+def time_calls(function, argument, repeat):
+    timings = []
+    for _ in range(repeat):
+        start = time.perf_counter()
+        function(argument)
+        timings.append(time.perf_counter() - start)
+    timings.sort()
+    return timings
+
+
+def summarize(timings, size):
+    total = sum(timings)
+    return {
+        'mean_us': total / len(timings) * 1e6,
+        'p50_us': percentile(timings, 0.5) * 1e6,
+        'p90_us': percentile(timings, 0.9) * 1e6,
+        'p99_us': percentile(timings, 0.99) * 1e6,
+        'min_us': timings[0] * 1e6,
+        'mb_per_sec': size * len(timings) / total / 1e6 if total else None,
+    }
+
+
+def peak_memory(function, argument):
+    gc.collect()
+    tracemalloc.start()
+    try:
+        function(argument)
+        return tracemalloc.get_traced_memory()[1]
+    finally:
+        tracemalloc.stop()
+
+
+def run_one(doc, dumps, loads, repeat):
+    try:
+        encoded = dumps(doc)
+    except (TypeError, ValueError) as e:
+        return {'error': 'unsupported: {}'.format(e)}
+    size = len(encoded)
+    # Warm up caches before timing
+    dumps(doc)
+    loads(encoded)
+    return {
+        'size': size,
+        'roundtrip': loads(encoded) == doc,
+        'encode': summarize(time_calls(dumps, doc, repeat), size),
+        'decode': summarize(time_calls(loads, encoded, repeat), size),
+        'encode_peak_bytes': peak_memory(dumps, doc),
+        'decode_peak_bytes': peak_memory(loads, encoded),
+    }
+
+
+def run(corpora, codecs, seed, scale, repeat):
+    results = []
+    for corpus in corpora:
+        doc = generate(corpus, seed, scale)
+        for codec in codecs:
+            functions = CODECS[codec]
+            if functions is None:
+                result = {'error': 'unavailable'}
+            else:
+                result = run_one(doc, functions[0], functions[1], repeat)
+            result.update(corpus=corpus, codec=codec)
+            results.append(result)
+            print_result(result)
+    return {
+        'meta': {
+            'pbjson_version': pbjson.__version__,
+            'python': sys.version.split()[0],
+            'implementation': platform.python_implementation(),
+            'platform': platform.platform(),
+            'machine': platform.machine(),
+            'speedups': pbjson._has_encoder_speedups(),
+            'seed': seed,
+            'scale': scale,
+            'repeat': repeat,
+            'time': time.strftime('%Y-%m-%dT%H:%M:%SZ', time.gmtime()),
+        },
+        'results': results,
+    }
+
+
+def print_result(result):
+    if 'error' in result:
+        print('{corpus:8} {codec:10} {error}'.format(**result))
+        return
+    print('{:8} {:10} {:>9} bytes  encode p50 {:>10.1f}us {:>8.1f}MB/s  decode p50 {:>10.1f}us {:>8.1f}MB/s  peak {:>9}/{:<9}{}'.format(
+        result['corpus'], result['codec'], result['size'],
+        result['encode']['p50_us'], result['encode']['mb_per_sec'],
+        result['decode']['p50_us'], result['decode']['mb_per_sec'],
+        result['encode_peak_bytes'], result['decode_peak_bytes'],
+        '' if result['roundtrip'] else '  (lossy roundtrip)'))
+
+
+def compare(baseline, current):
+    """Print the ratio of current to baseline p50 latency and size"""
+    old = dict(((r['corpus'], r['codec']), r) for r in baseline['results'] if 'error' not in r)
+    print('\nCompared with {} ({}):'.format(baseline['meta']['pbjson_version'], baseline['meta']['time']))
+    for result in current['results']:
+        before = old.get((result['corpus'], result['codec']))
+        if before is None or 'error' in result:
+            continue
+        print('{:8} {:10} size {:6.2f}x  encode {:6.2f}x  decode {:6.2f}x'.format(
+            result['corpus'], result['codec'],
+            result['size'] / float(before['size']),
+            result['encode']['p50_us'] / before['encode']['p50_us'],
+            result['decode']['p50_us'] / before['decode']['p50_us']))
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description='Benchmark pbjson against json, marshal and pickle')
+    parser.add_argument('--corpus', action='append', choices=sorted(CORPORA), help='corpus to run (default: all)')
+    parser.add_argument('--codec', action='append', choices=sorted(CODECS), help='codec to run (default: all)')
+    parser.add_argument('--seed', type=int, default=0)
+    parser.add_argument('--scale', type=int, default=1, help='multiplies the size of each corpus')
+    parser.add_argument('--repeat', type=int, default=50, help='timed calls per measurement')
+    parser.add_argument('--output', help='write results as JSON to this file')
+    parser.add_argument('--compare', help='JSON results of an earlier run to compare with')
+    args = parser.parse_args(argv)
+
+    corpora = args.corpus or sorted(CORPORA)
+    codecs = args.codec or ['pbjson-c', 'pbjson-py', 'json', 'marshal', 'pickle']
+    results = run(corpora, codecs, args.seed, args.scale, args.repeat)
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+    if args.compare:
+        with open(args.compare) as f:
+            compare(json.load(f), results)
+
+
+if __name__ == '__main__':
+    main()
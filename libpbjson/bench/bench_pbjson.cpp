@@ -0,0 +1,78 @@
+// Native microbenchmarks for libpbjson: writing, skipping with the Cursor
+// and building a Document for a list of small records, the shape of the
+// Python benchmarks' "records" corpus.
+#include "pbjson/pbjson.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+using Clock = std::chrono::steady_clock;
+
+static void write_records(pbjson::Writer &writer, int count)
+{
+    static const char *const names[] = {"alpha", "bravo", "charlie", "delta"};
+    writer.begin_list(count);
+    for (int i = 0; i < count; i++) {
+        writer.begin_dict(5);
+        writer.key("id");
+        writer.int64(i);
+        writer.key("name");
+        writer.string(names[i & 3]);
+        writer.key("score");
+        writer.number(i * 0.25);
+        writer.key("active");
+        writer.boolean(i & 1);
+        writer.key("tags");
+        writer.begin_list(2);
+        writer.string("x");
+        writer.string("y");
+    }
+}
+
+template <class F>
+static double best_of(int repeats, F function)
+{
+    double best = 1e30;
+    for (int i = 0; i < repeats; i++) {
+        auto start = Clock::now();
+        function();
+        double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        if (elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+static void report(const char *name, double seconds, size_t bytes)
+{
+    std::printf("%-10s %9.3f ms %9.1f MB/s\n", name, seconds * 1e3, bytes / seconds / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    int count = argc > 1 ? std::atoi(argv[1]) : 100000;
+    int repeats = argc > 2 ? std::atoi(argv[2]) : 10;
+    pbjson::Writer writer;
+    write_records(writer, count);
+    const std::string encoded = writer.take();
+    std::printf("%d records, %zu bytes\n", count, encoded.size());
+
+    report("write", best_of(repeats, [&] {
+        writer.clear();
+        write_records(writer, count);
+    }), encoded.size());
+    report("skip", best_of(repeats, [&] {
+        pbjson::Cursor cursor(encoded);
+        cursor.skip();
+    }), encoded.size());
+    pbjson::Arena arena;
+    report("document", best_of(repeats, [&] {
+        arena.clear();
+        pbjson::Document document(encoded, arena);
+        if (document.root().size() != static_cast<size_t>(count))
+            std::abort();
+    }), encoded.size());
+    return 0;
+}
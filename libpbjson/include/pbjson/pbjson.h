@@ -0,0 +1,331 @@
+/* -*- mode: C; c-file-style: "python"; c-basic-offset: 4 -*- */
+/* Token-level Packed Binary JSON primitives.
+
+   Header-only and free of Python, allocation and I/O, so the same code
+   writes and reads tokens for the Python extension and for pbjson.hpp.
+   Each function works on caller-owned memory: writers return the number of
+   bytes they stored and readers are handed bytes the caller has already
+   checked are available. */
+#ifndef PBJSON_H
+#define PBJSON_H
+
+#include <float.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_MSC_VER) && !defined(__cplusplus)
+#define PBJSON_API static __inline
+#else
+#define PBJSON_API static inline
+#endif
+
+/* Tokens with no length: the whole byte is the token */
+#define PBJSON_FALSE 0
+#define PBJSON_TRUE 1
+#define PBJSON_NULL 2
+#define PBJSON_INF 3
+#define PBJSON_NEGINF 4
+#define PBJSON_NAN 5
+#define PBJSON_TERMINATED_LIST 0xc
+#define PBJSON_TERMINATED_DICT 0xd
+#define PBJSON_CUSTOM 0xe
+#define PBJSON_TERMINATOR 0xf
+#define PBJSON_TYPED_ARRAY 0x10
+#define PBJSON_TABLE 0x11
+#define PBJSON_VALUE_DEF 0x12
+#define PBJSON_VALUE_REF 0x13
+#define PBJSON_VALUE_REF16 0x14
+#define PBJSON_COMPRESSED 0x15
+#define PBJSON_EXT 0x16
+#define PBJSON_FRAGMENT 0x17
+/* Prefix to a string, binary, list or dict token with all its length bits
+   set, whose length then takes eight bytes instead of four */
+#define PBJSON_LONG_LENGTH 0x18
+
+/* Tokens in the top three bits, with a length below them */
+#define PBJSON_INT 0x20
+#define PBJSON_NEGINT 0x40
+#define PBJSON_FLOAT 0x60
+#define PBJSON_STRING 0x80
+#define PBJSON_BINARY 0xA0
+#define PBJSON_LIST 0xC0
+#define PBJSON_DICT 0xE0
+
+/* Float characters packed into nibbles */
+#define PBJSON_FLT_PLUS 0xa
+#define PBJSON_FLT_MINUS 0xb
+#define PBJSON_FLT_DECIMAL 0xd
+#define PBJSON_FLT_E 0xe
+
+/* A long length prefix, a token byte and at most eight length bytes */
+#define PBJSON_HEADER_MAX 10
+/* Keys are at most 127 bytes and the first 128 can be referred back to */
+#define PBJSON_KEY_MAX 127
+#define PBJSON_KEY_REFS 128
+/* Strings with this many bytes can be remembered as values */
+#define PBJSON_VALUE_REF_MIN 3
+#define PBJSON_VALUE_REF_MAX 127
+#define PBJSON_VALUE_REF_LIMIT 0x10000
+/* Longest packed float a reader accepts, and the text it unpacks to */
+#define PBJSON_FLOAT_MAX 0x1f
+#define PBJSON_FLOAT_CHARS 0x40
+
+PBJSON_API size_t
+pbjson_put_header(unsigned char *out, unsigned char token, uint64_t length)
+{
+    /* Write token with length folded in, returning 1, 2, 3, 5 or 10 bytes */
+    size_t i;
+    if (length < 16) {
+        out[0] = token | (unsigned char)length;
+        return 1;
+    }
+    if (length < 2048) {
+        out[0] = token | 0x10 | (unsigned char)(length >> 8);
+        out[1] = (unsigned char)length;
+        return 2;
+    }
+    if (length < 458752) {
+        out[0] = token | 0x18 | (unsigned char)(length >> 16);
+        out[1] = (unsigned char)(length >> 8);
+        out[2] = (unsigned char)length;
+        return 3;
+    }
+    if (length <= 0xffffffffu) {
+        out[0] = token | 0x1f;
+        out[1] = (unsigned char)(length >> 24);
+        out[2] = (unsigned char)(length >> 16);
+        out[3] = (unsigned char)(length >> 8);
+        out[4] = (unsigned char)length;
+        return 5;
+    }
+    out[0] = PBJSON_LONG_LENGTH;
+    out[1] = token | 0x1f;
+    for (i = 9; i > 1; --i) {
+        out[i] = (unsigned char)length;
+        length >>= 8;
+    }
+    return 10;
+}
+
+PBJSON_API int
+pbjson_long_token(unsigned char first_byte)
+{
+    /* Whether first_byte may follow PBJSON_LONG_LENGTH, with the eight
+       length bytes after it */
+    return (first_byte & 0x1f) == 0x1f && (first_byte & 0xe0) >= PBJSON_STRING;
+}
+
+PBJSON_API size_t
+pbjson_length_size(unsigned char first_byte)
+{
+    /* Number of length bytes following a token with a length */
+    if (!(first_byte & 0x10))
+        return 0;
+    if ((first_byte & 0xf) == 0xf)
+        return 4;
+    return first_byte & 0x8 ? 2 : 1;
+}
+
+PBJSON_API uint32_t
+pbjson_get_length(unsigned char first_byte, const unsigned char *extra)
+{
+    /* The length of a token, given its pbjson_length_size() extra bytes */
+    size_t lenlen = pbjson_length_size(first_byte);
+    uint32_t length = first_byte & 0xf;
+    if (lenlen == 4)
+        length = 0;
+    else if (lenlen)
+        length &= 0x7;
+    while (lenlen--) {
+        length = (length << 8) | *extra++;
+    }
+    return length;
+}
+
+PBJSON_API size_t
+pbjson_put_uint(unsigned char *out, uint64_t magnitude)
+{
+    /* Write magnitude big endian without leading zero bytes, so zero takes
+       none; out must have room for eight */
+    size_t length = 0;
+    uint64_t rest = magnitude;
+    size_t i;
+    while (rest) {
+        ++length;
+        rest >>= 8;
+    }
+    for (i = length; i; --i) {
+        out[i - 1] = (unsigned char)magnitude;
+        magnitude >>= 8;
+    }
+    return length;
+}
+
+PBJSON_API uint64_t
+pbjson_get_uint(const unsigned char *bytes, size_t length)
+{
+    /* Read at most eight big endian bytes */
+    uint64_t magnitude = 0;
+    while (length--) {
+        magnitude = (magnitude << 8) | *bytes++;
+    }
+    return magnitude;
+}
+
+PBJSON_API unsigned char
+pbjson_float_nibble(char c)
+{
+    if (c >= '0' && c <= '9')
+        return (unsigned char)(c - '0');
+    switch (c) {
+        case '+': return PBJSON_FLT_PLUS;
+        case '-': return PBJSON_FLT_MINUS;
+        case '.': return PBJSON_FLT_DECIMAL;
+        case 'e': case 'E': return PBJSON_FLT_E;
+    }
+    return 0;
+}
+
+PBJSON_API char
+pbjson_float_char(unsigned char nibble)
+{
+    /* The character for a nibble, or 0 for the unused codes */
+    if (nibble <= 9)
+        return (char)('0' + nibble);
+    switch (nibble) {
+        case PBJSON_FLT_PLUS: return '+';
+        case PBJSON_FLT_MINUS: return '-';
+        case PBJSON_FLT_DECIMAL: return '.';
+        case PBJSON_FLT_E: return 'e';
+    }
+    return 0;
+}
+
+PBJSON_API size_t
+pbjson_pack_float(unsigned char *out, const char *str, size_t len)
+{
+    /* Pack a number's text two characters to a byte, dropping leading
+       zeros and a trailing ".0" and padding with a decimal point. out needs
+       len / 2 + 1 bytes. */
+    size_t count = 0;
+    int half = 0;
+    unsigned char c = 0;
+    if (len && str[0] == '-') {
+        c = PBJSON_FLT_MINUS << 4;
+        half = 1;
+        ++str;
+        --len;
+    }
+    while (len && *str == '0') {
+        --len;
+        ++str;
+    }
+    if (len > 1 && str[len - 1] == '0' && str[len - 2] == '.') {
+        len -= 2;
+    }
+    while (len--) {
+        unsigned char nibble = pbjson_float_nibble(*str++);
+        if (half) {
+            out[count++] = c | nibble;
+            half = 0;
+        }
+        else {
+            c = (unsigned char)(nibble << 4);
+            half = 1;
+        }
+    }
+    if (half) {
+        out[count++] = c | PBJSON_FLT_DECIMAL;
+    }
+    return count;
+}
+
+PBJSON_API size_t
+pbjson_unpack_float(char *out, const unsigned char *bytes, size_t length)
+{
+    /* Unpack at most PBJSON_FLOAT_MAX bytes into PBJSON_FLOAT_CHARS of
+       text for strtod, returning its length. An unused nibble unpacks to a
+       NUL, which ends the text early so the number fails to parse. */
+    size_t count = 0;
+    if (!length) {
+        out[count++] = '0';
+    }
+    while (length--) {
+        out[count++] = pbjson_float_char(*bytes >> 4);
+        out[count++] = pbjson_float_char(*bytes++ & 0xf);
+    }
+    if (out[count - 1] == '.') {
+        --count;
+    }
+    if (count == 1 && out[0] == '-') {
+        /* Negative zero has no digits left once its zeros are stripped */
+        out[count++] = '0';
+    }
+    out[count] = 0;
+    return count;
+}
+
+PBJSON_API unsigned char
+pbjson_dtoa_check(double value)
+{
+    /* PBJSON_FLOAT for a finite value, otherwise its own token */
+    if (value != value)
+        return PBJSON_NAN;
+    if (value - value != 0.0)
+        return value < 0 ? PBJSON_NEGINF : PBJSON_INF;
+    return PBJSON_FLOAT;
+}
+
+PBJSON_API unsigned char
+pbjson_dtoa(double value, char out[PBJSON_FLOAT_CHARS])
+{
+    /* Write the shortest text that reads back as value and return
+       PBJSON_FLOAT, or return the token for an infinity or NaN. Uses the C
+       locale's decimal point. */
+    int precision;
+    unsigned char token = pbjson_dtoa_check(value);
+    if (token != PBJSON_FLOAT)
+        return token;
+    /* Any decimal of at most 15 digits survives a round trip through a
+       normal double, so if 15 digits read back they are already the
+       shortest. Subnormals carry fewer digits, so those are searched from
+       one digit up. */
+    precision = value != 0.0 && (value < 0 ? -value : value) < DBL_MIN ? 1 : 15;
+    for (; precision < 17; precision++) {
+        snprintf(out, PBJSON_FLOAT_CHARS, "%.*g", precision, value);
+        if (strtod(out, NULL) == value)
+            return PBJSON_FLOAT;
+    }
+    snprintf(out, PBJSON_FLOAT_CHARS, "%.17g", value);
+    return PBJSON_FLOAT;
+}
+
+PBJSON_API int
+pbjson_typed_array_itemsize(unsigned char code)
+{
+    /* Element size for a typed array code, or 0 if it isn't one */
+    switch (code) {
+        case 'b': case 'B':
+            return 1;
+        case 'h': case 'H':
+            return 2;
+        case 'i': case 'I': case 'f':
+            return 4;
+        case 'q': case 'Q': case 'd':
+            return 8;
+    }
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PBJSON_H */
@@ -0,0 +1,843 @@
+// -*- mode: C++; c-basic-offset: 4 -*-
+// Packed Binary JSON for C++17: a Writer, a pull Cursor over encoded
+// bytes and an arena-allocated Document built on the Cursor.
+//
+// Strings, binaries and typed arrays read by the Cursor and Document are
+// views into the input, which must outlive them.
+#ifndef PBJSON_HPP
+#define PBJSON_HPP
+
+#include "pbjson.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace pbjson {
+
+class Error : public std::runtime_error {
+public:
+    explicit Error(const char *message) : std::runtime_error(message) {}
+};
+
+namespace detail {
+
+inline bool little_endian()
+{
+    const uint16_t one = 1;
+    unsigned char first;
+    std::memcpy(&first, &one, 1);
+    return first == 1;
+}
+
+template <class T> struct typed_array_code;
+template <> struct typed_array_code<int8_t> { static constexpr char value = 'b'; };
+template <> struct typed_array_code<uint8_t> { static constexpr char value = 'B'; };
+template <> struct typed_array_code<int16_t> { static constexpr char value = 'h'; };
+template <> struct typed_array_code<uint16_t> { static constexpr char value = 'H'; };
+template <> struct typed_array_code<int32_t> { static constexpr char value = 'i'; };
+template <> struct typed_array_code<uint32_t> { static constexpr char value = 'I'; };
+template <> struct typed_array_code<int64_t> { static constexpr char value = 'q'; };
+template <> struct typed_array_code<uint64_t> { static constexpr char value = 'Q'; };
+template <> struct typed_array_code<float> { static constexpr char value = 'f'; };
+template <> struct typed_array_code<double> { static constexpr char value = 'd'; };
+
+} // namespace detail
+
+// Writes one document into a growing byte string. Containers are written
+// with their item count up front, except unsized lists and dicts, which
+// end with end_list() and end_dict(). Keys are remembered so repeats take a single byte.
+class Writer {
+public:
+    struct Options {
+        // Remember short string values and write repeats as references
+        bool value_refs = false;
+    };
+
+    Writer() = default;
+    explicit Writer(Options options) : options_(options) {}
+
+    void null() { put(PBJSON_NULL); }
+    void boolean(bool value) { put(value ? PBJSON_TRUE : PBJSON_FALSE); }
+
+    void int64(int64_t value)
+    {
+        if (value < 0)
+            integer(PBJSON_NEGINT, 0 - static_cast<uint64_t>(value));
+        else
+            integer(PBJSON_INT, static_cast<uint64_t>(value));
+    }
+
+    void uint64(uint64_t value) { integer(PBJSON_INT, value); }
+
+    // An integer of any size from its big endian magnitude
+    void big_integer(bool negative, const void *magnitude, size_t size)
+    {
+        const unsigned char *bytes = static_cast<const unsigned char *>(magnitude);
+        while (size && !*bytes) {
+            ++bytes;
+            --size;
+        }
+        content(negative && size ? PBJSON_NEGINT : PBJSON_INT, bytes, size);
+    }
+
+    void number(double value)
+    {
+        char text[PBJSON_FLOAT_CHARS];
+        unsigned char token = pbjson_dtoa_check(value);
+        if (token != PBJSON_FLOAT) {
+            put(token);
+            return;
+        }
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+        // The shortest text that reads back, without pbjson_dtoa's retries
+        size_t size = static_cast<size_t>(std::to_chars(text, text + sizeof(text), value).ptr - text);
+#else
+        pbjson_dtoa(value, text);
+        size_t size = std::strlen(text);
+#endif
+        unsigned char packed[PBJSON_FLOAT_CHARS / 2 + 1];
+        content(PBJSON_FLOAT, packed, pbjson_pack_float(packed, text, size));
+    }
+
+    void string(std::string_view value)
+    {
+        if (options_.value_refs && value.size() >= PBJSON_VALUE_REF_MIN && value.size() <= PBJSON_VALUE_REF_MAX) {
+            auto found = values_.find(value);
+            if (found != values_.end()) {
+                if (found->second < 0x100) {
+                    unsigned char ref[2] = {PBJSON_VALUE_REF, static_cast<unsigned char>(found->second)};
+                    append(ref, 2);
+                }
+                else {
+                    unsigned char ref[3] = {PBJSON_VALUE_REF16, static_cast<unsigned char>(found->second >> 8),
+                                            static_cast<unsigned char>(found->second)};
+                    append(ref, 3);
+                }
+                return;
+            }
+            if (values_.size() < PBJSON_VALUE_REF_LIMIT) {
+                values_.emplace(remember(value), static_cast<uint32_t>(values_.size()));
+                put(PBJSON_VALUE_DEF);
+            }
+        }
+        content(PBJSON_STRING, value.data(), value.size());
+    }
+
+    void binary(const void *data, size_t size) { content(PBJSON_BINARY, data, size); }
+
+    // Elements are written little endian whatever the host order
+    template <class T>
+    void typed_array(const T *items, size_t count)
+    {
+        static_assert(std::is_arithmetic<T>::value, "typed arrays hold numbers");
+        unsigned char header[2] = {PBJSON_TYPED_ARRAY, static_cast<unsigned char>(detail::typed_array_code<T>::value)};
+        append(header, 2);
+        if (sizeof(T) == 1 || detail::little_endian()) {
+            binary(items, count * sizeof(T));
+            return;
+        }
+        length(PBJSON_BINARY, count * sizeof(T));
+        for (size_t i = 0; i < count; i++) {
+            unsigned char item[sizeof(T)];
+            std::memcpy(item, &items[i], sizeof(T));
+            for (size_t j = sizeof(T); j; j--)
+                out_.push_back(static_cast<char>(item[j - 1]));
+        }
+    }
+
+    void begin_list(size_t count) { length(PBJSON_LIST, count); }
+    void begin_list() { put(PBJSON_TERMINATED_LIST); }
+    void end_list() { put(PBJSON_TERMINATOR); }
+    void begin_dict(size_t count) { length(PBJSON_DICT, count); }
+    void begin_dict() { put(PBJSON_TERMINATED_DICT); }
+    void end_dict() { put(PBJSON_TERMINATOR); }
+
+    void key(std::string_view name)
+    {
+        if (name.size() > PBJSON_KEY_MAX)
+            throw Error("keys must be at most 127 bytes");
+        auto found = keys_.find(name);
+        if (found != keys_.end()) {
+            put(static_cast<unsigned char>(0x80 | found->second));
+            return;
+        }
+        put(static_cast<unsigned char>(name.size()));
+        append(name.data(), name.size());
+        if (keys_.size() < PBJSON_KEY_REFS)
+            keys_.emplace(remember(name), static_cast<unsigned char>(keys_.size()));
+    }
+
+    // A table is a list of rows sharing their keys: write the column keys
+    // with key(), then rows * columns values row by row
+    void begin_table(size_t rows, size_t columns)
+    {
+        put(PBJSON_TABLE);
+        length(PBJSON_LIST, rows);
+        length(PBJSON_DICT, columns);
+    }
+
+    // The next value is the payload of extension type_id
+    void extension(unsigned char type_id)
+    {
+        unsigned char header[2] = {PBJSON_EXT, type_id};
+        append(header, 2);
+    }
+
+    // The next value is passed to the reader's custom hook
+    void custom() { put(PBJSON_CUSTOM); }
+
+    // Embed a whole uncompressed document, such as another Writer's data(),
+    // as the next value. It keeps its own keys and values, so it neither
+    // refers to this document's nor changes their numbering.
+    void fragment(std::string_view encoded)
+    {
+        if (encoded.empty() || static_cast<unsigned char>(encoded[0]) == PBJSON_COMPRESSED)
+            throw Error("a fragment must be an uncompressed document");
+        put(PBJSON_FRAGMENT);
+        append(encoded.data(), encoded.size());
+    }
+
+    const std::string &data() const { return out_; }
+    std::string take()
+    {
+        std::string result;
+        result.swap(out_);
+        clear();
+        return result;
+    }
+
+    // Start a new document, forgetting remembered keys and values
+    void clear()
+    {
+        out_.clear();
+        keys_.clear();
+        values_.clear();
+        names_.clear();
+    }
+
+private:
+    // Keep a copy that the memos can view; a deque never moves its strings
+    std::string_view remember(std::string_view text)
+    {
+        names_.emplace_back(text);
+        return names_.back();
+    }
+
+    void put(unsigned char byte) { out_.push_back(static_cast<char>(byte)); }
+    void append(const void *data, size_t size) { out_.append(static_cast<const char *>(data), size); }
+
+    void length(unsigned char token, size_t size)
+    {
+        unsigned char header[PBJSON_HEADER_MAX];
+        append(header, pbjson_put_header(header, token, size));
+    }
+
+    void content(unsigned char token, const void *data, size_t size)
+    {
+        length(token, size);
+        append(data, size);
+    }
+
+    void integer(unsigned char token, uint64_t magnitude)
+    {
+        unsigned char bytes[8];
+        content(token, bytes, pbjson_put_uint(bytes, magnitude));
+    }
+
+    Options options_;
+    std::string out_;
+    std::deque<std::string> names_;
+    std::unordered_map<std::string_view, unsigned char> keys_;
+    std::unordered_map<std::string_view, uint32_t> values_;
+};
+
+enum class Type : uint8_t {
+    Null,
+    False,
+    True,
+    Int,         // negative and magnitude
+    BigInt,      // negative and bytes, the big endian magnitude
+    Float,       // number, including infinities and NaN
+    String,      // bytes, UTF-8
+    Binary,      // bytes
+    List,        // length items, or unsized until End
+    Dict,        // length key and value pairs, or unsized until End
+    End,         // closes an unsized list or dict
+    TypedArray,  // code and bytes, the little endian elements
+    Table,       // length rows and columns keys, then the values row by row
+    Extension,   // code is the type ID, the payload is the next value
+    Custom,      // the next value is for the custom hook
+    Fragment,    // bytes, a document with keys and values of its own
+};
+
+constexpr size_t unsized = static_cast<size_t>(-1);
+
+struct Token {
+    Type type = Type::Null;
+    bool negative = false;
+    unsigned char code = 0;
+    uint64_t magnitude = 0;
+    double number = 0;
+    std::string_view bytes;
+    size_t length = 0;
+    size_t columns = 0;
+
+    // The value of an Int, throwing if it doesn't fit
+    int64_t as_int64() const
+    {
+        if (type != Type::Int)
+            throw Error("not an integer that fits in 64 bits");
+        if (negative) {
+            if (magnitude > static_cast<uint64_t>(std::numeric_limits<int64_t>::max()) + 1)
+                throw Error("integer does not fit in 64 bits");
+            return static_cast<int64_t>(0 - magnitude);
+        }
+        if (magnitude > static_cast<uint64_t>(std::numeric_limits<int64_t>::max()))
+            throw Error("integer does not fit in 64 bits");
+        return static_cast<int64_t>(magnitude);
+    }
+};
+
+// Reads tokens one at a time without building anything. The caller follows
+// the structure: after a Dict of length n, call key() and next() n times.
+// Unsized containers go on until peek() is PBJSON_TERMINATOR, read as End.
+// Malformed or truncated input throws Error.
+class Cursor {
+public:
+    Cursor(const void *data, size_t size)
+        : data_(static_cast<const unsigned char *>(data)), end_(data_ + size), start_(data_)
+    {
+    }
+    explicit Cursor(std::string_view bytes) : Cursor(bytes.data(), bytes.size()) {}
+    // The input must outlive the Cursor
+    explicit Cursor(std::string &&) = delete;
+
+    bool done() const { return data_ == end_; }
+    size_t offset() const { return static_cast<size_t>(data_ - start_); }
+    size_t remaining() const { return static_cast<size_t>(end_ - data_); }
+
+    Token next()
+    {
+        Token token;
+        unsigned char first = peek();
+        if (!(first & 0xe0) && first != PBJSON_LONG_LENGTH) {
+            ++data_;
+            switch (first) {
+                case PBJSON_FALSE: token.type = Type::False; return token;
+                case PBJSON_TRUE: token.type = Type::True; return token;
+                case PBJSON_NULL: token.type = Type::Null; return token;
+                case PBJSON_INF:
+                case PBJSON_NEGINF:
+                case PBJSON_NAN:
+                    token.type = Type::Float;
+                    token.number = first == PBJSON_NAN ? std::numeric_limits<double>::quiet_NaN()
+                                                       : std::numeric_limits<double>::infinity();
+                    if (first == PBJSON_NEGINF)
+                        token.number = -token.number;
+                    return token;
+                case PBJSON_TERMINATED_LIST:
+                    token.type = Type::List;
+                    token.length = unsized;
+                    return token;
+                case PBJSON_TERMINATED_DICT:
+                    token.type = Type::Dict;
+                    token.length = unsized;
+                    return token;
+                case PBJSON_TERMINATOR: token.type = Type::End; return token;
+                case PBJSON_CUSTOM: token.type = Type::Custom; return token;
+                case PBJSON_TYPED_ARRAY: return typed_array();
+                case PBJSON_TABLE:
+                    token.type = Type::Table;
+                    token.length = container(PBJSON_LIST);
+                    token.columns = container(PBJSON_DICT);
+                    if (!token.columns)
+                        throw Error("tables need at least one column");
+                    return token;
+                case PBJSON_VALUE_DEF: {
+                    if (data_ == end_ || (*data_ & 0xe0) != PBJSON_STRING)
+                        throw Error("a value definition must hold a string");
+                    token = next();
+                    if (values_.size() < PBJSON_VALUE_REF_LIMIT)
+                        values_.push_back(token.bytes);
+                    return token;
+                }
+                case PBJSON_VALUE_REF:
+                case PBJSON_VALUE_REF16: {
+                    size_t index = byte();
+                    if (first == PBJSON_VALUE_REF16)
+                        index = index << 8 | byte();
+                    if (index >= values_.size())
+                        throw Error("reference to an undefined value");
+                    token.type = Type::String;
+                    token.bytes = values_[index];
+                    return token;
+                }
+                case PBJSON_EXT:
+                    token.type = Type::Extension;
+                    token.code = byte();
+                    return token;
+                case PBJSON_FRAGMENT: {
+                    // Its extent is only known by passing over it
+                    Cursor inner(data_, remaining());
+                    inner.skip();
+                    token.type = Type::Fragment;
+                    token.bytes = bytes(inner.offset());
+                    return token;
+                }
+                case PBJSON_COMPRESSED:
+                    throw Error("compressed documents must be decompressed first");
+            }
+            throw Error("invalid token");
+        }
+        size_t size = header(first);
+        unsigned char type = first & 0xe0;
+        switch (type) {
+            case PBJSON_INT:
+            case PBJSON_NEGINT:
+                token.negative = type == PBJSON_NEGINT;
+                token.bytes = bytes(size);
+                if (size <= 8) {
+                    token.type = Type::Int;
+                    token.magnitude = pbjson_get_uint(reinterpret_cast<const unsigned char *>(token.bytes.data()), size);
+                }
+                else {
+                    token.type = Type::BigInt;
+                }
+                return token;
+            case PBJSON_FLOAT: {
+                if (size > PBJSON_FLOAT_MAX)
+                    throw Error("float is too long");
+                char text[PBJSON_FLOAT_CHARS];
+                size_t count = pbjson_unpack_float(text, data_, size);
+                data_ += size;
+                char *parsed;
+                token.type = Type::Float;
+                token.number = std::strtod(text, &parsed);
+                if (parsed != text + count)
+                    throw Error("invalid float");
+                return token;
+            }
+            case PBJSON_STRING:
+                token.type = Type::String;
+                token.bytes = bytes(size);
+                return token;
+            case PBJSON_BINARY:
+                token.type = Type::Binary;
+                token.bytes = bytes(size);
+                return token;
+            case PBJSON_LIST:
+            case PBJSON_DICT:
+                // Every item takes at least a byte
+                if (size > remaining())
+                    throw Error("container is longer than the input");
+                token.type = type == PBJSON_LIST ? Type::List : Type::Dict;
+                token.length = size;
+                return token;
+        }
+        throw Error("invalid token");
+    }
+
+    std::string_view key()
+    {
+        unsigned char first = byte();
+        if (first & 0x80) {
+            if ((first & 0x7f) >= keys_.size())
+                throw Error("reference to an undefined key");
+            return keys_[first & 0x7f];
+        }
+        std::string_view name = bytes(first);
+        if (keys_.size() < PBJSON_KEY_REFS)
+            keys_.push_back(name);
+        return name;
+    }
+
+    // Pass over the next value and everything inside it
+    void skip()
+    {
+        Token token = next();
+        switch (token.type) {
+            case Type::List:
+                if (token.length == unsized) {
+                    while (peek() != PBJSON_TERMINATOR)
+                        skip();
+                    ++data_;
+                }
+                else {
+                    for (size_t i = 0; i < token.length; i++)
+                        skip();
+                }
+                break;
+            case Type::Dict:
+                if (token.length == unsized) {
+                    while (peek() != PBJSON_TERMINATOR) {
+                        key();
+                        skip();
+                    }
+                    ++data_;
+                }
+                else {
+                    for (size_t i = 0; i < token.length; i++) {
+                        key();
+                        skip();
+                    }
+                }
+                break;
+            case Type::Table:
+                for (size_t i = 0; i < token.columns; i++)
+                    key();
+                for (size_t i = 0; i < token.length; i++) {
+                    for (size_t j = 0; j < token.columns; j++)
+                        skip();
+                }
+                break;
+            case Type::Extension:
+            case Type::Custom:
+                skip();
+                break;
+            case Type::End:
+                throw Error("terminator outside an unsized container");
+            default:
+                break;
+        }
+    }
+
+    // The next byte, without consuming it
+    unsigned char peek() const
+    {
+        if (data_ == end_)
+            throw Error("truncated input");
+        return *data_;
+    }
+
+private:
+    unsigned char byte()
+    {
+        unsigned char result = peek();
+        ++data_;
+        return result;
+    }
+
+    std::string_view bytes(size_t size)
+    {
+        if (size > remaining())
+            throw Error("truncated input");
+        std::string_view result(reinterpret_cast<const char *>(data_), size);
+        data_ += size;
+        return result;
+    }
+
+    size_t length(unsigned char first)
+    {
+        size_t lenlen = pbjson_length_size(first);
+        if (lenlen > remaining())
+            throw Error("truncated input");
+        uint32_t result = pbjson_get_length(first, data_);
+        data_ += lenlen;
+        return result;
+    }
+
+    // Read a token and its length, after a long length prefix if there is
+    // one, leaving the token in first
+    size_t header(unsigned char &first)
+    {
+        first = byte();
+        if (first != PBJSON_LONG_LENGTH)
+            return length(first);
+        first = byte();
+        if (!pbjson_long_token(first))
+            throw Error("invalid long length");
+        if (remaining() < 8)
+            throw Error("truncated input");
+        uint64_t result = pbjson_get_uint(data_, 8);
+        data_ += 8;
+        if (result > std::numeric_limits<size_t>::max())
+            throw Error("length does not fit in memory");
+        return static_cast<size_t>(result);
+    }
+
+    size_t container(unsigned char type)
+    {
+        unsigned char first;
+        size_t size = header(first);
+        if ((first & 0xe0) != type)
+            throw Error("invalid table header");
+        return size;
+    }
+
+    Token typed_array()
+    {
+        Token token;
+        token.type = Type::TypedArray;
+        token.code = byte();
+        unsigned char first;
+        size_t size = header(first);
+        int itemsize = pbjson_typed_array_itemsize(token.code);
+        if (!itemsize || (first & 0xe0) != PBJSON_BINARY)
+            throw Error("invalid typed array");
+        token.bytes = bytes(size);
+        if (token.bytes.size() % itemsize)
+            throw Error("typed array length is not a whole number of elements");
+        token.length = token.bytes.size() / itemsize;
+        return token;
+    }
+
+    const unsigned char *data_;
+    const unsigned char *end_;
+    const unsigned char *start_;
+    std::vector<std::string_view> keys_;
+    std::vector<std::string_view> values_;
+};
+
+// Bump allocator for Document nodes, freed all at once
+class Arena {
+public:
+    explicit Arena(size_t block_size = 0x10000) : block_size_(block_size) {}
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    void *allocate(size_t size, size_t align = alignof(std::max_align_t))
+    {
+        size_t offset = (used_ + align - 1) & ~(align - 1);
+        if (blocks_.empty() || offset + size > capacity_) {
+            capacity_ = size > block_size_ ? size : block_size_;
+            blocks_.emplace_back(new unsigned char[capacity_]);
+            offset = 0;
+        }
+        used_ = offset + size;
+        return blocks_.back().get() + offset;
+    }
+
+    template <class T>
+    T *make_array(size_t count)
+    {
+        static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+        if (!count)
+            return nullptr;
+        T *items = static_cast<T *>(allocate(sizeof(T) * count, alignof(T)));
+        for (size_t i = 0; i < count; i++)
+            new (&items[i]) T();
+        return items;
+    }
+
+    void clear()
+    {
+        blocks_.clear();
+        used_ = capacity_ = 0;
+    }
+
+private:
+    size_t block_size_;
+    size_t used_ = 0;
+    size_t capacity_ = 0;
+    std::vector<std::unique_ptr<unsigned char[]>> blocks_;
+};
+
+struct Member;
+
+// A decoded value. Tables are expanded into a List of Dicts, Extension
+// and Custom values hold their payload in items[0], and a Fragment is
+// replaced by the value it holds.
+struct Value {
+    Type type = Type::Null;
+    bool negative = false;
+    unsigned char code = 0;
+    size_t length = 0;
+    union {
+        uint64_t magnitude;
+        double number;
+        const char *bytes;
+        Value *items;
+        Member *members;
+    };
+
+    Value() : magnitude(0) {}
+
+    bool is_null() const { return type == Type::Null; }
+    bool as_bool() const { return type == Type::True; }
+    int64_t as_int64() const
+    {
+        Token token;
+        token.type = type;
+        token.negative = negative;
+        token.magnitude = type == Type::Int ? magnitude : 0;
+        return token.as_int64();
+    }
+    double as_double() const
+    {
+        if (type == Type::Float)
+            return number;
+        if (type == Type::Int)
+            return negative ? -static_cast<double>(magnitude) : static_cast<double>(magnitude);
+        throw Error("not a number");
+    }
+    std::string_view as_string() const { return std::string_view(bytes, length); }
+
+    size_t size() const { return length; }
+    const Value &operator[](size_t index) const { return items[index]; }
+    const Value *find(std::string_view key) const;
+};
+
+struct Member {
+    std::string_view key;
+    Value value;
+};
+
+inline const Value *Value::find(std::string_view key) const
+{
+    if (type != Type::Dict)
+        return nullptr;
+    for (size_t i = 0; i < length; i++) {
+        if (members[i].key == key)
+            return &members[i].value;
+    }
+    return nullptr;
+}
+
+// Parses a whole document into an arena. Strings point into the input.
+class Document {
+public:
+    static constexpr int max_depth = 1000;
+
+    Document(const void *data, size_t size, Arena &arena) : cursor_(data, size), arena_(arena)
+    {
+        read(root_, 0);
+        if (!cursor_.done())
+            throw Error("extra data after the document");
+    }
+    Document(std::string_view bytes, Arena &arena) : Document(bytes.data(), bytes.size(), arena) {}
+    // The input must outlive the Document
+    Document(std::string &&, Arena &) = delete;
+
+    const Value &root() const { return root_; }
+
+private:
+    void read(Value &value, int depth)
+    {
+        if (depth > max_depth)
+            throw Error("document is nested too deeply");
+        Token token = cursor_.next();
+        value.type = token.type;
+        value.negative = token.negative;
+        value.code = token.code;
+        switch (token.type) {
+            case Type::Int:
+                value.magnitude = token.magnitude;
+                break;
+            case Type::Float:
+                value.number = token.number;
+                break;
+            case Type::BigInt:
+            case Type::String:
+            case Type::Binary:
+            case Type::TypedArray:
+                value.bytes = token.bytes.data();
+                value.length = token.bytes.size();
+                break;
+            case Type::List:
+                if (token.length == unsized) {
+                    std::vector<Value> items;
+                    while (cursor_.peek() != PBJSON_TERMINATOR) {
+                        items.emplace_back();
+                        read(items.back(), depth + 1);
+                    }
+                    cursor_.next();
+                    value.length = items.size();
+                    value.items = arena_.make_array<Value>(items.size());
+                    std::copy(items.begin(), items.end(), value.items);
+                }
+                else {
+                    value.length = token.length;
+                    value.items = arena_.make_array<Value>(token.length);
+                    for (size_t i = 0; i < token.length; i++)
+                        read(value.items[i], depth + 1);
+                }
+                break;
+            case Type::Dict:
+                if (token.length == unsized) {
+                    std::vector<Member> members;
+                    while (cursor_.peek() != PBJSON_TERMINATOR) {
+                        members.emplace_back();
+                        members.back().key = cursor_.key();
+                        read(members.back().value, depth + 1);
+                    }
+                    cursor_.next();
+                    value.length = members.size();
+                    value.members = arena_.make_array<Member>(members.size());
+                    std::copy(members.begin(), members.end(), value.members);
+                }
+                else {
+                    value.length = token.length;
+                    value.members = arena_.make_array<Member>(token.length);
+                    for (size_t i = 0; i < token.length; i++) {
+                        value.members[i].key = cursor_.key();
+                        read(value.members[i].value, depth + 1);
+                    }
+                }
+                break;
+            case Type::Table:
+                table(value, token, depth);
+                break;
+            case Type::Extension:
+            case Type::Custom:
+                value.length = 1;
+                value.items = arena_.make_array<Value>(1);
+                read(value.items[0], depth + 1);
+                break;
+            case Type::Fragment: {
+                Cursor inner(token.bytes);
+                std::swap(cursor_, inner);
+                read(value, depth + 1);
+                std::swap(cursor_, inner);
+                break;
+            }
+            case Type::End:
+                throw Error("terminator outside an unsized container");
+            default:
+                break;
+        }
+    }
+
+    void table(Value &value, const Token &token, int depth)
+    {
+        std::vector<std::string_view> keys(token.columns);
+        for (auto &key : keys)
+            key = cursor_.key();
+        if (token.length > cursor_.remaining() / token.columns)
+            throw Error("table is longer than the input");
+        value.type = Type::List;
+        value.length = token.length;
+        value.items = arena_.make_array<Value>(token.length);
+        for (size_t row = 0; row < token.length; row++) {
+            Value &record = value.items[row];
+            record.type = Type::Dict;
+            record.length = token.columns;
+            record.members = arena_.make_array<Member>(token.columns);
+            for (size_t column = 0; column < token.columns; column++) {
+                record.members[column].key = keys[column];
+                read(record.members[column].value, depth + 2);
+            }
+        }
+    }
+
+    Cursor cursor_;
+    Arena &arena_;
+    Value root_;
+};
+
+} // namespace pbjson
+
+#endif // PBJSON_HPP
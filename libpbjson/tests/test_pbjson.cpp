@@ -0,0 +1,497 @@
+// Unit tests for libpbjson. The expected bytes are what the Python
+// package writes for the same documents.
+#include "pbjson/pbjson.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+static int checks = 0;
+
+#define CHECK(condition)                                                       \
+    do {                                                                       \
+        ++checks;                                                              \
+        if (!(condition)) {                                                    \
+            ++failures;                                                        \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__,       \
+                         __LINE__, #condition);                                \
+        }                                                                      \
+    } while (0)
+
+#define CHECK_THROWS(expression)                                               \
+    do {                                                                       \
+        bool thrown = false;                                                   \
+        try {                                                                  \
+            expression;                                                        \
+        } catch (const pbjson::Error &) {                                      \
+            thrown = true;                                                     \
+        }                                                                      \
+        CHECK(thrown);                                                         \
+    } while (0)
+
+static std::string bytes(const char *data, size_t size) { return std::string(data, size); }
+#define BYTES(literal) bytes(literal, sizeof(literal) - 1)
+
+// {'name': 'toast', 'count': 3, 'neg': -300, 'ratio': 1.5, 'tiny': -0.25,
+//  'flags': [True, False, None], 'blob': b'\x00\x01', 'big': 1 << 70,
+//  'rows': [{'id': 1, 'name': 'a'}, {'id': 2, 'name': 'b'}]}
+static const std::string sample = BYTES(
+    "\xe9\x04name\x85toast\x05" "count\x21\x03\x03neg\x42\x01\x2c\x05ratio\x62\x1d\x5d\x04tiny\x62\xbd\x25"
+    "\x05" "flags\xc3\x01\x00\x02\x04" "blob\xa2\x00\x01\x03" "big\x29\x40\x00\x00\x00\x00\x00\x00\x00\x00"
+    "\x04rows\xc2\xe2\x02id\x21\x01\x80\x81" "a\xe2\x89\x21\x02\x80\x81" "b");
+
+// The same with tables=True
+static const std::string sample_table = BYTES(
+    "\xe9\x04name\x85toast\x05" "count\x21\x03\x03neg\x42\x01\x2c\x05ratio\x62\x1d\x5d\x04tiny\x62\xbd\x25"
+    "\x05" "flags\xc3\x01\x00\x02\x04" "blob\xa2\x00\x01\x03" "big\x29\x40\x00\x00\x00\x00\x00\x00\x00\x00"
+    "\x04rows\x11\xc2\xe2\x02id\x80\x21\x01\x81" "a\x21\x02\x81" "b");
+
+// {'id': RawPBJSON(dumps({'x': 1})), 'n': {'x': 2, 'id': 3}}: the key
+// inside the fragment is written again outside it
+static const std::string fragment = BYTES("\xe2\x02id\x17\xe1\x01x\x21\x01\x01n\xe2\x01x\x21\x02\x80\x21\x03");
+
+static void write_sample(pbjson::Writer &writer, bool table)
+{
+    static const unsigned char big[] = {0x40, 0, 0, 0, 0, 0, 0, 0, 0};
+    writer.begin_dict(9);
+    writer.key("name");
+    writer.string("toast");
+    writer.key("count");
+    writer.int64(3);
+    writer.key("neg");
+    writer.int64(-300);
+    writer.key("ratio");
+    writer.number(1.5);
+    writer.key("tiny");
+    writer.number(-0.25);
+    writer.key("flags");
+    writer.begin_list(3);
+    writer.boolean(true);
+    writer.boolean(false);
+    writer.null();
+    writer.key("blob");
+    writer.binary("\x00\x01", 2);
+    writer.key("big");
+    writer.big_integer(false, big, sizeof(big));
+    writer.key("rows");
+    if (table) {
+        writer.begin_table(2, 2);
+        writer.key("id");
+        writer.key("name");
+        writer.int64(1);
+        writer.string("a");
+        writer.int64(2);
+        writer.string("b");
+    }
+    else {
+        writer.begin_list(2);
+        for (int i = 1; i <= 2; i++) {
+            writer.begin_dict(2);
+            writer.key("id");
+            writer.int64(i);
+            writer.key("name");
+            writer.string(i == 1 ? "a" : "b");
+        }
+    }
+}
+
+static void test_core()
+{
+    unsigned char header[PBJSON_HEADER_MAX];
+    const uint32_t lengths[] = {0, 15, 16, 2047, 2048, 458751, 458752, 0xffffffff};
+    const size_t sizes[] = {1, 1, 2, 2, 3, 3, 5, 5};
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        size_t size = pbjson_put_header(header, PBJSON_BINARY, lengths[i]);
+        CHECK(size == sizes[i]);
+        CHECK((header[0] & 0xe0) == PBJSON_BINARY);
+        CHECK(pbjson_length_size(header[0]) == size - 1);
+        CHECK(pbjson_get_length(header[0], header + 1) == lengths[i]);
+    }
+    CHECK(pbjson_put_header(header, PBJSON_LIST, 0x123456789abULL) == 10);
+    CHECK(header[0] == PBJSON_LONG_LENGTH && header[1] == 0xdf && pbjson_long_token(header[1]));
+    CHECK(pbjson_get_uint(header + 2, 8) == 0x123456789abULL);
+    CHECK(!pbjson_long_token(0x3f) && !pbjson_long_token(0x9e));
+
+    unsigned char magnitude[8];
+    CHECK(pbjson_put_uint(magnitude, 0) == 0);
+    CHECK(pbjson_put_uint(magnitude, 300) == 2 && magnitude[0] == 1 && magnitude[1] == 0x2c);
+    CHECK(pbjson_put_uint(magnitude, UINT64_MAX) == 8);
+    CHECK(pbjson_get_uint(magnitude, 8) == UINT64_MAX);
+
+    unsigned char packed[PBJSON_FLOAT_CHARS];
+    char text[PBJSON_FLOAT_CHARS];
+    CHECK(pbjson_pack_float(packed, "-0.25", 5) == 2 && packed[0] == 0xbd && packed[1] == 0x25);
+    CHECK(pbjson_pack_float(packed, "4.0", 3) == 1 && packed[0] == 0x4d);
+    CHECK(pbjson_pack_float(packed, "1E+5", 4) == 2 && packed[0] == 0x1e && packed[1] == 0xa5);
+    CHECK(pbjson_unpack_float(text, packed, 2) == 4 && std::string(text) == "1e+5");
+    CHECK(pbjson_unpack_float(text, packed, 0) == 1 && std::string(text) == "0");
+
+    const double values[] = {0.1, 1.5, 123456.789, 1e100, 1e-7, 5e-324, 1.7976931348623157e308, 3.141592653589793};
+    for (double value : values) {
+        CHECK(pbjson_dtoa(value, text) == PBJSON_FLOAT);
+        CHECK(std::strtod(text, nullptr) == value);
+    }
+    CHECK(pbjson_dtoa(0.1, text) == PBJSON_FLOAT && std::string(text) == "0.1");
+    CHECK(pbjson_dtoa(1e-7, text) == PBJSON_FLOAT && std::string(text) == "1e-07");
+    // Subnormals have fewer digits than the 15 every normal double keeps
+    CHECK(pbjson_dtoa(5e-324, text) == PBJSON_FLOAT && std::string(text) == "5e-324");
+    CHECK(pbjson_dtoa(-1e-310, text) == PBJSON_FLOAT && std::string(text) == "-1e-310");
+    CHECK(pbjson_dtoa(2.2250738585072e-308, text) == PBJSON_FLOAT && std::string(text) == "2.2250738585072e-308");
+    CHECK(pbjson_dtoa(-HUGE_VAL, text) == PBJSON_NEGINF);
+    CHECK(pbjson_dtoa(std::nan(""), text) == PBJSON_NAN);
+    CHECK(pbjson_typed_array_itemsize('d') == 8 && pbjson_typed_array_itemsize('z') == 0);
+}
+
+// {'a': 1, 'a': {}} written as unsized dicts
+static const std::string unsized_dict = BYTES("\x0d\x01" "a\x21\x01\x80\x0d\x0f\x0f");
+
+static void test_writer()
+{
+    pbjson::Writer writer;
+    write_sample(writer, false);
+    CHECK(writer.data() == sample);
+    writer.clear();
+    write_sample(writer, true);
+    CHECK(writer.data() == sample_table);
+
+    pbjson::Writer refs(pbjson::Writer::Options{true});
+    refs.begin_list(2);
+    refs.string("same value");
+    refs.string("same value");
+    CHECK(refs.take() == BYTES("\xc2\x12\x8asame value\x13\x00"));
+    CHECK(refs.data().empty());
+
+    const int16_t shorts[] = {1, -2};
+    writer.clear();
+    writer.typed_array(shorts, 2);
+    CHECK(writer.data() == BYTES("\x10h\xa4\x01\x00\xfe\xff"));
+
+    writer.clear();
+    writer.begin_list();
+    writer.int64(1);
+    writer.int64(2);
+    writer.end_list();
+    CHECK(writer.data() == BYTES("\x0c\x21\x01\x21\x02\x0f"));
+
+    writer.clear();
+    writer.begin_dict();
+    writer.key("a");
+    writer.int64(1);
+    writer.key("a");
+    writer.begin_dict();
+    writer.end_dict();
+    writer.end_dict();
+    CHECK(writer.data() == unsized_dict);
+
+    writer.clear();
+    writer.begin_list(5);
+    writer.number(1e100);
+    writer.number(123456.789);
+    writer.number(1e-7);
+    writer.number(HUGE_VAL);
+    writer.number(std::nan(""));
+    CHECK(writer.data() == BYTES("\xc5\x63\x1e\xa1\x00\x65\x12\x34\x56\xd7\x89\x63\x1e\xb0\x7d\x03\x05"));
+
+    writer.clear();
+    writer.int64(INT64_MIN);
+    writer.uint64(UINT64_MAX);
+    writer.big_integer(true, "\x00\x00\x01", 3);
+    CHECK(writer.data() == BYTES("\x48\x80\x00\x00\x00\x00\x00\x00\x00\x28\xff\xff\xff\xff\xff\xff\xff\xff\x41\x01"));
+
+    pbjson::Writer embedded;
+    embedded.begin_dict(1);
+    embedded.key("x");
+    embedded.int64(1);
+    writer.clear();
+    writer.begin_dict(2);
+    writer.key("id");
+    writer.fragment(embedded.data());
+    writer.key("n");
+    writer.begin_dict(2);
+    writer.key("x");
+    writer.int64(2);
+    writer.key("id");
+    writer.int64(3);
+    CHECK(writer.data() == fragment);
+
+    CHECK_THROWS(writer.key(std::string(128, 'k')));
+    CHECK_THROWS(writer.fragment(""));
+}
+
+static void test_cursor()
+{
+    pbjson::Cursor cursor(sample);
+    pbjson::Token token = cursor.next();
+    CHECK(token.type == pbjson::Type::Dict && token.length == 9);
+    CHECK(cursor.key() == "name");
+    token = cursor.next();
+    CHECK(token.type == pbjson::Type::String && token.bytes == "toast");
+    CHECK(cursor.key() == "count");
+    CHECK(cursor.next().as_int64() == 3);
+    CHECK(cursor.key() == "neg");
+    CHECK(cursor.next().as_int64() == -300);
+    CHECK(cursor.key() == "ratio");
+    CHECK(cursor.next().number == 1.5);
+    CHECK(cursor.key() == "tiny");
+    CHECK(cursor.next().number == -0.25);
+    CHECK(cursor.key() == "flags");
+    cursor.skip();
+    CHECK(cursor.key() == "blob");
+    token = cursor.next();
+    CHECK(token.type == pbjson::Type::Binary && token.bytes == std::string("\x00\x01", 2));
+    CHECK(cursor.key() == "big");
+    token = cursor.next();
+    CHECK(token.type == pbjson::Type::BigInt && token.bytes.size() == 9 && !token.negative);
+    CHECK_THROWS(token.as_int64());
+    CHECK(cursor.key() == "rows");
+    cursor.skip();
+    CHECK(cursor.done());
+
+    pbjson::Cursor table(sample_table);
+    table.skip();
+    CHECK(table.done());
+
+    const std::string referenced = BYTES("\xc2\x12\x8asame value\x13\x00");
+    pbjson::Cursor refs(referenced);
+    refs.next();
+    CHECK(refs.next().bytes == "same value");
+    token = refs.next();
+    CHECK(token.type == pbjson::Type::String && token.bytes == "same value");
+
+    const std::string shorts = BYTES("\x10h\xa4\x01\x00\xfe\xff");
+    pbjson::Cursor typed(shorts);
+    token = typed.next();
+    CHECK(token.type == pbjson::Type::TypedArray && token.code == 'h' && token.length == 2);
+
+    // Lengths after a long length prefix take eight bytes
+    const std::string long_lengths = BYTES("\xc2\x18\x9f\0\0\0\0\0\0\0\x03" "abc\x10h\x18\xbf\0\0\0\0\0\0\0\x04\x01\x00\xfe\xff");
+    pbjson::Cursor long_cursor(long_lengths);
+    CHECK(long_cursor.next().length == 2);
+    CHECK(long_cursor.next().bytes == "abc");
+    token = long_cursor.next();
+    CHECK(token.type == pbjson::Type::TypedArray && token.length == 2);
+    CHECK(long_cursor.done());
+
+    pbjson::Cursor outer(fragment);
+    outer.next();
+    CHECK(outer.key() == "id");
+    token = outer.next();
+    CHECK(token.type == pbjson::Type::Fragment && token.bytes == BYTES("\xe1\x01x\x21\x01"));
+    CHECK(outer.key() == "n");
+    outer.next();
+    CHECK(outer.key() == "x");
+    outer.skip();
+    CHECK(outer.key() == "id");
+    outer.skip();
+    CHECK(outer.done());
+
+    pbjson::Cursor open(unsized_dict);
+    token = open.next();
+    CHECK(token.type == pbjson::Type::Dict && token.length == pbjson::unsized);
+    CHECK(open.key() == "a");
+    CHECK(open.next().as_int64() == 1);
+    CHECK(open.key() == "a");
+    open.skip();
+    CHECK(open.peek() == PBJSON_TERMINATOR && open.next().type == pbjson::Type::End);
+    CHECK(open.done());
+
+    const std::string invalid[] = {
+        BYTES("\xa5" "abc"),         // truncated binary
+        BYTES("\xc5\x01"),           // list longer than the input
+        BYTES("\x13\x00"),           // undefined value reference
+        BYTES("\x10z\xa0"),          // unknown typed array code
+        BYTES("\x10h\xa3" "abc"),    // partial element
+        BYTES("\x62\xff\xff"),       // float with unused nibbles
+        BYTES("\x15\x00"),           // compressed
+        BYTES("\x07"),               // unassigned token
+        BYTES("\x0f"),               // stray terminator
+        BYTES("\xe1\x80\x01"),       // undefined key reference
+        BYTES("\xc2\xe1\x01x\x02\x17\xe1\x80\x02"),  // key reference into the enclosing document
+        BYTES("\x17\xc2\x02"),       // truncated fragment
+        BYTES("\x0d\x01" "a\x02"),     // unterminated dict
+        BYTES("\x18\x3f\0\0\0\0\0\0\0\x01\x01"),  // long length int
+        BYTES("\x18\x9e\0\0\0\0\0\0\0\x01" "a"),  // long length without all length bits set
+        BYTES("\x18\xbf\0\0\0\x01\0\0\0\0"),  // binary longer than 4 GB
+        BYTES("\x18\x9f\0\0"),          // truncated long length
+    };
+    for (const std::string &encoded : invalid) {
+        pbjson::Cursor bad(encoded);
+        CHECK_THROWS(bad.skip());
+    }
+}
+
+static void test_document()
+{
+    pbjson::Arena arena(256);
+    for (const std::string *encoded : {&sample, &sample_table}) {
+        pbjson::Document document(*encoded, arena);
+        const pbjson::Value &root = document.root();
+        CHECK(root.type == pbjson::Type::Dict && root.size() == 9);
+        CHECK(root.find("name")->as_string() == "toast");
+        CHECK(root.find("neg")->as_int64() == -300);
+        CHECK(root.find("ratio")->as_double() == 1.5);
+        CHECK(root.find("flags")->size() == 3 && (*root.find("flags"))[0].as_bool());
+        CHECK((*root.find("flags"))[2].is_null());
+        CHECK(root.find("big")->type == pbjson::Type::BigInt);
+        const pbjson::Value &rows = *root.find("rows");
+        CHECK(rows.type == pbjson::Type::List && rows.size() == 2);
+        CHECK(rows[1].find("id")->as_int64() == 2);
+        CHECK(rows[1].find("name")->as_string() == "b");
+        CHECK(root.find("missing") == nullptr);
+    }
+
+    const std::string nested = BYTES("\x0c\x21\x01\xc1\x0c\x0f\x0f");
+    pbjson::Document unsized(nested, arena);
+    CHECK(unsized.root().size() == 2 && unsized.root()[1].size() == 1 && unsized.root()[1][0].size() == 0);
+
+    pbjson::Document members(unsized_dict, arena);
+    CHECK(members.root().type == pbjson::Type::Dict && members.root().size() == 2);
+    CHECK(members.root().find("a")->as_int64() == 1);
+    CHECK(members.root().members[1].value.type == pbjson::Type::Dict && members.root().members[1].value.size() == 0);
+
+    const std::string money = BYTES("\x16\x40\xc2\x22\x03\xe7\x83USD");
+    pbjson::Document ext(money, arena);
+    CHECK(ext.root().type == pbjson::Type::Extension && ext.root().code == 0x40);
+    CHECK(ext.root()[0][1].as_string() == "USD");
+
+    pbjson::Document embedded(fragment, arena);
+    CHECK(embedded.root().find("id")->type == pbjson::Type::Dict);
+    CHECK(embedded.root().find("id")->find("x")->as_int64() == 1);
+    CHECK(embedded.root().find("n")->find("id")->as_int64() == 3);
+
+    const std::string invalid[] = {
+        BYTES("\x21\x01\x21"),                          // extra data
+        std::string(2000, '\x0c'),                       // too deep
+        BYTES("\x11\xdf\xff\xff\xff\xff\xe1\x01x"),      // more rows than input
+    };
+    for (const std::string &encoded : invalid)
+        CHECK_THROWS(pbjson::Document(encoded, arena));
+    arena.clear();
+}
+
+// Write the value at the cursor again, leaving every choice the format
+// allows to the Writer
+static void rewrite(pbjson::Cursor &cursor, pbjson::Writer &writer)
+{
+    pbjson::Token token = cursor.next();
+    switch (token.type) {
+        case pbjson::Type::Null: writer.null(); return;
+        case pbjson::Type::False: writer.boolean(false); return;
+        case pbjson::Type::True: writer.boolean(true); return;
+        case pbjson::Type::Int:
+            if (!token.negative)
+                writer.uint64(token.magnitude);
+            else if (token.magnitude <= static_cast<uint64_t>(INT64_MAX) + 1)
+                writer.int64(token.as_int64());
+            else
+                writer.big_integer(true, token.bytes.data(), token.bytes.size());
+            return;
+        case pbjson::Type::BigInt: writer.big_integer(token.negative, token.bytes.data(), token.bytes.size()); return;
+        case pbjson::Type::Float: writer.number(token.number); return;
+        case pbjson::Type::String: writer.string(token.bytes); return;
+        case pbjson::Type::Binary: writer.binary(token.bytes.data(), token.bytes.size()); return;
+        case pbjson::Type::List:
+            if (token.length == pbjson::unsized) {
+                writer.begin_list();
+                while (cursor.peek() != PBJSON_TERMINATOR)
+                    rewrite(cursor, writer);
+                cursor.next();
+                writer.end_list();
+                return;
+            }
+            writer.begin_list(token.length);
+            for (size_t i = 0; i < token.length; i++)
+                rewrite(cursor, writer);
+            return;
+        case pbjson::Type::Dict:
+            if (token.length == pbjson::unsized) {
+                writer.begin_dict();
+                while (cursor.peek() != PBJSON_TERMINATOR) {
+                    writer.key(cursor.key());
+                    rewrite(cursor, writer);
+                }
+                cursor.next();
+                writer.end_dict();
+                return;
+            }
+            writer.begin_dict(token.length);
+            for (size_t i = 0; i < token.length; i++) {
+                writer.key(cursor.key());
+                rewrite(cursor, writer);
+            }
+            return;
+        case pbjson::Type::Table:
+            writer.begin_table(token.length, token.columns);
+            for (size_t i = 0; i < token.columns; i++)
+                writer.key(cursor.key());
+            for (size_t i = 0; i < token.length * token.columns; i++)
+                rewrite(cursor, writer);
+            return;
+        case pbjson::Type::Extension:
+            writer.extension(token.code);
+            rewrite(cursor, writer);
+            return;
+        case pbjson::Type::Custom:
+            writer.custom();
+            rewrite(cursor, writer);
+            return;
+        case pbjson::Type::Fragment: writer.fragment(token.bytes); return;
+        default:
+            throw pbjson::Error("unexpected token in the golden corpus");
+    }
+}
+
+static std::string golden_path;
+
+// Each line of golden.txt is "name options hex", the bytes dumps writes for
+// one document of pbjson/tests/test_golden.py. The Writer has to write the
+// same bytes when given the same values.
+static void test_golden()
+{
+    std::ifstream file(golden_path);
+    CHECK(file.good());
+    std::string line;
+    int documents = 0;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string name, options, hex;
+        fields >> name >> options >> hex;
+        std::string encoded;
+        for (size_t i = 0; i + 1 < hex.size(); i += 2)
+            encoded.push_back(static_cast<char>(std::stoi(hex.substr(i, 2), nullptr, 16)));
+        pbjson::Writer writer(pbjson::Writer::Options{options.find("value_refs") != std::string::npos});
+        pbjson::Cursor cursor(encoded);
+        rewrite(cursor, writer);
+        CHECK(cursor.done());
+        if (writer.data() != encoded)
+            std::fprintf(stderr, "golden document %s differs\n", name.c_str());
+        CHECK(writer.data() == encoded);
+        ++documents;
+    }
+    CHECK(documents > 0);
+}
+
+int main(int argc, char **argv)
+{
+    // ctest passes the golden corpus; without it that test is left out
+    std::vector<std::function<void()>> tests = {test_core, test_writer, test_cursor, test_document};
+    if (argc > 1) {
+        golden_path = argv[1];
+        tests.push_back(test_golden);
+    }
+    for (const auto &test : tests) {
+        try {
+            test();
+        } catch (const std::exception &e) {
+            ++failures;
+            std::fprintf(stderr, "unexpected exception in test %zu: %s\n", &test - &tests[0], e.what());
+        }
+    }
+    std::printf("%d checks, %d failures\n", checks, failures);
+    return failures ? 1 : 0;
+}
@@ -74,24 +74,37 @@ Using pbjson.tool from the shell to validate and pretty-print::
 from __future__ import absolute_import
 __version__ = '1.19.0'
 __all__ = [
-    'dump', 'dumps', 'load', 'loads',
-    'PBJSONDecodeError',
+    'dump', 'dumps', 'encoded_size', 'load', 'loads', 'parse_events', 'patch',
+    'canonical_dumps', 'PBJSONDecodeError', 'PBJSONWriter', 'RawPBJSON', 'register_class', 'register_codec',
+    'register_extension', 'stats', 'enable_stats',
 ]
 
 __author__ = 'Scott Maxwell <scott@codecobblers.com>'
 
+import hashlib
+from io import BytesIO
+from itertools import chain
+from . import compression
 from . import decoder
 from . import encoder
+from . import splice
+from .compat import string_types
+from .compression import register_codec
 from .decoder import PBJSONDecodeError
+from .encoder import register_class
+from .extensions import register_extension, decoders as extension_decoders
+from .raw_pbjson import RawPBJSON
+from .tokens import Enc_COMPRESSED
+from .writer import PBJSONWriter
 
 
-def dump(obj, fp, skip_illegal_keys=False, check_circular=True, sort_keys=False, custom=None, convert=None, use_for_json=False):
+def dump(obj, fp, skip_illegal_keys=False, check_circular=True, sort_keys=False, custom=None, convert=None, use_for_json=False, tables=False, value_refs=False, compress=None, extensions=False):
     """Serialize ``obj`` as a Packed Binary JSON stream to ``fp`` (a
     ``.write()``-supporting file-like object).
 
-    If *skip_illegal_keys* is true then ``dict`` keys that are not basic types
-    (``str``, ``unicode``, ``int``, ``long``, ``float``, ``bool``, ``None``)
-    will be skipped instead of raising a ``TypeError``.
+    If *skip_illegal_keys* is true then ``dict`` items whose keys are not
+    strings are left out, instead of raising a ``TypeError``. Keys longer
+    than 127 bytes still raise a ``ValueError``.
 
     If *check_circular* is false, then the circular reference check
     for container types will be skipped and a circular reference will
@@ -114,18 +127,46 @@ def dump(obj, fp, skip_illegal_keys=False, check_circular=True, sort_keys=False,
     method will use the return value of that method for encoding as JSON
     instead of the object.
 
+    Objects supporting the buffer protocol with a simple numeric format
+    (e.g. :class:`array.array`) are packed as typed arrays. A
+    :class:`bytearray` or a :class:`memoryview` of bytes is written as
+    binary, as is any other buffer whose format has no typed array code.
+
+    If *tables* is true (default: ``False``), lists of dicts that all have
+    the same string keys are written as a table, with the keys written once
+    followed by the values row by row.
+
+    If *value_refs* is true (default: ``False``), short string values are
+    remembered and repeats are written as back-references. The decoder
+    returns the same ``str`` object for every occurrence.
+
+    If *compress* is a codec name such as ``'zlib'`` (or ``True`` for
+    zlib), the output is compressed a buffer at a time as it is encoded.
+    See :func:`register_codec` for adding codecs.
+
+    If *extensions* is true (default: ``False``), :class:`datetime.datetime`,
+    :class:`datetime.date`, :class:`uuid.UUID` and :class:`decimal.Decimal`
+    values are written in compact binary forms tagged with their type, and
+    so are types added with :func:`register_extension`. They decode back to
+    the same types. Aware datetimes keep their UTC offset as a fixed
+    :class:`datetime.timezone`.
+
     """
     # cached encoder
-    for chunk in encoder.iterencode(obj, skip_illegal_keys, check_circular, sort_keys, custom, convert, use_for_json):
-        fp.write(chunk)
+    if compress:
+        writer = compression.CompressedWriter(fp.write, compression.get_codec(compress))
+        encoder.dump(obj, writer.write, skip_illegal_keys, check_circular, sort_keys, custom, convert, use_for_json, tables, value_refs, extensions=extensions)
+        writer.close()
+    else:
+        encoder.dump(obj, fp.write, skip_illegal_keys, check_circular, sort_keys, custom, convert, use_for_json, tables, value_refs, extensions=extensions)
 
 
-def dumps(obj, skip_illegal_keys=False, check_circular=True, sort_keys=False, custom=None, convert=None, use_for_json=False):
+def dumps(obj, skip_illegal_keys=False, check_circular=True, sort_keys=False, custom=None, convert=None, use_for_json=False, tables=False, value_refs=False, compress=None, extensions=False):
     """Serialize ``obj`` to a Packed Binary JSON formatted binary string.
 
-    If *skip_illegal_keys* is false then ``dict`` keys that are not basic types
-    (``str``, ``unicode``, ``int``, ``long``, ``float``, ``bool``, ``None``)
-    will be skipped instead of raising a ``TypeError``.
+    If *skip_illegal_keys* is true then ``dict`` items whose keys are not
+    strings are left out, instead of raising a ``TypeError``. Keys longer
+    than 127 bytes still raise a ``ValueError``.
 
     If *check_circular* is false, then the circular reference check
     for container types will be skipped and a circular reference will
@@ -148,12 +189,99 @@ def dumps(obj, skip_illegal_keys=False, check_circular=True, sort_keys=False, cu
     method will use the return value of that method for encoding as JSON
     instead of the object.
 
+    Objects supporting the buffer protocol with a simple numeric format
+    (e.g. :class:`array.array`) are packed as typed arrays. A
+    :class:`bytearray` or a :class:`memoryview` of bytes is written as
+    binary, as is any other buffer whose format has no typed array code.
+
+    If *tables* is true (default: ``False``), lists of dicts that all have
+    the same string keys are written as a table, with the keys written once
+    followed by the values row by row.
+
+    If *value_refs* is true (default: ``False``), short string values are
+    remembered and repeats are written as back-references. The decoder
+    returns the same ``str`` object for every occurrence.
+
+    If *compress* is a codec name such as ``'zlib'`` (or ``True`` for
+    zlib), the output is compressed a buffer at a time as it is encoded.
+    See :func:`register_codec` for adding codecs.
+
+    If *extensions* is true (default: ``False``), :class:`datetime.datetime`,
+    :class:`datetime.date`, :class:`uuid.UUID` and :class:`decimal.Decimal`
+    values are written in compact binary forms tagged with their type, and
+    so are types added with :func:`register_extension`. They decode back to
+    the same types. Aware datetimes keep their UTC offset as a fixed
+    :class:`datetime.timezone`.
+
     """
     # cached encoder
-    return encoder.encode(obj, skip_illegal_keys=skip_illegal_keys, check_circular=check_circular, sort_keys=sort_keys, custom=custom, convert=convert, use_for_json=use_for_json)
+    if compress:
+        chunks = []
+        writer = compression.CompressedWriter(chunks.append, compression.get_codec(compress))
+        encoder.dump(obj, writer.write, skip_illegal_keys, check_circular, sort_keys, custom, convert, use_for_json, tables, value_refs, extensions=extensions)
+        writer.close()
+        return b''.join(chunks)
+    return encoder.encode(obj, skip_illegal_keys=skip_illegal_keys, check_circular=check_circular, sort_keys=sort_keys, custom=custom, convert=convert, use_for_json=use_for_json, tables=tables, value_refs=value_refs, extensions=extensions)
+
+
+def encoded_size(obj, skip_illegal_keys=False, check_circular=True, sort_keys=False, custom=None, convert=None, use_for_json=False, tables=False, value_refs=False, extensions=False):
+    """Return ``len(dumps(obj, ...))`` without producing the bytes.
+
+    The object is walked exactly as :func:`dumps` walks it, assigning key
+    and value references and choosing integer, float and length sizes the
+    same way, but the output is only counted. The options are as for
+    :func:`dumps`; a compressed size cannot be known without compressing,
+    so there is no *compress*.
+
+    """
+    return encoder.encoded_size(obj, skip_illegal_keys=skip_illegal_keys, check_circular=check_circular, sort_keys=sort_keys, custom=custom, convert=convert, use_for_json=use_for_json, tables=tables, value_refs=value_refs, extensions=extensions)
+
+
+def canonical_dumps(obj, digest='blake2b', output=True, custom=None, convert=None, use_for_json=False):
+    """Serialize ``obj`` to a byte-stable Packed Binary JSON binary string
+    and return ``(encoded, digest)``.
+
+    Equal objects always encode to the same bytes: keys are sorted, set
+    items are ordered by their encoded bytes so any mix of types can be
+    ordered, floats are written as their shortest round-tripping ``repr``
+    and tables and value references are never used, so keys are
+    remembered in the order the sorted output first uses them.
 
+    *digest* is a :mod:`hashlib` algorithm name (default: ``'blake2b'``)
+    or a constructor returning a hash object. Each buffer is hashed as it
+    is produced rather than in a second pass over the result. If *digest*
+    is ``None``, only the encoded bytes are returned.
 
-def load(fp, document_class=None, float_class=None, custom=None, unicode_errors='strict'):
+    If *output* is false, the encoded bytes are not kept at all and only
+    the digest is returned.
+
+    *custom*, *convert* and *use_for_json* are as for :func:`dumps`.
+
+    """
+    if digest is None:
+        hasher = None
+    elif isinstance(digest, string_types):
+        hasher = hashlib.new(digest)
+    else:
+        hasher = digest()
+    if not output:
+        if hasher is None:
+            raise ValueError('canonical_dumps needs a digest when output is false')
+        encoder.dump(obj, hasher.update, False, True, True, custom, convert, use_for_json, canonical=True)
+        return hasher.digest()
+    chunks = []
+    if hasher is None:
+        write = chunks.append
+    else:
+        def write(chunk):
+            hasher.update(chunk)
+            chunks.append(chunk)
+    encoder.dump(obj, write, False, True, True, custom, convert, use_for_json, canonical=True)
+    encoded = b''.join(chunks)
+    return encoded if hasher is None else (encoded, hasher.digest())
+
+
+def load(fp, document_class=None, float_class=None, custom=None, unicode_errors='strict', zero_copy=False, columnar=False, object_pairs_hook=None, schema=None):
     """Deserialize ``fp`` (a ``.read()``-supporting file-like object containing
     a Packed Binary JSON document) to a Python object.
 
@@ -163,11 +291,39 @@ def load(fp, document_class=None, float_class=None, custom=None, unicode_errors=
         *float_class* allows you to specify an alternate class for float values
         (e.g. :class:`decimal.Decimal`). The class will be passed a string
          representing the float.
+
+        If *zero_copy* is true, typed arrays are returned as :class:`memoryview`
+        slices of the data read instead of :class:`array.array` copies.
+
+        If *columnar* is true, tables are returned as a single object mapping
+        each key to the list of that column's values instead of a list of
+        objects.
+
+        *object_pairs_hook*, if given, is called once per object with a list
+        of its ``(key, value)`` pairs and its result is used instead of a
+        *document_class* instance. The C extension fills an
+        :class:`collections.OrderedDict` directly and wraps a dict in a
+        :class:`types.MappingProxyType`, without the list. Any other hook,
+        and every hook in the pure-Python decoder, gets a list of tuples.
+
+        *schema* is a dataclass or ``__slots__`` class, or a sequence of
+        them. An object whose keys are exactly the fields of one of them is
+        decoded straight into an instance of that class, without a dict in
+        between; other objects are decoded as usual. Instances are created
+        with ``cls.__new__`` and their fields set like
+        ``object.__setattr__``, so ``__init__`` and ``__post_init__`` are
+        not called.
+
+        The document is read a block at a time and compressed streams
+        (see :func:`dump`) are decompressed as they are read.
     """
-    return decoder.decode(fp.read(), document_class, float_class, custom, unicode_errors)
+    if schema is not None:
+        schema = decoder.prepare_schema(schema)
+    data, read = compression.open_stream(fp.read)
+    return decoder.decode(data, document_class, float_class, custom, unicode_errors, zero_copy=zero_copy, columnar=columnar, read=read, object_pairs_hook=object_pairs_hook, schema=schema, extensions=extension_decoders)
 
 
-def loads(s, document_class=None, float_class=None, custom=None, unicode_errors='strict'):
+def loads(s, document_class=None, float_class=None, custom=None, unicode_errors='strict', zero_copy=False, columnar=False, object_pairs_hook=None, schema=None):
     """Deserialize ``s`` (a binary string containing a Packed
        Binary JSON document) to a Python object.
 
@@ -178,8 +334,137 @@ def loads(s, document_class=None, float_class=None, custom=None, unicode_errors=
         (e.g. :class:`decimal.Decimal`). The class will be passed a string
          representing the float.
 
+        If *zero_copy* is true, typed arrays are returned as :class:`memoryview`
+        slices of ``s`` instead of :class:`array.array` copies.
+
+        If *columnar* is true, tables are returned as a single object mapping
+        each key to the list of that column's values instead of a list of
+        objects.
+
+        *object_pairs_hook*, if given, is called once per object with a list
+        of its ``(key, value)`` pairs and its result is used instead of a
+        *document_class* instance. The C extension fills an
+        :class:`collections.OrderedDict` directly and wraps a dict in a
+        :class:`types.MappingProxyType`, without the list. Any other hook,
+        and every hook in the pure-Python decoder, gets a list of tuples.
+
+        *schema* is a dataclass or ``__slots__`` class, or a sequence of
+        them. An object whose keys are exactly the fields of one of them is
+        decoded straight into an instance of that class, without a dict in
+        between; other objects are decoded as usual. Instances are created
+        with ``cls.__new__`` and their fields set like
+        ``object.__setattr__``, so ``__init__`` and ``__post_init__`` are
+        not called.
+
+        Compressed documents (see :func:`dumps`) are decompressed a block
+        at a time as they are decoded.
+
     """
-    return decoder.decode(s, document_class, float_class, custom, unicode_errors)
+    if schema is not None:
+        schema = decoder.prepare_schema(schema)
+    if s[:1] == Enc_COMPRESSED:
+        data, read = compression.open_stream(BytesIO(s).read)
+        return decoder.decode(data, document_class, float_class, custom, unicode_errors, zero_copy=zero_copy, columnar=columnar, read=read, object_pairs_hook=object_pairs_hook, schema=schema, extensions=extension_decoders)
+    return decoder.decode(s, document_class, float_class, custom, unicode_errors, zero_copy=zero_copy, columnar=columnar, object_pairs_hook=object_pairs_hook, schema=schema, extensions=extension_decoders)
+
+
+def parse_events(s, handler=None, float_class=None, unicode_errors='strict', batch_size=decoder.EVENT_BATCH):
+    """Walk the Packed Binary JSON document in ``s`` (a binary string or
+    a ``.read()``-supporting file-like object) without building its lists
+    and dicts, in the style of ijson's ``parse``.
+
+        The document is reported as ``(event, value)`` pairs. Objects are
+        ``start_map``, a ``map_key`` event with each key followed by its
+        value, and ``end_map``. Lists are ``start_array``, their items and
+        ``end_array``. Tables are reported as the list of objects they
+        stand for. The value of these events is None. Every other value is
+        reported whole as ``null``, ``boolean``, ``number``, ``string``,
+        ``binary``, ``typed_array``, ``extension`` or ``custom`` (the value
+        it wraps).
+
+        Events are produced in lists of up to *batch_size*. If *handler* is
+        given it is called once with each list and None is returned;
+        otherwise an iterator over the events is returned, which decodes
+        the document lazily as it is consumed.
+
+        *float_class* and *unicode_errors* are as for :func:`loads`.
+    """
+    if hasattr(s, 'read'):
+        data, read = compression.open_stream(s.read)
+    elif s[:1] == Enc_COMPRESSED:
+        data, read = compression.open_stream(BytesIO(s).read)
+    else:
+        data, read = s, None
+    batches = decoder.event_batches(data, float_class, unicode_errors, read=read, extensions=extension_decoders, batch_size=batch_size)
+    if handler is None:
+        return chain.from_iterable(batches)
+    for batch in batches:
+        handler(batch)
+
+
+def patch(s, path, obj, custom=None, convert=None, use_for_json=False, extensions=False):
+    """Return a copy of the Packed Binary JSON document ``s`` with the
+    value at *path* replaced by ``obj``, without decoding and re-encoding
+    the rest of it.
+
+        *path* is a sequence of object keys and list indexes, such as
+        ``('users', 3, 'email')``. A value in a table is reached with the
+        row index followed by its key. :class:`KeyError`,
+        :class:`IndexError` or :class:`TypeError` is raised if the path
+        does not lead to a value.
+
+        ``obj`` is encoded as by :func:`dumps` with *custom*, *convert*,
+        *use_for_json* and *extensions*, using the keys the document has
+        already defined. The rest of the document is copied unchanged,
+        except for the key and value references after the change that
+        have to be renumbered when the change adds or removes keys or
+        remembered values.
+
+        Compressed documents are decompressed and compressed again with
+        the same codec.
+    """
+    encoded = dumps(obj, custom=custom, convert=convert, use_for_json=use_for_json, extensions=extensions)
+    if s[:1] == Enc_COMPRESSED:
+        data, read = compression.open_stream(BytesIO(s).read)
+        patched = splice.splice(b''.join([data] + decoder._read_all(read)), tuple(path), encoded)
+        chunks = []
+        writer = compression.CompressedWriter(chunks.append, compression._codecs_by_id[ord(s[1:2])])
+        writer.write(patched)
+        writer.close()
+        return b''.join(chunks)
+    return splice.splice(s, tuple(path), encoded)
+
+
+def _import_speedups():
+    try:
+        # noinspection PyUnresolvedReferences
+        from . import _speedups
+        return _speedups
+    except ImportError:
+        return None
+
+
+def stats(reset=False):
+    """Return a dict of counters recorded by the C extension while
+    counting is enabled (see :func:`enable_stats`): bytes encoded and
+    decoded, chunks flushed, key table hits, misses and overflows past 128
+    keys, custom handler and *convert* calls, terminated lists written and
+    big integers taking the slow path. If *reset* is true the counters are
+    zeroed after reading them.
+
+    The pure-Python implementation does not count, so the dict is empty
+    without the C extension or if it was built with ``PBJSON_STATS=0``.
+    """
+    speedups = _import_speedups()
+    return speedups.stats(reset) if speedups else {}
+
+
+def enable_stats(enabled=True):
+    """Switch the C extension's counters on or off and return whether
+    they were on. Counting is off by default unless the extension was built
+    with ``PBJSON_STATS=1``."""
+    speedups = _import_speedups()
+    return speedups.enable_stats(enabled) if speedups else False
 
 
 def _has_encoder_speedups():
@@ -193,10 +478,18 @@ def _has_decoder_speedups():
 def _toggle_speedups(enabled):
     if enabled:
         encoder.iterencoder = encoder.c_iterencoder or encoder.py_iterencoder
+        encoder.encoder_session = encoder.c_encoder_session or encoder.py_encoder_session
         decoder.decode = decoder.c_decoder or decoder.py_decoder
+        decoder.event_batches = decoder.c_event_batches or decoder.py_event_batches
+        splice.splice = splice.c_splice or splice.py_splice
+        splice.value_length = splice.c_value_length or splice.py_value_length
     else:
         encoder.iterencoder = encoder.py_iterencoder
+        encoder.encoder_session = encoder.py_encoder_session
         decoder.decode = decoder.py_decoder
+        decoder.event_batches = decoder.py_event_batches
+        splice.splice = splice.py_splice
+        splice.value_length = splice.py_value_length
 
 
 def simple_first(kv):
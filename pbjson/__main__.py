@@ -91,7 +91,7 @@ def main():
         pbjson.dump(obj, args.outfile)
     else:
         try:
-            obj = pbjson.loads(contents, document_class=OrderedDict)
+            obj = pbjson.loads(contents, object_pairs_hook=OrderedDict)
         except ValueError:
             raise SystemExit(sys.exc_info()[1])
         if yaml is not None and args.yaml:
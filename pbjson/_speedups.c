@@ -1,6 +1,8 @@
 /* -*- mode: C; c-file-style: "python"; c-basic-offset: 4 -*- */
 #include "Python.h"
 #include "structmember.h"
+#include "datetime.h"
+#include "pbjson/pbjson.h"
 #include <math.h>
 
 #if PY_MAJOR_VERSION >= 3
@@ -12,29 +14,64 @@
 #else /* PY_MAJOR_VERSION >= 3 */
 #endif /* PY_MAJOR_VERSION < 3 */
 
-#define Enc_FALSE 0
-#define Enc_TRUE 1
-#define Enc_NULL 2
-#define Enc_INF 3
-#define Enc_NEGINF 4
-#define Enc_NAN 5
-#define Enc_TERMINATED_LIST 0xc
-#define Enc_CUSTOM 0xe
-#define Enc_TERMINATOR 0xf
-#define Enc_INT 0x20
-#define Enc_NEGINT 0x40
-#define Enc_FLOAT 0x60
-#define Enc_STRING 0x80
-#define Enc_BINARY 0xA0
-#define Enc_LIST 0xC0
-#define Enc_DICT 0xE0
-
-#define FltEnc_Plus 0xa
-#define FltEnc_Minus 0xb
-#define FltEnc_Decimal 0xd
-#define FltEnc_E 0xe
+/* Token values come from the shared libpbjson core */
+#define Enc_FALSE PBJSON_FALSE
+#define Enc_TRUE PBJSON_TRUE
+#define Enc_NULL PBJSON_NULL
+#define Enc_INF PBJSON_INF
+#define Enc_NEGINF PBJSON_NEGINF
+#define Enc_NAN PBJSON_NAN
+#define Enc_TERMINATED_LIST PBJSON_TERMINATED_LIST
+#define Enc_TERMINATED_DICT PBJSON_TERMINATED_DICT
+#define Enc_CUSTOM PBJSON_CUSTOM
+#define Enc_TERMINATOR PBJSON_TERMINATOR
+#define Enc_TYPED_ARRAY PBJSON_TYPED_ARRAY
+#define Enc_TABLE PBJSON_TABLE
+#define Enc_VALUE_DEF PBJSON_VALUE_DEF
+#define Enc_VALUE_REF PBJSON_VALUE_REF
+#define Enc_VALUE_REF16 PBJSON_VALUE_REF16
+#define Enc_EXT PBJSON_EXT
+#define Enc_FRAGMENT PBJSON_FRAGMENT
+#define Enc_LONG_LENGTH PBJSON_LONG_LENGTH
+#define Enc_INT PBJSON_INT
+#define Enc_NEGINT PBJSON_NEGINT
+#define Enc_FLOAT PBJSON_FLOAT
+#define Enc_STRING PBJSON_STRING
+#define Enc_BINARY PBJSON_BINARY
+#define Enc_LIST PBJSON_LIST
+#define Enc_DICT PBJSON_DICT
 
 #define BUFFER_SIZE 0x1000
+#define READ_SIZE 0x10000
+
+/* Strings with this many UTF-8 bytes are candidates for value references */
+#define VALUE_REF_MIN PBJSON_VALUE_REF_MIN
+#define VALUE_REF_MAX PBJSON_VALUE_REF_MAX
+#define VALUE_REF_LIMIT PBJSON_VALUE_REF_LIMIT
+
+/* Extension type IDs with native codecs. Those below EXT_USER_MIN are
+   reserved and hold BINARY values. */
+#define EXT_DATETIME 0
+#define EXT_DATE 1
+#define EXT_UUID 2
+#define EXT_DECIMAL 3
+#define EXT_USER_MIN 0x40
+
+#define DECIMAL_FINITE 0
+#define DECIMAL_INFINITE 1
+#define DECIMAL_NAN 2
+#define DECIMAL_SNAN 3
+
+#define MICROS_PER_DAY 86400000000LL
+/* Days from the epoch to 0001-01-01 and 9999-12-31, the datetime range */
+#define DATETIME_MIN_DAYS -719162LL
+#define DATETIME_MAX_DAYS 2932896LL
+
+/* Schema classes are told apart with a 64-bit mask */
+#define SCHEMA_LIMIT 64
+
+/* Events handed over at a time by event_batches */
+#define EVENT_BATCH 256
 
 #if PY_VERSION_HEX < 0x02070000
 #if !defined(PyOS_string_to_double)
@@ -84,17 +121,54 @@ typedef int Py_ssize_t;
 #define UNUSED
 #endif
 
+/* Hot path counters. They are compiled in and switched on at runtime with
+   enable_stats() unless PBJSON_STATS is defined at build time: 0 leaves
+   them out entirely and any other value starts with them switched on. */
+#ifndef PBJSON_STATS
+#define PBJSON_STATS_DEFAULT 0
+#elif PBJSON_STATS
+#define PBJSON_STATS_DEFAULT 1
+#endif
+
+#ifdef PBJSON_STATS_DEFAULT
+typedef struct _PBJSONStats {
+    unsigned long long bytes_encoded;
+    unsigned long long bytes_decoded;
+    unsigned long long chunk_flushes;
+    unsigned long long key_memo_hits;
+    unsigned long long key_memo_misses;
+    unsigned long long key_memo_overflows;
+    unsigned long long custom_calls;
+    unsigned long long convert_calls;
+    unsigned long long terminated_lists;
+    unsigned long long bigint_encodes;
+    unsigned long long bigint_decodes;
+} PBJSONStats;
+
+static PBJSONStats stats;
+static int stats_enabled = PBJSON_STATS_DEFAULT;
+#define STAT_ADD(name, n) do { if (stats_enabled) stats.name += (n); } while (0)
+#else
+#define STAT_ADD(name, n) do { } while (0)
+#endif
+#define STAT_INC(name) STAT_ADD(name, 1)
+
 
 typedef struct _PyEncoder {
     PyObject *defaultfn;
     PyObject *custom;
     PyObject *Decimal;
     PyObject *Mapping;
+    PyObject *RawPBJSON;
+    PyObject *classes;      /* Class to (fields, sorted fields) from register_class, or NULL */
+    PyObject *extensions;   /* Class to (type ID, encode function) when extensions are on, or NULL */
 
     PyObject *item_sort_kw;
     PyObject *markers;      /* Dict for tracking circular references */
     PyObject *key_memo;     /* Place to keep track of previously used keys */
+    PyObject *value_memo;   /* Place to keep track of previously used string values */
     PyObject *chunk_list;   /* A list of previously accumulated strings */
+    PyObject *write;        /* Callable receiving each chunk instead of chunk_list */
     PyObject *buffer;       /* A string for building up a chunk */
     unsigned char* ptr;     /* Pointer into the buffer */
     int position;           /* How far into the buffer we have written */
@@ -103,6 +177,12 @@ typedef struct _PyEncoder {
     int skipkeys;
     int for_json;
     int single_custom;
+    int tables;
+    int value_refs;
+    int sort_native;        /* sort_keys=True: sort items by key without calling into Python */
+    int canonical;          /* Byte-stable output: repr floats and sorted sets */
+    int size_only;          /* Count the output in size instead of keeping it */
+    Py_ssize_t size;
 
 } PyEncoder;
 
@@ -111,11 +191,40 @@ typedef struct _PyDecoder {
     PyObject *float_class;
     PyObject *custom;
     PyObject *keys;
+    PyObject *values;       /* String values that can be referenced again */
+    PyObject *source;       /* Object exporting the buffer being decoded */
+    PyObject *read;         /* Callable returning more data, or NULL */
+    PyObject *block;        /* Data refilled from read, once it has been called */
+    const unsigned char* start;
     const unsigned char* data;
     const char* unicode_errors;
-    int len;
+    PyObject *pairs_hook;   /* Called once per object with its (key, value) pairs */
+    int pairs_kind;         /* PAIRS_NONE, or how objects are built for pairs_hook */
+    PyObject *schema_classes;   /* (cls, field count, setters) per class from prepare_schema, or NULL */
+    PyObject *schema_lookup;    /* Field name to its position in each class */
+    PyObject *key_fields;       /* schema_lookup entry for each of keys, or None */
+    PyObject *extensions;       /* Type ID to decode function, or NULL */
+    PyObject *tz;               /* Timezone of the last aware datetime decoded */
+    long tz_offset;
+    Py_ssize_t schema_count;
+    Py_ssize_t schema_sizes[SCHEMA_LIMIT];
+    Py_ssize_t len;
+    int zero_copy;
+    int columnar;
 } PyDecoder;
 
+/* Objects are gathered into a list of pairs for pairs_hook, except for
+   OrderedDict, which is filled through its C API, and MappingProxyType,
+   which wraps a dict filled in C */
+#define PAIRS_NONE 0
+#define PAIRS_LIST 1
+#define PAIRS_ORDERED_DICT 2
+#define PAIRS_MAPPING_PROXY 3
+
+/* Objects with up to this many keys are matched against the schema without
+   allocating */
+#define SCHEMA_STACK 16
+
 
 static int
 JSON_Accu_Accumulate(PyEncoder *acc, const unsigned char *bytes, size_t len);
@@ -126,13 +235,6 @@ JSON_Accu_Destroy(PyEncoder *acc);
 
 static PyObject *
 decode_one(PyDecoder *decoder);
-#if PY_MAJOR_VERSION < 3
-static PyObject *
-join_list_string(PyObject *lst);
-#else
-static PyObject *
-join_list_bytes(PyObject *lst);
-#endif
 static int
 encode_list(PyEncoder *encoder, PyObject *seq);
 static int
@@ -141,6 +243,10 @@ static int
 encode_one(PyEncoder *encoder, PyObject *obj);
 static int
 encode_dict(PyEncoder *encoder, PyObject *dct);
+static int
+encode_buffer(PyEncoder *encoder, PyObject *obj);
+static int
+encode_object(PyEncoder *encoder, PyObject *obj, PyObject *plan);
 static PyObject *
 encode_dict_items(PyEncoder *encoder, PyObject *dct);
 static void
@@ -175,43 +281,106 @@ raise_errmsg(const char *msg)
     }
 }
 
-#if PY_MAJOR_VERSION >= 3
-static PyObject *
-join_list_bytes(PyObject *lst)
+/* Big integers are converted in a single pass through the long object's
+   byte array helpers. Python 3.13 made these public as the NativeBytes API
+   and changed the signature of the private ones. */
+static Py_ssize_t
+long_byte_length(PyObject *value)
 {
-    /* return u''.join(lst) */
-    static PyObject *joinfn = NULL;
-    if (joinfn == NULL) {
-        PyObject *ustr = PyString_FromStringAndSize(NULL, 0);
-        if (ustr == NULL)
-            return NULL;
+    /* Number of bytes needed for non-negative value. The size NativeBytes
+       asks for may include a byte for the sign, so the bits are counted. */
+    size_t bits = _PyLong_NumBits(value);
+    if (bits == (size_t)-1 && PyErr_Occurred())
+        return -1;
+    return (Py_ssize_t)((bits + 7) >> 3);
+}
 
-        joinfn = PyObject_GetAttrString(ustr, "join");
-        Py_DECREF(ustr);
-        if (joinfn == NULL)
-            return NULL;
+static int
+long_as_bytes(PyObject *value, unsigned char *bytes, Py_ssize_t length)
+{
+    /* Store non-negative value big endian in exactly length bytes */
+#if PY_VERSION_HEX >= 0x030D0000
+    return PyLong_AsNativeBytes(value, bytes, length, Py_ASNATIVEBYTES_BIG_ENDIAN | Py_ASNATIVEBYTES_UNSIGNED_BUFFER) < 0 ? -1 : 0;
+#else
+    return _PyLong_AsByteArray((PyLongObject *)value, bytes, (size_t)length, 0, 0);
+#endif
+}
+
+static void
+store_be(unsigned char *bytes, unsigned long long value, int length)
+{
+    while (length--) {
+        bytes[length] = (unsigned char)value;
+        value >>= 8;
     }
-    return PyObject_CallFunctionObjArgs(joinfn, lst, NULL);
 }
-#else /* PY_MAJOR_VERSION >= 3 */
-static PyObject *
-join_list_string(PyObject *lst)
+
+static long long
+load_be(const unsigned char *bytes, int length)
 {
-    /* return ''.join(lst) */
-    static PyObject *joinfn = NULL;
-    if (joinfn == NULL) {
-        PyObject *ustr = PyString_FromStringAndSize(NULL, 0);
-        if (ustr == NULL)
-            return NULL;
+    /* Sign-extended big endian integer of length bytes */
+    unsigned long long value = bytes[0] & 0x80 ? ~0ULL : 0;
+    while (length--)
+        value = (value << 8) | *bytes++;
+    return (long long)value;
+}
 
-        joinfn = PyObject_GetAttrString(ustr, "join");
-        Py_DECREF(ustr);
-        if (joinfn == NULL)
+static long long
+days_from_civil(long long y, unsigned int m, unsigned int d)
+{
+    /* Days since 1970-01-01 in the proleptic Gregorian calendar */
+    long long era;
+    unsigned int yoe, doy, doe;
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = (unsigned int)(y - era * 400);
+    doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (long long)doe - 719468;
+}
+
+static void
+civil_from_days(long long z, long long *y, int *m, int *d)
+{
+    long long era;
+    unsigned int doe, yoe, doy, mp;
+    z += 719468;
+    era = (z >= 0 ? z : z - 146096) / 146097;
+    doe = (unsigned int)(z - era * 146097);
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    *d = (int)(doy - (153 * mp + 2) / 5 + 1);
+    *m = (int)(mp < 10 ? mp + 3 : mp - 9);
+    *y = (long long)yoe + era * 400 + (*m <= 2);
+}
+
+static PyObject *
+import_class(const char *module_name, const char *name, PyObject **cache)
+{
+    /* Borrowed reference to a class, imported the first time it is needed */
+    if (*cache == NULL) {
+        PyObject *module = PyImport_ImportModule(module_name);
+        if (module == NULL)
             return NULL;
+        *cache = PyObject_GetAttrString(module, name);
+        Py_DECREF(module);
     }
-    return PyObject_CallFunctionObjArgs(joinfn, lst, NULL);
+    return *cache;
+}
+
+/* pbjson.raw_pbjson.RawPBJSON, whose bytes are written as they are */
+static PyObject *RawPBJSON = NULL;
+
+static PyObject *
+long_from_bytes(const unsigned char *bytes, Py_ssize_t length)
+{
+#if PY_VERSION_HEX >= 0x030D0000
+    return PyLong_FromUnsignedNativeBytes(bytes, length, Py_ASNATIVEBYTES_BIG_ENDIAN);
+#else
+    return _PyLong_FromByteArray(bytes, (size_t)length, 0, 0);
+#endif
 }
-#endif /* PY_MAJOR_VERSION < 3 */
 
 
 static char inf_string_be[8] = {0x7f, 0xf0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
@@ -246,56 +415,114 @@ set_overflow()
 }
 
 static PyObject *
-decode_unsigned_long_long(PyDecoder *decoder, int length)
+get_array_type(void)
 {
-    unsigned long long accumulator = *decoder->data++;
-    decoder->len--;
-    length--;
-    while (length) {
-        accumulator <<= 8;
-        accumulator |= *decoder->data++;
-        decoder->len--;
-        length--;
+    /* Borrowed reference to array.array */
+    static PyObject *array_type = NULL;
+    if (array_type == NULL) {
+        PyObject *module = PyImport_ImportModule("array");
+        if (module == NULL)
+            return NULL;
+        array_type = PyObject_GetAttrString(module, "array");
+        Py_DECREF(module);
+    }
+    return array_type;
+}
+
+static int
+decoder_fill(PyDecoder *decoder, Py_ssize_t needed)
+{
+    /* Read blocks from the stream until needed bytes are buffered, moving
+       the unconsumed tail of the current block to the front */
+    PyObject *chunks = NULL;
+    PyObject *block = NULL;
+    Py_ssize_t total = decoder->len;
+    Py_ssize_t i;
+    if (decoder->read == NULL) {
+        set_overflow();
+        return -1;
+    }
+    chunks = PyList_New(0);
+    if (chunks == NULL)
+        return -1;
+    while (total < needed) {
+        PyObject *chunk = PyObject_CallFunction(decoder->read, "n", (Py_ssize_t)READ_SIZE);
+        if (chunk == NULL)
+            goto bail;
+        if (!PyBytes_Check(chunk)) {
+            Py_DECREF(chunk);
+            PyErr_SetString(PyExc_TypeError, "read() must return bytes");
+            goto bail;
+        }
+        if (!PyBytes_GET_SIZE(chunk)) {
+            Py_DECREF(chunk);
+            set_overflow();
+            goto bail;
+        }
+        total += PyBytes_GET_SIZE(chunk);
+        int err = PyList_Append(chunks, chunk);
+        Py_DECREF(chunk);
+        if (err)
+            goto bail;
     }
+    block = PyBytes_FromStringAndSize(NULL, total);
+    if (block == NULL)
+        goto bail;
+    char *ptr = PyBytes_AS_STRING(block);
+    memcpy(ptr, decoder->data, decoder->len);
+    ptr += decoder->len;
+    for (i = 0; i < PyList_GET_SIZE(chunks); i++) {
+        PyObject *chunk = PyList_GET_ITEM(chunks, i);
+        memcpy(ptr, PyBytes_AS_STRING(chunk), PyBytes_GET_SIZE(chunk));
+        ptr += PyBytes_GET_SIZE(chunk);
+    }
+    Py_DECREF(chunks);
+    STAT_ADD(bytes_decoded, decoder->data - decoder->start);
+    Py_XDECREF(decoder->block);
+    decoder->block = decoder->source = block;
+    decoder->start = decoder->data = (const unsigned char *)PyBytes_AS_STRING(block);
+    decoder->len = total;
+    return 0;
+
+bail:
+    Py_DECREF(chunks);
+    return -1;
+}
+
+static int
+decoder_require(PyDecoder *decoder, Py_ssize_t needed)
+{
+    /* Make sure the next needed bytes are available */
+    return decoder->len >= needed ? 0 : decoder_fill(decoder, needed);
+}
+
+static PyObject *
+decode_unsigned_long_long(PyDecoder *decoder, int length)
+{
+    unsigned long long accumulator = pbjson_get_uint(decoder->data, length);
+    decoder->data += length;
+    decoder->len -= length;
     return PyLong_FromUnsignedLongLong(accumulator);
 }
 
 static PyObject *
-decode_int(PyDecoder *decoder, int length)
+decode_int(PyDecoder *decoder, Py_ssize_t length)
 {
-    int one_bite = length<=8 ? length : 8;
-    if (!one_bite) {
+    if (!length) {
         return PyLong_FromLong(0);
     }
-    PyObject *tmp = NULL;
-    PyObject *more = NULL;
-    PyObject *shifter = NULL;
-    PyObject *result = decode_unsigned_long_long(decoder, one_bite);
-    while (length > 8) {
-        length -= 8;
-        one_bite = length<=8 ? length : 8;
-        if (!shifter) {
-            shifter = PyLong_FromLong(one_bite << 3);
-        }
-        else if (length < 8) {
-            Py_XDECREF(shifter);
-            shifter = PyLong_FromLong(length << 3);
-        }
-        tmp = PyNumber_InPlaceLshift(result, shifter);
-        Py_DECREF(result);
-        result = tmp;
-        more = decode_unsigned_long_long(decoder, one_bite);
-        tmp = PyNumber_InPlaceOr(result, more);
-        Py_DECREF(result);
-        result = tmp;
-        Py_XDECREF(more);
+    if (length <= 8) {
+        return decode_unsigned_long_long(decoder, length);
     }
-    Py_XDECREF(shifter);
+    STAT_INC(bigint_decodes);
+    PyObject *result = long_from_bytes(decoder->data, length);
+    decoder->data += length;
+    decoder->len -= length;
     return result;
 }
 
 static PyObject *
-decode_negint(PyDecoder *decoder, int length)
+decode_negint(PyDecoder *decoder, Py_ssize_t length)
 {
     PyObject *result = decode_int(decoder, length);
     if (result) {
@@ -306,50 +533,17 @@ decode_negint(PyDecoder *decoder, int length)
     return result;
 }
 
-static char
-nibble(unsigned char c)
-{
-    if (c <= 9)
-        return c | '0';
-    if (c == FltEnc_Plus) {
-        return '+';
-    }
-    if (c == FltEnc_Minus) {
-        return '-';
-    }
-    if (c == FltEnc_Decimal) {
-        return '.';
-    }
-    if (c == FltEnc_E) {
-        return 'e';
-    }
-    return 0;
-}
-
 static PyObject *
-decode_float(PyDecoder *decoder, int length)
+decode_float(PyDecoder *decoder, Py_ssize_t length)
 {
-    char buffer[0x40];
-    if (length > 0x1f) {
+    char buffer[PBJSON_FLOAT_CHARS];
+    if (length > PBJSON_FLOAT_MAX) {
         set_overflow();
         return NULL;
     }
-    int unpacked_len = 0;
-    if (!length) {
-        buffer[0] = '0';
-        ++unpacked_len;
-    }
-    while (length) {
-        unsigned char c = *decoder->data++;
-        decoder->len--;
-        buffer[unpacked_len++] = nibble(c>>4);
-        buffer[unpacked_len++] = nibble(c & 0xf);
-        length--;
-    }
-    if (buffer[unpacked_len-1] == '.') {
-        unpacked_len--;
-    }
-    buffer[unpacked_len] = 0;
+    Py_ssize_t unpacked_len = (Py_ssize_t)pbjson_unpack_float(buffer, decoder->data, length);
+    decoder->data += length;
+    decoder->len -= length;
     if (!decoder->float_class) {
         double d = PyOS_string_to_double(buffer, NULL, NULL);
         if (d == -1.0 && PyErr_Occurred())
@@ -380,7 +574,7 @@ decode_special_float(PyDecoder *decoder, unsigned char token)
 }
 
 static PyObject *
-decode_string(PyDecoder *decoder, int length)
+decode_string(PyDecoder *decoder, Py_ssize_t length)
 {
     PyObject *result = PyUnicode_DecodeUTF8((const char *)decoder->data, length, decoder->unicode_errors);
     decoder->data += length;
@@ -389,7 +583,7 @@ decode_string(PyDecoder *decoder, int length)
 }
 
 static PyObject *
-decode_binary(PyDecoder *decoder, int length)
+decode_binary(PyDecoder *decoder, Py_ssize_t length)
 {
     PyObject *result = PyBytes_FromStringAndSize((const char *)decoder->data, length);
     decoder->data += length;
@@ -398,12 +592,16 @@ decode_binary(PyDecoder *decoder, int length)
 }
 
 static PyObject *
-decode_list(PyDecoder *decoder, int length)
+decode_list(PyDecoder *decoder, Py_ssize_t length)
 {
     PyObject *result = PyList_New(0);
     if (result) {
         while (length) {
             if (length == -1) {
+                if (decoder_require(decoder, 1)) {
+                    Py_CLEAR(result);
+                    break;
+                }
                 if (*decoder->data == Enc_TERMINATOR) {
                     decoder->data++;
                     decoder->len--;
@@ -429,24 +627,286 @@ decode_list(PyDecoder *decoder, int length)
 }
 
 static PyObject *
-decode_dict(PyDecoder *decoder, int length)
+key_fields(PyDecoder *decoder, PyObject *key)
 {
-    PyObject *result = NULL;
+    /* Return the borrowed schema_lookup entry for a new key, or None */
+    PyObject *fields = PyDict_GetItem(decoder->schema_lookup, key);
+    Py_ssize_t c;
+    if (fields == NULL || !PyTuple_Check(fields) || PyTuple_GET_SIZE(fields) != decoder->schema_count)
+        return Py_None;
+    for (c = 0; c < decoder->schema_count; c++) {
+        if (!PyLong_Check(PyTuple_GET_ITEM(fields, c)))
+            return Py_None;
+    }
+    return fields;
+}
+
+static PyObject *
+decode_key(PyDecoder *decoder, Py_ssize_t *index)
+{
+    /* Return a new reference to the next key, remembering new ones, and
+       set index to its position in keys if it is not NULL */
+    PyObject *key;
+    if (decoder_require(decoder, 1))
+        return NULL;
+    unsigned char token = *decoder->data++;
+    decoder->len--;
+    if (token & 0x80) {
+        if (!decoder->keys) {
+            set_overflow();
+            return NULL;
+        }
+        key = PyList_GetItem(decoder->keys, token & 0x7f);
+        if (!key) {
+            return NULL;
+        }
+        if (index)
+            *index = token & 0x7f;
+        Py_INCREF(key);
+        return key;
+    }
+    if (decoder_require(decoder, token))
+        return NULL;
+    key = PyUnicode_FromStringAndSize((const char *)decoder->data, token);
+    if (!key) {
+        return NULL;
+    }
+    decoder->data += token;
+    decoder->len -= token;
+    if (!decoder->keys) {
+        decoder->keys = PyList_New(0);
+        if (decoder->keys && decoder->schema_classes)
+            decoder->key_fields = PyList_New(0);
+    }
+    if (!decoder->keys || PyList_Append(decoder->keys, key)) {
+        Py_DECREF(key);
+        return NULL;
+    }
+    if (decoder->schema_classes && (!decoder->key_fields || PyList_Append(decoder->key_fields, key_fields(decoder, key)))) {
+        Py_DECREF(key);
+        return NULL;
+    }
+    if (index)
+        *index = PyList_GET_SIZE(decoder->keys) - 1;
+    return key;
+}
+
+static Py_ssize_t
+match_schema(PyDecoder *decoder, const Py_ssize_t *key_index, Py_ssize_t count, Py_ssize_t *positions)
+{
+    /* Return the schema class whose fields are exactly the keys at key_index
+       and fill positions with their field positions. Return -1 if no class
+       matches and -2 on error. */
+    unsigned char stack_seen[SCHEMA_STACK];
+    unsigned char *seen;
+    unsigned long long mask = 0;
+    PyObject *fields;
+    Py_ssize_t i, c, position;
+    for (c = 0; c < decoder->schema_count; c++) {
+        if (decoder->schema_sizes[c] == count)
+            mask |= 1ULL << c;
+    }
+    for (i = 0; i < count && mask; i++) {
+        fields = PyList_GET_ITEM(decoder->key_fields, key_index[i]);
+        if (fields == Py_None)
+            return -1;
+        for (c = 0; c < decoder->schema_count; c++) {
+            if ((mask >> c) & 1 && PyLong_AsSsize_t(PyTuple_GET_ITEM(fields, c)) < 0)
+                mask &= ~(1ULL << c);
+        }
+    }
+    if (!mask)
+        return -1;
+    for (c = 0; !((mask >> c) & 1); c++)
+        ;
+    /* A repeated key would leave another field unset */
+    seen = count <= SCHEMA_STACK ? stack_seen : (unsigned char *)PyMem_Malloc(count);
+    if (seen == NULL) {
+        PyErr_NoMemory();
+        return -2;
+    }
+    memset(seen, 0, count);
+    for (i = 0; i < count; i++) {
+        fields = PyList_GET_ITEM(decoder->key_fields, key_index[i]);
+        position = PyLong_AsSsize_t(PyTuple_GET_ITEM(fields, c));
+        if (position >= count || seen[position]) {
+            c = -1;
+            break;
+        }
+        seen[position] = 1;
+        positions[i] = position;
+    }
+    if (seen != stack_seen)
+        PyMem_Free(seen);
+    return c;
+}
+
+static PyObject *
+new_record(PyDecoder *decoder, Py_ssize_t c)
+{
+    /* Return an instance of schema class c without calling __init__ */
+    PyTypeObject *cls = (PyTypeObject *)PyTuple_GET_ITEM(PyTuple_GET_ITEM(decoder->schema_classes, c), 0);
+    PyObject *args = PyTuple_New(0);
+    PyObject *record;
+    if (args == NULL)
+        return NULL;
+    record = cls->tp_new(cls, args, NULL);
+    Py_DECREF(args);
+    return record;
+}
+
+static int
+set_field(PyDecoder *decoder, PyObject *record, Py_ssize_t c, Py_ssize_t position, PyObject *obj)
+{
+    /* Set a field through its slot, or object.__setattr__ for a name */
+    PyObject *setter = PyTuple_GET_ITEM(PyTuple_GET_ITEM(PyTuple_GET_ITEM(decoder->schema_classes, c), 2), position);
+    if (PyUnicode_Check(setter))
+        return PyObject_GenericSetAttr(record, setter, obj);
+    return Py_TYPE(setter)->tp_descr_set(setter, record, obj);
+}
+
+static PyObject *
+new_document(PyDecoder *decoder)
+{
+    /* Return an empty object, or what its pairs are gathered in until
+       finish_document builds it */
+    if (decoder->pairs_kind == PAIRS_LIST) {
+        return PyList_New(0);
+    }
+#if PY_VERSION_HEX >= 0x03050000
+    if (decoder->pairs_kind == PAIRS_ORDERED_DICT) {
+        return PyODict_New();
+    }
+#endif
+    if (decoder->document_class) {
+        return PyObject_CallFunctionObjArgs(decoder->document_class, NULL);
+    }
+    return PyDict_New();
+}
+
+static int
+document_set_item(PyDecoder *decoder, PyObject *document, PyObject *key, PyObject *obj)
+{
+    if (decoder->pairs_kind == PAIRS_LIST) {
+        int err;
+        PyObject *pair = PyTuple_Pack(2, key, obj);
+        if (pair == NULL)
+            return -1;
+        err = PyList_Append(document, pair);
+        Py_DECREF(pair);
+        return err;
+    }
+#if PY_VERSION_HEX >= 0x03050000
+    if (decoder->pairs_kind == PAIRS_ORDERED_DICT) {
+        return PyODict_SetItem(document, key, obj);
+    }
+#endif
     if (decoder->document_class) {
-        result = PyObject_CallFunctionObjArgs(decoder->document_class, NULL);
+        return PyObject_SetItem(document, key, obj);
+    }
+    return PyDict_SetItem(document, key, obj);
+}
+
+static PyObject *
+finish_document(PyDecoder *decoder, PyObject *document)
+{
+    /* Steal document from new_document and return the object it becomes */
+    PyObject *result;
+    if (document == NULL || decoder->pairs_kind == PAIRS_NONE || decoder->pairs_kind == PAIRS_ORDERED_DICT)
+        return document;
+    if (decoder->pairs_kind == PAIRS_MAPPING_PROXY)
+        result = PyDictProxy_New(document);
+    else
+        result = PyObject_CallFunctionObjArgs(decoder->pairs_hook, document, NULL);
+    Py_DECREF(document);
+    return result;
+}
+
+static PyObject *
+decode_record(PyDecoder *decoder, Py_ssize_t length)
+{
+    /* Decode an object of known length into the schema class whose fields
+       are exactly its keys, or into a document if there is none */
+    Py_ssize_t stack_index[SCHEMA_STACK] = {0};
+    Py_ssize_t stack_positions[SCHEMA_STACK];
+    PyObject *stack_values[SCHEMA_STACK];
+    Py_ssize_t *key_index = stack_index;
+    Py_ssize_t *positions = stack_positions;
+    PyObject **values = stack_values;
+    PyObject *result = NULL;
+    PyObject *key;
+    Py_ssize_t capacity = SCHEMA_STACK;
+    Py_ssize_t count, i, c;
+    for (count = 0; count < length; count++) {
+        if (count == capacity) {
+            /* Room grows with the items actually decoded, so a count larger
+               than the input does not allocate for it */
+            Py_ssize_t size = capacity > length / 2 ? length : capacity * 2;
+            Py_ssize_t *block = (Py_ssize_t *)PyMem_Malloc(size * (2 * sizeof(Py_ssize_t) + sizeof(PyObject *)));
+            if (block == NULL) {
+                PyErr_NoMemory();
+                goto bail;
+            }
+            memcpy(block, key_index, count * sizeof(Py_ssize_t));
+            memcpy(block + 2 * size, values, count * sizeof(PyObject *));
+            if (key_index != stack_index)
+                PyMem_Free(key_index);
+            key_index = block;
+            positions = block + size;
+            values = (PyObject **)(positions + size);
+            capacity = size;
+        }
+        /* keys keeps the key alive once it has been decoded */
+        key = decode_key(decoder, &key_index[count]);
+        if (key == NULL)
+            goto bail;
+        Py_DECREF(key);
+        values[count] = decode_one(decoder);
+        if (values[count] == NULL)
+            goto bail;
+    }
+    c = match_schema(decoder, key_index, count, positions);
+    if (c == -2)
+        goto bail;
+    if (c >= 0) {
+        result = new_record(decoder, c);
+        for (i = 0; result && i < count; i++) {
+            if (set_field(decoder, result, c, positions[i], values[i]))
+                Py_CLEAR(result);
+        }
     }
     else {
-        result = PyDict_New();
+        result = new_document(decoder);
+        for (i = 0; result && i < count; i++) {
+            if (document_set_item(decoder, result, PyList_GET_ITEM(decoder->keys, key_index[i]), values[i]))
+                Py_CLEAR(result);
+        }
+        result = finish_document(decoder, result);
     }
+
+bail:
+    for (i = 0; i < count; i++)
+        Py_DECREF(values[i]);
+    if (key_index != stack_index)
+        PyMem_Free(key_index);
+    return result;
+}
+
+static PyObject *
+decode_dict(PyDecoder *decoder, Py_ssize_t length)
+{
+    PyObject *result;
+    if (decoder->schema_classes && length >= 0)
+        return decode_record(decoder, length);
+    result = new_document(decoder);
     if (result) {
         PyObject *key;
         while (length) {
-            if (decoder->len < 2) {
-                set_overflow();
-                Py_CLEAR(result);
-                break;
-            }
             if (length == -1) {
+                if (decoder_require(decoder, 1)) {
+                    Py_CLEAR(result);
+                    break;
+                }
                 if (*decoder->data == Enc_TERMINATOR) {
                     decoder->data++;
                     decoder->len--;
@@ -455,41 +915,10 @@ decode_dict(PyDecoder *decoder, int length)
             } else {
                 --length;
             }
-            unsigned char token = *decoder->data++;
-            decoder->len--;
-            if (token & 0x80) {
-                if (!decoder->keys) {
-                    Py_CLEAR(result);
-                    set_overflow();
-                    break;
-                }
-                key = PyList_GetItem(decoder->keys, token & 0x7f);
-                if (!key) {
-                    Py_CLEAR(result);
-                    break;
-                }
-                Py_INCREF(key);
-            }
-            else {
-                if (token > decoder->len) {
-                    Py_CLEAR(result);
-                    set_overflow();
-                    break;
-                }
-                key = PyUnicode_FromStringAndSize((const char *)decoder->data, token);
-                if (!key) {
-                    Py_CLEAR(result);
-                    break;
-                }
-                decoder->data += token;
-                decoder->len -= token;
-                if (!decoder->keys) {
-                    decoder->keys = PyList_New(0);
-                }
-                if (!decoder->keys || PyList_Append(decoder->keys, key)) {
-                    Py_CLEAR(result);
-                    break;
-                }
+            key = decode_key(decoder, NULL);
+            if (!key) {
+                Py_CLEAR(result);
+                break;
             }
             PyObject *obj = decode_one(decoder);
             if (!obj) {
@@ -497,7 +926,7 @@ decode_dict(PyDecoder *decoder, int length)
                 Py_XDECREF(key);
                 break;
             }
-            if (decoder->document_class ? PyObject_SetItem(result, key, obj) : PyDict_SetItem(result, key, obj)) {
+            if (document_set_item(decoder, result, key, obj)) {
                 Py_XDECREF(key);
                 Py_XDECREF(obj);
                 Py_CLEAR(result);
@@ -507,29 +936,608 @@ decode_dict(PyDecoder *decoder, int length)
             Py_XDECREF(key);
         }
     }
-    return result;
+    return finish_document(decoder, result);
 }
 
-static PyObject *
-decode_one(PyDecoder *decoder)
+static int
+decode_length(PyDecoder *decoder, unsigned char first_byte, Py_ssize_t *length)
 {
-    PyObject *temp=NULL;
-    if (decoder->len) {
-        unsigned char first_byte = *decoder->data++;
-        unsigned token = first_byte & 0xe0;
-        if (!token) {
-            switch (first_byte) {
-                case Enc_FALSE:
-                    Py_INCREF(Py_False);
-                    return Py_False;
-                    
-                case Enc_TRUE:
-                    Py_INCREF(Py_True);
-                    return Py_True;
-                    
-                case Enc_NULL:
-                    Py_INCREF(Py_None);
-                    return Py_None;
+    Py_ssize_t lenlen = (Py_ssize_t)pbjson_length_size(first_byte);
+    if (lenlen && decoder_require(decoder, lenlen))
+        return -1;
+    *length = (Py_ssize_t)pbjson_get_length(first_byte, decoder->data);
+    decoder->data += lenlen;
+    decoder->len -= lenlen;
+    return 0;
+}
+
+static int
+decode_long_length(PyDecoder *decoder, unsigned char *first_byte, Py_ssize_t *length)
+{
+    /* After Enc_LONG_LENGTH, read the token into first_byte and its eight
+       byte length */
+    uint64_t value;
+    if (decoder_require(decoder, 9))
+        return -1;
+    *first_byte = *decoder->data;
+    value = pbjson_get_uint(decoder->data + 1, 8);
+    if (!pbjson_long_token(*first_byte) || value > PY_SSIZE_T_MAX) {
+        set_overflow();
+        return -1;
+    }
+    *length = (Py_ssize_t)value;
+    decoder->data += 9;
+    decoder->len -= 9;
+    return 0;
+}
+
+static int
+decode_header(PyDecoder *decoder, unsigned char *first_byte, Py_ssize_t *length)
+{
+    /* Read a token with a length into first_byte, after a long length
+       prefix if there is one */
+    if (decoder_require(decoder, 1))
+        return -1;
+    *first_byte = *decoder->data++;
+    decoder->len--;
+    if (*first_byte == Enc_LONG_LENGTH)
+        return decode_long_length(decoder, first_byte, length);
+    return decode_length(decoder, *first_byte, length);
+}
+
+static PyObject *
+decode_typed_array(PyDecoder *decoder)
+{
+    /* Enc_TYPED_ARRAY, element code, then the little endian elements as binary */
+    PyObject *result;
+    Py_ssize_t len;
+    unsigned char first_byte;
+    if (decoder_require(decoder, 1))
+        return NULL;
+    unsigned char code = *decoder->data++;
+    decoder->len--;
+    int itemsize = pbjson_typed_array_itemsize(code);
+    if (!itemsize) {
+        set_overflow();
+        return NULL;
+    }
+    if (decode_header(decoder, &first_byte, &len))
+        return NULL;
+    if ((first_byte & 0xe0) != Enc_BINARY) {
+        set_overflow();
+        return NULL;
+    }
+    if (decoder_require(decoder, len))
+        return NULL;
+    if (len % itemsize) {
+        set_overflow();
+        return NULL;
+    }
+#if PY_LITTLE_ENDIAN
+    if (decoder->zero_copy && decoder->source) {
+        PyObject *view = PyMemoryView_FromObject(decoder->source);
+        if (view == NULL)
+            return NULL;
+        Py_ssize_t offset = decoder->data - decoder->start;
+        PyObject *slice = PySequence_GetSlice(view, offset, offset + len);
+        Py_DECREF(view);
+        if (slice == NULL)
+            return NULL;
+        result = PyObject_CallMethod(slice, "cast", "C", code);
+        Py_DECREF(slice);
+        decoder->data += len;
+        decoder->len -= len;
+        return result;
+    }
+#endif
+    PyObject *array_type = get_array_type();
+    if (array_type == NULL)
+        return NULL;
+    result = PyObject_CallFunction(array_type, "C", code);
+    if (result == NULL)
+        return NULL;
+    PyObject *contents = PyMemoryView_FromMemory((char *)decoder->data, len, PyBUF_READ);
+    decoder->data += len;
+    decoder->len -= len;
+    if (contents == NULL) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    PyObject *rv = PyObject_CallMethod(result, "frombytes", "O", contents);
+    Py_DECREF(contents);
+#if !PY_LITTLE_ENDIAN
+    if (rv != NULL && itemsize > 1) {
+        Py_DECREF(rv);
+        rv = PyObject_CallMethod(result, "byteswap", NULL);
+    }
+#endif
+    if (rv == NULL) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    Py_DECREF(rv);
+#if !PY_LITTLE_ENDIAN
+    if (decoder->zero_copy) {
+        PyObject *view = PyMemoryView_FromObject(result);
+        Py_DECREF(result);
+        result = view;
+    }
+#endif
+    return result;
+}
+
+static int
+decode_container_length(PyDecoder *decoder, unsigned char token, Py_ssize_t *length)
+{
+    unsigned char first_byte;
+    if (decode_header(decoder, &first_byte, length))
+        return -1;
+    if ((first_byte & 0xe0) != token) {
+        set_overflow();
+        return -1;
+    }
+    return 0;
+}
+
+static int
+set_list_item(PyObject *list, Py_ssize_t index, PyObject *obj)
+{
+    /* Steal obj into a presized list, appending past its presized end */
+    if (index < PyList_GET_SIZE(list)) {
+        PyList_SET_ITEM(list, index, obj);
+        return 0;
+    }
+    int err = PyList_Append(list, obj);
+    Py_DECREF(obj);
+    return err;
+}
+
+static PyObject *
+decode_table(PyDecoder *decoder)
+{
+    /* Enc_TABLE, a list header with the row count, a dict header with the
+       column count, the column keys, then the values row by row */
+    Py_ssize_t rows, width, row, column;
+    PyObject *columns = NULL;
+    PyObject *lists = NULL;
+    PyObject *result = NULL;
+    PyObject *obj;
+    Py_ssize_t *column_index = NULL;
+    Py_ssize_t *positions = NULL;
+    Py_ssize_t presize;
+    Py_ssize_t record = -1;
+    if (decode_container_length(decoder, Enc_LIST, &rows) || decode_container_length(decoder, Enc_DICT, &width))
+        return NULL;
+    presize = rows;
+    if (!width) {
+        set_overflow();
+        return NULL;
+    }
+    if (rows > decoder->len / width) {
+        /* Only trust the row count once the values are buffered */
+        if (!decoder->read) {
+            set_overflow();
+            return NULL;
+        }
+        presize = 0;
+    }
+    columns = PyTuple_New(width);
+    if (columns == NULL)
+        return NULL;
+    if (decoder->schema_classes && !decoder->columnar) {
+        /* Rows share their keys, so they are matched to a class once */
+        if (width > decoder->len && !decoder->read) {
+            /* Each key takes at least a byte */
+            set_overflow();
+            goto bail;
+        }
+        column_index = (Py_ssize_t *)PyMem_Malloc(width * 2 * sizeof(Py_ssize_t));
+        if (column_index == NULL) {
+            PyErr_NoMemory();
+            goto bail;
+        }
+    }
+    for (column = 0; column < width; column++) {
+        obj = decode_key(decoder, column_index ? &column_index[column] : NULL);
+        if (obj == NULL)
+            goto bail;
+        PyTuple_SET_ITEM(columns, column, obj);
+    }
+    if (column_index) {
+        positions = column_index + width;
+        record = match_schema(decoder, column_index, width, positions);
+        if (record == -2)
+            goto bail;
+    }
+    if (decoder->columnar) {
+        lists = PyTuple_New(width);
+        if (lists == NULL)
+            goto bail;
+        for (column = 0; column < width; column++) {
+            obj = PyList_New(presize);
+            if (obj == NULL)
+                goto bail;
+            PyTuple_SET_ITEM(lists, column, obj);
+        }
+        for (row = 0; row < rows; row++) {
+            for (column = 0; column < width; column++) {
+                obj = decode_one(decoder);
+                if (obj == NULL || set_list_item(PyTuple_GET_ITEM(lists, column), row, obj))
+                    goto bail;
+            }
+        }
+        result = new_document(decoder);
+        if (result == NULL)
+            goto bail;
+        for (column = 0; column < width; column++) {
+            if (document_set_item(decoder, result, PyTuple_GET_ITEM(columns, column), PyTuple_GET_ITEM(lists, column)))
+                goto bail;
+        }
+        Py_CLEAR(lists);
+        result = finish_document(decoder, result);
+        if (result == NULL)
+            goto bail;
+    }
+    else {
+        result = PyList_New(presize);
+        if (result == NULL)
+            goto bail;
+        for (row = 0; row < rows && record >= 0; row++) {
+            PyObject *document = new_record(decoder, record);
+            if (document == NULL)
+                goto bail;
+            for (column = 0; column < width; column++) {
+                obj = decode_one(decoder);
+                if (obj == NULL || set_field(decoder, document, record, positions[column], obj)) {
+                    Py_XDECREF(obj);
+                    Py_DECREF(document);
+                    goto bail;
+                }
+                Py_DECREF(obj);
+            }
+            if (set_list_item(result, row, document))
+                goto bail;
+        }
+        for (row = 0; row < rows && record < 0; row++) {
+            PyObject *document = new_document(decoder);
+            if (document == NULL)
+                goto bail;
+            for (column = 0; column < width; column++) {
+                obj = decode_one(decoder);
+                if (obj == NULL || document_set_item(decoder, document, PyTuple_GET_ITEM(columns, column), obj)) {
+                    Py_XDECREF(obj);
+                    Py_DECREF(document);
+                    goto bail;
+                }
+                Py_DECREF(obj);
+            }
+            document = finish_document(decoder, document);
+            if (document == NULL || set_list_item(result, row, document))
+                goto bail;
+        }
+    }
+    Py_DECREF(columns);
+    if (column_index)
+        PyMem_Free(column_index);
+    return result;
+
+bail:
+    if (column_index)
+        PyMem_Free(column_index);
+    Py_XDECREF(columns);
+    Py_XDECREF(lists);
+    Py_XDECREF(result);
+    return NULL;
+}
+
+static PyObject *
+decode_value_def(PyDecoder *decoder)
+{
+    /* Enc_VALUE_DEF, then a string to remember for later references */
+    if (decoder_require(decoder, 1))
+        return NULL;
+    if ((*decoder->data & 0xe0) != Enc_STRING) {
+        set_overflow();
+        return NULL;
+    }
+    PyObject *result = decode_one(decoder);
+    if (result == NULL)
+        return NULL;
+    if (!decoder->values) {
+        decoder->values = PyList_New(0);
+    }
+    if (!decoder->values || PyList_Append(decoder->values, result)) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    return result;
+}
+
+static PyObject *
+decode_value_ref(PyDecoder *decoder, int width)
+{
+    Py_ssize_t index = 0;
+    if (decoder_require(decoder, width))
+        return NULL;
+    if (!decoder->values) {
+        set_overflow();
+        return NULL;
+    }
+    while (width--) {
+        index = (index << 8) | *decoder->data++;
+        decoder->len--;
+    }
+    if (index >= PyList_GET_SIZE(decoder->values)) {
+        set_overflow();
+        return NULL;
+    }
+    PyObject *result = PyList_GET_ITEM(decoder->values, index);
+    Py_INCREF(result);
+    return result;
+}
+
+static PyObject *
+decode_datetime(PyDecoder *decoder, const unsigned char *bytes, Py_ssize_t length)
+{
+    /* Microseconds since the epoch in UTC, then the UTC offset in seconds
+       for an aware datetime */
+    long long micros, days, year;
+    int month, day;
+    long offset = 0;
+    PyObject *tz = Py_None;
+    if (length != 8 && length != 12) {
+        set_overflow();
+        return NULL;
+    }
+    micros = load_be(bytes, 8);
+    /* A day either side leaves room for the offset without overflowing */
+    if (micros < (DATETIME_MIN_DAYS - 1) * MICROS_PER_DAY || micros >= (DATETIME_MAX_DAYS + 2) * MICROS_PER_DAY) {
+        set_overflow();
+        return NULL;
+    }
+    if (length == 12) {
+        offset = (long)load_be(bytes + 8, 4);
+        if (offset <= -86400 || offset >= 86400) {
+            set_overflow();
+            return NULL;
+        }
+        if (decoder->tz == NULL || decoder->tz_offset != offset) {
+            PyObject *delta = PyDelta_FromDSU(0, offset, 0);
+            if (delta == NULL)
+                return NULL;
+            Py_XSETREF(decoder->tz, PyTimeZone_FromOffset(delta));
+            Py_DECREF(delta);
+            if (decoder->tz == NULL)
+                return NULL;
+            decoder->tz_offset = offset;
+        }
+        tz = decoder->tz;
+        micros += offset * 1000000LL;
+    }
+    days = micros / MICROS_PER_DAY;
+    micros %= MICROS_PER_DAY;
+    if (micros < 0) {
+        micros += MICROS_PER_DAY;
+        days--;
+    }
+    civil_from_days(days, &year, &month, &day);
+    if (year < 1 || year > 9999) {
+        set_overflow();
+        return NULL;
+    }
+    return PyDateTimeAPI->DateTime_FromDateAndTime((int)year, month, day,
+        (int)(micros / 3600000000LL), (int)(micros / 60000000 % 60), (int)(micros / 1000000 % 60), (int)(micros % 1000000),
+        tz, PyDateTimeAPI->DateTimeType);
+}
+
+static PyObject *
+decode_date(const unsigned char *bytes, Py_ssize_t length)
+{
+    /* Days since the epoch */
+    long long year;
+    int month, day;
+    if (length != 4) {
+        set_overflow();
+        return NULL;
+    }
+    civil_from_days(load_be(bytes, 4), &year, &month, &day);
+    if (year < 1 || year > 9999) {
+        set_overflow();
+        return NULL;
+    }
+    return PyDate_FromDate((int)year, month, day);
+}
+
+static PyObject *
+decode_uuid(const unsigned char *bytes, Py_ssize_t length)
+{
+    /* Set the fields of a new UUID the way UUID.__setstate__ does, since
+       UUID.__init__ is far slower than the rest of decoding */
+    static PyObject *UUID = NULL;
+    static PyObject *SafeUUID = NULL;
+    static PyObject *unknown = NULL;
+    static PyObject *int_name = NULL;
+    static PyObject *is_safe_name = NULL;
+    PyObject *value;
+    PyObject *args;
+    PyObject *result;
+    if (length != 16) {
+        set_overflow();
+        return NULL;
+    }
+    if (import_class("uuid", "UUID", &UUID) == NULL || import_class("uuid", "SafeUUID", &SafeUUID) == NULL)
+        return NULL;
+    if (unknown == NULL && (unknown = PyObject_GetAttrString(SafeUUID, "unknown")) == NULL)
+        return NULL;
+    if (int_name == NULL && (int_name = PyUnicode_InternFromString("int")) == NULL)
+        return NULL;
+    if (is_safe_name == NULL && (is_safe_name = PyUnicode_InternFromString("is_safe")) == NULL)
+        return NULL;
+    args = PyTuple_New(0);
+    if (args == NULL)
+        return NULL;
+    result = ((PyTypeObject *)UUID)->tp_new((PyTypeObject *)UUID, args, NULL);
+    Py_DECREF(args);
+    if (result == NULL)
+        return NULL;
+    value = long_from_bytes(bytes, 16);
+    if (value == NULL || PyObject_GenericSetAttr(result, int_name, value) || PyObject_GenericSetAttr(result, is_safe_name, unknown))
+        Py_CLEAR(result);
+    Py_XDECREF(value);
+    return result;
+}
+
+static PyObject *
+decode_ext_decimal(const unsigned char *bytes, Py_ssize_t length)
+{
+    /* The flags byte, the exponent of a finite value, then the digits two
+       to a byte, padded with 0xf */
+    static PyObject *Decimal = NULL;
+    static const char *exponents[] = {NULL, "F", "n", "N"};
+    PyObject *digits = NULL;
+    PyObject *exponent = NULL;
+    PyObject *args = NULL;
+    PyObject *result = NULL;
+    Py_ssize_t i, count;
+    unsigned int kind;
+    if (!length || bytes[0] >> 3) {
+        set_overflow();
+        return NULL;
+    }
+    kind = bytes[0] >> 1;
+    if (kind == DECIMAL_FINITE) {
+        if (length < 5) {
+            set_overflow();
+            return NULL;
+        }
+        exponent = PyLong_FromLongLong(load_be(bytes + 1, 4));
+        i = 5;
+    }
+    else {
+        exponent = PyUnicode_FromString(exponents[kind]);
+        i = 1;
+    }
+    if (exponent == NULL)
+        return NULL;
+    count = (length - i) * 2;
+    if (count && (bytes[length - 1] & 0xf) == 0xf)
+        count--;
+    digits = PyTuple_New(count);
+    if (digits == NULL)
+        goto bail;
+    for (count = 0; count < PyTuple_GET_SIZE(digits); count++) {
+        unsigned int digit = count & 1 ? bytes[i + count / 2] & 0xf : bytes[i + count / 2] >> 4;
+        if (digit > 9) {
+            set_overflow();
+            goto bail;
+        }
+        PyTuple_SET_ITEM(digits, count, PyLong_FromLong(digit));
+    }
+    if (import_class("decimal", "Decimal", &Decimal) == NULL)
+        goto bail;
+    args = Py_BuildValue("(iOO)", bytes[0] & 1, digits, exponent);
+    if (args != NULL)
+        result = PyObject_CallFunctionObjArgs(Decimal, args, NULL);
+
+bail:
+    Py_XDECREF(digits);
+    Py_XDECREF(exponent);
+    Py_XDECREF(args);
+    return result;
+}
+
+static PyObject *
+decode_extension(PyDecoder *decoder)
+{
+    /* Enc_EXT, a type ID, then the value its codec was given */
+    unsigned char type_id;
+    Py_ssize_t length;
+    const unsigned char *bytes;
+    PyObject *decode;
+    PyObject *obj;
+    PyObject *result;
+    if (decoder_require(decoder, 1))
+        return NULL;
+    type_id = *decoder->data++;
+    decoder->len--;
+    if (type_id <= EXT_DECIMAL) {
+        if (decode_container_length(decoder, Enc_BINARY, &length) || decoder_require(decoder, length))
+            return NULL;
+        bytes = decoder->data;
+        decoder->data += length;
+        decoder->len -= length;
+        switch (type_id) {
+            case EXT_DATETIME:
+                return decode_datetime(decoder, bytes, length);
+            case EXT_DATE:
+                return decode_date(bytes, length);
+            case EXT_UUID:
+                return decode_uuid(bytes, length);
+            default:
+                return decode_ext_decimal(bytes, length);
+        }
+    }
+    obj = PyLong_FromLong(type_id);
+    if (obj == NULL)
+        return NULL;
+    decode = decoder->extensions ? PyDict_GetItemWithError(decoder->extensions, obj) : NULL;
+    Py_DECREF(obj);
+    if (decode == NULL) {
+        if (!PyErr_Occurred())
+            raise_errmsg("Unknown extension type in Packed Binary JSON");
+        return NULL;
+    }
+    obj = decode_one(decoder);
+    if (obj == NULL)
+        return NULL;
+    result = PyObject_CallFunctionObjArgs(decode, obj, NULL);
+    Py_DECREF(obj);
+    return result;
+}
+
+static PyObject *
+decode_fragment(PyDecoder *decoder)
+{
+    /* Enc_FRAGMENT, then a value with its own keys and remembered values */
+    PyObject *keys = decoder->keys;
+    PyObject *key_fields = decoder->key_fields;
+    PyObject *values = decoder->values;
+    PyObject *result;
+    if (Py_EnterRecursiveCall(" while decoding a Packed Binary JSON fragment"))
+        return NULL;
+    decoder->keys = decoder->key_fields = decoder->values = NULL;
+    result = decode_one(decoder);
+    Py_CLEAR(decoder->keys);
+    Py_CLEAR(decoder->key_fields);
+    Py_CLEAR(decoder->values);
+    decoder->keys = keys;
+    decoder->key_fields = key_fields;
+    decoder->values = values;
+    Py_LeaveRecursiveCall();
+    return result;
+}
+
+static PyObject *
+decode_one(PyDecoder *decoder)
+{
+    PyObject *temp=NULL;
+    if (!decoder_require(decoder, 1)) {
+        unsigned char first_byte = *decoder->data++;
+        decoder->len--;
+        unsigned token = first_byte & 0xe0;
+        if (!token && first_byte != Enc_LONG_LENGTH) {
+            switch (first_byte) {
+                case Enc_FALSE:
+                    Py_INCREF(Py_False);
+                    return Py_False;
+                    
+                case Enc_TRUE:
+                    Py_INCREF(Py_True);
+                    return Py_True;
+                    
+                case Enc_NULL:
+                    Py_INCREF(Py_None);
+                    return Py_None;
 
                 case Enc_INF:
                 case Enc_NEGINF:
@@ -539,129 +1547,1433 @@ decode_one(PyDecoder *decoder)
                 case Enc_TERMINATED_LIST:
                     return decode_list(decoder, -1);
 
+                case Enc_TERMINATED_DICT:
+                    return decode_dict(decoder, -1);
+
+                case Enc_TYPED_ARRAY:
+                    return decode_typed_array(decoder);
+
+                case Enc_TABLE:
+                    return decode_table(decoder);
+
+                case Enc_VALUE_DEF:
+                    return decode_value_def(decoder);
+
+                case Enc_VALUE_REF:
+                    return decode_value_ref(decoder, 1);
+
+                case Enc_VALUE_REF16:
+                    return decode_value_ref(decoder, 2);
+
+                case Enc_EXT:
+                    return decode_extension(decoder);
+
+                case Enc_FRAGMENT:
+                    return decode_fragment(decoder);
+
                 case Enc_CUSTOM:
                     temp = decode_one(decoder);
-                    if (decoder->custom) {
+                    if (temp && decoder->custom) {
                         PyObject *newobj = PyObject_CallFunctionObjArgs(decoder->custom, temp, NULL);
                         Py_CLEAR(temp);
                         if (newobj) {
                             temp = newobj;
                         }
                     }
-                    return temp;
-
-                default:
-                    PyErr_SetString(PyExc_ValueError, "Invalid token in PBJSON string");
-                    break;
-            }
-        }
-        else {
-            unsigned int len = first_byte & 0xf;
-            if (first_byte & 0x10) {
-                int lenlen = 0;
-                if (len == 0xf) {
-                    len = 0;
-                    lenlen = 4;
+                    return temp;
+
+                default:
+                    PyErr_SetString(PyExc_ValueError, "Invalid token in PBJSON string");
+                    break;
+            }
+        }
+        else {
+            Py_ssize_t len;
+            if (first_byte == Enc_LONG_LENGTH) {
+                if (decode_long_length(decoder, &first_byte, &len))
+                    return NULL;
+                token = first_byte & 0xe0;
+            }
+            else if (decode_length(decoder, first_byte, &len)) {
+                return NULL;
+            }
+            if (token < Enc_LIST) {
+                /* Scalars are decoded straight from the buffer */
+                if (decoder_require(decoder, len))
+                    return NULL;
+            }
+            else if (!decoder->read && decoder->len < len) {
+                /* Every item takes at least a byte */
+                set_overflow();
+                return NULL;
+            }
+            switch (token) {
+                case Enc_INT:
+                    return decode_int(decoder, len);
+
+                case Enc_NEGINT:
+                    return decode_negint(decoder, len);
+
+                case Enc_FLOAT:
+                    return decode_float(decoder, len);
+                    
+                case Enc_STRING:
+                    return decode_string(decoder, len);
+                    
+                case Enc_BINARY:
+                    return decode_binary(decoder, len);
+                    
+                case Enc_LIST:
+                    return decode_list(decoder, len);
+                    
+                case Enc_DICT:
+                    return decode_dict(decoder, len);
+                    
+            }
+        }
+    }
+    return NULL;
+}
+
+PyDoc_STRVAR(pydoc_decode,
+             "decode(bytes, document_class, float_class, custom, unicode_errors, zero_copy=False, columnar=False, read=None, object_pairs_hook=None, schema=None) -> object\n"
+             "\n"
+             "Decode the byte object into an object. If read is given, it is called\n"
+             "with a size for more data whenever the bytes run out. If\n"
+             "object_pairs_hook is given, each object is built by one call to it with\n"
+             "a list of (key, value) pairs. If schema is given, it is the result of\n"
+             "prepare_schema and objects whose keys are exactly the fields of one of\n"
+             "its classes become instances of that class."
+             );
+
+static int
+set_schema(PyDecoder *decoder, PyObject *schema)
+{
+    /* Check what prepare_schema returned and keep its parts */
+    PyObject *entry;
+    Py_ssize_t c;
+    decoder->schema_classes = NULL;
+    decoder->schema_lookup = NULL;
+    decoder->key_fields = NULL;
+    decoder->schema_count = 0;
+    if (schema == NULL || schema == Py_None)
+        return 0;
+    if (!PyTuple_Check(schema) || PyTuple_GET_SIZE(schema) != 2 ||
+            !PyTuple_Check(PyTuple_GET_ITEM(schema, 0)) || !PyDict_Check(PyTuple_GET_ITEM(schema, 1)) ||
+            PyTuple_GET_SIZE(PyTuple_GET_ITEM(schema, 0)) > SCHEMA_LIMIT)
+        goto invalid;
+    decoder->schema_classes = PyTuple_GET_ITEM(schema, 0);
+    decoder->schema_lookup = PyTuple_GET_ITEM(schema, 1);
+    decoder->schema_count = PyTuple_GET_SIZE(decoder->schema_classes);
+    for (c = 0; c < decoder->schema_count; c++) {
+        Py_ssize_t i;
+        PyObject *setters;
+        entry = PyTuple_GET_ITEM(decoder->schema_classes, c);
+        if (!PyTuple_Check(entry) || PyTuple_GET_SIZE(entry) != 3 || !PyType_Check(PyTuple_GET_ITEM(entry, 0)) ||
+                ((PyTypeObject *)PyTuple_GET_ITEM(entry, 0))->tp_new == NULL || !PyTuple_Check(PyTuple_GET_ITEM(entry, 2)))
+            goto invalid;
+        setters = PyTuple_GET_ITEM(entry, 2);
+        decoder->schema_sizes[c] = PyLong_AsSsize_t(PyTuple_GET_ITEM(entry, 1));
+        if (decoder->schema_sizes[c] != PyTuple_GET_SIZE(setters))
+            goto invalid;
+        for (i = 0; i < decoder->schema_sizes[c]; i++) {
+            PyObject *setter = PyTuple_GET_ITEM(setters, i);
+            if (!PyUnicode_Check(setter) && Py_TYPE(setter)->tp_descr_set == NULL)
+                goto invalid;
+        }
+    }
+    return 0;
+
+invalid:
+    PyErr_Clear();
+    decoder->schema_classes = NULL;
+    PyErr_SetString(PyExc_TypeError, "schema must be the result of prepare_schema");
+    return -1;
+}
+
+static PyObject *
+py_decode(PyObject* self UNUSED, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"data", "document_class", "float_class", "custom", "unicode_errors", "zero_copy", "columnar", "read", "object_pairs_hook", "schema", "extensions", NULL};
+
+    PyDecoder decoder;
+    PyObject *schema = NULL;
+    Py_buffer buf;
+    decoder.zero_copy = 0;
+    decoder.columnar = 0;
+    decoder.read = NULL;
+    decoder.pairs_hook = NULL;
+    decoder.extensions = NULL;
+    decoder.tz = NULL;
+    decoder.tz_offset = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*OOOz|ppOOOO:decode", kwlist, &buf, &decoder.document_class, &decoder.float_class, &decoder.custom, &decoder.unicode_errors, &decoder.zero_copy, &decoder.columnar, &decoder.read, &decoder.pairs_hook, &schema, &decoder.extensions))
+        return NULL;
+    if (decoder.extensions == Py_None) {
+        decoder.extensions = NULL;
+    }
+    else if (decoder.extensions && !PyDict_Check(decoder.extensions)) {
+        PyErr_SetString(PyExc_TypeError, "extensions must be a dict");
+        PyBuffer_Release(&buf);
+        return NULL;
+    }
+    if (set_schema(&decoder, schema)) {
+        PyBuffer_Release(&buf);
+        return NULL;
+    }
+    if (decoder.read == Py_None) {
+        decoder.read = NULL;
+    }
+    decoder.pairs_kind = PAIRS_NONE;
+    if (decoder.pairs_hook == Py_None || decoder.pairs_hook == (PyObject *)&PyDict_Type) {
+        decoder.pairs_hook = NULL;
+    }
+    else if (decoder.pairs_hook) {
+        /* Objects are gathered in a dict, not passed to document_class */
+        decoder.document_class = NULL;
+        if (decoder.pairs_hook == (PyObject *)&PyDictProxy_Type)
+            decoder.pairs_kind = PAIRS_MAPPING_PROXY;
+#if PY_VERSION_HEX >= 0x03050000
+        else if (decoder.pairs_hook == (PyObject *)&PyODict_Type)
+            decoder.pairs_kind = PAIRS_ORDERED_DICT;
+#endif
+        else
+            decoder.pairs_kind = PAIRS_LIST;
+    }
+    decoder.block = NULL;
+    decoder.source = buf.obj;
+    decoder.start = decoder.data = (unsigned char*)buf.buf;
+    decoder.len = buf.len;
+    if (decoder.document_class == Py_None || decoder.document_class == (PyObject *)&PyDict_Type) {
+        decoder.document_class = NULL;
+    }
+#if PY_VERSION_HEX >= 0x03050000
+    else if (decoder.document_class == (PyObject *)&PyODict_Type && decoder.pairs_kind == PAIRS_NONE) {
+        decoder.document_class = NULL;
+        decoder.pairs_kind = PAIRS_ORDERED_DICT;
+    }
+#endif
+    if (decoder.float_class == Py_None || decoder.float_class == (PyObject *)&PyFloat_Type) {
+        decoder.float_class = NULL;
+    }
+    decoder.keys = NULL;
+    decoder.values = NULL;
+    PyObject *result = decode_one(&decoder);
+    STAT_ADD(bytes_decoded, decoder.data - decoder.start);
+    Py_CLEAR(decoder.keys);
+    Py_CLEAR(decoder.key_fields);
+    Py_CLEAR(decoder.tz);
+    Py_CLEAR(decoder.values);
+    Py_CLEAR(decoder.block);
+    PyBuffer_Release(&buf);
+    return result;
+}
+
+/* Events reported by event_batches, by index into event_names */
+enum {
+    EV_START_MAP,
+    EV_END_MAP,
+    EV_START_ARRAY,
+    EV_END_ARRAY,
+    EV_MAP_KEY,
+    EV_NULL,
+    EV_BOOLEAN,
+    EV_NUMBER,
+    EV_STRING,
+    EV_BINARY,
+    EV_TYPED_ARRAY,
+    EV_EXTENSION,
+    EV_CUSTOM,
+    EV_COUNT
+};
+
+/* Events before EV_MAP_KEY carry no value and are shared (name, None) pairs */
+#define EV_MARKS EV_MAP_KEY
+
+static const char *const event_strings[EV_COUNT] = {
+    "start_map", "end_map", "start_array", "end_array", "map_key", "null", "boolean",
+    "number", "string", "binary", "typed_array", "extension", "custom"
+};
+static PyObject *event_names[EV_COUNT];
+static PyObject *event_marks[EV_MARKS];
+
+typedef struct _EventFrame {
+    unsigned char kind;     /* Enc_LIST, Enc_DICT, Enc_TABLE or Enc_FRAGMENT */
+    int key_read;           /* The key of the next value has been reported */
+    Py_ssize_t remaining;   /* Items or rows left, or -1 until a terminator */
+    Py_ssize_t column;      /* Next column of a table row, or -1 between rows */
+    PyObject *columns;      /* Keys of a table */
+    PyObject *keys;         /* The enclosing tables, set aside for a fragment */
+    PyObject *values;
+} EventFrame;
+
+typedef struct _EventBatches {
+    PyObject_HEAD
+    PyDecoder decoder;
+    Py_buffer buf;
+    PyObject *errors;       /* Owns the text decoder.unicode_errors points to */
+    EventFrame *stack;
+    Py_ssize_t depth;
+    Py_ssize_t capacity;
+    Py_ssize_t batch_size;
+    int started;
+    int finished;
+} EventBatches;
+
+static int
+append_event(PyObject *batch, int event, PyObject *value)
+{
+    /* Append (event, value) to batch, stealing value, or the shared pair
+       for an event without one */
+    PyObject *pair;
+    int err;
+    if (event < EV_MARKS) {
+        pair = event_marks[event];
+        Py_INCREF(pair);
+    }
+    else {
+        pair = PyTuple_New(2);
+        if (pair == NULL) {
+            Py_DECREF(value);
+            return -1;
+        }
+        Py_INCREF(event_names[event]);
+        PyTuple_SET_ITEM(pair, 0, event_names[event]);
+        PyTuple_SET_ITEM(pair, 1, value);
+    }
+    err = PyList_Append(batch, pair);
+    Py_DECREF(pair);
+    return err;
+}
+
+static int
+value_event(unsigned char first_byte)
+{
+    /* The event for a value decode_one decodes whole */
+    switch (first_byte & 0xe0) {
+        case Enc_INT:
+        case Enc_NEGINT:
+        case Enc_FLOAT:
+            return EV_NUMBER;
+        case Enc_STRING:
+            return EV_STRING;
+        case Enc_BINARY:
+            return EV_BINARY;
+    }
+    switch (first_byte) {
+        case Enc_FALSE:
+        case Enc_TRUE:
+            return EV_BOOLEAN;
+        case Enc_INF:
+        case Enc_NEGINF:
+        case Enc_NAN:
+            return EV_NUMBER;
+        case Enc_TYPED_ARRAY:
+            return EV_TYPED_ARRAY;
+        case Enc_VALUE_DEF:
+        case Enc_VALUE_REF:
+        case Enc_VALUE_REF16:
+            return EV_STRING;
+        case Enc_EXT:
+            return EV_EXTENSION;
+        case Enc_CUSTOM:
+            return EV_CUSTOM;
+    }
+    return EV_NULL;
+}
+
+static int
+push_frame(EventBatches *self, unsigned char kind, Py_ssize_t remaining, PyObject *columns)
+{
+    /* Open a container, stealing columns */
+    EventFrame *frame;
+    if (self->depth == self->capacity) {
+        Py_ssize_t capacity = self->capacity ? self->capacity * 2 : 16;
+        EventFrame *stack = PyMem_Realloc(self->stack, capacity * sizeof(EventFrame));
+        if (stack == NULL) {
+            Py_XDECREF(columns);
+            PyErr_NoMemory();
+            return -1;
+        }
+        self->stack = stack;
+        self->capacity = capacity;
+    }
+    frame = &self->stack[self->depth++];
+    frame->kind = kind;
+    frame->key_read = 0;
+    frame->remaining = remaining;
+    frame->column = -1;
+    frame->columns = columns;
+    frame->keys = NULL;
+    frame->values = NULL;
+    return 0;
+}
+
+static void
+pop_frame(EventBatches *self)
+{
+    EventFrame *frame = &self->stack[--self->depth];
+    Py_XDECREF(frame->columns);
+    if (frame->kind == Enc_FRAGMENT) {
+        Py_XSETREF(self->decoder.keys, frame->keys);
+        Py_XSETREF(self->decoder.values, frame->values);
+    }
+}
+
+static int
+start_value(EventBatches *self, PyObject *batch)
+{
+    /* Report the next value, or open it if it is a container */
+    PyDecoder *decoder = &self->decoder;
+    unsigned char first_byte;
+    Py_ssize_t length, width, column;
+    PyObject *obj;
+    if (decoder_require(decoder, 1))
+        return -1;
+    first_byte = *decoder->data;
+    if (first_byte == Enc_LONG_LENGTH) {
+        /* The token after the prefix says what the value is */
+        if (decoder_require(decoder, 2))
+            return -1;
+        if (pbjson_long_token(decoder->data[1]))
+            first_byte = decoder->data[1];
+    }
+    if ((first_byte & 0xc0) == Enc_LIST) {
+        if (decode_header(decoder, &first_byte, &length))
+            return -1;
+        if (!decoder->read && decoder->len < length) {
+            /* Every item takes at least a byte */
+            set_overflow();
+            return -1;
+        }
+        if (first_byte < Enc_DICT) {
+            return push_frame(self, Enc_LIST, length, NULL) || append_event(batch, EV_START_ARRAY, NULL);
+        }
+        return push_frame(self, Enc_DICT, length, NULL) || append_event(batch, EV_START_MAP, NULL);
+    }
+    if (first_byte == Enc_TERMINATED_LIST) {
+        decoder->data++;
+        decoder->len--;
+        return push_frame(self, Enc_LIST, -1, NULL) || append_event(batch, EV_START_ARRAY, NULL);
+    }
+    if (first_byte == Enc_TERMINATED_DICT) {
+        decoder->data++;
+        decoder->len--;
+        return push_frame(self, Enc_DICT, -1, NULL) || append_event(batch, EV_START_MAP, NULL);
+    }
+    if (first_byte == Enc_TABLE) {
+        decoder->data++;
+        decoder->len--;
+        if (decode_container_length(decoder, Enc_LIST, &length) || decode_container_length(decoder, Enc_DICT, &width))
+            return -1;
+        if (!width || (!decoder->read && length > decoder->len / width)) {
+            set_overflow();
+            return -1;
+        }
+        obj = PyTuple_New(width);
+        if (obj == NULL)
+            return -1;
+        for (column = 0; column < width; column++) {
+            PyObject *key = decode_key(decoder, NULL);
+            if (key == NULL) {
+                Py_DECREF(obj);
+                return -1;
+            }
+            PyTuple_SET_ITEM(obj, column, key);
+        }
+        return push_frame(self, Enc_TABLE, length, obj) || append_event(batch, EV_START_ARRAY, NULL);
+    }
+    if (first_byte == Enc_FRAGMENT) {
+        /* Its value is reported with tables of its own */
+        EventFrame *frame;
+        decoder->data++;
+        decoder->len--;
+        if (push_frame(self, Enc_FRAGMENT, 1, NULL))
+            return -1;
+        frame = &self->stack[self->depth - 1];
+        frame->keys = decoder->keys;
+        frame->values = decoder->values;
+        decoder->keys = decoder->values = NULL;
+        return 0;
+    }
+    obj = decode_one(decoder);
+    if (obj == NULL)
+        return -1;
+    return append_event(batch, value_event(first_byte), obj);
+}
+
+static PyObject *
+event_batches_next(EventBatches *self)
+{
+    PyDecoder *decoder = &self->decoder;
+    PyObject *batch;
+    if (self->finished)
+        return NULL;
+    batch = PyList_New(0);
+    if (batch == NULL)
+        goto bail;
+    while (PyList_GET_SIZE(batch) < self->batch_size) {
+        if (self->depth) {
+            EventFrame *frame = &self->stack[self->depth - 1];
+            if (frame->kind == Enc_LIST) {
+                if (frame->remaining < 0) {
+                    if (decoder_require(decoder, 1))
+                        goto bail;
+                    if (*decoder->data == Enc_TERMINATOR) {
+                        decoder->data++;
+                        decoder->len--;
+                        frame->remaining = 0;
+                    }
                 }
-                else if (len >= 8) {
-                    len &= 0x7;
-                    lenlen = 2;
+                if (!frame->remaining) {
+                    pop_frame(self);
+                    if (append_event(batch, EV_END_ARRAY, NULL))
+                        goto bail;
+                    continue;
+                }
+                if (frame->remaining > 0)
+                    frame->remaining--;
+            }
+            else if (frame->kind == Enc_DICT) {
+                if (frame->key_read) {
+                    frame->key_read = 0;
+                    if (frame->remaining > 0)
+                        frame->remaining--;
                 }
                 else {
-                    len &= 7;
-                    lenlen = 1;
+                    PyObject *key;
+                    if (frame->remaining < 0) {
+                        if (decoder_require(decoder, 1))
+                            goto bail;
+                        if (*decoder->data == Enc_TERMINATOR) {
+                            decoder->data++;
+                            decoder->len--;
+                            frame->remaining = 0;
+                        }
+                    }
+                    if (!frame->remaining) {
+                        pop_frame(self);
+                        if (append_event(batch, EV_END_MAP, NULL))
+                            goto bail;
+                        continue;
+                    }
+                    key = decode_key(decoder, NULL);
+                    if (key == NULL || append_event(batch, EV_MAP_KEY, key))
+                        goto bail;
+                    frame->key_read = 1;
+                    continue;
                 }
-                if (decoder->len < lenlen) {
-                    set_overflow();
-                    return NULL;
+            }
+            else if (frame->kind == Enc_FRAGMENT) {
+                if (!frame->remaining) {
+                    pop_frame(self);
+                    continue;
                 }
-                while (lenlen) {
-                    len <<= 8;
-                    len |= *decoder->data++;
-                    decoder->len--;
-                    lenlen--;
+                frame->remaining = 0;
+            }
+            else if (frame->key_read) {
+                frame->key_read = 0;
+                frame->column++;
+            }
+            else if (frame->column < 0) {
+                if (!frame->remaining) {
+                    pop_frame(self);
+                    if (append_event(batch, EV_END_ARRAY, NULL))
+                        goto bail;
+                    continue;
                 }
+                frame->remaining--;
+                frame->column = 0;
+                if (append_event(batch, EV_START_MAP, NULL))
+                    goto bail;
+                continue;
+            }
+            else if (frame->column == PyTuple_GET_SIZE(frame->columns)) {
+                frame->column = -1;
+                if (append_event(batch, EV_END_MAP, NULL))
+                    goto bail;
+                continue;
+            }
+            else {
+                PyObject *key = PyTuple_GET_ITEM(frame->columns, frame->column);
+                Py_INCREF(key);
+                if (append_event(batch, EV_MAP_KEY, key))
+                    goto bail;
+                frame->key_read = 1;
+                continue;
+            }
+        }
+        else if (self->started) {
+            self->finished = 1;
+            STAT_ADD(bytes_decoded, decoder->data - decoder->start);
+            break;
+        }
+        self->started = 1;
+        if (start_value(self, batch))
+            goto bail;
+    }
+    if (!PyList_GET_SIZE(batch)) {
+        Py_DECREF(batch);
+        return NULL;
+    }
+    return batch;
+
+bail:
+    self->finished = 1;
+    Py_XDECREF(batch);
+    return NULL;
+}
+
+static void
+event_batches_dealloc(EventBatches *self)
+{
+    while (self->depth)
+        pop_frame(self);
+    PyMem_Free(self->stack);
+    Py_CLEAR(self->decoder.keys);
+    Py_CLEAR(self->decoder.key_fields);
+    Py_CLEAR(self->decoder.tz);
+    Py_CLEAR(self->decoder.values);
+    Py_CLEAR(self->decoder.block);
+    Py_CLEAR(self->decoder.float_class);
+    Py_CLEAR(self->decoder.read);
+    Py_CLEAR(self->decoder.extensions);
+    Py_CLEAR(self->errors);
+    PyBuffer_Release(&self->buf);
+    PyObject_Del(self);
+}
+
+static PyTypeObject EventBatchesType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "pbjson._speedups.EventBatches",    /* tp_name */
+    sizeof(EventBatches),               /* tp_basicsize */
+    0,                                  /* tp_itemsize */
+    (destructor)event_batches_dealloc,  /* tp_dealloc */
+};
+
+PyDoc_STRVAR(pydoc_event_batches,
+             "event_batches(bytes, float_class=None, unicode_errors='strict', read=None, extensions=None, batch_size=256) -> iterator\n"
+             "\n"
+             "Iterate over lists of up to batch_size (event, value) pairs for the\n"
+             "document in bytes, without building its lists and dicts. If read is\n"
+             "given, it is called with a size for more data whenever the bytes run out."
+             );
+
+static PyObject *
+py_event_batches(PyObject* self UNUSED, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"data", "float_class", "unicode_errors", "read", "extensions", "batch_size", NULL};
+
+    EventBatches *events;
+    Py_buffer buf;
+    PyObject *float_class = NULL;
+    PyObject *read = NULL;
+    PyObject *extensions = NULL;
+    const char *unicode_errors = "strict";
+    Py_ssize_t batch_size = EVENT_BATCH;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|OzOOn:event_batches", kwlist, &buf, &float_class, &unicode_errors, &read, &extensions, &batch_size))
+        return NULL;
+    if (extensions == Py_None) {
+        extensions = NULL;
+    }
+    else if (extensions && !PyDict_Check(extensions)) {
+        PyErr_SetString(PyExc_TypeError, "extensions must be a dict");
+        PyBuffer_Release(&buf);
+        return NULL;
+    }
+    if (batch_size < 1) {
+        PyErr_SetString(PyExc_ValueError, "batch_size must be positive");
+        PyBuffer_Release(&buf);
+        return NULL;
+    }
+    events = PyObject_New(EventBatches, &EventBatchesType);
+    if (events == NULL) {
+        PyBuffer_Release(&buf);
+        return NULL;
+    }
+    memset(&events->decoder, 0, sizeof(PyDecoder));
+    events->buf = buf;
+    events->stack = NULL;
+    events->depth = events->capacity = 0;
+    events->batch_size = batch_size;
+    events->started = events->finished = 0;
+    events->errors = unicode_errors ? PyUnicode_FromString(unicode_errors) : NULL;
+    if (unicode_errors && events->errors == NULL) {
+        Py_DECREF(events);
+        return NULL;
+    }
+    if (float_class != Py_None && float_class != (PyObject *)&PyFloat_Type) {
+        Py_XINCREF(float_class);
+        events->decoder.float_class = float_class;
+    }
+    if (read != Py_None) {
+        Py_XINCREF(read);
+        events->decoder.read = read;
+    }
+    Py_XINCREF(extensions);
+    events->decoder.extensions = extensions;
+    events->decoder.unicode_errors = events->errors ? PyUnicode_AsUTF8(events->errors) : NULL;
+    events->decoder.pairs_kind = PAIRS_NONE;
+    events->decoder.source = buf.obj;
+    events->decoder.start = events->decoder.data = (unsigned char*)buf.buf;
+    events->decoder.len = buf.len;
+    return (PyObject *)events;
+}
+
+typedef struct _SpliceTarget {
+    PyObject *keys;         /* Keys the decoder of the result can refer back to */
+    PyObject *index;        /* Each of keys to its number */
+    Py_ssize_t values;      /* Values it remembers */
+    PyObject *out;          /* The result, grown as it is written */
+    Py_ssize_t len;
+} SpliceTarget;
+
+typedef struct _SpliceDef {
+    const unsigned char *token; /* The VALUE_DEF and its string */
+    Py_ssize_t size;
+    Py_ssize_t index;           /* Its number in the target, or -1 once replaced */
+} SpliceDef;
+
+typedef struct _SpliceFrame {
+    int keyed;              /* An object, rather than a list or table */
+    Py_ssize_t remaining;   /* Items after the one on the path, or -1 until a terminator */
+} SpliceFrame;
+
+typedef struct _Locator {
+    const unsigned char *data;
+    Py_ssize_t len;         /* Bytes left */
+    PyObject *keys;         /* The first PBJSON_KEY_REFS keys, as the decoder numbers them */
+    Py_ssize_t values;      /* VALUE_DEFs passed */
+    Py_ssize_t base;        /* VALUE_DEFs before defs started being kept, or -1 */
+    SpliceDef *defs;
+    Py_ssize_t defs_capacity;
+    SpliceTarget *target;   /* Where key and value references are rewritten to, or NULL */
+    const unsigned char *mark;  /* Start of the bytes not copied to target yet */
+} Locator;
+
+static void
+locator_init(Locator *loc, const unsigned char *data, Py_ssize_t len, PyObject *keys)
+{
+    loc->data = loc->mark = data;
+    loc->len = len;
+    loc->keys = keys;
+    loc->values = 0;
+    loc->base = -1;
+    loc->defs = NULL;
+    loc->defs_capacity = 0;
+    loc->target = NULL;
+}
+
+static int
+locator_need(Locator *loc, Py_ssize_t needed)
+{
+    if (loc->len < needed) {
+        set_overflow();
+        return -1;
+    }
+    return 0;
+}
+
+static int
+splice_write(SpliceTarget *target, const unsigned char *bytes, Py_ssize_t size)
+{
+    if (target->len + size > PyBytes_GET_SIZE(target->out)) {
+        Py_ssize_t capacity = PyBytes_GET_SIZE(target->out);
+        capacity += capacity / 8 + size + 64;
+        if (_PyBytes_Resize(&target->out, capacity))
+            return -1;
+    }
+    memcpy(PyBytes_AS_STRING(target->out) + target->len, bytes, size);
+    target->len += size;
+    return 0;
+}
+
+static int
+locate_rewrite(Locator *loc, const unsigned char *start, const unsigned char *token, Py_ssize_t size)
+{
+    /* Replace the bytes from start to data with token in the target, if
+       they differ */
+    if (loc->data - start == size && !memcmp(start, token, size))
+        return 0;
+    if (splice_write(loc->target, loc->mark, start - loc->mark) || splice_write(loc->target, token, size))
+        return -1;
+    loc->mark = loc->data;
+    return 0;
+}
+
+static int
+locate_flush(Locator *loc)
+{
+    /* Copy what is left of the data to the target */
+    int err = splice_write(loc->target, loc->mark, loc->data + loc->len - loc->mark);
+    loc->mark = loc->data + loc->len;
+    return err;
+}
+
+static unsigned char
+locate_token(Locator *loc)
+{
+    /* The token at data, which must hold a byte, looking past a long
+       length prefix to the token it applies to */
+    if (*loc->data == Enc_LONG_LENGTH && loc->len > 1 && pbjson_long_token(loc->data[1]))
+        return loc->data[1];
+    return *loc->data;
+}
+
+static int
+locate_length(Locator *loc, Py_ssize_t *length)
+{
+    /* Read the token at data and its length */
+    size_t lenlen;
+    if (locator_need(loc, 1))
+        return -1;
+    if (*loc->data == Enc_LONG_LENGTH) {
+        uint64_t value;
+        if (locator_need(loc, 10))
+            return -1;
+        value = pbjson_get_uint(loc->data + 2, 8);
+        if (!pbjson_long_token(loc->data[1]) || value > PY_SSIZE_T_MAX) {
+            set_overflow();
+            return -1;
+        }
+        *length = (Py_ssize_t)value;
+        loc->data += 10;
+        loc->len -= 10;
+        return 0;
+    }
+    lenlen = pbjson_length_size(*loc->data);
+    if (locator_need(loc, 1 + (Py_ssize_t)lenlen))
+        return -1;
+    *length = pbjson_get_length(*loc->data, loc->data + 1);
+    loc->data += 1 + lenlen;
+    loc->len -= 1 + lenlen;
+    return 0;
+}
+
+static int
+locate_container_length(Locator *loc, unsigned char token, Py_ssize_t *length)
+{
+    if (locator_need(loc, 1))
+        return -1;
+    if ((locate_token(loc) & 0xe0) != token) {
+        set_overflow();
+        return -1;
+    }
+    return locate_length(loc, length);
+}
+
+static int
+target_key(Locator *loc, const unsigned char *start, PyObject *key)
+{
+    /* Write key as the target numbers it */
+    SpliceTarget *target = loc->target;
+    unsigned char token[1 + PBJSON_KEY_MAX];
+    PyObject *number = PyDict_GetItem(target->index, key);
+    const char *name;
+    Py_ssize_t size;
+    if (number) {
+        token[0] = 0x80 | (unsigned char)PyLong_AsLong(number);
+        return locate_rewrite(loc, start, token, 1);
+    }
+    if (PyList_GET_SIZE(target->keys) < PBJSON_KEY_REFS) {
+        number = PyLong_FromSsize_t(PyList_GET_SIZE(target->keys));
+        if (number == NULL || PyDict_SetItem(target->index, key, number) || PyList_Append(target->keys, key)) {
+            Py_XDECREF(number);
+            return -1;
+        }
+        Py_DECREF(number);
+    }
+    name = PyUnicode_AsUTF8AndSize(key, &size);
+    if (name == NULL)
+        return -1;
+    token[0] = (unsigned char)size;
+    memcpy(token + 1, name, size);
+    return locate_rewrite(loc, start, token, 1 + size);
+}
+
+static int
+locate_key(Locator *loc, PyObject *match, int *matched)
+{
+    /* Pass a key, remembering it if the decoder can refer back to it, and
+       set matched to whether it equals match if match is given */
+    const unsigned char *start = loc->data;
+    unsigned char token;
+    PyObject *key;
+    int err = 0;
+    if (locator_need(loc, 1))
+        return -1;
+    token = *loc->data++;
+    loc->len--;
+    if (token & 0x80) {
+        if ((token & 0x7f) >= PyList_GET_SIZE(loc->keys)) {
+            set_overflow();
+            return -1;
+        }
+        key = PyList_GET_ITEM(loc->keys, token & 0x7f);
+        if (match) {
+            *matched = PyObject_RichCompareBool(key, match, Py_EQ);
+            if (*matched < 0)
+                return -1;
+        }
+        return loc->target ? target_key(loc, start, key) : 0;
+    }
+    if (locator_need(loc, token))
+        return -1;
+    loc->data += token;
+    loc->len -= token;
+    if (!match && !loc->target && PyList_GET_SIZE(loc->keys) >= PBJSON_KEY_REFS)
+        return 0;
+    key = PyUnicode_DecodeUTF8((const char *)start + 1, token, NULL);
+    if (key == NULL)
+        return -1;
+    if (PyList_GET_SIZE(loc->keys) < PBJSON_KEY_REFS)
+        err = PyList_Append(loc->keys, key);
+    if (!err && match) {
+        *matched = PyObject_RichCompareBool(key, match, Py_EQ);
+        err = *matched < 0;
+    }
+    if (!err && loc->target)
+        err = target_key(loc, start, key);
+    Py_DECREF(key);
+    return err ? -1 : 0;
+}
+
+static int
+locate_value_def(Locator *loc, const unsigned char *start)
+{
+    /* Number the VALUE_DEF from start to data, keeping it once defs are */
+    SpliceDef *def;
+    loc->values++;
+    if (loc->base < 0)
+        return 0;
+    if (loc->values - loc->base > loc->defs_capacity) {
+        Py_ssize_t capacity = loc->defs_capacity ? loc->defs_capacity * 2 : 16;
+        SpliceDef *defs = PyMem_Realloc(loc->defs, capacity * sizeof(SpliceDef));
+        if (defs == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        loc->defs = defs;
+        loc->defs_capacity = capacity;
+    }
+    def = &loc->defs[loc->values - loc->base - 1];
+    def->token = start;
+    def->size = loc->data - start;
+    def->index = loc->target ? loc->target->values++ : -1;
+    return 0;
+}
+
+static int
+locate_value_ref(Locator *loc, const unsigned char *start, Py_ssize_t index)
+{
+    /* Write a reference to the index-th value as the target numbers it */
+    unsigned char token[3];
+    if (index >= loc->values) {
+        set_overflow();
+        return -1;
+    }
+    if (loc->base >= 0 && index >= loc->base) {
+        SpliceDef *def = &loc->defs[index - loc->base];
+        if (def->index < 0) {
+            /* Its definition was replaced, so this becomes it */
+            def->index = loc->target->values++;
+            return locate_rewrite(loc, start, def->token, def->size);
+        }
+        index = def->index;
+    }
+    if (index < 0x100) {
+        token[0] = Enc_VALUE_REF;
+        token[1] = (unsigned char)index;
+        return locate_rewrite(loc, start, token, 2);
+    }
+    token[0] = Enc_VALUE_REF16;
+    token[1] = (unsigned char)(index >> 8);
+    token[2] = (unsigned char)index;
+    return locate_rewrite(loc, start, token, 3);
+}
+
+static int
+locate_skip(Locator *loc);
+
+static int
+locate_skip_items(Locator *loc, Py_ssize_t count, int keyed)
+{
+    /* Pass count items, or up to the terminator if count is negative */
+    while (count) {
+        if (count < 0) {
+            if (locator_need(loc, 1))
+                return -1;
+            if (*loc->data == Enc_TERMINATOR) {
+                loc->data++;
+                loc->len--;
+                return 0;
+            }
+        }
+        else {
+            count--;
+        }
+        if ((keyed && locate_key(loc, NULL, NULL)) || locate_skip(loc))
+            return -1;
+    }
+    return 0;
+}
+
+static int
+locate_skip_fragment(Locator *loc)
+{
+    /* Pass the document after an Enc_FRAGMENT, which has tables of its own
+       and is copied as it is */
+    Locator inner;
+    int err;
+    locator_init(&inner, loc->data, loc->len, PyList_New(0));
+    if (inner.keys == NULL)
+        return -1;
+    err = locate_skip(&inner);
+    PyMem_Free(inner.defs);
+    Py_DECREF(inner.keys);
+    if (!err) {
+        loc->len -= inner.data - loc->data;
+        loc->data = inner.data;
+    }
+    return err;
+}
+
+static int
+locate_skip_one(Locator *loc)
+{
+    const unsigned char *start = loc->data;
+    unsigned char first_byte;
+    Py_ssize_t length, width, column;
+    if (locator_need(loc, 1))
+        return -1;
+    first_byte = locate_token(loc);
+    if (first_byte & 0xe0) {
+        if (locate_length(loc, &length))
+            return -1;
+        switch (first_byte & 0xe0) {
+            case Enc_LIST:
+                return locate_skip_items(loc, length, 0);
+            case Enc_DICT:
+                return locate_skip_items(loc, length, 1);
+        }
+        if (locator_need(loc, length))
+            return -1;
+        loc->data += length;
+        loc->len -= length;
+        return 0;
+    }
+    loc->data++;
+    loc->len--;
+    switch (first_byte) {
+        case Enc_FALSE:
+        case Enc_TRUE:
+        case Enc_NULL:
+        case Enc_INF:
+        case Enc_NEGINF:
+        case Enc_NAN:
+            return 0;
+
+        case Enc_TERMINATED_LIST:
+            return locate_skip_items(loc, -1, 0);
+
+        case Enc_TERMINATED_DICT:
+            return locate_skip_items(loc, -1, 1);
+
+        case Enc_CUSTOM:
+            return locate_skip(loc);
+
+        case Enc_FRAGMENT:
+            return locate_skip_fragment(loc);
+
+        case Enc_TYPED_ARRAY:
+        case Enc_EXT:
+            if (locator_need(loc, 1))
+                return -1;
+            loc->data++;
+            loc->len--;
+            return locate_skip(loc);
+
+        case Enc_TABLE:
+            if (locate_container_length(loc, Enc_LIST, &length) || locate_container_length(loc, Enc_DICT, &width))
+                return -1;
+            for (column = 0; column < width; column++) {
+                if (locate_key(loc, NULL, NULL))
+                    return -1;
+            }
+            while (width && length--) {
+                if (locate_skip_items(loc, width, 0))
+                    return -1;
             }
-            if (decoder->len < (int)len) {
+            return 0;
+
+        case Enc_VALUE_DEF:
+            if (locator_need(loc, 1))
+                return -1;
+            if ((*loc->data & 0xe0) != Enc_STRING) {
                 set_overflow();
-                return NULL;
+                return -1;
             }
-            switch (token) {
-                case Enc_INT:
-                    return decode_int(decoder, len);
+            return locate_skip(loc) || locate_value_def(loc, start) ? -1 : 0;
 
-                case Enc_NEGINT:
-                    return decode_negint(decoder, len);
+        case Enc_VALUE_REF:
+        case Enc_VALUE_REF16:
+            length = first_byte == Enc_VALUE_REF ? 1 : 2;
+            if (locator_need(loc, length))
+                return -1;
+            column = length == 1 ? loc->data[0] : (loc->data[0] << 8) | loc->data[1];
+            loc->data += length;
+            loc->len -= length;
+            return loc->target ? locate_value_ref(loc, start, column) : 0;
+    }
+    set_overflow();
+    return -1;
+}
 
-                case Enc_FLOAT:
-                    return decode_float(decoder, len);
-                    
-                case Enc_STRING:
-                    return decode_string(decoder, len);
-                    
-                case Enc_BINARY:
-                    return decode_binary(decoder, len);
-                    
-                case Enc_LIST:
-                    return decode_list(decoder, len);
-                    
-                case Enc_DICT:
-                    return decode_dict(decoder, len);
-                    
+static int
+locate_skip(Locator *loc)
+{
+    /* Pass one value */
+    int err;
+    if (Py_EnterRecursiveCall(" while locating a value"))
+        return -1;
+    err = locate_skip_one(loc);
+    Py_LeaveRecursiveCall();
+    return err;
+}
+
+static int
+locate_index(PyObject *step, Py_ssize_t length, Py_ssize_t *index)
+{
+    /* Check a list index, counting from the end if it is negative and
+       length is known */
+    if (!PyLong_Check(step) || PyBool_Check(step)) {
+        PyErr_Format(PyExc_TypeError, "list indices must be integers, not %.200s", Py_TYPE(step)->tp_name);
+        return -1;
+    }
+    *index = PyLong_AsSsize_t(step);
+    if (*index == -1 && PyErr_Occurred()) {
+        PyErr_Clear();
+        length = -1;
+    }
+    if (*index < 0 && length >= 0)
+        *index += length;
+    if (*index < 0 || (length >= 0 && *index >= length)) {
+        PyErr_SetString(PyExc_IndexError, "list index out of range");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+locate_step(Locator *loc, PyObject *path, Py_ssize_t *i, SpliceFrame *frame)
+{
+    /* Move from a container to the value that path[*i] names, consuming
+       two steps for a table row and its key */
+    PyObject *step = PyTuple_GET_ITEM(path, *i);
+    unsigned char first_byte;
+    Py_ssize_t length, width, index, found, column;
+    int matched = 0;
+    if (locator_need(loc, 1))
+        return -1;
+    first_byte = locate_token(loc);
+    if ((first_byte & 0xe0) == Enc_DICT || first_byte == Enc_TERMINATED_DICT) {
+        if (!PyUnicode_Check(step)) {
+            PyErr_Format(PyExc_TypeError, "object keys must be str, not %.200s", Py_TYPE(step)->tp_name);
+            return -1;
+        }
+        if (first_byte == Enc_TERMINATED_DICT) {
+            loc->data++;
+            loc->len--;
+            length = -1;
+        }
+        else if (locate_length(loc, &length)) {
+            return -1;
+        }
+        for (index = 0; index != length; index++) {
+            if (length < 0) {
+                if (locator_need(loc, 1))
+                    return -1;
+                if (*loc->data == Enc_TERMINATOR)
+                    break;
             }
+            if (locate_key(loc, step, &matched))
+                return -1;
+            if (matched)
+                break;
+            if (locate_skip(loc))
+                return -1;
+        }
+        if (!matched) {
+            PyErr_SetObject(PyExc_KeyError, step);
+            return -1;
         }
+        frame->keyed = 1;
+        frame->remaining = length < 0 ? -1 : length - index - 1;
+        return 0;
     }
-    return NULL;
+    if ((first_byte & 0xe0) == Enc_LIST || first_byte == Enc_TERMINATED_LIST) {
+        if (first_byte == Enc_TERMINATED_LIST) {
+            loc->data++;
+            loc->len--;
+            length = -1;
+        }
+        else if (locate_length(loc, &length)) {
+            return -1;
+        }
+        if (locate_index(step, length, &index))
+            return -1;
+        for (column = 0; ; column++) {
+            if (length < 0) {
+                if (locator_need(loc, 1))
+                    return -1;
+                if (*loc->data == Enc_TERMINATOR) {
+                    PyErr_SetString(PyExc_IndexError, "list index out of range");
+                    return -1;
+                }
+            }
+            if (column == index)
+                break;
+            if (locate_skip(loc))
+                return -1;
+        }
+        frame->keyed = 0;
+        frame->remaining = length < 0 ? -1 : length - index - 1;
+        return 0;
+    }
+    if (first_byte == Enc_TABLE) {
+        PyObject *key;
+        loc->data++;
+        loc->len--;
+        if (locate_container_length(loc, Enc_LIST, &length) || locate_container_length(loc, Enc_DICT, &width))
+            return -1;
+        if (locate_index(step, length, &index))
+            return -1;
+        if (++*i == PyTuple_GET_SIZE(path)) {
+            PyErr_SetString(PyExc_ValueError, "a table row is not stored in one piece; give the key of one of its values");
+            return -1;
+        }
+        key = PyTuple_GET_ITEM(path, *i);
+        found = -1;
+        for (column = 0; column < width; column++) {
+            if (locate_key(loc, key, &matched))
+                return -1;
+            if (matched && found < 0)
+                found = column;
+        }
+        if (found < 0) {
+            PyErr_SetObject(PyExc_KeyError, key);
+            return -1;
+        }
+        if (locate_skip_items(loc, index * width + found, 0))
+            return -1;
+        frame->keyed = 0;
+        frame->remaining = length * width - (index * width + found) - 1;
+        return 0;
+    }
+    PyErr_Format(PyExc_TypeError, "path step %R does not index a list or object", step);
+    return -1;
 }
 
-PyDoc_STRVAR(pydoc_decode,
-             "decode(bytes, document_class, float_class, custom, unicode_errors) -> object\n"
+PyDoc_STRVAR(pydoc_splice,
+             "splice(bytes, path, value) -> bytes\n"
              "\n"
-             "Decode the byte object into an object."
+             "Replace the value at path, a tuple of keys and indexes, with the encoded\n"
+             "value, rewriting the key and value references after it if the change\n"
+             "renumbers them."
              );
 
 static PyObject *
-py_decode(PyObject* self UNUSED, PyObject *args, PyObject *kwds)
+splice_document(Py_buffer *buf, PyObject *path, Py_ssize_t first, Py_buffer *value)
 {
-    static char *kwlist[] = {"data", "document_class", "float_class", "custom", "unicode_errors", NULL};
+    /* Replace the value at path[first:] in buf */
+    Locator loc;
+    Locator replacement;
+    SpliceTarget target;
+    SpliceFrame *frames = NULL;
+    PyObject *result = NULL;
+    const unsigned char *start;
+    Py_ssize_t depth = 0;
+    Py_ssize_t i, values;
+    int same;
+    locator_init(&loc, (const unsigned char *)buf->buf, buf->len, PyList_New(0));
+    locator_init(&replacement, (const unsigned char *)value->buf, value->len, PyList_New(0));
+    target.keys = NULL;
+    target.index = PyDict_New();
+    target.values = 0;
+    target.out = NULL;
+    target.len = 0;
+    if (loc.keys == NULL || replacement.keys == NULL || target.index == NULL)
+        goto bail;
+    if (PyTuple_GET_SIZE(path)) {
+        frames = PyMem_New(SpliceFrame, PyTuple_GET_SIZE(path));
+        if (frames == NULL) {
+            PyErr_NoMemory();
+            goto bail;
+        }
+    }
+    for (i = first; i < PyTuple_GET_SIZE(path); i++) {
+        if (loc.len && *loc.data == Enc_FRAGMENT) {
+            /* The embedded document is patched on its own and its size
+               is not recorded anywhere, so it is simply put back */
+            Py_buffer fragment = *buf;
+            PyObject *patched;
+            loc.data++;
+            loc.len--;
+            fragment.buf = (void *)loc.data;
+            if (locate_skip_fragment(&loc))
+                goto bail;
+            fragment.len = loc.data - (const unsigned char *)fragment.buf;
+            patched = splice_document(&fragment, path, i, value);
+            if (patched == NULL)
+                goto bail;
+            target.out = PyBytes_FromStringAndSize(NULL, buf->len - fragment.len + PyBytes_GET_SIZE(patched));
+            if (target.out == NULL
+                    || splice_write(&target, (const unsigned char *)buf->buf, (const unsigned char *)fragment.buf - (const unsigned char *)buf->buf)
+                    || splice_write(&target, (const unsigned char *)PyBytes_AS_STRING(patched), PyBytes_GET_SIZE(patched))
+                    || splice_write(&target, loc.data, loc.len)) {
+                Py_DECREF(patched);
+                goto bail;
+            }
+            Py_DECREF(patched);
+            result = target.out;
+            target.out = NULL;
+            goto bail;
+        }
+        if (locate_step(&loc, path, &i, &frames[depth++]))
+            goto bail;
+    }
 
-    PyDecoder decoder;
-    Py_buffer buf;
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*OOOz:decode", kwlist, &buf, &decoder.document_class, &decoder.float_class, &decoder.custom, &decoder.unicode_errors))
-        return NULL;
-    decoder.data = (unsigned char*)buf.buf;
-    decoder.len = buf.len;
-    if (decoder.document_class == Py_None || decoder.document_class == (PyObject *)&PyDict_Type) {
-        decoder.document_class = NULL;
+    /* The replacement is written for the keys and values known here */
+    start = loc.data;
+    values = loc.values;
+    target.values = values;
+    target.keys = PyList_GetSlice(loc.keys, 0, PyList_GET_SIZE(loc.keys));
+    if (target.keys == NULL)
+        goto bail;
+    for (i = PyList_GET_SIZE(target.keys) - 1; i >= 0; i--) {
+        PyObject *number = PyLong_FromSsize_t(i);
+        if (number == NULL || PyDict_SetItem(target.index, PyList_GET_ITEM(target.keys, i), number)) {
+            Py_XDECREF(number);
+            goto bail;
+        }
+        Py_DECREF(number);
     }
-    if (decoder.float_class == Py_None || decoder.float_class == (PyObject *)&PyFloat_Type) {
-        decoder.float_class = NULL;
+    loc.base = values;
+    if (locate_skip(&loc))
+        goto bail;
+    target.out = PyBytes_FromStringAndSize(NULL, buf->len - (loc.data - start) + value->len);
+    if (target.out == NULL || splice_write(&target, (const unsigned char *)buf->buf, start - (const unsigned char *)buf->buf))
+        goto bail;
+    replacement.target = &target;
+    replacement.base = 0;
+    if (locate_skip(&replacement) || locate_flush(&replacement))
+        goto bail;
+
+    loc.mark = loc.data;
+    loc.target = &target;
+    same = target.values == values && loc.values == values;
+    if (same) {
+        same = PyObject_RichCompareBool(target.keys, loc.keys, Py_EQ);
+        if (same < 0)
+            goto bail;
     }
-    decoder.keys = NULL;
-    PyObject *result = decode_one(&decoder);
-    Py_CLEAR(decoder.keys);
-    PyBuffer_Release(&buf);
+    if (!same) {
+        /* Keys or values remembered after the change are numbered
+           differently, so the references in the rest of each container
+           around it are rewritten */
+        while (depth--) {
+            if (locate_skip_items(&loc, frames[depth].remaining, frames[depth].keyed))
+                goto bail;
+        }
+    }
+    if (locate_flush(&loc) || _PyBytes_Resize(&target.out, target.len))
+        goto bail;
+    result = target.out;
+    target.out = NULL;
+
+bail:
+    PyMem_Free(frames);
+    PyMem_Free(loc.defs);
+    PyMem_Free(replacement.defs);
+    Py_XDECREF(loc.keys);
+    Py_XDECREF(replacement.keys);
+    Py_XDECREF(target.keys);
+    Py_XDECREF(target.index);
+    Py_XDECREF(target.out);
     return result;
 }
 
+static PyObject *
+py_splice(PyObject* self UNUSED, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"data", "path", "value", NULL};
 
+    Py_buffer buf, value;
+    PyObject *path;
+    PyObject *result;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*O!y*:splice", kwlist, &buf, &PyTuple_Type, &path, &value))
+        return NULL;
+    result = splice_document(&buf, path, 0, &value);
+    PyBuffer_Release(&buf);
+    PyBuffer_Release(&value);
+    return result;
+}
 
+PyDoc_STRVAR(pydoc_value_length,
+             "value_length(bytes) -> int\n"
+             "\n"
+             "Return the length of the encoded value at the start of bytes."
+             );
 
+static PyObject *
+py_value_length(PyObject* self UNUSED, PyObject *args)
+{
+    Py_buffer buf;
+    Locator loc;
+    Py_ssize_t length;
+    int err;
+    if (!PyArg_ParseTuple(args, "y*:value_length", &buf))
+        return NULL;
+    locator_init(&loc, (const unsigned char *)buf.buf, buf.len, PyList_New(0));
+    if (loc.keys == NULL) {
+        PyBuffer_Release(&buf);
+        return NULL;
+    }
+    err = locate_skip(&loc);
+    length = loc.data - (const unsigned char *)buf.buf;
+    PyMem_Free(loc.defs);
+    Py_DECREF(loc.keys);
+    PyBuffer_Release(&buf);
+    return err ? NULL : PyLong_FromSsize_t(length);
+}
 
+static int
+emit_chunk(PyEncoder *acc, PyObject *chunk)
+{
+    /* Pass a finished chunk to the write callable or keep it for the result */
+    STAT_INC(chunk_flushes);
+    if (acc->write) {
+        PyObject *rv = PyObject_CallFunctionObjArgs(acc->write, chunk, NULL);
+        if (rv == NULL)
+            return -1;
+        Py_DECREF(rv);
+        return 0;
+    }
+    if (acc->chunk_list == NULL) {
+        acc->chunk_list = PyList_New(0);
+        if (acc->chunk_list == NULL)
+            return -1;
+    }
+    return PyList_Append(acc->chunk_list, chunk);
+}
 
 static int
 flush_accumulator(PyEncoder *acc)
 {
     if (acc->buffer) {
-        if (acc->chunk_list == NULL) {
-            acc->chunk_list = PyList_New(0);
-            if (acc->chunk_list == NULL)
-                return -1;
-        }
         if (_PyString_Resize(&acc->buffer, acc->position)) {
             return -1;
         }
-        if (PyList_Append(acc->chunk_list, acc->buffer)) {
+        if (emit_chunk(acc, acc->buffer)) {
             return -1;
         }
         Py_CLEAR(acc->buffer);
@@ -677,6 +2989,11 @@ JSON_Accu_Accumulate(PyEncoder *acc, const unsigned char *bytes, size_t len)
     if (!len) {
         return 0;
     }
+    if (acc->size_only) {
+        acc->size += len;
+        return 0;
+    }
+    STAT_ADD(bytes_encoded, len);
     if (acc->position + len > BUFFER_SIZE) {
         if (flush_accumulator(acc)) {
             return -1;
@@ -686,11 +3003,9 @@ JSON_Accu_Accumulate(PyEncoder *acc, const unsigned char *bytes, size_t len)
             if (!s) {
                 return -1;
             }
-            if (PyList_Append(acc->chunk_list, s)) {
-                return -1;
-            }
+            int err = emit_chunk(acc, s);
             Py_DECREF(s);
-            return 0;
+            return err;
         }
     }
     if (!acc->buffer) {
@@ -729,6 +3044,7 @@ JSON_Accu_Destroy(PyEncoder *acc)
     Py_CLEAR(acc->item_sort_kw);
     Py_CLEAR(acc->markers);
     Py_CLEAR(acc->key_memo);
+    Py_CLEAR(acc->value_memo);
     Py_CLEAR(acc->chunk_list);
     Py_CLEAR(acc->buffer);
 }
@@ -765,35 +3081,15 @@ _has_for_json_hook(PyObject *obj)
 
 
 static int
-encode_type_and_length(PyEncoder *rval, unsigned char token, int length)
+encode_type_and_length(PyEncoder *rval, unsigned char token, Py_ssize_t length)
 {
-    unsigned char buffer[5];
-    if (length < 16) {
-        token |= (unsigned char)length;
-        return JSON_Accu_Accumulate(rval, &token, 1);
-    }
-    else if (length < 2048) {
-        buffer[0] = token | 0x10 | (unsigned char)(length >> 8);
-        buffer[1] = (unsigned char)length;
-        return JSON_Accu_Accumulate(rval, buffer, 2);
-    }
-    else if (length < 458752) {
-        buffer[0] = token | 0x18 | (unsigned char)(length >> 16);
-        buffer[1] = (unsigned char)(length >> 8);
-        buffer[2] = (unsigned char)length;
-        return JSON_Accu_Accumulate(rval, buffer, 3);
-    }
-    buffer[0] = token | 0x1f;
-    buffer[1] = (unsigned char)(length >> 24);
-    buffer[2] = (unsigned char)(length >> 16);
-    buffer[3] = (unsigned char)(length >> 8);
-    buffer[4] = (unsigned char)length;
-    return JSON_Accu_Accumulate(rval, buffer, 5);
+    unsigned char buffer[PBJSON_HEADER_MAX];
+    return JSON_Accu_Accumulate(rval, buffer, pbjson_put_header(buffer, token, (uint64_t)length));
 }
 
 
 static int
-encode_type_and_content(PyEncoder *rval, unsigned char token, unsigned char *bytes, int length)
+encode_type_and_content(PyEncoder *rval, unsigned char token, unsigned char *bytes, Py_ssize_t length)
 {
     if (encode_type_and_length(rval, token, length)) {
         return -1;
@@ -806,95 +3102,61 @@ encode_long_no_overflow(PyEncoder *rval, long long value)
 {
     unsigned char buffer[8];
     unsigned char token;
+    unsigned long long magnitude;
     if (value >= 0) {
         token = Enc_INT;
+        magnitude = (unsigned long long)value;
     } else {
         token = Enc_NEGINT;
-        value = -value;
+        magnitude = 0ULL - (unsigned long long)value;
     }
-    int i=0;
-    buffer[0] = (unsigned char)(value >> 56);
-    buffer[1] = (unsigned char)(value >> 48);
-    buffer[2] = (unsigned char)(value >> 40);
-    buffer[3] = (unsigned char)(value >> 32);
-    buffer[4] = (unsigned char)(value >> 24);
-    buffer[5] = (unsigned char)(value >> 16);
-    buffer[6] = (unsigned char)(value >> 8);
-    buffer[7] = (unsigned char)value;
-    for (; i<8; i++) {
-        if (buffer[i])
-            break;
-    }
-    if (encode_type_and_length(rval, token, 8-i)) {
-        PyErr_Clear();
-        return -1;
-    }
-    return JSON_Accu_Accumulate(rval, buffer+i, 8-i);
+    return encode_type_and_content(rval, token, buffer, (Py_ssize_t)pbjson_put_uint(buffer, magnitude));
 }
 
+#define LONG_STACK_BUFFER 0x40
+
 static int
 encode_long(PyEncoder *rval, PyObject *obj)
 {
     int overflow;
-    int count = 0;
-    int err;
-    PyObject *work=NULL;
-    unsigned PY_LONG_LONG ull;
-    long l = PyLong_AsLongAndOverflow(obj, &overflow);
+    int ret = -1;
+    unsigned char stack_buffer[LONG_STACK_BUFFER];
+    unsigned char *buffer = stack_buffer;
+    PyObject *magnitude;
+    Py_ssize_t length;
+    long long l = PyLong_AsLongLongAndOverflow(obj, &overflow);
     if (!overflow) {
+        if (l == -1 && PyErr_Occurred())
+            return -1;
         return encode_long_no_overflow(rval, l);
     }
-    if (overflow >= 0) {
+    STAT_INC(bigint_encodes);
+    if (overflow > 0) {
         Py_INCREF(obj);
+        magnitude = obj;
     } else {
-        obj = PyNumber_Negative(obj);
+        magnitude = PyNumber_Negative(obj);
+        if (magnitude == NULL)
+            return -1;
     }
-    PyObject *list = PyList_New(0);
-    PyObject *n64 = PyLong_FromLongLong(64);
-    int ret=0;
-    do {
-        unsigned char buffer[8];
-        ull = PyLong_AsUnsignedLongLong(obj);
-        err = PyErr_Occurred() ? 1 : 0;
-        if (err) {
-            PyErr_Clear();
-            ull = PyLong_AsUnsignedLongLongMask(obj);
-            work = PyNumber_Rshift(obj, n64);
-            Py_DECREF(obj);
-            obj = work;
-        }
-        buffer[0] = (unsigned char)(ull >> 56);
-        buffer[1] = (unsigned char)(ull >> 48);
-        buffer[2] = (unsigned char)(ull >> 40);
-        buffer[3] = (unsigned char)(ull >> 32);
-        buffer[4] = (unsigned char)(ull >> 24);
-        buffer[5] = (unsigned char)(ull >> 16);
-        buffer[6] = (unsigned char)(ull >> 8);
-        buffer[7] = (unsigned char)ull;
-        int i=0;
-        if (!err) {
-            for (; i<8; i++) {
-                if (buffer[i])
-                    break;
-            }
-        }
-        work = PyString_FromStringAndSize((const char*)buffer+i, 8-i);
-        count += (8-i);
-        if (work) {
-            ret = PyList_Insert(list, 0, work);
-            Py_CLEAR(work);
-        } else {
-            ret = -1;
+    length = long_byte_length(magnitude);
+    if (length < 0)
+        goto bail;
+    if (length > LONG_STACK_BUFFER) {
+        buffer = (unsigned char *)PyMem_Malloc(length);
+        if (buffer == NULL) {
+            PyErr_NoMemory();
+            goto bail;
         }
-    } while (err && !ret);
-    if (!ret) {
-        work = join_list_bytes(list);
-        ret = encode_type_and_content(rval, overflow>0 ? Enc_INT : Enc_NEGINT, (unsigned char*)PyString_AS_STRING(work), count);
-        Py_CLEAR(work);
     }
-    Py_DECREF(n64);
-    Py_DECREF(obj);
-    Py_CLEAR(list);
+    if (!long_as_bytes(magnitude, buffer, length)) {
+        ret = encode_type_and_content(rval, overflow > 0 ? Enc_INT : Enc_NEGINT, buffer, length);
+    }
+    if (buffer != stack_buffer) {
+        PyMem_Free(buffer);
+    }
+bail:
+    Py_DECREF(magnitude);
     return ret;
 }
 
@@ -1071,62 +3333,26 @@ unsigned char dtoa(double value, char str[FLOAT_BUFFER])
 }
 
 static int
-encode_float_from_charstring(PyEncoder *rval, const char* str, int len, unsigned char token)
+encode_float_from_charstring(PyEncoder *rval, const char* str, Py_ssize_t len, unsigned char token)
 {
-    int rv = -1;
-    int i;
+    unsigned char stack_buffer[FLOAT_BUFFER];
+    unsigned char *packed = stack_buffer;
+    int rv;
     if (token != Enc_FLOAT) {
-        rv = JSON_Accu_Accumulate(rval, &token, 1);
+        return JSON_Accu_Accumulate(rval, &token, 1);
     }
-    else {
-        unsigned char c;
-        int nibble_index=0;
-        if (str[0] == '-') {
-            c = FltEnc_Minus << 4;
-            nibble_index=1;
-            ++str;
-            --len;
-        }
-        while (len > 0 && *str == '0') {
-            --len;
-            ++str;
-        }
-        if (len > 1 && str[len-1] == '0' && str[len-2] == '.') {
-            len -= 2;
-        }
-
-        rv = encode_type_and_length(rval, Enc_FLOAT, (len+1+nibble_index)/2);
-        for (i=0; i<len && !rv; i++) {
-            char nibble = str[i];
-            if (nibble>='0' && nibble<='9') {
-                nibble -= '0';
-            }
-            else if (nibble == '-') {
-                nibble = FltEnc_Minus;
-            }
-            else if (nibble == '+') {
-                nibble = FltEnc_Plus;
-            }
-            else if (nibble == '.') {
-                nibble = FltEnc_Decimal;
-            }
-            else if (nibble == 'e') {
-                nibble = FltEnc_E;
-            }
-            if (!nibble_index) {
-                nibble_index = 1;
-                c = nibble << 4;
-            } else {
-                c |= nibble;
-                nibble_index = 0;
-                rv = JSON_Accu_Accumulate(rval, &c, 1);
-            }
-        }
-        if (!rv && nibble_index) {
-            c |= FltEnc_Decimal;
-            rv = JSON_Accu_Accumulate(rval, &c, 1);
+    if (len / 2 + 1 > FLOAT_BUFFER) {
+        /* Decimals can have any number of digits */
+        packed = (unsigned char *)PyMem_Malloc(len / 2 + 1);
+        if (packed == NULL) {
+            PyErr_NoMemory();
+            return -1;
         }
     }
+    rv = encode_type_and_content(rval, Enc_FLOAT, packed, (Py_ssize_t)pbjson_pack_float(packed, str, len));
+    if (packed != stack_buffer) {
+        PyMem_Free(packed);
+    }
     return rv;
 }
 
@@ -1136,7 +3362,19 @@ encode_float(PyEncoder *rval, PyObject *obj)
 #if 1
     char buffer[FLOAT_BUFFER];
     double d = PyFloat_AS_DOUBLE(obj);
-    unsigned char token = dtoa(d, buffer);
+    unsigned char token;
+    if (rval->canonical && Py_IS_FINITE(d)) {
+        /* The fast dtoa can be off in the last digit, so canonical output
+           uses the shortest repr that round trips, the same as Python */
+        int rv;
+        char *repr = PyOS_double_to_string(d, 'r', 0, 0, NULL);
+        if (repr == NULL)
+            return -1;
+        rv = encode_float_from_charstring(rval, repr, strlen(repr), Enc_FLOAT);
+        PyMem_Free(repr);
+        return rv;
+    }
+    token = dtoa(d, buffer);
     return encode_float_from_charstring(rval, buffer, strlen(buffer), token);
 #else
     PyObject *encoded = PyObject_Str(obj);
@@ -1152,7 +3390,7 @@ encode_float(PyEncoder *rval, PyObject *obj)
     }
 #endif
     const char* str = PyString_AS_STRING(encoded);
-    int len = PyString_GET_SIZE(encoded);
+    Py_ssize_t len = PyString_GET_SIZE(encoded);
     unsigned char token = Enc_FLOAT;
     if (len) {
         if (str[0] == 'i') {
@@ -1181,13 +3419,13 @@ encode_decimal(PyEncoder *rval, PyObject *obj)
 #if PY_MAJOR_VERSION >= 3
     obj = encoded;
     encoded = PyUnicode_AsUTF8String(obj);
+    Py_DECREF(obj);
     if (!encoded) {
-        Py_XDECREF(obj);
         return -1;
     }
 #endif
     const char* str = PyString_AS_STRING(encoded);
-    int len = PyString_GET_SIZE(encoded);
+    Py_ssize_t len = PyString_GET_SIZE(encoded);
     unsigned char token = Enc_FLOAT;
     if (len) {
         if (str[0] == 'I') {
@@ -1205,6 +3443,154 @@ encode_decimal(PyEncoder *rval, PyObject *obj)
     return rv;
 }
 
+static unsigned char
+typed_array_code(Py_buffer *view, int *swap)
+{
+    /* Map a buffer's struct format to a typed array element code.
+       Returns 0 when the format can't be packed. */
+    const char *format = view->format ? view->format : "B";
+    int big_endian = !PY_LITTLE_ENDIAN;
+    switch (*format) {
+        case '<':
+            big_endian = 0;
+            ++format;
+            break;
+        case '>':
+        case '!':
+            big_endian = 1;
+            ++format;
+            break;
+        case '@':
+        case '=':
+            ++format;
+            break;
+    }
+    if (!format[0] || format[1]) {
+        return 0;
+    }
+    *swap = big_endian && view->itemsize > 1;
+    switch (format[0]) {
+        case 'b': case 'h': case 'i': case 'l': case 'q': case 'n':
+            switch (view->itemsize) {
+                case 1: return 'b';
+                case 2: return 'h';
+                case 4: return 'i';
+                case 8: return 'q';
+            }
+            break;
+        case 'B': case 'H': case 'I': case 'L': case 'Q': case 'N':
+            switch (view->itemsize) {
+                case 1: return 'B';
+                case 2: return 'H';
+                case 4: return 'I';
+                case 8: return 'Q';
+            }
+            break;
+        case 'f':
+            return view->itemsize == 4 ? 'f' : 0;
+        case 'd':
+            return view->itemsize == 8 ? 'd' : 0;
+    }
+    return 0;
+}
+
+static void
+swap_items(unsigned char *bytes, Py_ssize_t len, Py_ssize_t itemsize)
+{
+    Py_ssize_t i, j;
+    for (i = 0; i < len; i += itemsize) {
+        for (j = 0; j < itemsize / 2; j++) {
+            unsigned char c = bytes[i + j];
+            bytes[i + j] = bytes[i + itemsize - 1 - j];
+            bytes[i + itemsize - 1 - j] = c;
+        }
+    }
+}
+
+static int
+accumulate_view(PyEncoder *encoder, Py_buffer *view, int swap)
+{
+    /* Copy a buffer's contents to the output in C order. Large
+       non-contiguous views are gathered straight into their own chunk. */
+    unsigned char small[BUFFER_SIZE];
+    unsigned char *bytes;
+    PyObject *chunk;
+    int rv;
+    if (!swap && PyBuffer_IsContiguous(view, 'C'))
+        return JSON_Accu_Accumulate(encoder, (const unsigned char *)view->buf, view->len);
+    if (encoder->size_only) {
+        encoder->size += view->len;
+        return 0;
+    }
+    if (view->len < BUFFER_SIZE) {
+        if (PyBuffer_ToContiguous(small, view, view->len, 'C'))
+            return -1;
+        if (swap)
+            swap_items(small, view->len, view->itemsize);
+        return JSON_Accu_Accumulate(encoder, small, view->len);
+    }
+    if (flush_accumulator(encoder))
+        return -1;
+    chunk = PyString_FromStringAndSize(NULL, view->len);
+    if (chunk == NULL)
+        return -1;
+    bytes = (unsigned char *)PyString_AS_STRING(chunk);
+    if (PyBuffer_ToContiguous(bytes, view, view->len, 'C')) {
+        Py_DECREF(chunk);
+        return -1;
+    }
+    if (swap)
+        swap_items(bytes, view->len, view->itemsize);
+    STAT_ADD(bytes_encoded, view->len);
+    rv = emit_chunk(encoder, chunk);
+    Py_DECREF(chunk);
+    return rv;
+}
+
+static int
+is_byte_view(PyObject *obj, Py_buffer *view)
+{
+    /* True for a memoryview of unsigned bytes, which is written as binary
+       rather than as a typed array like its exporter would be */
+    const char *format = view->format;
+    if (!PyMemoryView_Check(obj) || view->itemsize != 1)
+        return 0;
+    if (format == NULL)
+        return 1;
+    if (*format == '<' || *format == '>' || *format == '!' || *format == '@' || *format == '=')
+        ++format;
+    return *format == 'B' && !format[1];
+}
+
+static int
+encode_buffer(PyEncoder *encoder, PyObject *obj)
+{
+    /* Encode a buffer-protocol object as a typed array, or as binary if it
+       is a view of bytes or its format has no typed array code.
+       Returns 1 without raising if obj doesn't export a buffer. */
+    Py_buffer view;
+    int swap = 0;
+    int rv = -1;
+    if (PyObject_GetBuffer(obj, &view, PyBUF_FULL_RO)) {
+        PyErr_Clear();
+        return 1;
+    }
+    unsigned char header[2];
+    header[0] = Enc_TYPED_ARRAY;
+    header[1] = typed_array_code(&view, &swap);
+    if (!header[1] || is_byte_view(obj, &view)) {
+        swap = 0;
+    }
+    else if (JSON_Accu_Accumulate(encoder, header, 2)) {
+        goto bail;
+    }
+    if (encode_type_and_length(encoder, Enc_BINARY, view.len))
+        goto bail;
+    rv = accumulate_view(encoder, &view, swap);
+bail:
+    PyBuffer_Release(&view);
+    return rv;
+}
 
 static int
 encode_key(PyEncoder *rval, PyObject *obj)
@@ -1221,40 +3607,188 @@ encode_key(PyEncoder *rval, PyObject *obj)
         }
     }
 #if PY_MAJOR_VERSION < 3
-    else if (PyString_Check(obj))
-    {
-        Py_INCREF(obj);
-        encoded = obj;
-    }
+    else if (PyString_Check(obj))
+    {
+        Py_INCREF(obj);
+        encoded = obj;
+    }
+#endif
+    else {
+        PyErr_Format(PyExc_TypeError, "keys must be str, not %.100s", Py_TYPE(obj)->tp_name);
+        return -1;
+    }
+    if (!str) {
+        str = PyString_AS_STRING(encoded);
+        len = PyString_GET_SIZE(encoded);
+    }
+    unsigned char clen = (unsigned char)len;
+    if (len > 127) {
+        PyErr_Format(PyExc_ValueError, "keys must be at most 127 bytes, not %zd", len);
+        Py_DECREF(encoded);
+        return -1;
+    }
+    if (JSON_Accu_Accumulate(rval, &clen, 1)) {
+        Py_DECREF(encoded);
+        return -1;
+    }
+    int ret = JSON_Accu_Accumulate(rval, (unsigned char*)str, len);
+    STAT_INC(key_memo_misses);
+    if (ret)
+        goto done;
+    if (rval->key_memo == NULL) {
+        rval->key_memo = PyDict_New();
+        if (rval->key_memo == NULL) {
+            ret = -1;
+            goto done;
+        }
+    }
+    len = PyDict_Size(rval->key_memo);
+    if (len < 128) {
+        value = PyLong_FromSsize_t(len);
+        if (value == NULL || PyDict_SetItem(rval->key_memo, obj, value))
+            ret = -1;
+    }
+    else {
+        STAT_INC(key_memo_overflows);
+    }
+done:
+    Py_CLEAR(value);
+    Py_DECREF(encoded);
+    return ret;
+}
+
+static int
+encode_value_ref(PyEncoder *encoder, PyObject *obj, Py_ssize_t len)
+{
+    /* Write a reference if obj has been seen before, otherwise mark it to
+       be remembered. Returns 1 if the string itself still needs writing. */
+    PyObject *index;
+    unsigned char buffer[3];
+    if (len < VALUE_REF_MIN || len > VALUE_REF_MAX)
+        return 1;
+    if (!encoder->value_memo) {
+        encoder->value_memo = PyDict_New();
+        if (!encoder->value_memo)
+            return -1;
+    }
+    index = PyDict_GetItemWithError(encoder->value_memo, obj);
+    if (index != NULL) {
+        long value = PyLong_AS_LONG(index);
+        if (value < 0x100) {
+            buffer[0] = Enc_VALUE_REF;
+            buffer[1] = (unsigned char)value;
+            return JSON_Accu_Accumulate(encoder, buffer, 2);
+        }
+        buffer[0] = Enc_VALUE_REF16;
+        buffer[1] = (unsigned char)(value >> 8);
+        buffer[2] = (unsigned char)value;
+        return JSON_Accu_Accumulate(encoder, buffer, 3);
+    }
+    if (PyErr_Occurred())
+        return -1;
+    Py_ssize_t count = PyDict_GET_SIZE(encoder->value_memo);
+    if (count < VALUE_REF_LIMIT) {
+        index = PyLong_FromSsize_t(count);
+        if (index == NULL)
+            return -1;
+        int err = PyDict_SetItem(encoder->value_memo, obj, index);
+        Py_DECREF(index);
+        buffer[0] = Enc_VALUE_DEF;
+        if (err || JSON_Accu_Accumulate(encoder, buffer, 1))
+            return -1;
+    }
+    return 1;
+}
+
+static int
+encode_string(PyEncoder *encoder, PyObject *obj)
+{
+    int rv = -1;
+    PyObject *encoded = PyUnicode_AsUTF8String(obj);
+    if (encoded != NULL) {
+        rv = encoder->value_refs ? encode_value_ref(encoder, obj, PyString_GET_SIZE(encoded)) : 1;
+        if (rv == 1) {
+            rv = encode_type_and_content(encoder, Enc_STRING, (unsigned char*)PyString_AS_STRING(encoded), PyString_GET_SIZE(encoded));
+        }
+        Py_DECREF(encoded);
+    }
+    return rv;
+}
+
+static int
+is_str_key(PyObject *key)
+{
+    /* True for the keys encode_key can write */
+#if PY_MAJOR_VERSION < 3
+    if (PyString_Check(key))
+        return 1;
 #endif
-    else {
-        return -1;
-    }
-    if (!str) {
-        str = PyString_AS_STRING(encoded);
-        len = PyString_GET_SIZE(encoded);
+    return PyUnicode_Check(key);
+}
+
+static Py_ssize_t
+count_str_keys(PyObject *dct)
+{
+    /* Count the items of a mapping that skip_illegal_keys keeps */
+    Py_ssize_t count = 0;
+    PyObject *key;
+    PyObject *iter;
+    if (PyDict_Check(dct)) {
+        Py_ssize_t pos = 0;
+        PyObject *value;
+        while (PyDict_Next(dct, &pos, &key, &value))
+            count += is_str_key(key);
+        return count;
     }
-    unsigned char clen = (unsigned char)len;
-    if (len > 127 || JSON_Accu_Accumulate(rval, &clen, 1)) {
-        Py_DECREF(encoded);
+    key = PyMapping_Keys(dct);
+    if (key == NULL)
         return -1;
+    iter = PyObject_GetIter(key);
+    Py_DECREF(key);
+    if (iter == NULL)
+        return -1;
+    while ((key = PyIter_Next(iter))) {
+        count += is_str_key(key);
+        Py_DECREF(key);
     }
-    int ret = JSON_Accu_Accumulate(rval, (unsigned char*)str, len);
-    if (rval->key_memo) {
-        len = PyDict_Size(rval->key_memo);
-    }
-    else {
-        rval->key_memo = PyDict_New();
-        len = 0;
+    Py_DECREF(iter);
+    return PyErr_Occurred() ? -1 : count;
+}
+
+static PyObject *
+str_key_items(PyObject *items)
+{
+    /* Return a list of the items whose keys can be written. Anything that
+       isn't a pair is kept for the caller to reject. */
+    PyObject *item;
+    PyObject *lst;
+    PyObject *iter = PyObject_GetIter(items);
+    if (iter == NULL)
+        return NULL;
+    lst = PyList_New(0);
+    while (lst && (item = PyIter_Next(iter))) {
+        if ((!PyTuple_Check(item) || Py_SIZE(item) != 2 || is_str_key(PyTuple_GET_ITEM(item, 0))) &&
+                PyList_Append(lst, item))
+            Py_CLEAR(lst);
+        Py_DECREF(item);
     }
-    if (len < 128) {
-        PyObject *value = PyLong_FromLong(len);
-        if (PyDict_SetItem(rval->key_memo, obj, value))
-            ret = -1;
+    Py_DECREF(iter);
+    if (lst && PyErr_Occurred())
+        Py_CLEAR(lst);
+    return lst;
+}
+
+static int
+encode_key_ref(PyEncoder *encoder, PyObject *key)
+{
+    /* Encode a key as a back-reference if it has been seen before */
+    PyObject *index = encoder->key_memo ? PyDict_GetItem(encoder->key_memo, key) : NULL;
+    if (index != NULL) {
+        unsigned char c = 0x80 | (unsigned char)PyLong_AS_LONG(index);
+        STAT_INC(key_memo_hits);
+        return JSON_Accu_Accumulate(encoder, &c, 1);
     }
-    Py_CLEAR(value);
-    Py_DECREF(encoded);
-    return ret;
+    return encode_key(encoder, key);
 }
 
 static int
@@ -1286,10 +3820,237 @@ check_circular(PyEncoder *rval, PyObject *obj, PyObject **ident_ptr)
     return 0;
 }
 
+static int
+encode_ext_header(PyEncoder *encoder, unsigned char type_id)
+{
+    unsigned char header[2];
+    header[0] = Enc_EXT;
+    header[1] = type_id;
+    return JSON_Accu_Accumulate(encoder, header, 2);
+}
+
+static int
+encode_datetime(PyEncoder *encoder, PyObject *obj)
+{
+    /* Microseconds since the epoch in UTC, then the UTC offset in seconds
+       if the datetime is aware; naive datetimes are counted as if in UTC */
+    unsigned char bytes[12];
+    int length = 8;
+    long long days = days_from_civil(PyDateTime_GET_YEAR(obj), PyDateTime_GET_MONTH(obj), PyDateTime_GET_DAY(obj));
+    long long micros = ((days * 24 + PyDateTime_DATE_GET_HOUR(obj)) * 60 + PyDateTime_DATE_GET_MINUTE(obj)) * 60 + PyDateTime_DATE_GET_SECOND(obj);
+    micros = micros * 1000000 + PyDateTime_DATE_GET_MICROSECOND(obj);
+    if (_PyDateTime_HAS_TZINFO(obj)) {
+        long offset;
+        PyObject *delta = PyObject_CallMethod(obj, "utcoffset", NULL);
+        if (delta == NULL)
+            return -1;
+        if (delta != Py_None) {
+            if (!PyDelta_Check(delta) || PyDateTime_DELTA_GET_MICROSECONDS(delta)) {
+                PyErr_SetString(PyExc_ValueError, "UTC offsets with microseconds are not supported");
+                Py_DECREF(delta);
+                return -1;
+            }
+            offset = PyDateTime_DELTA_GET_DAYS(delta) * 86400L + PyDateTime_DELTA_GET_SECONDS(delta);
+            if (offset <= -86400 || offset >= 86400) {
+                PyErr_SetString(PyExc_ValueError, "UTC offsets must be less than a day");
+                Py_DECREF(delta);
+                return -1;
+            }
+            micros -= offset * 1000000LL;
+            store_be(bytes + 8, (unsigned long long)(long long)offset, 4);
+            length = 12;
+        }
+        Py_DECREF(delta);
+    }
+    store_be(bytes, (unsigned long long)micros, 8);
+    if (encode_ext_header(encoder, EXT_DATETIME))
+        return -1;
+    return encode_type_and_content(encoder, Enc_BINARY, bytes, length);
+}
+
+static int
+encode_date(PyEncoder *encoder, PyObject *obj)
+{
+    /* Days since the epoch */
+    unsigned char bytes[4];
+    long long days = days_from_civil(PyDateTime_GET_YEAR(obj), PyDateTime_GET_MONTH(obj), PyDateTime_GET_DAY(obj));
+    store_be(bytes, (unsigned long long)days, 4);
+    if (encode_ext_header(encoder, EXT_DATE))
+        return -1;
+    return encode_type_and_content(encoder, Enc_BINARY, bytes, 4);
+}
+
+static int
+encode_uuid(PyEncoder *encoder, PyObject *obj)
+{
+    unsigned char bytes[16];
+    PyObject *value = PyObject_GetAttrString(obj, "int");
+    int rv;
+    if (value == NULL)
+        return -1;
+    rv = PyLong_Check(value) ? long_as_bytes(value, bytes, 16) : -1;
+    Py_DECREF(value);
+    if (rv) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_TypeError, "UUID.int must be an int");
+        return -1;
+    }
+    if (encode_ext_header(encoder, EXT_UUID))
+        return -1;
+    return encode_type_and_content(encoder, Enc_BINARY, bytes, 16);
+}
+
+static int
+encode_ext_decimal(PyEncoder *encoder, PyObject *obj)
+{
+    /* The flags byte, the exponent of a finite value, then the digits two
+       to a byte, padded with 0xf, all from as_tuple() */
+    PyObject *parts = PyObject_CallMethod(obj, "as_tuple", NULL);
+    PyObject *digits, *exponent, *content = NULL;
+    unsigned char *bytes;
+    Py_ssize_t count, i, size;
+    int kind = DECIMAL_FINITE;
+    long long exp = 0;
+    long sign;
+    int rv = -1;
+    if (parts == NULL)
+        return -1;
+    if (!PyTuple_Check(parts) || PyTuple_GET_SIZE(parts) != 3 || !PyTuple_Check(PyTuple_GET_ITEM(parts, 1))) {
+        PyErr_SetString(PyExc_TypeError, "as_tuple() must return (sign, digits, exponent)");
+        goto bail;
+    }
+    sign = PyLong_AsLong(PyTuple_GET_ITEM(parts, 0));
+    digits = PyTuple_GET_ITEM(parts, 1);
+    exponent = PyTuple_GET_ITEM(parts, 2);
+    if (sign == -1 && PyErr_Occurred())
+        goto bail;
+    if (PyUnicode_Check(exponent)) {
+        if (PyUnicode_CompareWithASCIIString(exponent, "F") == 0)
+            kind = DECIMAL_INFINITE;
+        else if (PyUnicode_CompareWithASCIIString(exponent, "n") == 0)
+            kind = DECIMAL_NAN;
+        else
+            kind = DECIMAL_SNAN;
+    }
+    else {
+        exp = PyLong_AsLongLong(exponent);
+        if (exp == -1 && PyErr_Occurred())
+            goto bail;
+        if (exp < -0x80000000LL || exp > 0x7fffffffLL) {
+            PyErr_SetString(PyExc_OverflowError, "Decimal exponent out of range");
+            goto bail;
+        }
+    }
+    count = PyTuple_GET_SIZE(digits);
+    size = (kind == DECIMAL_FINITE ? 5 : 1) + (count + 1) / 2;
+    content = PyBytes_FromStringAndSize(NULL, size);
+    if (content == NULL)
+        goto bail;
+    bytes = (unsigned char *)PyBytes_AS_STRING(content);
+    bytes[0] = (unsigned char)(kind << 1 | (sign & 1));
+    if (kind == DECIMAL_FINITE) {
+        store_be(bytes + 1, (unsigned long long)exp, 4);
+        bytes += 5;
+    }
+    else {
+        bytes++;
+    }
+    for (i = 0; i < count; i++) {
+        long digit = PyLong_AsLong(PyTuple_GET_ITEM(digits, i));
+        if (digit < 0 || digit > 9) {
+            if (!PyErr_Occurred())
+                PyErr_SetString(PyExc_ValueError, "Decimal digits must be 0 to 9");
+            goto bail;
+        }
+        if (i & 1)
+            bytes[i / 2] |= (unsigned char)digit;
+        else
+            bytes[i / 2] = (unsigned char)(digit << 4 | (i + 1 == count ? 0xf : 0));
+    }
+    if (!encode_ext_header(encoder, EXT_DECIMAL))
+        rv = encode_type_and_content(encoder, Enc_BINARY, (unsigned char *)PyBytes_AS_STRING(content), size);
+
+bail:
+    Py_XDECREF(content);
+    Py_DECREF(parts);
+    return rv;
+}
+
+static int
+encode_extension(PyEncoder *encoder, PyObject *obj, PyObject *entry)
+{
+    /* Encode obj as Enc_EXT with its (type ID, encode function) entry,
+       natively for the reserved type IDs */
+    PyObject *ident = NULL;
+    PyObject *newobj;
+    long type_id;
+    int rv = -1;
+    if (!PyTuple_Check(entry) || PyTuple_GET_SIZE(entry) != 2) {
+        PyErr_SetString(PyExc_TypeError, "extensions must map each type to (type ID, encode function)");
+        return -1;
+    }
+    type_id = PyLong_AsLong(PyTuple_GET_ITEM(entry, 0));
+    if (type_id < 0 || type_id > 0xff) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_ValueError, "Extension type IDs must be between 0 and 255");
+        return -1;
+    }
+    switch (type_id) {
+        case EXT_DATETIME:
+            if (PyDateTime_Check(obj))
+                return encode_datetime(encoder, obj);
+            break;
+        case EXT_DATE:
+            if (PyDate_Check(obj))
+                return encode_date(encoder, obj);
+            break;
+        case EXT_UUID:
+            return encode_uuid(encoder, obj);
+        case EXT_DECIMAL:
+            return encode_ext_decimal(encoder, obj);
+    }
+    if (type_id < EXT_USER_MIN) {
+        PyErr_Format(PyExc_ValueError, "Extension type ID %ld is reserved", type_id);
+        return -1;
+    }
+    if (encoder->check_circular && check_circular(encoder, obj, &ident))
+        return -1;
+    newobj = PyObject_CallFunctionObjArgs(PyTuple_GET_ITEM(entry, 1), obj, NULL);
+    if (newobj != NULL) {
+        if (!encode_ext_header(encoder, (unsigned char)type_id) && !encode_one(encoder, newobj))
+            rv = 0;
+        Py_DECREF(newobj);
+    }
+    if (!rv && ident != NULL && PyDict_DelItem(encoder->markers, ident))
+        rv = -1;
+    Py_XDECREF(ident);
+    return rv;
+}
+
+static int
+encode_raw(PyEncoder *encoder, PyObject *obj)
+{
+    /* Copy the bytes of a RawPBJSON after a FRAGMENT token */
+    unsigned char c = Enc_FRAGMENT;
+    int rv = -1;
+    PyObject *encoded = PyObject_GetAttrString(obj, "encoded_pbjson");
+    if (encoded == NULL)
+        return -1;
+    if (!PyBytes_Check(encoded)) {
+        PyErr_SetString(PyExc_TypeError, "RawPBJSON.encoded_pbjson must be bytes");
+    }
+    else if (!JSON_Accu_Accumulate(encoder, &c, 1)) {
+        rv = JSON_Accu_Accumulate(encoder, (unsigned char *)PyBytes_AS_STRING(encoded), PyBytes_GET_SIZE(encoded));
+    }
+    Py_DECREF(encoded);
+    return rv;
+}
+
 static int
 encode_one(PyEncoder *encoder, PyObject *obj)
 {
     /* Encode Python object obj to a byte object */
+    PyObject *ext;
     int rv = -1;
     do {
         if (obj == Py_None || obj == Py_True || obj == Py_False) {
@@ -1298,11 +4059,7 @@ encode_one(PyEncoder *encoder, PyObject *obj)
         }
         else if (PyUnicode_Check(obj))
         {
-            PyObject *encoded = PyUnicode_AsUTF8String(obj);
-            if (encoded != NULL) {
-                rv = encode_type_and_content(encoder, Enc_STRING, (unsigned char*)PyString_AS_STRING(encoded), PyString_GET_SIZE(encoded));
-                Py_DECREF(encoded);
-            }
+            rv = encode_string(encoder, obj);
         }
 #if PY_MAJOR_VERSION >= 3
         else if (PyBytes_Check(obj))
@@ -1324,9 +4081,22 @@ encode_one(PyEncoder *encoder, PyObject *obj)
         else if (PyFloat_Check(obj)) {
             rv = encode_float(encoder, obj);
         }
+        else if (PyByteArray_Check(obj))
+        {
+            rv = encode_type_and_content(encoder, Enc_BINARY, (unsigned char*)PyByteArray_AS_STRING(obj), PyByteArray_GET_SIZE(obj));
+        }
+        else if (encoder->extensions && (ext = PyDict_GetItem(encoder->extensions, (PyObject *)Py_TYPE(obj))) != NULL) {
+            if (Py_EnterRecursiveCall(" while encoding a JSON object"))
+                return rv;
+            rv = encode_extension(encoder, obj, ext);
+            Py_LeaveRecursiveCall();
+        }
         else if (encoder->Decimal && PyObject_TypeCheck(obj, (PyTypeObject *)encoder->Decimal)) {
             rv = encode_decimal(encoder, obj);
         }
+        else if (PyObject_TypeCheck(obj, (PyTypeObject *)encoder->RawPBJSON)) {
+            rv = encode_raw(encoder, obj);
+        }
         else {
             if (encoder->custom) {
                 PyObject *callable=NULL;
@@ -1339,7 +4109,7 @@ encode_one(PyEncoder *encoder, PyObject *obj)
                     PyObject *iter = PyObject_GetIter(encoder->custom);
                     if (iter == NULL)
                         return -1;
-                    while ((tuple = PyIter_Next(iter)) && !callable && !PyErr_Occurred()) {
+                    while (!callable && !PyErr_Occurred() && (tuple = PyIter_Next(iter))) {
                         if (!PyTuple_Check(tuple) || Py_SIZE(tuple) != 2) {
                             PyErr_SetString(PyExc_ValueError, "Custom handlers must be a sequence of 2-tuples (type, function)");
                         }
@@ -1357,12 +4127,15 @@ encode_one(PyEncoder *encoder, PyObject *obj)
                         break;
                     }
                     PyErr_Clear();
+                    STAT_INC(custom_calls);
                     newobj = PyObject_CallFunctionObjArgs(callable, obj, NULL);
                     if (newobj) {
                         unsigned char c = Enc_CUSTOM;
                         rv = JSON_Accu_Accumulate(encoder, &c, 1);
-                        rv = encode_one(encoder, newobj);
-                        Py_XDECREF(newobj);
+                        if (!rv) {
+                            rv = encode_one(encoder, newobj);
+                        }
+                        Py_DECREF(newobj);
                     }
                     if (rv) {
                         rv = -1;
@@ -1380,6 +4153,20 @@ encode_one(PyEncoder *encoder, PyObject *obj)
                     break;
                 }
             }
+            if (encoder->classes) {
+                PyObject *plan = PyDict_GetItemWithError(encoder->classes, (PyObject *)Py_TYPE(obj));
+                if (plan != NULL) {
+                    if (Py_EnterRecursiveCall(" while encoding a JSON object"))
+                        return rv;
+                    rv = encode_object(encoder, obj, plan);
+                    Py_LeaveRecursiveCall();
+                    break;
+                }
+                if (PyErr_Occurred()) {
+                    rv = -1;
+                    break;
+                }
+            }
             if (encoder->for_json && _has_for_json_hook(obj)) {
                 PyObject *newobj;
                 if (Py_EnterRecursiveCall(" while encoding a JSON object"))
@@ -1408,6 +4195,9 @@ encode_one(PyEncoder *encoder, PyObject *obj)
                 }
                 Py_LeaveRecursiveCall();
             }
+            else if (PyObject_CheckBuffer(obj) && (rv = encode_buffer(encoder, obj)) != 1) {
+                /* Packed as a typed array or binary */
+            }
             else if (PyObject_Length(obj) >= 0) {
                 if (Py_EnterRecursiveCall(" while encoding a JSON object"))
                     return rv;
@@ -1424,105 +4214,391 @@ encode_one(PyEncoder *encoder, PyObject *obj)
                     Py_XDECREF(iter);
                 } else {
                     PyObject *ident = NULL;
-                    PyObject *newobj;
-                    if (encoder->check_circular && check_circular(encoder, obj, &ident)) {
-                        break;
-                    }
                     PyErr_Clear();
-                    newobj = PyObject_CallFunctionObjArgs(encoder->defaultfn, obj, NULL);
-                    if (newobj) {
-                        rv = encode_one(encoder, newobj);
-                        Py_XDECREF(newobj);
-                    }
-                    if (rv) {
-                        rv = -1;
-                    }
-                    else if (ident != NULL) {
-                        if (PyDict_DelItem(encoder->markers, ident)) {
+                    rv = -1;
+                    if (!encoder->check_circular || !check_circular(encoder, obj, &ident)) {
+                        STAT_INC(convert_calls);
+                        PyObject *newobj = PyObject_CallFunctionObjArgs(encoder->defaultfn, obj, NULL);
+                        if (newobj) {
+                            rv = encode_one(encoder, newobj);
+                            Py_DECREF(newobj);
+                        }
+                        if (rv) {
                             rv = -1;
                         }
+                        else if (ident != NULL) {
+                            if (PyDict_DelItem(encoder->markers, ident)) {
+                                rv = -1;
+                            }
+                        }
+                        Py_XDECREF(ident);
                     }
-                    Py_XDECREF(ident);
                 }
                 Py_LeaveRecursiveCall();
             }
         }
-    } while (0);
-    return rv;
+    } while (0);
+    return rv;
+}
+
+static int
+encode_dict(PyEncoder *encoder, PyObject *dct)
+{
+    /* Encode Python dict dct a JSON term */
+    PyObject *kstr = NULL;
+    PyObject *ident = NULL;
+    PyObject *iter = NULL;
+    PyObject *item = NULL;
+    PyObject *items = NULL;
+    PyObject *encoded = NULL;
+
+    Py_ssize_t len = PyMapping_Size(dct);
+    if (len > 0 && encoder->skipkeys)
+        len = count_str_keys(dct);
+    if (len < 0 || encode_type_and_length(encoder, Enc_DICT, len)) {
+        return -1;
+    }
+
+    if (len) {
+        if (encoder->check_circular && check_circular(encoder, dct, &ident)) {
+            goto bail;
+        }
+        
+        iter = encode_dict_items(encoder, dct);
+        if (iter == NULL)
+            goto bail;
+        
+        while ((item = PyIter_Next(iter))) {
+            PyObject *key, *value;
+            if (!PyTuple_Check(item) || Py_SIZE(item) != 2) {
+                PyErr_SetString(PyExc_ValueError, "items must return 2-tuples");
+                goto bail;
+            }
+            key = PyTuple_GET_ITEM(item, 0);
+            if (key == NULL)
+                goto bail;
+            value = PyTuple_GET_ITEM(item, 1);
+            if (value == NULL)
+                goto bail;
+
+            if (encode_key_ref(encoder, key))
+                goto bail;
+            if (encode_one(encoder, value))
+                goto bail;
+            Py_CLEAR(item);
+        }
+        Py_CLEAR(iter);
+        if (PyErr_Occurred())
+            goto bail;
+        if (ident != NULL) {
+            if (PyDict_DelItem(encoder->markers, ident))
+                goto bail;
+            Py_CLEAR(ident);
+        }
+    }
+    return 0;
+
+bail:
+    Py_XDECREF(encoded);
+    Py_XDECREF(item);
+    Py_XDECREF(items);
+    Py_XDECREF(iter);
+    Py_XDECREF(kstr);
+    Py_XDECREF(ident);
+    return -1;
+}
+
+static PyObject *
+get_field(PyObject *obj, PyObject *accessor)
+{
+    /* Read a field through its slot, or getattr for a name */
+    if (PyUnicode_Check(accessor))
+        return PyObject_GetAttr(obj, accessor);
+    if (Py_TYPE(accessor)->tp_descr_get == NULL) {
+        PyErr_SetString(PyExc_TypeError, "fields must be read through a name or a descriptor");
+        return NULL;
+    }
+    return Py_TYPE(accessor)->tp_descr_get(accessor, obj, (PyObject *)Py_TYPE(obj));
+}
+
+static int
+encode_object(PyEncoder *encoder, PyObject *obj, PyObject *plan)
+{
+    /* Encode an instance of a registered class as a dict of its fields,
+       read straight from the object */
+    PyObject *fields;
+    PyObject *field;
+    PyObject *value;
+    PyObject *ident = NULL;
+    Py_ssize_t i, len;
+    if (!PyTuple_Check(plan) || PyTuple_GET_SIZE(plan) != 2 || !PyTuple_Check(PyTuple_GET_ITEM(plan, 0)) || !PyTuple_Check(PyTuple_GET_ITEM(plan, 1)))
+        goto invalid;
+    fields = PyTuple_GET_ITEM(plan, encoder->sort_native ? 1 : 0);
+    len = PyTuple_GET_SIZE(fields);
+    for (i = 0; i < len; i++) {
+        field = PyTuple_GET_ITEM(fields, i);
+        if (!PyTuple_Check(field) || PyTuple_GET_SIZE(field) != 2)
+            goto invalid;
+    }
+    if (encoder->item_sort_kw) {
+        /* Sorted by a Python key function, which needs the items */
+        int rv;
+        PyObject *dct = PyDict_New();
+        if (dct == NULL)
+            return -1;
+        for (i = 0; i < len; i++) {
+            field = PyTuple_GET_ITEM(fields, i);
+            value = get_field(obj, PyTuple_GET_ITEM(field, 1));
+            if (value == NULL || PyDict_SetItem(dct, PyTuple_GET_ITEM(field, 0), value)) {
+                Py_XDECREF(value);
+                Py_DECREF(dct);
+                return -1;
+            }
+            Py_DECREF(value);
+        }
+        rv = encode_dict(encoder, dct);
+        Py_DECREF(dct);
+        return rv;
+    }
+    if (encode_type_and_length(encoder, Enc_DICT, len))
+        return -1;
+    if (encoder->check_circular && check_circular(encoder, obj, &ident))
+        return -1;
+    for (i = 0; i < len; i++) {
+        field = PyTuple_GET_ITEM(fields, i);
+        value = get_field(obj, PyTuple_GET_ITEM(field, 1));
+        if (value == NULL)
+            goto bail;
+        if (encode_key_ref(encoder, PyTuple_GET_ITEM(field, 0)) || encode_one(encoder, value)) {
+            Py_DECREF(value);
+            goto bail;
+        }
+        Py_DECREF(value);
+    }
+    if (ident != NULL) {
+        if (PyDict_DelItem(encoder->markers, ident))
+            goto bail;
+        Py_DECREF(ident);
+    }
+    return 0;
+
+invalid:
+    PyErr_SetString(PyExc_TypeError, "classes must map each class to its plan from register_class");
+    return -1;
+
+bail:
+    Py_XDECREF(ident);
+    return -1;
+}
+
+
+static PyObject *
+table_columns(PyEncoder *encoder, PyObject *seq)
+{
+    /* Return the column keys if seq is a list of at least two dicts with
+       identical string keys, or NULL without an exception if it isn't */
+    Py_ssize_t i, j, width, rows = PySequence_Fast_GET_SIZE(seq);
+    PyObject **items = PySequence_Fast_ITEMS(seq);
+    PyObject *columns = NULL;
+    if (rows < 2 || !PyDict_CheckExact(items[0]))
+        return NULL;
+    width = PyDict_GET_SIZE(items[0]);
+    if (!width)
+        return NULL;
+    for (i = 1; i < rows; i++) {
+        if (!PyDict_CheckExact(items[i]) || PyDict_GET_SIZE(items[i]) != width)
+            return NULL;
+    }
+    if (encoder->sort_native || encoder->item_sort_kw) {
+        PyObject *item;
+        PyObject *iter = encode_dict_items(encoder, items[0]);
+        if (iter == NULL)
+            return NULL;
+        columns = PyList_New(0);
+        while (columns && (item = PyIter_Next(iter))) {
+            if (PyList_Append(columns, PyTuple_GET_ITEM(item, 0)))
+                Py_CLEAR(columns);
+            Py_DECREF(item);
+        }
+        Py_DECREF(iter);
+        if (columns == NULL || PyErr_Occurred() || PyList_GET_SIZE(columns) != width)
+            goto bail;
+    }
+    else {
+        columns = PyDict_Keys(items[0]);
+        if (columns == NULL)
+            return NULL;
+    }
+    for (j = 0; j < width; j++) {
+        Py_ssize_t len;
+        PyObject *key = PyList_GET_ITEM(columns, j);
+        if (!PyUnicode_Check(key))
+            goto bail;
+        if (PyUnicode_AsUTF8AndSize(key, &len) == NULL) {
+            PyErr_Clear();
+            goto bail;
+        }
+        if (len > 127)
+            goto bail;
+        for (i = 1; i < rows; i++) {
+            if (PyDict_GetItemWithError(items[i], key) == NULL)
+                goto bail;
+        }
+    }
+    return columns;
+
+bail:
+    Py_XDECREF(columns);
+    return NULL;
 }
 
 static int
-encode_dict(PyEncoder *encoder, PyObject *dct)
+encode_table(PyEncoder *encoder, PyObject *seq, PyObject *columns)
 {
-    /* Encode Python dict dct a JSON term */
-    PyObject *kstr = NULL;
+    /* Encode a list of same-shaped dicts with the keys written once */
+    Py_ssize_t i, j;
+    Py_ssize_t rows = PySequence_Fast_GET_SIZE(seq);
+    Py_ssize_t width = PyList_GET_SIZE(columns);
     PyObject *ident = NULL;
-    PyObject *iter = NULL;
-    PyObject *item = NULL;
-    PyObject *items = NULL;
-    PyObject *encoded = NULL;
-
-    int len = PyMapping_Size(dct);
-    if (encode_type_and_length(encoder, Enc_DICT, len)) {
+    unsigned char c = Enc_TABLE;
+    if (JSON_Accu_Accumulate(encoder, &c, 1) ||
+        encode_type_and_length(encoder, Enc_LIST, rows) ||
+        encode_type_and_length(encoder, Enc_DICT, width))
         return -1;
+    for (j = 0; j < width; j++) {
+        if (encode_key_ref(encoder, PyList_GET_ITEM(columns, j)))
+            return -1;
     }
-
-    if (len) {
-        if (encoder->check_circular && check_circular(encoder, dct, &ident)) {
+    if (encoder->check_circular && check_circular(encoder, seq, &ident))
+        return -1;
+    for (i = 0; i < rows; i++) {
+        PyObject *row_ident = NULL;
+        PyObject *row;
+        if (i >= PySequence_Fast_GET_SIZE(seq)) {
+            PyErr_SetString(PyExc_RuntimeError, "list changed size during iteration");
             goto bail;
         }
-        
-        iter = encode_dict_items(encoder, dct);
-        if (iter == NULL)
+        row = PySequence_Fast_GET_ITEM(seq, i);
+        Py_INCREF(row);
+        if (encoder->check_circular && check_circular(encoder, row, &row_ident)) {
+            Py_DECREF(row);
             goto bail;
-        
-        while ((item = PyIter_Next(iter))) {
-            PyObject *encoded, *key, *value;
-            if (!PyTuple_Check(item) || Py_SIZE(item) != 2) {
-                PyErr_SetString(PyExc_ValueError, "items must return 2-tuples");
-                goto bail;
+        }
+        for (j = 0; j < width; j++) {
+            PyObject *value = PyDict_GetItemWithError(row, PyList_GET_ITEM(columns, j));
+            int rv;
+            if (value == NULL) {
+                if (!PyErr_Occurred())
+                    PyErr_SetString(PyExc_RuntimeError, "dictionary changed during iteration");
+                rv = -1;
             }
-            key = PyTuple_GET_ITEM(item, 0);
-            if (key == NULL)
-                goto bail;
-            value = PyTuple_GET_ITEM(item, 1);
-            if (value == NULL)
-                goto bail;
-
-            encoded = encoder->key_memo ? PyDict_GetItem(encoder->key_memo, key) : NULL;
-            if (encoded != NULL) {
-                long value = PyLong_AS_LONG(encoded);
-                unsigned char l = 0x80 | (unsigned char)value;
-                if (JSON_Accu_Accumulate(encoder, &l, 1)) {
-                    goto bail;
-                }
-            } else if (encode_key(encoder, key)) {
-                goto bail;
+            else {
+                Py_INCREF(value);
+                rv = encode_one(encoder, value);
+                Py_DECREF(value);
             }
-            if (encode_one(encoder, value))
+            if (rv) {
+                Py_XDECREF(row_ident);
+                Py_DECREF(row);
                 goto bail;
-            Py_CLEAR(item);
+            }
         }
-        Py_CLEAR(iter);
-        if (PyErr_Occurred())
-            goto bail;
-        if (ident != NULL) {
-            if (PyDict_DelItem(encoder->markers, ident))
+        Py_DECREF(row);
+        if (row_ident != NULL) {
+            int rv = PyDict_DelItem(encoder->markers, row_ident);
+            Py_DECREF(row_ident);
+            if (rv)
                 goto bail;
-            Py_CLEAR(ident);
         }
     }
+    if (ident != NULL) {
+        if (PyDict_DelItem(encoder->markers, ident))
+            goto bail;
+        Py_CLEAR(ident);
+    }
     return 0;
 
 bail:
-    Py_XDECREF(encoded);
-    Py_XDECREF(items);
-    Py_XDECREF(iter);
-    Py_XDECREF(kstr);
     Py_XDECREF(ident);
     return -1;
 }
 
+static PyObject *
+encode_alone(PyEncoder *encoder, PyObject *obj)
+{
+    /* obj encoded as bytes with encoder's options but a key table of its
+       own. The circular reference markers are shared. */
+    PyEncoder alone = *encoder;
+    PyObject *chunks, *empty, *rval;
+    if (encoder->check_circular && encoder->markers == NULL) {
+        encoder->markers = PyDict_New();
+        if (encoder->markers == NULL)
+            return NULL;
+    }
+    alone.markers = encoder->markers;
+    Py_XINCREF(alone.markers);
+    Py_XINCREF(alone.item_sort_kw);
+    alone.key_memo = NULL;
+    alone.value_memo = NULL;
+    alone.chunk_list = NULL;
+    alone.write = NULL;
+    alone.buffer = NULL;
+    alone.ptr = NULL;
+    alone.position = 0;
+    alone.size_only = 0;
+    alone.size = 0;
+    if (encode_one(&alone, obj)) {
+        JSON_Accu_Destroy(&alone);
+        return NULL;
+    }
+    chunks = JSON_Accu_FinishAsList(&alone);
+    if (chunks == NULL)
+        return NULL;
+    empty = PyString_FromStringAndSize(NULL, 0);
+    rval = empty ? PyObject_CallMethod(empty, "join", "O", chunks) : NULL;
+    Py_XDECREF(empty);
+    Py_DECREF(chunks);
+    return rval;
+}
+
+static PyObject *
+sorted_by_encoding(PyEncoder *encoder, PyObject *seq)
+{
+    /* The items of seq as a list ordered by their encoded bytes, a total
+       order even for items of types that cannot be compared */
+    Py_ssize_t i, n;
+    PyObject *pairs, *item, *rval = NULL;
+    PyObject *items = PySequence_List(seq);
+    if (items == NULL)
+        return NULL;
+    n = PyList_GET_SIZE(items);
+    pairs = PyList_New(n);
+    if (pairs == NULL)
+        goto bail;
+    for (i = 0; i < n; i++) {
+        PyObject *encoded = encode_alone(encoder, PyList_GET_ITEM(items, i));
+        if (encoded == NULL)
+            goto bail;
+        /* The index breaks ties without comparing the items themselves */
+        item = Py_BuildValue("(NnO)", encoded, i, PyList_GET_ITEM(items, i));
+        if (item == NULL)
+            goto bail;
+        PyList_SET_ITEM(pairs, i, item);
+    }
+    if (PyList_Sort(pairs))
+        goto bail;
+    for (i = 0; i < n; i++) {
+        item = PyTuple_GET_ITEM(PyList_GET_ITEM(pairs, i), 2);
+        Py_INCREF(item);
+        PyList_SetItem(items, i, item);
+    }
+    rval = items;
+    items = NULL;
+bail:
+    Py_XDECREF(items);
+    Py_XDECREF(pairs);
+    return rval;
+}
 
 static int
 encode_list(PyEncoder *encoder, PyObject *seq)
@@ -1531,8 +4607,28 @@ encode_list(PyEncoder *encoder, PyObject *seq)
     PyObject *iter = NULL;
     PyObject *obj = NULL;
     PyObject *ident = NULL;
-    int len = PyObject_Length(seq);
-    if (encode_type_and_length(encoder, Enc_LIST, len)) {
+    Py_ssize_t len = PyObject_Length(seq);
+    if (encoder->canonical && PyAnySet_Check(seq)) {
+        /* Set iteration order depends on hashes, which can vary by run */
+        int rv = -1;
+        PyObject *sorted = sorted_by_encoding(encoder, seq);
+        if (sorted == NULL)
+            return -1;
+        rv = encode_list(encoder, sorted);
+        Py_DECREF(sorted);
+        return rv;
+    }
+    if (encoder->tables && len > 1 && (PyList_CheckExact(seq) || PyTuple_CheckExact(seq))) {
+        PyObject *columns = table_columns(encoder, seq);
+        if (columns != NULL) {
+            int rv = encode_table(encoder, seq, columns);
+            Py_DECREF(columns);
+            return rv;
+        }
+        if (PyErr_Occurred())
+            return -1;
+    }
+    if (len < 0 || encode_type_and_length(encoder, Enc_LIST, len)) {
         return -1;
     }
 
@@ -1575,6 +4671,7 @@ encode_terminated_list(PyEncoder *encoder, PyObject *iter)
     PyObject *obj = NULL;
     
     unsigned char c = Enc_TERMINATED_LIST;
+    STAT_INC(terminated_lists);
     if (JSON_Accu_Accumulate(encoder, &c, 1))
         return -1;
 
@@ -1593,6 +4690,26 @@ encode_terminated_list(PyEncoder *encoder, PyObject *iter)
     return 0;
 }
 
+static int
+compare_item_keys(const void *a, const void *b)
+{
+    /* qsort callback ordering (key, value) tuples by key code points, the
+       same as sorting them by str. Keys are unique, so stability is moot. */
+    PyObject *ka = PyTuple_GET_ITEM(*(PyObject * const *)a, 0);
+    PyObject *kb = PyTuple_GET_ITEM(*(PyObject * const *)b, 0);
+#if PY_MAJOR_VERSION >= 3
+    if (PyUnicode_KIND(ka) == PyUnicode_1BYTE_KIND && PyUnicode_KIND(kb) == PyUnicode_1BYTE_KIND) {
+        Py_ssize_t la = PyUnicode_GET_LENGTH(ka);
+        Py_ssize_t lb = PyUnicode_GET_LENGTH(kb);
+        int cmp = memcmp(PyUnicode_1BYTE_DATA(ka), PyUnicode_1BYTE_DATA(kb), la < lb ? la : lb);
+        if (cmp)
+            return cmp;
+        return la < lb ? -1 : la > lb;
+    }
+#endif
+    return PyUnicode_Compare(ka, kb);
+}
+
 static PyObject *
 encode_dict_items(PyEncoder *encoder, PyObject *dct)
 {
@@ -1601,7 +4718,8 @@ encode_dict_items(PyEncoder *encoder, PyObject *dct)
     PyObject *lst = NULL;
     PyObject *item = NULL;
     PyObject *kstr = NULL;
-    static PyObject *sortfun = NULL;
+    PyObject *sortfun = NULL;
+    PyObject *sorted;
     static PyObject *sortargs = NULL;
     
     if (sortargs == NULL) {
@@ -1616,6 +4734,43 @@ encode_dict_items(PyEncoder *encoder, PyObject *dct)
         items = PyMapping_Items(dct);
     if (items == NULL)
         return NULL;
+    if (encoder->skipkeys) {
+        PyObject *legal = str_key_items(items);
+        Py_DECREF(items);
+        if (legal == NULL)
+            return NULL;
+        items = legal;
+    }
+    if (encoder->sort_native) {
+        Py_ssize_t i, n;
+        PyObject **entries;
+        lst = PySequence_List(items);
+        Py_DECREF(items);
+        if (lst == NULL)
+            return NULL;
+        n = PyList_GET_SIZE(lst);
+        entries = PySequence_Fast_ITEMS(lst);
+        for (i = 0; i < n; i++) {
+            if (!PyTuple_Check(entries[i]) || Py_SIZE(entries[i]) != 2) {
+                PyErr_SetString(PyExc_ValueError, "items must return 2-tuples");
+                goto bail;
+            }
+            if (!PyUnicode_Check(PyTuple_GET_ITEM(entries[i], 0))) {
+                PyErr_Format(PyExc_TypeError, "keys must be str, not %.100s", Py_TYPE(PyTuple_GET_ITEM(entries[i], 0))->tp_name);
+                goto bail;
+            }
+#if PY_MAJOR_VERSION >= 3 && PY_VERSION_HEX < 0x030C0000
+            if (PyUnicode_READY(PyTuple_GET_ITEM(entries[i], 0)))
+                goto bail;
+#endif
+        }
+        qsort(entries, (size_t)n, sizeof(PyObject *), compare_item_keys);
+        if (PyErr_Occurred())
+            goto bail;
+        iter = PyObject_GetIter(lst);
+        Py_CLEAR(lst);
+        return iter;
+    }
     iter = PyObject_GetIter(items);
     Py_DECREF(items);
     if (iter == NULL)
@@ -1643,6 +4798,7 @@ encode_dict_items(PyEncoder *encoder, PyObject *dct)
             /* item can be added as-is */
         }
         else {
+            PyErr_Format(PyExc_TypeError, "keys must be str, not %.100s", Py_TYPE(key)->tp_name);
             goto bail;
         }
         if (PyList_Append(lst, item))
@@ -1655,8 +4811,10 @@ encode_dict_items(PyEncoder *encoder, PyObject *dct)
     sortfun = PyObject_GetAttrString(lst, "sort");
     if (sortfun == NULL)
         goto bail;
-    if (!PyObject_Call(sortfun, sortargs, encoder->item_sort_kw))
+    sorted = PyObject_Call(sortfun, sortargs, encoder->item_sort_kw);
+    if (sorted == NULL)
         goto bail;
+    Py_DECREF(sorted);
     Py_CLEAR(sortfun);
     iter = PyObject_GetIter(lst);
     Py_CLEAR(lst);
@@ -1672,9 +4830,13 @@ bail:
 
 
 PyDoc_STRVAR(pydoc_encode,
-             "encode(object, Decimal, Mapping, skip_illegal_keys, check_circular, sort_keys, convert, use_for_json) -> object\n"
+             "encode(object, Decimal, Mapping, skip_illegal_keys, check_circular, sort_keys, custom, convert, use_for_json, tables, value_refs, write, canonical, classes, extensions, size_only) -> object\n"
              "\n"
-             "Encode the object into a byte object."
+             "Encode the object into a list of byte objects, or pass each one to write\n"
+             "as the buffer fills and return None. canonical sorts keys, orders sets by\n"
+             "their items' encoding and writes floats as their repr so the output is\n"
+             "byte-stable. size_only returns the number of bytes instead of producing\n"
+             "them."
              );
 
 
@@ -1685,39 +4847,259 @@ convert_to_bool(PyObject *o, int *value)
     return 1;
 }
 
+static int
+encoder_options(PyEncoder *encoder, PyObject *sort_keys)
+{
+    /* Normalize the parsed arguments shared by encode and encoder_session.
+       The object fields stay borrowed. */
+    if (encoder->extensions == Py_None) {
+        encoder->extensions = NULL;
+    }
+    else if (encoder->extensions && !PyDict_Check(encoder->extensions)) {
+        PyErr_SetString(PyExc_TypeError, "extensions must be a dict");
+        return -1;
+    }
+    if (encoder->classes == Py_None || (encoder->classes && PyDict_Check(encoder->classes) && PyDict_Size(encoder->classes) == 0)) {
+        encoder->classes = NULL;
+    }
+    else if (encoder->classes && !PyDict_Check(encoder->classes)) {
+        PyErr_SetString(PyExc_TypeError, "classes must be a dict");
+        return -1;
+    }
+    if (encoder->write == Py_None) {
+        encoder->write = NULL;
+    }
+    if (encoder->Decimal == Py_None || encoder->Decimal == (PyObject *)&PyFloat_Type) {
+        encoder->Decimal = NULL;
+    }
+    encoder->RawPBJSON = import_class("pbjson.raw_pbjson", "RawPBJSON", &RawPBJSON);
+    if (encoder->RawPBJSON == NULL)
+        return -1;
+    if (encoder->custom == Py_None || (encoder->custom && PyObject_Length(encoder->custom) == 0)) {
+        encoder->custom = NULL;
+    } else {
+        encoder->single_custom = PyTuple_Check(encoder->custom) && Py_SIZE(encoder->custom) == 2 && PyType_Check(PyTuple_GET_ITEM(encoder->custom, 0));
+    }
+    if (sort_keys == Py_True || (encoder->canonical && (sort_keys == NULL || sort_keys == Py_None))) {
+        encoder->sort_native = 1;
+    }
+    else if (sort_keys != NULL && sort_keys != Py_None) {
+        encoder->item_sort_kw = PyDict_New();
+        if (encoder->item_sort_kw == NULL)
+            return -1;
+        if (PyDict_SetItemString(encoder->item_sort_kw, "key", sort_keys)) {
+            Py_CLEAR(encoder->item_sort_kw);
+            return -1;
+        }
+    }
+    return 0;
+}
+
 static PyObject *
 py_encode(PyObject* self UNUSED, PyObject *args, PyObject *kwds)
 {
-    static char *kwlist[] = {"object", "Decimal", "Mapping", "skip_illegal_keys", "check_circular", "sort_keys", "custom", "convert", "use_for_json", NULL};
+    static char *kwlist[] = {"object", "Decimal", "Mapping", "skip_illegal_keys", "check_circular", "sort_keys", "custom", "convert", "use_for_json", "tables", "value_refs", "write", "canonical", "classes", "extensions", "size_only", NULL};
 
     PyObject *obj=NULL;
     PyObject *sort_keys=NULL;
     PyEncoder encoder;
     memset(&encoder, 0, sizeof(encoder));
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OOO&O&OOOO&:encode", kwlist, &obj, &encoder.Decimal, &encoder.Mapping, convert_to_bool, &encoder.skipkeys, convert_to_bool, &encoder.check_circular, &sort_keys, &encoder.custom, &encoder.defaultfn, convert_to_bool, &encoder.for_json))
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OOO&O&OOOO&O&O&OO&OOO&:encode", kwlist, &obj, &encoder.Decimal, &encoder.Mapping, convert_to_bool, &encoder.skipkeys, convert_to_bool, &encoder.check_circular, &sort_keys, &encoder.custom, &encoder.defaultfn, convert_to_bool, &encoder.for_json, convert_to_bool, &encoder.tables, convert_to_bool, &encoder.value_refs, &encoder.write, convert_to_bool, &encoder.canonical, &encoder.classes, &encoder.extensions, convert_to_bool, &encoder.size_only))
+        return NULL;
+    if (encoder_options(&encoder, sort_keys))
+        return NULL;
+    if (encode_one(&encoder, obj)) {
+        JSON_Accu_Destroy(&encoder);
         return NULL;
-    if (encoder.Decimal == Py_None || encoder.Decimal == (PyObject *)&PyFloat_Type) {
-        encoder.Decimal = NULL;
     }
-    if (encoder.custom == Py_None || (encoder.custom && PyObject_Length(encoder.custom) == 0)) {
-        encoder.custom = NULL;
-    } else {
-        encoder.single_custom = PyTuple_Check(encoder.custom) && Py_SIZE(encoder.custom) == 2 && PyType_Check(PyTuple_GET_ITEM(encoder.custom, 0));
+    if (encoder.size_only) {
+        JSON_Accu_Destroy(&encoder);
+        return PyLong_FromSsize_t(encoder.size);
     }
-    if (sort_keys != Py_None) {
-        encoder.item_sort_kw = PyDict_New();
-        if (encoder.item_sort_kw == NULL)
-            return NULL;
-        if (PyDict_SetItemString(encoder.item_sort_kw, "key", sort_keys)) {
-            Py_CLEAR(encoder.item_sort_kw);
-            return NULL;
-        }
+    PyObject *result = JSON_Accu_FinishAsList(&encoder);
+    if (result && encoder.write) {
+        Py_DECREF(result);
+        Py_RETURN_NONE;
     }
-    if (encode_one(&encoder, obj)) {
+    return result;
+}
+
+/* One document written a piece at a time. The encoder, with its key and
+   value tables and its buffer, lives across the calls; the caller keeps
+   track of the structure and writes the container tokens itself. */
+typedef struct _EncoderSession {
+    PyObject_HEAD
+    PyEncoder encoder;
+} EncoderSession;
+
+static PyObject *
+encoder_session_value(EncoderSession *self, PyObject *obj)
+{
+    if (encode_one(&self->encoder, obj))
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+encoder_session_key(EncoderSession *self, PyObject *key)
+{
+    if (encode_key_ref(&self->encoder, key))
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+encoder_session_token(EncoderSession *self, PyObject *token)
+{
+    Py_buffer buf;
+    int err;
+    if (PyObject_GetBuffer(token, &buf, PyBUF_SIMPLE))
+        return NULL;
+    err = JSON_Accu_Accumulate(&self->encoder, (const unsigned char *)buf.buf, (size_t)buf.len);
+    PyBuffer_Release(&buf);
+    if (err)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+encoder_session_flush(EncoderSession *self, PyObject *unused UNUSED)
+{
+    if (flush_accumulator(&self->encoder))
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static void
+encoder_session_dealloc(EncoderSession *self)
+{
+    PyEncoder *encoder = &self->encoder;
+    JSON_Accu_Destroy(encoder);
+    Py_CLEAR(encoder->defaultfn);
+    Py_CLEAR(encoder->custom);
+    Py_CLEAR(encoder->Decimal);
+    Py_CLEAR(encoder->Mapping);
+    Py_CLEAR(encoder->RawPBJSON);
+    Py_CLEAR(encoder->classes);
+    Py_CLEAR(encoder->extensions);
+    Py_CLEAR(encoder->write);
+    PyObject_Del(self);
+}
+
+static PyMethodDef encoder_session_methods[] = {
+    {"value", (PyCFunction)encoder_session_value, METH_O, "Encode one value"},
+    {"key", (PyCFunction)encoder_session_key, METH_O, "Encode a dict key, as a reference if it was seen before"},
+    {"token", (PyCFunction)encoder_session_token, METH_O, "Write bytes as they are"},
+    {"flush", (PyCFunction)encoder_session_flush, METH_NOARGS, "Pass the buffered output to write"},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject EncoderSessionType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "pbjson._speedups.EncoderSession",  /* tp_name */
+    sizeof(EncoderSession),             /* tp_basicsize */
+    0,                                  /* tp_itemsize */
+    (destructor)encoder_session_dealloc,    /* tp_dealloc */
+};
+
+PyDoc_STRVAR(pydoc_encoder_session,
+             "encoder_session(write, Decimal, Mapping, skip_illegal_keys, check_circular, sort_keys, custom, convert, use_for_json, tables, value_refs, classes, extensions) -> EncoderSession\n"
+             "\n"
+             "Return an encoder that writes one document through calls to its value,\n"
+             "key and token methods, sharing the key and value tables between them.\n"
+             "Output is passed to write as the buffer fills, and on flush."
+             );
+
+static PyObject *
+py_encoder_session(PyObject* self UNUSED, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"write", "Decimal", "Mapping", "skip_illegal_keys", "check_circular", "sort_keys", "custom", "convert", "use_for_json", "tables", "value_refs", "classes", "extensions", NULL};
+
+    PyObject *sort_keys = NULL;
+    EncoderSession *session;
+    PyEncoder encoder;
+    memset(&encoder, 0, sizeof(encoder));
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OOO&O&OOOO&O&O&OO:encoder_session", kwlist, &encoder.write, &encoder.Decimal, &encoder.Mapping, convert_to_bool, &encoder.skipkeys, convert_to_bool, &encoder.check_circular, &sort_keys, &encoder.custom, &encoder.defaultfn, convert_to_bool, &encoder.for_json, convert_to_bool, &encoder.tables, convert_to_bool, &encoder.value_refs, &encoder.classes, &encoder.extensions))
+        return NULL;
+    if (!PyCallable_Check(encoder.write)) {
+        PyErr_SetString(PyExc_TypeError, "write must be callable");
+        return NULL;
+    }
+    if (encoder_options(&encoder, sort_keys))
+        return NULL;
+    session = PyObject_New(EncoderSession, &EncoderSessionType);
+    if (session == NULL) {
         JSON_Accu_Destroy(&encoder);
         return NULL;
     }
-    return JSON_Accu_FinishAsList(&encoder);
+    Py_XINCREF(encoder.defaultfn);
+    Py_XINCREF(encoder.custom);
+    Py_XINCREF(encoder.Decimal);
+    Py_XINCREF(encoder.Mapping);
+    Py_XINCREF(encoder.RawPBJSON);
+    Py_XINCREF(encoder.classes);
+    Py_XINCREF(encoder.extensions);
+    Py_XINCREF(encoder.write);
+    session->encoder = encoder;
+    return (PyObject *)session;
+}
+
+PyDoc_STRVAR(pydoc_stats,
+             "stats(reset=False) -> dict\n"
+             "\n"
+             "Return the hot path counters, optionally zeroing them afterwards.\n"
+             "The dict is empty if the counters were left out of the build."
+             );
+
+static PyObject *
+py_stats(PyObject* self UNUSED, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"reset", NULL};
+    int reset = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p:stats", kwlist, &reset))
+        return NULL;
+#ifdef PBJSON_STATS_DEFAULT
+    PyObject *result = Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K}",
+                                     "bytes_encoded", stats.bytes_encoded,
+                                     "bytes_decoded", stats.bytes_decoded,
+                                     "chunk_flushes", stats.chunk_flushes,
+                                     "key_memo_hits", stats.key_memo_hits,
+                                     "key_memo_misses", stats.key_memo_misses,
+                                     "key_memo_overflows", stats.key_memo_overflows,
+                                     "custom_calls", stats.custom_calls,
+                                     "convert_calls", stats.convert_calls,
+                                     "terminated_lists", stats.terminated_lists,
+                                     "bigint_encodes", stats.bigint_encodes,
+                                     "bigint_decodes", stats.bigint_decodes);
+    if (result && reset) {
+        memset(&stats, 0, sizeof(stats));
+    }
+    return result;
+#else
+    return PyDict_New();
+#endif
+}
+
+PyDoc_STRVAR(pydoc_enable_stats,
+             "enable_stats(enabled=True) -> bool\n"
+             "\n"
+             "Switch the hot path counters on or off, returning the previous state."
+             );
+
+static PyObject *
+py_enable_stats(PyObject* self UNUSED, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"enabled", NULL};
+    int enabled = 1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p:enable_stats", kwlist, &enabled))
+        return NULL;
+#ifdef PBJSON_STATS_DEFAULT
+    int previous = stats_enabled;
+    stats_enabled = enabled;
+    return PyBool_FromLong(previous);
+#else
+    Py_RETURN_FALSE;
+#endif
 }
 
 
@@ -1726,10 +5108,34 @@ static PyMethodDef speedups_methods[] = {
         (PyCFunction)py_decode,
         METH_VARARGS | METH_KEYWORDS,
         pydoc_decode},
+    {"event_batches",
+        (PyCFunction)py_event_batches,
+        METH_VARARGS | METH_KEYWORDS,
+        pydoc_event_batches},
+    {"splice",
+        (PyCFunction)py_splice,
+        METH_VARARGS | METH_KEYWORDS,
+        pydoc_splice},
+    {"value_length",
+        (PyCFunction)py_value_length,
+        METH_VARARGS,
+        pydoc_value_length},
     {"encode",
         (PyCFunction)py_encode,
         METH_VARARGS | METH_KEYWORDS,
         pydoc_encode},
+    {"encoder_session",
+        (PyCFunction)py_encoder_session,
+        METH_VARARGS | METH_KEYWORDS,
+        pydoc_encoder_session},
+    {"stats",
+        (PyCFunction)py_stats,
+        METH_VARARGS | METH_KEYWORDS,
+        pydoc_stats},
+    {"enable_stats",
+        (PyCFunction)py_enable_stats,
+        METH_VARARGS | METH_KEYWORDS,
+        pydoc_enable_stats},
     {NULL, NULL, 0, NULL}
 };
 
@@ -1750,6 +5156,32 @@ static struct PyModuleDef moduledef = {
 };
 #endif
 
+static int
+init_events(void)
+{
+    int i;
+    EventBatchesType.tp_flags = Py_TPFLAGS_DEFAULT;
+    EventBatchesType.tp_iter = PyObject_SelfIter;
+    EventBatchesType.tp_iternext = (iternextfunc)event_batches_next;
+    if (PyType_Ready(&EventBatchesType))
+        return -1;
+    for (i = 0; i < EV_COUNT; i++) {
+        if (event_names[i] == NULL) {
+            event_names[i] = PyUnicode_InternFromString(event_strings[i]);
+            if (event_names[i] == NULL)
+                return -1;
+        }
+    }
+    for (i = 0; i < EV_MARKS; i++) {
+        if (event_marks[i] == NULL) {
+            event_marks[i] = PyTuple_Pack(2, event_names[i], Py_None);
+            if (event_marks[i] == NULL)
+                return -1;
+        }
+    }
+    return 0;
+}
+
 static PyObject *
 moduleinit(void)
 {
@@ -1760,6 +5192,15 @@ moduleinit(void)
 #else
     m = Py_InitModule3("_speedups", speedups_methods, module_doc);
 #endif
+    PyDateTime_IMPORT;
+    if (m && PyDateTimeAPI == NULL)
+        Py_CLEAR(m);
+    if (m && init_events())
+        Py_CLEAR(m);
+    EncoderSessionType.tp_flags = Py_TPFLAGS_DEFAULT;
+    EncoderSessionType.tp_methods = encoder_session_methods;
+    if (m && PyType_Ready(&EncoderSessionType))
+        Py_CLEAR(m);
     return m;
 }
 
@@ -5,6 +5,10 @@ try:
     from collections.abc import MutableMapping, Mapping
 except ImportError:
     from collections import MutableMapping, Mapping
+try:
+    from types import MappingProxyType
+except ImportError:
+    MappingProxyType = None
 
 if sys.version_info[0] < 3:
     PY3 = False
@@ -0,0 +1,124 @@
+from __future__ import absolute_import
+
+__author__ = 'Scott Maxwell'
+
+# noinspection PyStatementEffect
+"""Compressed framing for Packed Binary JSON streams
+
+A compressed stream is the COMPRESSED token, a codec id byte and then the
+codec's own stream of the encoded document. The encoder's output is
+compressed a buffer at a time as it is written and the decoder pulls
+decompressed blocks as it needs them, so the whole encoded document never
+has to be held in memory.
+"""
+
+import zlib
+from struct import pack
+from .decoder import PBJSONDecodeError, READ_SIZE
+from .tokens import Enc_COMPRESSED
+
+
+class Codec(object):
+    def __init__(self, name, codec_id, compressobj, decompressobj):
+        self.name = name
+        self.codec_id = codec_id
+        self.compressobj = compressobj
+        self.decompressobj = decompressobj
+
+
+_codecs_by_name = {}
+_codecs_by_id = {}
+
+
+def register_codec(name, codec_id, compressobj, decompressobj):
+    """Register a codec for compressed streams.
+
+    *codec_id* is the byte (0-255) written after the COMPRESSED token.
+    *compressobj* and *decompressobj* are called with no arguments for each
+    stream and must return objects with the ``compress()``/``flush()`` and
+    ``decompress()`` methods of :func:`zlib.compressobj` and
+    :func:`zlib.decompressobj`. ``flush()`` is optional on the decompressor.
+    """
+    if not 0 <= codec_id <= 0xff:
+        raise ValueError("codec_id must be a byte")
+    existing = _codecs_by_id.get(codec_id)
+    if existing is not None and existing.name != name:
+        raise ValueError("codec_id {} is already registered for {}".format(codec_id, existing.name))
+    codec = Codec(name, codec_id, compressobj, decompressobj)
+    _codecs_by_name[name] = codec
+    _codecs_by_id[codec_id] = codec
+
+
+def get_codec(compress):
+    """Return the codec for a ``compress`` argument (a name or ``True``)"""
+    if compress is True:
+        compress = 'zlib'
+    try:
+        return _codecs_by_name[compress]
+    except (KeyError, TypeError):
+        raise ValueError("Unknown compression codec {!r}".format(compress))
+
+
+register_codec('zlib', 1, zlib.compressobj, zlib.decompressobj)
+
+
+class CompressedWriter(object):
+    """Compresses chunks as they are written and passes the result to write"""
+
+    def __init__(self, write, codec):
+        self._write = write
+        self._compressor = codec.compressobj()
+        write(Enc_COMPRESSED + pack('B', codec.codec_id))
+
+    def write(self, data):
+        compressed = self._compressor.compress(data)
+        if compressed:
+            self._write(compressed)
+
+    def close(self):
+        compressed = self._compressor.flush()
+        if compressed:
+            self._write(compressed)
+
+
+class DecompressedReader(object):
+    """Decompresses a stream a block at a time as the decoder reads it"""
+
+    def __init__(self, read, codec, data=b''):
+        self._read = read
+        self._decompressor = codec.decompressobj()
+        self._pending = data
+        self._eof = False
+
+    def read(self, size=READ_SIZE):
+        # Returns whatever the next block decompresses to; the decoder
+        # only treats size as a hint
+        while not self._eof:
+            data = self._pending or self._read(READ_SIZE)
+            self._pending = b''
+            if not data:
+                self._eof = True
+                flush = getattr(self._decompressor, 'flush', None)
+                return flush() if flush else b''
+            decompressed = self._decompressor.decompress(data)
+            if decompressed:
+                return decompressed
+        return b''
+
+
+def open_stream(read):
+    """Return the first block of a stream and a read function for the
+    rest, undoing any compression."""
+    data = read(READ_SIZE)
+    if data[:1] != Enc_COMPRESSED:
+        return data, read
+    while len(data) < 2:
+        more = read(READ_SIZE)
+        if not more:
+            raise PBJSONDecodeError("Invalid binary stream for Packed Binary JSON")
+        data += more
+    codec = _codecs_by_id.get(ord(data[1:2]))
+    if codec is None:
+        raise PBJSONDecodeError("Unknown compression codec id {}".format(ord(data[1:2])))
+    reader = DecompressedReader(read, codec, data[2:])
+    return reader.read(), reader.read
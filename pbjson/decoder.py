@@ -1,9 +1,15 @@
 __author__ = 'Scott Maxwell'
-__all__ = ['decode', "PBJSONDecodeError"]
+__all__ = ['decode', 'event_batches', 'prepare_schema', "PBJSONDecodeError"]
 
 # noinspection PyStatementEffect
 """Implementation of PBJSONDecoder"""
 import struct
+import sys
+from array import array
+from types import MemberDescriptorType
+from . import extensions as ext
+from .compat import PY3, MappingProxyType
+from .fields import class_fields, field_accessor
 from .tokens import *
 
 
@@ -11,6 +17,18 @@ class PBJSONDecodeError(ValueError):
     pass
 
 
+# Size of each block requested from a stream's read function
+READ_SIZE = 0x10000
+
+# Classes in one schema are told apart with a 64-bit mask by the speedups
+SCHEMA_LIMIT = 64
+
+# Events handed over at a time by event_batches
+EVENT_BATCH = 256
+
+_schemas = {}
+
+
 def _import_speedups():
     try:
         # noinspection PyUnresolvedReferences
@@ -20,27 +38,40 @@ def _import_speedups():
         return None
 
 
-def _decode_int(content):
-    accumulator = 0
-    length = len(content)
-    offset = 0
-    while length >= 4:
-        accumulator |= struct.unpack_from('!L', content, offset)[0]
-        length -= 4
-        offset += 4
-        if length:
-            if length > 4:
-                accumulator <<= 32
-            else:
-                accumulator <<= (length * 8)
-    if length == 3:
-        b, h = struct.unpack_from('!BH', content, offset)
-        accumulator |= ((b << 16) | h)
-    elif length == 2:
-        accumulator |= struct.unpack_from('!H', content, offset)[0]
-    elif length == 1:
-        accumulator |= struct.unpack_from('B', content, offset)[0]
-    return accumulator
+def _import_event_speedups():
+    try:
+        # noinspection PyUnresolvedReferences
+        from . import _speedups
+        return _speedups.event_batches
+    except (ImportError, AttributeError):
+        return None
+
+
+if PY3:
+    def _decode_int(content):
+        return int.from_bytes(content, 'big')
+else:
+    def _decode_int(content):
+        accumulator = 0
+        length = len(content)
+        offset = 0
+        while length >= 4:
+            accumulator |= struct.unpack_from('!L', content, offset)[0]
+            length -= 4
+            offset += 4
+            if length:
+                if length > 4:
+                    accumulator <<= 32
+                else:
+                    accumulator <<= (length * 8)
+        if length == 3:
+            b, h = struct.unpack_from('!BH', content, offset)
+            accumulator |= ((b << 16) | h)
+        elif length == 2:
+            accumulator |= struct.unpack_from('!H', content, offset)[0]
+        elif length == 1:
+            accumulator |= struct.unpack_from('B', content, offset)[0]
+        return accumulator
 
 
 def _decode_float(float_class, content):
@@ -51,93 +82,628 @@ def _decode_float(float_class, content):
             encoded.append(float_decode[b & 0xf])
         if encoded and encoded[-1] == '.':
             encoded = encoded[:-1]
+        if encoded == ['-']:
+            # Negative zero has no digits left once its zeros are stripped
+            encoded.append('0')
         encoded = ''.join(encoded)
     else:
         encoded = '0'
     return float_class(encoded)
 
 
-def _decode_list(context, data, length=-1):
-    result = []
-    while length:
-        if length < 0 and data[0] == TERMINATOR:
-            return result, data[1:]
-        item, data = _decode_one(context, data)
-        result.append(item)
-        length -= 1
-    return result, data
-
-
-def _decode_dict(context, document_class, keys, data, length=-1):
+def _finish_pairs(document_class, pairs, pairs_hook, schema):
+    if schema is not None:
+        result = _build_record(schema, pairs)
+        if result is not None:
+            return result
+    if pairs_hook is not None:
+        return pairs_hook(pairs)
     result = document_class()
-    while length:
-        if length < 0 and data[0] == TERMINATOR:
-            return result, data[1:]
-        key_token, data = data[0], data[1:]
-        if key_token < 0x80:
-            key_name, data = data[:key_token].decode(), data[key_token:]
-            if len(keys) < 128:
-                keys.append(key_name)
-        else:
-            key_name = keys[key_token & 0x7f]
-        item, data = _decode_one(context, data)
+    for key_name, item in pairs:
         result[key_name] = item
-        length -= 1
-    return result, data
+    return result
 
 
-def _decode_custom(context, data, custom):
-    result, data = _decode_one(context, data)
-    return custom(result), data
+_unpack_H = struct.Struct('!H').unpack_from
+_unpack_L = struct.Struct('!L').unpack_from
+_unpack_Q = struct.Struct('!Q').unpack_from
 
 
-def _decode_one(context, data):
-    """Return the Python representation of ``s`` (a ``bytes`` instance containing a Packed Binary JSON document)"""
-    if data:
-        first_byte, data = data[0], data[1:]
-        token = first_byte & 0xe0
-        if not token:
-            return context[first_byte](context, data)
+def _long_token(first_byte):
+    """Whether first_byte may follow LONG_LENGTH"""
+    return first_byte & 0x1f == 0x1f and first_byte >= STRING
+
+
+def _buffer(data):
+    """Return data if it is bytes, or else a view of its bytes, so that a
+    large buffer such as an mmap is read in place rather than copied"""
+    if isinstance(data, bytes):
+        return data
+    view = memoryview(data)
+    if not view.c_contiguous:
+        return view.tobytes()
+    return view.cast('B')
 
+
+class _Decoder(object):
+    """One document being decoded. Values are read at an offset into the
+    input and each handler returns the value and the offset after it, so
+    nothing but the values themselves is ever copied. The handlers are
+    looked up by first byte in a table built once per document."""
+
+    def __init__(self, data, document_class=None, float_class=None, custom=None, unicode_errors='strict', zero_copy=False, columnar=False, object_pairs_hook=None, schema=None, extensions=None):
+        self.data = data
+        self.size = len(data)
+        # Views have no decode method but str takes the same arguments
+        self.text = bytes.decode if isinstance(data, bytes) else str
+        self.document_class = document_class or dict
+        self.float_class = float_class or float
+        self.custom_hook = custom
+        self.unicode_errors = unicode_errors
+        self.zero_copy = zero_copy
+        self.columnar = columnar
+        if object_pairs_hook is dict:
+            object_pairs_hook = None
+        elif object_pairs_hook is not None and object_pairs_hook is MappingProxyType:
+            object_pairs_hook = _mapping_proxy
+        self.pairs_hook = object_pairs_hook
+        self.schema = schema
+        self.extensions = ext.decoders if extensions is None else extensions
+        self.keys = []
+        self.values = []
+        self.constants = {
+            FALSE: False,
+            TRUE: True,
+            NULL: None,
+            INF: self.float_class('inf'),
+            NEGINF: self.float_class('-inf'),
+            NAN: self.float_class('nan'),
+        }
+        handlers = [self.invalid] * 0x100
+        for first_byte in self.constants:
+            handlers[first_byte] = self.constant
+        handlers[TERMINATED_LIST] = self.terminated_list
+        handlers[TERMINATED_DICT] = self.terminated_dict
+        handlers[CUSTOM] = self.custom
+        handlers[TYPED_ARRAY] = self.typed_array
+        handlers[TABLE] = self.table
+        handlers[VALUE_DEF] = self.value_def
+        handlers[VALUE_REF] = self.value_ref
+        handlers[VALUE_REF16] = self.value_ref
+        handlers[EXT] = self.extension
+        handlers[FRAGMENT] = self.fragment
+        handlers[LONG_LENGTH] = self.long_length
+        for token, handler in ((INT, self.integer), (NEGINT, self.integer), (FLOAT, self.number), (STRING, self.string),
+                               (BINARY, self.binary), (LIST, self.sized_list), (DICT, self.sized_dict)):
+            handlers[token:token + 0x20] = [handler] * 0x20
+        self.handlers = handlers
+
+    def one(self, pos):
+        """Return the value at pos and the offset after it"""
+        first_byte = self.data[pos]
+        return self.handlers[first_byte](first_byte, pos + 1)
+
+    def length(self, first_byte, pos):
+        """Return the length held by first_byte and the bytes after it at
+        pos, and the offset after them"""
         length = first_byte & 0xf
         if first_byte & 0x10:
             if length == 0xf:
-                length, data = struct.unpack_from('!L', data, 0)[0], data[4:]
-            elif length >= 8:
-                length, data = ((length & 7) << 16) | struct.unpack_from('!H', data, 0)[0], data[2:]
+                return _unpack_L(self.data, pos)[0], pos + 4
+            if length >= 8:
+                return ((length & 7) << 16) | _unpack_H(self.data, pos)[0], pos + 2
+            return ((length & 7) << 8) | self.data[pos], pos + 1
+        return length, pos
+
+    def header(self, pos):
+        """Return the token at pos, its length and the offset after them,
+        reading past a long length prefix"""
+        first_byte = self.data[pos]
+        if first_byte != LONG_LENGTH:
+            length, pos = self.length(first_byte, pos + 1)
+            return first_byte, length, pos
+        first_byte = self.data[pos + 1]
+        if not _long_token(first_byte):
+            raise PBJSONDecodeError("Invalid binary stream for Packed Binary JSON")
+        return first_byte, _unpack_Q(self.data, pos + 2)[0], pos + 10
+
+    def content(self, first_byte, pos):
+        """Return the start and end of the content of a sized token"""
+        if first_byte & 0x10:
+            length, pos = self.length(first_byte, pos)
+            end = pos + length
+        else:
+            end = pos + (first_byte & 0xf)
+        if end > self.size:
+            raise PBJSONDecodeError("Invalid binary stream for Packed Binary JSON")
+        return pos, end
+
+    def container_length(self, token, pos):
+        if pos >= self.size:
+            raise PBJSONDecodeError('Invalid table in Packed Binary JSON')
+        first_byte, length, pos = self.header(pos)
+        if first_byte & 0xe0 != token:
+            raise PBJSONDecodeError('Invalid table in Packed Binary JSON')
+        return length, pos
+
+    def key(self, pos):
+        """Return the key at pos and the offset after it"""
+        key_token = self.data[pos]
+        pos += 1
+        if key_token < 0x80:
+            end = pos + key_token
+            if end > self.size:
+                raise PBJSONDecodeError("Invalid binary stream for Packed Binary JSON")
+            key_name = self.text(self.data[pos:end], 'utf-8')
+            if len(self.keys) < 128:
+                self.keys.append(key_name)
+            return key_name, end
+        return self.keys[key_token & 0x7f], pos
+
+    def invalid(self, first_byte, pos):
+        raise PBJSONDecodeError("Invalid binary stream for Packed Binary JSON")
+
+    def constant(self, first_byte, pos):
+        return self.constants[first_byte], pos
+
+    def integer(self, first_byte, pos):
+        start, end = self.content(first_byte, pos)
+        value = _decode_int(self.data[start:end])
+        return -value if first_byte & 0xe0 == NEGINT else value, end
+
+    def number(self, first_byte, pos):
+        start, end = self.content(first_byte, pos)
+        return _decode_float(self.float_class, self.data[start:end]), end
+
+    def string(self, first_byte, pos):
+        start, end = self.content(first_byte, pos)
+        return self.text(self.data[start:end], 'utf-8', self.unicode_errors), end
+
+    def binary(self, first_byte, pos):
+        start, end = self.content(first_byte, pos)
+        return bytes(self.data[start:end]), end
+
+    def long_length(self, first_byte, pos):
+        """Decode the string, binary, list or dict after a long length
+        prefix"""
+        first_byte, length, pos = self.header(pos - 1)
+        token = first_byte & 0xe0
+        if token == LIST:
+            return self.items(pos, length)
+        if token == DICT:
+            return self.members(pos, length, self.schema)
+        end = pos + length
+        if end > self.size:
+            raise PBJSONDecodeError("Invalid binary stream for Packed Binary JSON")
+        if token == STRING:
+            return self.text(self.data[pos:end], 'utf-8', self.unicode_errors), end
+        return bytes(self.data[pos:end]), end
+
+    def sized_list(self, first_byte, pos):
+        length, pos = self.length(first_byte, pos)
+        return self.items(pos, length)
+
+    def items(self, pos, length):
+        """Return the list of length items at pos and the offset after it"""
+        data = self.data
+        handlers = self.handlers
+        result = []
+        append = result.append
+        for _ in range(length):
+            first_byte = data[pos]
+            item, pos = handlers[first_byte](first_byte, pos + 1)
+            append(item)
+        return result, pos
+
+    def terminated_list(self, first_byte, pos):
+        data = self.data
+        handlers = self.handlers
+        result = []
+        append = result.append
+        first_byte = data[pos]
+        while first_byte != TERMINATOR:
+            item, pos = handlers[first_byte](first_byte, pos + 1)
+            append(item)
+            first_byte = data[pos]
+        return result, pos + 1
+
+    def sized_dict(self, first_byte, pos):
+        length, pos = self.length(first_byte, pos)
+        return self.members(pos, length, self.schema)
+
+    def terminated_dict(self, first_byte, pos):
+        # Schemas match on the member count, which an unsized object lacks
+        return self.members(pos, -1, None)
+
+    def members(self, pos, length, schema):
+        """Return the dict of length members at pos, or of the members up to
+        a terminator if length is -1, and the offset after it"""
+        data = self.data
+        key = self.key
+        one = self.one
+        if self.pairs_hook is not None or schema is not None:
+            pairs = []
+            while length:
+                if length < 0 and data[pos] == TERMINATOR:
+                    pos += 1
+                    break
+                key_name, pos = key(pos)
+                item, pos = one(pos)
+                pairs.append((key_name, item))
+                length -= 1
+            return _finish_pairs(self.document_class, pairs, self.pairs_hook, schema), pos
+        handlers = self.handlers
+        result = self.document_class()
+        while length:
+            if length < 0 and data[pos] == TERMINATOR:
+                return result, pos + 1
+            if data[pos] & 0x80:
+                key_name = self.keys[data[pos] & 0x7f]
+                pos += 1
             else:
-                length, data = ((first_byte & 7) << 8) | data[0], data[1:]
-        if token in {LIST, DICT}:
-            return context[token](context, data, length)
-        return context[token](context, data[:length]), data[length:]
-
-
-def py_decoder(data, document_class=None, float_class=None, custom=None, unicode_errors='strict'):
-    if isinstance(data, memoryview):
-        data = data.tobytes()
-    float_class = float_class or float
-    document_class = document_class or dict
-    keys = []
-    context = {
-        FALSE: lambda _context, _data: (False, _data),
-        TRUE: lambda _context, _data: (True, _data),
-        NULL: lambda _context, _data: (None, _data),
-        INF: lambda _context, _data: (float_class('inf'), _data),
-        NEGINF: lambda _context, _data: (float_class('-inf'), _data),
-        NAN: lambda _context, _data: (float_class('nan'), _data),
-        TERMINATED_LIST: _decode_list,
-        INT: lambda _context, _data: _decode_int(_data),
-        NEGINT: lambda _context, _data: -_decode_int(_data),
-        FLOAT: lambda _context, _data: _decode_float(float_class, _data),
-        STRING: lambda _context, _data: _data.decode(errors=unicode_errors),
-        BINARY: lambda _context, _data: _data,
-        LIST: _decode_list,
-        DICT: lambda _context, _data, length: _decode_dict(_context, document_class, keys, _data, length),
-        CUSTOM: lambda _context, _data: _decode_custom(_context, _data, custom),
-    }
-    return _decode_one(context, data)[0]
-
-
-# Use speedup if available
+                key_name, pos = key(pos)
+            first_byte = data[pos]
+            result[key_name], pos = handlers[first_byte](first_byte, pos + 1)
+            length -= 1
+        return result, pos
+
+    def table_header(self, pos):
+        """Return the row count and column keys of the table at pos, and the
+        offset of its first value"""
+        rows, pos = self.container_length(LIST, pos)
+        width, pos = self.container_length(DICT, pos)
+        if not width or rows > (self.size - pos) // width:
+            raise PBJSONDecodeError('Invalid table in Packed Binary JSON')
+        columns = []
+        for _ in range(width):
+            key_name, pos = self.key(pos)
+            columns.append(key_name)
+        return rows, columns, pos
+
+    def table(self, first_byte, pos):
+        rows, columns, pos = self.table_header(pos)
+        one = self.one
+        document_class = self.document_class
+        pairs_hook = self.pairs_hook
+        if self.columnar:
+            lists = [[] for _ in columns]
+            for _ in range(rows):
+                for values in lists:
+                    item, pos = one(pos)
+                    values.append(item)
+            if pairs_hook is not None:
+                return pairs_hook(list(zip(columns, lists))), pos
+            result = document_class()
+            for key_name, values in zip(columns, lists):
+                result[key_name] = values
+            return result, pos
+        schema = self.schema
+        result = []
+        for _ in range(rows):
+            if pairs_hook is not None or schema is not None:
+                pairs = []
+                for key_name in columns:
+                    item, pos = one(pos)
+                    pairs.append((key_name, item))
+                result.append(_finish_pairs(document_class, pairs, pairs_hook, schema))
+                continue
+            row = document_class()
+            for key_name in columns:
+                row[key_name], pos = one(pos)
+            result.append(row)
+        return result, pos
+
+    def typed_array(self, first_byte, pos):
+        data = self.data
+        code = chr(data[pos])
+        itemsize = typed_array_itemsize.get(code)
+        first_byte, length, start = self.header(pos + 1)
+        end = start + length
+        if not itemsize or first_byte & 0xe0 != BINARY or length % itemsize or end > self.size:
+            raise PBJSONDecodeError('Invalid typed array in Packed Binary JSON')
+        if self.zero_copy and sys.byteorder == 'little':
+            return memoryview(data)[start:end].cast(code), end
+        result = array(code)
+        result.frombytes(data[start:end])
+        if sys.byteorder == 'big' and itemsize > 1:
+            result.byteswap()
+        return memoryview(result) if self.zero_copy else result, end
+
+    def value_def(self, first_byte, pos):
+        if pos >= self.size or self.data[pos] & 0xe0 != STRING:
+            raise PBJSONDecodeError('Invalid value reference in Packed Binary JSON')
+        result, pos = self.one(pos)
+        self.values.append(result)
+        return result, pos
+
+    def value_ref(self, first_byte, pos):
+        width = 1 if first_byte == VALUE_REF else 2
+        if pos + width > self.size:
+            raise PBJSONDecodeError('Invalid value reference in Packed Binary JSON')
+        index = self.data[pos] if width == 1 else _unpack_H(self.data, pos)[0]
+        try:
+            return self.values[index], pos + width
+        except IndexError:
+            raise PBJSONDecodeError('Invalid value reference in Packed Binary JSON')
+
+    def extension(self, first_byte, pos):
+        data = self.data
+        type_id = data[pos]
+        decode = self.extensions.get(type_id)
+        if decode is None:
+            raise PBJSONDecodeError('Unknown extension type {} in Packed Binary JSON'.format(type_id))
+        if type_id < ext.USER_MIN and (pos + 1 >= self.size or data[pos + 1] & 0xe0 != BINARY):
+            raise PBJSONDecodeError('Invalid extension in Packed Binary JSON')
+        result, pos = self.one(pos + 1)
+        try:
+            return decode(result), pos
+        except (ValueError, OverflowError, struct.error) as e:
+            if type_id < ext.USER_MIN:
+                raise PBJSONDecodeError(str(e))
+            raise
+
+    def fragment(self, first_byte, pos):
+        """Decode an embedded document with key and value tables of its own"""
+        outer = self.keys, self.values
+        self.keys, self.values = [], []
+        try:
+            return self.one(pos)
+        finally:
+            self.keys, self.values = outer
+
+    def custom(self, first_byte, pos):
+        result, pos = self.one(pos)
+        return self.custom_hook(result), pos
+
+
+def _read_all(read):
+    blocks = []
+    while True:
+        block = read(READ_SIZE)
+        if not isinstance(block, bytes):
+            raise TypeError('read() must return bytes')
+        if not block:
+            return blocks
+        blocks.append(block)
+
+
+def prepare_schema(schema):
+    """Return the form of *schema* that the decoders use.
+
+    *schema* is a dataclass or ``__slots__`` class, or a sequence of them.
+    The result is ``(classes, lookup)`` where each entry of ``classes`` is
+    ``(cls, field count, setters)`` and ``lookup`` maps each field name to
+    its position in every class, or -1 where the class has no such field.
+    """
+    key = schema if isinstance(schema, type) else tuple(schema)
+    prepared = _schemas.get(key)
+    if prepared is not None:
+        return prepared
+    classes = (schema,) if isinstance(schema, type) else key
+    if not classes or len(classes) > SCHEMA_LIMIT:
+        raise ValueError('A schema must have between 1 and {} classes'.format(SCHEMA_LIMIT))
+    entries = []
+    lookup = {}
+    key_sets = set()
+    for index, cls in enumerate(classes):
+        if not isinstance(cls, type):
+            raise TypeError('Schema entries must be classes, not {!r}'.format(cls))
+        names = class_fields(cls)
+        if not names:
+            raise TypeError('{} has no dataclass fields or __slots__'.format(cls.__name__))
+        key_set = frozenset(names)
+        if key_set in key_sets:
+            raise ValueError('{} has the same fields as another schema class'.format(cls.__name__))
+        key_sets.add(key_set)
+        entries.append((cls, len(names), tuple(field_accessor(cls, name) for name in names)))
+        for position, name in enumerate(names):
+            lookup.setdefault(name, [-1] * len(classes))[index] = position
+    prepared = tuple(entries), dict((name, tuple(positions)) for name, positions in lookup.items())
+    _schemas[key] = prepared
+    return prepared
+
+
+def _build_record(schema, pairs):
+    """Return an instance of the schema class whose fields are exactly the
+    keys in *pairs*, or None if there is none"""
+    classes, lookup = schema
+    candidates = [index for index, entry in enumerate(classes) if entry[1] == len(pairs)]
+    for key_name, _ in pairs:
+        if not candidates:
+            return None
+        positions = lookup.get(key_name)
+        if positions is None:
+            return None
+        candidates = [index for index in candidates if positions[index] >= 0]
+    if not candidates:
+        return None
+    cls, size, setters = classes[candidates[0]]
+    if len(set(key_name for key_name, _ in pairs)) != size:
+        return None
+    result = cls.__new__(cls)
+    for key_name, item in pairs:
+        setter = setters[lookup[key_name][candidates[0]]]
+        if isinstance(setter, MemberDescriptorType):
+            setter.__set__(result, item)
+        else:
+            object.__setattr__(result, setter, item)
+    return result
+
+
+def _mapping_proxy(pairs):
+    return MappingProxyType(dict(pairs))
+
+
+def py_decoder(data, document_class=None, float_class=None, custom=None, unicode_errors='strict', zero_copy=False, columnar=False, read=None, object_pairs_hook=None, schema=None, extensions=None):
+    data = _buffer(data)
+    if read is not None:
+        data = b''.join([data] + _read_all(read))
+    decoder = _Decoder(data, document_class, float_class, custom, unicode_errors, zero_copy, columnar, object_pairs_hook, schema, extensions)
+    try:
+        return decoder.one(0)[0]
+    except (IndexError, struct.error):
+        raise PBJSONDecodeError("Invalid binary stream for Packed Binary JSON")
+    finally:
+        # The handlers refer back to the decoder, so break the cycle to let
+        # go of a view of data, such as an mmap, as soon as this returns
+        decoder.handlers = None
+
+
+# Event reported for a value decoded whole, by its token
+_value_events = {
+    FALSE: 'boolean',
+    TRUE: 'boolean',
+    NULL: 'null',
+    INF: 'number',
+    NEGINF: 'number',
+    NAN: 'number',
+    TYPED_ARRAY: 'typed_array',
+    VALUE_DEF: 'string',
+    VALUE_REF: 'string',
+    VALUE_REF16: 'string',
+    EXT: 'extension',
+    CUSTOM: 'custom',
+    INT: 'number',
+    NEGINT: 'number',
+    FLOAT: 'number',
+    STRING: 'string',
+    BINARY: 'binary',
+}
+
+START_MAP = ('start_map', None)
+END_MAP = ('end_map', None)
+START_ARRAY = ('start_array', None)
+END_ARRAY = ('end_array', None)
+
+
+def py_event_batches(data, float_class=None, unicode_errors='strict', read=None, extensions=None, batch_size=EVENT_BATCH):
+    """Generate lists of up to *batch_size* ``(event, value)`` pairs for
+    the document in *data*, without building its lists and dicts.
+
+    Containers are reported as ``start_map``, ``map_key``, ``end_map``,
+    ``start_array`` and ``end_array`` events; a table is reported as the
+    list of objects it stands for. Every other value is reported whole as
+    ``null``, ``boolean``, ``number``, ``string``, ``binary``,
+    ``typed_array``, ``extension`` or ``custom``.
+    """
+    data = _buffer(data)
+    if read is not None:
+        data = b''.join([data] + _read_all(read))
+    # Custom values are reported as the value they wrap
+    decoder = _Decoder(data, None, float_class, lambda value: value, unicode_errors, extensions=extensions)
+    size = len(data)
+    pos = 0
+    # Each open container is a list: [LIST, items left] (-1 until the
+    # terminator), [DICT, items left (likewise), key read] or [TABLE, rows left,
+    # columns, next column or -1 between rows, key read]. A fragment is
+    # [FRAGMENT, value started, the enclosing keys and values].
+    stack = []
+    batch = []
+    started = False
+    try:
+        while True:
+            if len(batch) >= batch_size:
+                yield batch
+                batch = []
+            if stack:
+                frame = stack[-1]
+                kind = frame[0]
+                if kind == LIST:
+                    if frame[1] < 0 and data[pos] == TERMINATOR:
+                        pos += 1
+                        frame[1] = 0
+                    if not frame[1]:
+                        stack.pop()
+                        batch.append(END_ARRAY)
+                        continue
+                    frame[1] -= 1
+                elif kind == DICT:
+                    if frame[2]:
+                        frame[2] = False
+                        if frame[1] > 0:
+                            frame[1] -= 1
+                    else:
+                        if frame[1] < 0 and data[pos] == TERMINATOR:
+                            pos += 1
+                            frame[1] = 0
+                        if not frame[1]:
+                            stack.pop()
+                            batch.append(END_MAP)
+                            continue
+                        key_name, pos = decoder.key(pos)
+                        batch.append(('map_key', key_name))
+                        frame[2] = True
+                        continue
+                elif kind == FRAGMENT:
+                    if frame[1]:
+                        stack.pop()
+                        decoder.keys, decoder.values = frame[2]
+                        continue
+                    frame[1] = True
+                elif frame[4]:
+                    frame[4] = False
+                    frame[3] += 1
+                elif frame[3] < 0:
+                    if not frame[1]:
+                        stack.pop()
+                        batch.append(END_ARRAY)
+                        continue
+                    frame[1] -= 1
+                    frame[3] = 0
+                    batch.append(START_MAP)
+                    continue
+                elif frame[3] == len(frame[2]):
+                    frame[3] = -1
+                    batch.append(END_MAP)
+                    continue
+                else:
+                    batch.append(('map_key', frame[2][frame[3]]))
+                    frame[4] = True
+                    continue
+            elif started:
+                break
+            started = True
+            first_byte = data[pos]
+            if first_byte == LONG_LENGTH and _long_token(data[pos + 1]):
+                # The token after the prefix says what the value is
+                first_byte = data[pos + 1]
+            token = first_byte & 0xe0
+            if token == LIST or token == DICT:
+                first_byte, length, pos = decoder.header(pos)
+                if length > size - pos:
+                    raise PBJSONDecodeError("Invalid binary stream for Packed Binary JSON")
+                if token == LIST:
+                    stack.append([LIST, length])
+                    batch.append(START_ARRAY)
+                else:
+                    stack.append([DICT, length, False])
+                    batch.append(START_MAP)
+            elif first_byte == TERMINATED_LIST:
+                pos += 1
+                stack.append([LIST, -1])
+                batch.append(START_ARRAY)
+            elif first_byte == TERMINATED_DICT:
+                pos += 1
+                stack.append([DICT, -1, False])
+                batch.append(START_MAP)
+            elif first_byte == TABLE:
+                rows, columns, pos = decoder.table_header(pos + 1)
+                stack.append([TABLE, rows, columns, -1, False])
+                batch.append(START_ARRAY)
+            elif first_byte == FRAGMENT:
+                pos += 1
+                stack.append([FRAGMENT, False, (decoder.keys, decoder.values)])
+                decoder.keys, decoder.values = [], []
+            else:
+                item, pos = decoder.one(pos)
+                batch.append((_value_events[token or first_byte], item))
+    except (IndexError, KeyError, struct.error):
+        raise PBJSONDecodeError("Invalid binary stream for Packed Binary JSON")
+    if batch:
+        yield batch
+
+
 c_decoder = _import_speedups()
 decode = c_decoder or py_decoder
+c_event_batches = _import_event_speedups()
+event_batches = c_event_batches or py_event_batches
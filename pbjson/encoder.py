@@ -5,10 +5,16 @@ __author__ = 'Scott Maxwell'
 # noinspection PyStatementEffect
 """Implementation of PBJSON encoder"""
 
+import sys
+from array import array
 from operator import itemgetter
+from types import GeneratorType, MemberDescriptorType
 from decimal import Decimal
 from struct import pack
 from .compat import text_type, binary_type, string_types, integer_types, Mapping, PY3
+from . import extensions as ext
+from .fields import class_fields, field_accessor
+from .raw_pbjson import RawPBJSON
 from .tokens import *
 
 
@@ -21,6 +27,15 @@ def _import_speedups():
         return None
 
 
+def _import_session_speedups():
+    try:
+        # noinspection PyUnresolvedReferences
+        from . import _speedups
+        return _speedups.encoder_session
+    except (ImportError, AttributeError):
+        return None
+
+
 def encode_type_and_length(data_type, length):
     if length < 16:
         return pack('B', data_type | length)
@@ -28,7 +43,9 @@ def encode_type_and_length(data_type, length):
         return pack('BB', data_type | 0x10 | (length >> 8), length & 0xff)
     elif length < 458752:
         return pack('>BH', data_type | 0x18 | (length >> 16), length & 0xffff)
-    return pack('>BL', data_type | 0x1f, length)
+    elif length <= 0xffffffff:
+        return pack('>BL', data_type | 0x1f, length)
+    return pack('>BBQ', LONG_LENGTH, data_type | 0x1f, length)
 
 
 def encode_type_and_content(data_type, content):
@@ -39,7 +56,64 @@ def encode_type_and_content(data_type, content):
         return pack('BB%ds' % length, data_type | 0x10 | (length >> 8), length & 0xff, content)
     elif length < 458752:
         return pack('>BH%ds' % length, data_type | 0x18 | (length >> 16), length & 0xffff, content)
-    return pack('>BL%ds' % length, data_type | 0x1f, length, content)
+    return encode_type_and_length(data_type, length) + content
+
+
+_typed_array_signed = {1: 'b', 2: 'h', 4: 'i', 8: 'q'}
+_typed_array_unsigned = {1: 'B', 2: 'H', 4: 'I', 8: 'Q'}
+_typed_array_formats = {'f': {4: 'f'}, 'd': {8: 'd'}}
+for _c in 'bhilqn':
+    _typed_array_formats[_c] = _typed_array_signed
+for _c in 'BHILQN':
+    _typed_array_formats[_c] = _typed_array_unsigned
+
+
+def _typed_array_view(o):
+    """Return the typed array code for the buffer ``o`` exports, or ``None``
+    to write it as binary, its memoryview and whether it is big endian. Return
+    ``None`` if ``o`` isn't a buffer."""
+    try:
+        view = memoryview(o)
+    except TypeError:
+        return None
+    fmt = view.format
+    big_endian = sys.byteorder == 'big'
+    if fmt[:1] in ('<', '>', '!', '@', '='):
+        if fmt[0] != '@' and fmt[0] != '=':
+            big_endian = fmt[0] != '<'
+        fmt = fmt[1:]
+    code = _typed_array_formats.get(fmt, {}).get(view.itemsize)
+    if isinstance(o, memoryview) and fmt == 'B' and view.itemsize == 1:
+        code = None
+    return code, view, big_endian
+
+
+def typed_array_size(o):
+    """Return ``len(encode_typed_array(o))`` without copying the buffer"""
+    found = _typed_array_view(o)
+    if found is None:
+        return None
+    code, view, big_endian = found
+    return (2 if code else 0) + len(encode_type_and_length(BINARY, view.nbytes)) + view.nbytes
+
+
+def encode_typed_array(o):
+    """Return ``o`` packed as a typed array if it exports a buffer with a
+    simple numeric format, as binary if it is a memoryview of bytes or its
+    format has no typed array code, or ``None`` if it isn't a buffer."""
+    found = _typed_array_view(o)
+    if found is None:
+        return None
+    code, view, big_endian = found
+    if not code:
+        return encode_type_and_content(BINARY, view.tobytes())
+    content = view.tobytes()
+    if big_endian and view.itemsize > 1:
+        swapped = array(code)
+        swapped.frombytes(content)
+        swapped.byteswap()
+        content = swapped.tobytes()
+    return Enc_TYPED_ARRAY + code.encode() + encode_type_and_content(BINARY, content)
 
 
 def default_converter(o):
@@ -62,241 +136,588 @@ def default_converter(o):
     raise TypeError(repr(o) + " is not PBJSON serializable")
 
 
-def encode(obj, skip_illegal_keys=True, check_circular=True, sort_keys=None, custom=None, convert=default_converter, use_for_json=None):
+# Chunk size handed to a write function, matching the C encoder's buffer
+BUFFER_SIZE = 0x1000
+
+# Encoding plan for each class given to register_class
+registered_classes = {}
+
+
+def register_class(cls, fields=None):
+    """Encode instances of *cls* as objects of its *fields*.
+
+    *fields* defaults to the fields of a dataclass or the ``__slots__`` of
+    the class and its bases. Each field is read straight from its slot, or
+    with ``getattr``, instead of building a dict for every instance.
+    Instances of subclasses are not affected.
+    """
+    if not isinstance(cls, type):
+        raise TypeError('register_class needs a class, not {!r}'.format(cls))
+    names = class_fields(cls) if fields is None else list(fields)
+    for name in names:
+        if not isinstance(name, string_types):
+            raise TypeError('keys must be str, not {}'.format(type(name).__name__))
+        if len(name.encode()) > 127:
+            raise ValueError('keys must be at most 127 bytes, not {}'.format(len(name.encode())))
+    if not names or len(set(names)) != len(names):
+        raise ValueError('{} needs distinct fields to be registered'.format(cls.__name__))
+    plan = tuple((name, field_accessor(cls, name)) for name in names)
+    registered_classes[cls] = plan, tuple(sorted(plan, key=itemgetter(0)))
+
+
+def _registered_fields(o, plan):
+    """Return the (name, value) pairs of a registered class instance"""
+    return [(name, accessor.__get__(o, type(o)) if isinstance(accessor, MemberDescriptorType) else getattr(o, accessor)) for name, accessor in plan]
+
+
+def _item_sort_key(sort_keys):
+    """True is passed through so the C encoder can sort by key natively"""
     if sort_keys:
         if sort_keys is True:
-            sort_keys = itemgetter(0)
+            return True
         elif not callable(sort_keys):
             raise TypeError("sort_keys must be True, False or callable")
-    else:
-        sort_keys = None
+        return sort_keys
+    return None
+
+
+def encode(obj, skip_illegal_keys=False, check_circular=True, sort_keys=None, custom=None, convert=default_converter, use_for_json=None, tables=False, value_refs=False, extensions=False):
+    sort_keys = _item_sort_key(sort_keys)
     convert = convert or default_converter
-    return b''.join(iterencoder(obj, Decimal, Mapping, skip_illegal_keys, check_circular, sort_keys, custom, convert, use_for_json))
+    return b''.join(iterencoder(obj, Decimal, Mapping, skip_illegal_keys, check_circular, sort_keys, custom, convert, use_for_json, tables=tables, value_refs=value_refs, classes=registered_classes, extensions=ext.encoders if extensions else None))
 
 
-def iterencode(obj, skip_illegal_keys=True, check_circular=True, sort_keys=None, custom=None, convert=default_converter, use_for_json=None):
-    if sort_keys:
-        if sort_keys is True:
-            sort_keys = itemgetter(0)
-        elif not callable(sort_keys):
-            raise TypeError("sort_keys must be True, False or callable")
-    else:
-        sort_keys = None
+def iterencode(obj, skip_illegal_keys=False, check_circular=True, sort_keys=None, custom=None, convert=default_converter, use_for_json=None, tables=False, value_refs=False, extensions=False):
+    sort_keys = _item_sort_key(sort_keys)
     convert = convert or default_converter
-    for i in iterencoder(obj, Decimal, Mapping, skip_illegal_keys, check_circular, sort_keys, custom, convert, use_for_json):
+    # The pure-Python encoder yields as it goes; the C one returns its chunks
+    # when it is done
+    stream = {'stream': True} if iterencoder is py_iterencoder else {}
+    for i in iterencoder(obj, Decimal, Mapping, skip_illegal_keys, check_circular, sort_keys, custom, convert, use_for_json, tables=tables, value_refs=value_refs, classes=registered_classes, extensions=ext.encoders if extensions else None, **stream):
         yield i
 
 
+def dump(obj, write, skip_illegal_keys=False, check_circular=True, sort_keys=None, custom=None, convert=default_converter, use_for_json=None, tables=False, value_refs=False, canonical=False, extensions=False):
+    """Encode obj, passing the output to write a buffer at a time"""
+    sort_keys = _item_sort_key(sort_keys)
+    convert = convert or default_converter
+    iterencoder(obj, Decimal, Mapping, skip_illegal_keys, check_circular, sort_keys, custom, convert, use_for_json, tables=tables, value_refs=value_refs, write=write, canonical=canonical, classes=registered_classes, extensions=ext.encoders if extensions else None)
+
+
+def encoded_size(obj, skip_illegal_keys=False, check_circular=True, sort_keys=None, custom=None, convert=default_converter, use_for_json=None, tables=False, value_refs=False, extensions=False):
+    """Return the number of bytes encode would produce, without keeping them"""
+    sort_keys = _item_sort_key(sort_keys)
+    convert = convert or default_converter
+    return iterencoder(obj, Decimal, Mapping, skip_illegal_keys, check_circular, sort_keys, custom, convert, use_for_json, tables=tables, value_refs=value_refs, classes=registered_classes, extensions=ext.encoders if extensions else None, size_only=True)
+
+
+if PY3:
+    def _int_content(o):
+        return o.to_bytes((o.bit_length() + 7) >> 3, 'big')
+
+    # Float digits as hex digits, so bytes.fromhex packs two to a byte
+    _float_nibbles = dict((ord(c), u'%x' % n) for c, n in float_encode.items())
+
+    def _float_content(s, negative):
+        nibbles = (u'b' if negative else u'') + s.translate(_float_nibbles)
+        if len(nibbles) & 1:
+            nibbles += u'd'
+        return bytes.fromhex(nibbles)
+else:
+    def _int_content(o):
+        encoded = []
+        while o > 0xffffffff:
+            encoded.append(pack('!I', o & 0xffffffff))
+            o >>= 32
+        if o > 0xffffff:
+            encoded.append(pack('!I', o))
+        elif o > 0xffff:
+            encoded.append(pack('!BH', o >> 16, o & 0xffff))
+        elif o > 0xff:
+            encoded.append(pack('!H', o))
+        else:
+            encoded.append(pack('B', o))
+        encoded.reverse()
+        return b''.join(encoded)
+
+    def _float_content(s, negative):
+        encoded = bytearray()
+        nibble = FltEnc_Minus << 4 if negative else None
+        for c in s:
+            if nibble is None:
+                nibble = float_encode[c] << 4
+            else:
+                encoded.append(nibble | float_encode[c])
+                nibble = None
+        if nibble is not None:
+            encoded.append(nibble | FltEnc_Decimal)
+        return bytes(encoded)
+
+
 # noinspection PyShadowingBuiltins
-def py_iterencoder(obj, Decimal, Mapping, skip_illegal_keys, check_circular, sort_keys, custom, convert, use_for_json,
+def py_iterencoder(obj, Decimal, Mapping, skip_illegal_keys, check_circular, sort_keys, custom, convert, use_for_json, tables=False, value_refs=False, write=None, canonical=False, classes=None, extensions=None, size_only=False, session=False, markers=None, stream=False,
                    # HACK: hand-optimized bytecode; turn globals into locals
-                   _PY3=PY3,
                    ValueError=ValueError,
-                   string_types=string_types,
+                   bytes=bytes,
+                   bytearray=bytearray,
+                   dict=dict,
                    float=float,
                    id=id,
+                   int=int,
                    integer_types=integer_types,
                    isinstance=isinstance,
-                   str=str):
+                   len=len,
+                   list=list,
+                   str=str,
+                   string_types=string_types,
+                   text_type=text_type,
+                   tuple=tuple,
+                   type=type):
+    """Encode obj into one bytearray, returning a list of the encoded bytes,
+    or passing them to write about a buffer at a time and returning None.
+    With session=True, return the functions that append a value and a key to
+    the bytearray, and the bytearray, for py_encoder_session.
+    markers is shared with an enclosing encoder for check_circular.
+    With stream=True, return a generator of the encoded bytes that yields
+    about a buffer at a time, as soon as each is full."""
     key_cache = {}
-    markers = {} if check_circular else None
+    value_cache = {}
+    if markers is None and check_circular:
+        markers = {}
+    if sort_keys is True or (canonical and not sort_keys):
+        sort_keys = itemgetter(0)
     if custom and isinstance(custom[0], type):
         custom = (custom, )
     custom_types = tuple(c[0] for c in custom) if custom else None
+    if size_only:
+        counted = [0]
 
-    def _iterencode_list(lst):
-        yield encode_type_and_length(LIST, len(lst))
-        if not lst:
+        def write(chunk):
+            counted[0] += len(chunk)
+
+    # The builtin types that take the shortcut in _encode, unless a hook
+    # claims them first
+    hooked = set()
+    for cls in (float, list, dict, tuple):
+        if (custom_types and issubclass(cls, custom_types)) or (extensions and cls in extensions) or (classes and cls in classes):
+            hooked.add(cls)
+    fast_float = float not in hooked
+    fast_list = list not in hooked and not tables
+    fast_dict = dict not in hooked
+    out = bytearray()
+    append = out.append
+    extend = out.extend
+
+    def _header(token, length):
+        if length < 16:
+            append(token | length)
+        elif length < 2048:
+            extend((token | 0x10 | (length >> 8), length & 0xff))
+        else:
+            extend(encode_type_and_length(token, length))
+
+    def _flush():
+        # Only called between values, so every chunk ends on a token
+        if write is not None and len(out) >= BUFFER_SIZE:
+            write(bytes(out))
+            del out[:]
+
+    def _mark(o):
+        markerid = id(o)
+        if markerid in markers:
+            raise ValueError("Circular reference detected")
+        markers[markerid] = o
+        return markerid
+
+    def _encode_key(key):
+        index = key_cache.get(key)
+        if index is not None:
+            append(0x80 | index)
             return
+        if not isinstance(key, string_types):
+            raise TypeError('keys must be str, not {}'.format(type(key).__name__))
+        encoded_key = key.encode()
+        if len(encoded_key) > 127:
+            raise ValueError('keys must be at most 127 bytes, not {}'.format(len(encoded_key)))
+        key_count = len(key_cache)
+        if key_count < 128:
+            key_cache[key] = key_count
+        append(len(encoded_key))
+        extend(encoded_key)
+
+    def _table_columns(rows):
+        first = rows[0]
+        if type(first) is not dict or not first:
+            return None
+        width = len(first)
+        for row in rows:
+            if type(row) is not dict or len(row) != width:
+                return None
+        for key in first:
+            if not isinstance(key, text_type) or len(key.encode()) > 127:
+                return None
+        if sort_keys:
+            columns = [k for k, v in sorted(first.items(), key=sort_keys)]
+        else:
+            columns = list(first)
+        for key in columns:
+            for row in rows:
+                if key not in row:
+                    return None
+        return columns
+
+    def _encode_table(rows, columns):
+        append(TABLE)
+        _header(LIST, len(rows))
+        _header(DICT, len(columns))
+        for key in columns:
+            _encode_key(key)
         if check_circular:
-            markerid = id(lst)
-            if markerid in markers:
-                raise ValueError("Circular reference detected")
-            markers[markerid] = lst
-        for value in lst:
-            for encoded in _iterencode(value):
-                yield encoded
+            markerid = _mark(rows)
+        for row in rows:
+            if check_circular:
+                rowid = _mark(row)
+            for key in columns:
+                _encode(row[key])
+            if check_circular:
+                del markers[rowid]
+            _flush()
         if check_circular:
-            # noinspection PyUnboundLocalVariable
             del markers[markerid]
 
-    def _iterencode_dict(dct):
-        yield encode_type_and_length(DICT, len(dct))
-        if not dct:
+    def _encode_alone(o):
+        return b''.join(py_iterencoder(o, Decimal, Mapping, skip_illegal_keys, check_circular, sort_keys, custom, convert, use_for_json, tables=tables, value_refs=value_refs, canonical=canonical, classes=classes, extensions=extensions, markers=markers))
+
+    def _encode_list(lst):
+        if canonical and isinstance(lst, (set, frozenset)):
+            # Set iteration order depends on hashes, which can vary by run.
+            # Items of different types can't be compared, so order them by
+            # their encoded bytes, and by position when those are equal.
+            lst = [item for encoded, i, item in sorted((_encode_alone(item), i, item) for i, item in enumerate(lst))]
+        if tables and len(lst) > 1 and type(lst) in (list, tuple):
+            columns = _table_columns(lst)
+            if columns:
+                _encode_table(lst, columns)
+                return
+        _header(LIST, len(lst))
+        if not lst:
             return
         if check_circular:
-            markerid = id(dct)
-            if markerid in markers:
-                raise ValueError("Circular reference detected")
-            markers[markerid] = dct
-        if _PY3:
-            iteritems = dct.items()
-        else:
-            iteritems = dct.iteritems()
+            markerid = _mark(lst)
+        for value in lst:
+            _encode(value)
+            _flush()
+        if check_circular:
+            del markers[markerid]
+
+    def _dict_items(dct):
+        # Write the header and return the items in the order they are
+        # written, or None if there are none
+        items = dct.items()
+        if skip_illegal_keys:
+            items = [item for item in items if isinstance(item[0], string_types)]
+        _header(DICT, len(items))
+        if not items:
+            return None
         if sort_keys:
+            unsorted = items
             items = []
-            for k, v in dct.items():
+            for k, v in unsorted:
                 if not isinstance(k, string_types):
-                    if k is None:
-                        continue
+                    raise TypeError('keys must be str, not {}'.format(type(k).__name__))
                 items.append((k, v))
             items.sort(key=sort_keys)
-        else:
-            items = iteritems
+        return items
+
+    def _encode_dict(dct):
+        items = _dict_items(dct)
+        if items is None:
+            return
+        if check_circular:
+            markerid = _mark(dct)
         for key, value in items:
-            if not isinstance(key, string_types):
-                if key is None:
-                    # _skipkeys must be True
-                    continue
-            if key in key_cache:
-                yield pack('B', 0x80 | key_cache[key])
-            else:
-                encoded_key = key.encode()
-                if len(encoded_key) > 127:
-                    # _skipkeys must be True
-                    continue
-                key_count = len(key_cache)
-                if key_count < 128:
-                    key_cache[key] = key_count
-                yield pack('B', len(encoded_key)) + encoded_key
-            for encoded in _iterencode(value):
-                yield encoded
+            _encode_key(key)
+            _encode(value)
+            _flush()
         if check_circular:
-            # noinspection PyUnboundLocalVariable
             del markers[markerid]
 
-    def _iterencode(o):
-        if isinstance(o, (text_type, binary_type)):
-            if isinstance(o, text_type):
-                token = STRING
-                o = o.encode()
-            else:
-                token = BINARY
-            yield encode_type_and_content(token, o)
+    def _encode_string(o):
+        encoded = o.encode()
+        length = len(encoded)
+        if value_refs and VALUE_REF_MIN <= length <= VALUE_REF_MAX:
+            index = value_cache.get(o)
+            if index is not None:
+                if index < 0x100:
+                    extend((VALUE_REF, index))
+                else:
+                    extend((VALUE_REF16, index >> 8, index & 0xff))
+                return
+            if len(value_cache) < VALUE_REF_LIMIT:
+                value_cache[o] = len(value_cache)
+                append(VALUE_DEF)
+        _header(STRING, length)
+        extend(encoded)
+
+    def _encode_int(o):
+        if not o:
+            append(INT)
+            return
+        if o < 0:
+            token = NEGINT
+            o = -o
+        else:
+            token = INT
+        if o < 0x100:
+            extend((token | 1, o))
+            return
+        encoded = _int_content(o)
+        _header(token, len(encoded))
+        extend(encoded)
+
+    def _encode_float(o):
+        s = float.__repr__(o) if canonical and isinstance(o, float) else str(o)
+        first = s[0]
+        if first == 'n' or first == 'N':
+            append(NAN)
+            return
+        if first == 'i' or first == 'I':
+            append(INF)
+            return
+        if first == '-':
+            s = s[1:]
+            if s[0] == 'i' or s[0] == 'I':
+                append(NEGINF)
+                return
+            negative = True
+        else:
+            negative = False
+        if s[0] == '0':
+            s = s[1:]
+        if s.endswith('.0'):
+            s = s[:-2]
+        encoded = _float_content(s, negative)
+        _header(FLOAT, len(encoded))
+        extend(encoded)
+
+    def _encode(o):
+        t = type(o)
+        if t is str:
+            _encode_string(o)
+        elif t is int:
+            _encode_int(o)
+        elif t is float and fast_float:
+            _encode_float(o)
+        elif t is dict and fast_dict:
+            _encode_dict(o)
+        elif t is list and fast_list:
+            if not o:
+                append(LIST)
+                return
+            _header(LIST, len(o))
+            if check_circular:
+                markerid = _mark(o)
+            for value in o:
+                _encode(value)
+                _flush()
+            if check_circular:
+                del markers[markerid]
         elif o is None:
-            yield Enc_NULL
+            append(NULL)
         elif o is True:
-            yield Enc_TRUE
+            append(TRUE)
         elif o is False:
-            yield Enc_FALSE
-        elif isinstance(o, integer_types):
-            if o:
-                if o < 0:
-                    token = NEGINT
-                    o = -o
-                else:
-                    token = INT
-                length = 0
-                encoded = []
-                while o > 0xffffffff:
-                    encoded.append(pack('!I', o & 0xffffffff))
-                    o >>= 32
-                    length += 4
-                if o > 0xffffff:
-                    encoded.append(pack('!I', o))
-                    length += 4
-                elif o > 0xffff:
-                    encoded.append(pack('!BH', o >> 16, o & 0xffff))
-                    length += 3
-                elif o > 0xff:
-                    encoded.append(pack('!H', o))
-                    length += 2
-                elif o:
-                    encoded.append(pack('B', o))
-                    length += 1
-                if len(encoded) > 1:
-                    yield encode_type_and_length(token, length)
-                    while encoded:
-                        yield encoded.pop()
-                else:
-                    yield encode_type_and_content(token, encoded[0])
+            append(FALSE)
+        else:
+            _encode_other(o)
+
+    def _encode_other(o):
+        if isinstance(o, text_type):
+            _encode_string(o)
+        elif isinstance(o, (binary_type, bytearray)):
+            _header(BINARY, len(o))
+            if size_only:
+                counted[0] += len(o)
             else:
-                yield encode_type_and_length(INT, 0)
+                extend(o)
+        elif isinstance(o, integer_types):
+            _encode_int(int(o))
+        elif extensions and type(o) in extensions:
+            type_id, encode = extensions[type(o)]
+            extend((EXT, type_id))
+            # Only application codecs can return something holding o
+            checked = check_circular and type_id >= ext.USER_MIN
+            if checked:
+                markerid = _mark(o)
+            _encode(encode(o))
+            if checked:
+                del markers[markerid]
         elif isinstance(o, (float, Decimal)):
-            s = str(o)
-            encoded = []
-            nibble = None
-            if s[0] == 'n' or s[0] == 'N':
-                yield Enc_NAN
-            elif s[0] == 'i' or s[0] == 'I':
-                yield Enc_INF
-            else:
-                if s[0] == '-':
-                    nibble = FltEnc_Minus << 4
-                    s = s[1:]
-                    if s[0] == 'i' or s[0] == 'I':
-                        yield Enc_NEGINF
-                        return
-                if s[0] == '0':
-                    s = s[1:]
-                if s.endswith('.0'):
-                    s = s[:-2]
-                while s:
-                    c, s = float_encode[s[0]], s[1:]
-                    if nibble is None:
-                        nibble = c << 4
-                    else:
-                        encoded.append(pack('B', nibble | c))
-                        nibble = None
-                if nibble is not None:
-                    encoded.append(pack('B', nibble | FltEnc_Decimal))
-                encoded = b''.join(encoded)
-                yield encode_type_and_content(FLOAT, encoded)
+            _encode_float(o)
+        elif isinstance(o, RawPBJSON):
+            append(FRAGMENT)
+            extend(o.encoded_pbjson)
         elif custom and isinstance(o, custom_types):
-            yield Enc_CUSTOM
+            append(CUSTOM)
+            if check_circular:
+                markerid = _mark(o)
             for t in custom:
                 if isinstance(o, t[0]):
-                    o = t[1](o)
-                    for chunk in _iterencode(o):
-                        yield chunk
+                    _encode(t[1](o))
                     break
+            if check_circular:
+                del markers[markerid]
+        elif classes and type(o) in classes:
+            if check_circular:
+                markerid = _mark(o)
+            _encode_dict(dict(_registered_fields(o, classes[type(o)][0])))
+            if check_circular:
+                del markers[markerid]
         else:
             for_json = use_for_json and getattr(o, 'for_json', None)
             if for_json and callable(for_json):
-                for chunk in _iterencode(for_json()):
-                    yield chunk
-            elif isinstance(o, Mapping):
-                for chunk in _iterencode_dict(o):
-                    yield chunk
+                _encode(for_json())
+                return
+            if isinstance(o, Mapping):
+                _encode_dict(o)
+                return
+            _asdict = isinstance(o, tuple) and getattr(o, '_asdict', None)
+            if _asdict and callable(_asdict):
+                _encode_dict(_asdict())
+                return
+            if size_only:
+                size = typed_array_size(o)
+                if size is not None:
+                    counted[0] += size
+                    return
+            encoded = encode_typed_array(o)
+            if encoded is not None:
+                extend(encoded)
+                return
+            try:
+                iter(o)
+            except TypeError:
+                pass
             else:
-                _asdict = isinstance(o, tuple) and getattr(o, '_asdict', None)
-                if _asdict and callable(_asdict):
-                    for chunk in _iterencode_dict(_asdict()):
-                        yield chunk
+                try:
+                    len(o)
+                except Exception:
+                    pass
                 else:
-                    try:
-                        iter(o)
-                    except TypeError:
-                        pass
-                    else:
-                        try:
-                            len(o)
-                        except Exception:
-                            pass
-                        else:
-                            for chunk in _iterencode_list(o):
-                                yield chunk
-                            return
-                        yield Enc_TERMINATED_LIST
-                        for item in o:
-                            for chunk in _iterencode(item):
-                                yield chunk
-                        yield Enc_TERMINATOR
-                        return
-                    if check_circular:
-                        markerid = id(o)
-                        if markerid in markers:
-                            raise ValueError("Circular reference detected")
-                        markers[markerid] = o
-                    o = convert(o)
-                    for chunk in _iterencode(o):
+                    _encode_list(o)
+                    return
+                append(TERMINATED_LIST)
+                for item in o:
+                    _encode(item)
+                    _flush()
+                append(TERMINATOR)
+                return
+            if check_circular:
+                markerid = _mark(o)
+            _encode(convert(o))
+            if check_circular:
+                del markers[markerid]
+
+    def _stream(o):
+        # Encode o as _encode would, yielding the buffer at the points where
+        # _flush would write it. Lists, dicts and generators that _encode
+        # walks itself are followed; other values are encoded whole.
+        t = type(o)
+        if t is dict and fast_dict:
+            items = _dict_items(o)
+            if items is not None:
+                if check_circular:
+                    markerid = _mark(o)
+                for key, value in items:
+                    _encode_key(key)
+                    for chunk in _stream(value):
                         yield chunk
-                    if check_circular:
-                        # noinspection PyUnboundLocalVariable
-                        del markers[markerid]
+                if check_circular:
+                    del markers[markerid]
+        elif t is list and fast_list:
+            _header(LIST, len(o))
+            if check_circular and o:
+                markerid = _mark(o)
+            for value in o:
+                for chunk in _stream(value):
+                    yield chunk
+            if check_circular and o:
+                del markers[markerid]
+        elif t is GeneratorType and not (custom and isinstance(o, custom_types)) and not (extensions and t in extensions) and not (classes and t in classes):
+            append(TERMINATED_LIST)
+            for item in o:
+                for chunk in _stream(item):
+                    yield chunk
+            append(TERMINATOR)
+        else:
+            _encode(o)
+        if len(out) >= BUFFER_SIZE:
+            yield bytes(out)
+            del out[:]
+
+    def _chunks(o):
+        for chunk in _stream(o):
+            yield chunk
+        if out:
+            yield bytes(out)
+
+    if session:
+        return _encode, _encode_key, out
+    if stream:
+        return _chunks(obj)
+    _encode(obj)
+    if size_only:
+        return counted[0] + len(out)
+    if write is None:
+        return [bytes(out)]
+    if out:
+        write(bytes(out))
+
+
+class py_encoder_session(object):
+    """One document written a piece at a time, sharing the key and value
+    tables between the pieces. Output is passed to write a buffer at a time
+    and on flush."""
+
+    def __init__(self, write, Decimal, Mapping, skip_illegal_keys, check_circular, sort_keys, custom, convert, use_for_json, tables=False, value_refs=False, classes=None, extensions=None):
+        self._encode, self._encode_key, self._out = py_iterencoder(None, Decimal, Mapping, skip_illegal_keys, check_circular, sort_keys, custom, convert, use_for_json, tables=tables, value_refs=value_refs, classes=classes, extensions=extensions, session=True)
+        self._write = write
+
+    def _written(self, start):
+        """Pass on the buffer as the C encoder does once the piece appended
+        at start takes it past BUFFER_SIZE: what came before the piece, then
+        the piece itself if it fills a buffer on its own"""
+        out = self._out
+        if len(out) > BUFFER_SIZE:
+            if start:
+                self._write(bytes(out[:start]))
+                del out[:start]
+            if len(out) >= BUFFER_SIZE:
+                self.flush()
+
+    def token(self, chunk):
+        start = len(self._out)
+        self._out.extend(chunk)
+        self._written(start)
+
+    def value(self, obj):
+        start = len(self._out)
+        self._encode(obj)
+        self._written(start)
+
+    def key(self, key):
+        start = len(self._out)
+        self._encode_key(key)
+        self._written(start)
 
-    return _iterencode(obj)
+    def flush(self):
+        if self._out:
+            chunk = bytes(self._out)
+            del self._out[:]
+            self._write(chunk)
 
 
 c_iterencoder = _import_speedups()
 iterencoder = c_iterencoder or py_iterencoder
+c_encoder_session = _import_session_speedups()
+encoder_session = c_encoder_session or py_encoder_session
@@ -0,0 +1,152 @@
+"""Numbered extension types, written as Enc_EXT, a type ID byte and a value
+
+The built-in types are encoded natively by the speedups; the functions here
+are their pure-Python equivalents. Applications register their own types
+with :func:`register_extension`.
+"""
+import struct
+import uuid
+from datetime import date, datetime, timedelta
+from decimal import Decimal
+
+try:
+    from datetime import timezone
+except ImportError:
+    timezone = None
+
+__all__ = ['register_extension', 'DATETIME', 'DATE', 'UUID', 'DECIMAL', 'USER_MIN']
+
+# Type IDs below USER_MIN are reserved for pbjson
+DATETIME = 0
+DATE = 1
+UUID = 2
+DECIMAL = 3
+USER_MIN = 0x40
+
+EPOCH = datetime(1970, 1, 1)
+EPOCH_ORDINAL = 719163
+
+# Decimal flags byte: the sign in bit 0, the kind of value above it
+DECIMAL_FINITE = 0
+DECIMAL_INFINITE = 1
+DECIMAL_NAN = 2
+DECIMAL_SNAN = 3
+decimal_kinds = {'F': DECIMAL_INFINITE, 'n': DECIMAL_NAN, 'N': DECIMAL_SNAN}
+decimal_exponents = dict((v, k) for k, v in decimal_kinds.items())
+
+
+def _micros(delta):
+    return (delta.days * 86400 + delta.seconds) * 1000000 + delta.microseconds
+
+
+def _encode_datetime(o):
+    """Microseconds since the epoch in UTC, then the UTC offset in seconds
+    if the datetime is aware; naive datetimes are counted as if in UTC"""
+    offset = o.utcoffset()
+    if offset is None:
+        return struct.pack('>q', _micros(o.replace(tzinfo=None) - EPOCH))
+    if offset.microseconds:
+        raise ValueError('UTC offsets with microseconds are not supported')
+    return struct.pack('>qi', _micros(o.replace(tzinfo=None) - EPOCH - offset), offset.days * 86400 + offset.seconds)
+
+
+def _decode_datetime(content):
+    if len(content) == 8:
+        return EPOCH + timedelta(microseconds=struct.unpack('>q', content)[0])
+    if len(content) != 12:
+        raise ValueError('Invalid datetime in Packed Binary JSON')
+    micros, offset = struct.unpack('>qi', content)
+    local = EPOCH + timedelta(microseconds=micros + offset * 1000000)
+    return local.replace(tzinfo=timezone(timedelta(seconds=offset)))
+
+
+def _encode_date(o):
+    return struct.pack('>i', o.toordinal() - EPOCH_ORDINAL)
+
+
+def _decode_date(content):
+    if len(content) != 4:
+        raise ValueError('Invalid date in Packed Binary JSON')
+    return date.fromordinal(struct.unpack('>i', content)[0] + EPOCH_ORDINAL)
+
+
+def _encode_uuid(o):
+    return o.bytes
+
+
+def _decode_uuid(content):
+    return uuid.UUID(bytes=content)
+
+
+def _encode_decimal(o):
+    """The flags byte, the exponent of a finite value, then the digits two
+    to a byte, padded with 0xf"""
+    sign, digits, exponent = o.as_tuple()
+    kind = decimal_kinds.get(exponent, DECIMAL_FINITE)
+    encoded = [struct.pack('B', kind << 1 | sign)]
+    if kind == DECIMAL_FINITE:
+        if not -0x80000000 <= exponent <= 0x7fffffff:
+            raise OverflowError('Decimal exponent out of range')
+        encoded.append(struct.pack('>i', exponent))
+    if len(digits) & 1:
+        digits += (0xf,)
+    for i in range(0, len(digits), 2):
+        encoded.append(struct.pack('B', digits[i] << 4 | digits[i + 1]))
+    return b''.join(encoded)
+
+
+def _decode_decimal(content):
+    if not content or content[0] >> 3:
+        raise ValueError('Invalid Decimal in Packed Binary JSON')
+    sign, kind = content[0] & 1, content[0] >> 1
+    if kind == DECIMAL_FINITE:
+        if len(content) < 5:
+            raise ValueError('Invalid Decimal in Packed Binary JSON')
+        exponent = struct.unpack_from('>i', content, 1)[0]
+        content = content[5:]
+    else:
+        exponent = decimal_exponents[kind]
+        content = content[1:]
+    digits = []
+    for b in content:
+        digits.append(b >> 4)
+        digits.append(b & 0xf)
+    if digits and digits[-1] == 0xf:
+        digits.pop()
+    if any(d > 9 for d in digits):
+        raise ValueError('Invalid Decimal in Packed Binary JSON')
+    return Decimal((sign, tuple(digits), exponent))
+
+
+# Type to (type ID, encode function) and type ID to decode function. The
+# built-in types are encoded to bytes; other codecs may return any value.
+encoders = {
+    datetime: (DATETIME, _encode_datetime),
+    date: (DATE, _encode_date),
+    uuid.UUID: (UUID, _encode_uuid),
+    Decimal: (DECIMAL, _encode_decimal),
+}
+decoders = {
+    DATETIME: _decode_datetime,
+    DATE: _decode_date,
+    UUID: _decode_uuid,
+    DECIMAL: _decode_decimal,
+}
+
+
+def register_extension(type_id, cls, encode, decode):
+    """Encode instances of *cls* as extension *type_id* when ``extensions=True``.
+
+    *encode* is called with each instance and returns a value pbjson can
+    encode; *decode* is called with that value, decoded, and returns the
+    instance. *type_id* must be between :data:`USER_MIN` and 255. Only
+    instances of *cls* itself are encoded this way, not of its subclasses.
+    """
+    if not USER_MIN <= type_id <= 0xff:
+        raise ValueError('Extension type IDs must be between {} and 255'.format(USER_MIN))
+    if not isinstance(cls, type):
+        raise TypeError('register_extension needs a class, not {!r}'.format(cls))
+    if cls in encoders and encoders[cls][0] < USER_MIN:
+        raise ValueError('{} is already a built-in extension'.format(cls.__name__))
+    encoders[cls] = (type_id, encode)
+    decoders[type_id] = decode
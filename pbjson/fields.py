@@ -0,0 +1,35 @@
+"""The fields of dataclasses and ``__slots__`` classes, shared by the
+encoder's registered classes and the decoder's schemas"""
+from __future__ import absolute_import
+from types import MemberDescriptorType
+try:
+    import dataclasses
+except ImportError:
+    dataclasses = None
+from .compat import string_types
+
+
+def class_fields(cls):
+    """Return the field names of a dataclass or a class with ``__slots__``"""
+    if dataclasses is not None and dataclasses.is_dataclass(cls):
+        return [field.name for field in dataclasses.fields(cls)]
+    names = []
+    for base in reversed(cls.__mro__):
+        slots = base.__dict__.get('__slots__', ())
+        if isinstance(slots, string_types):
+            slots = (slots,)
+        for name in slots:
+            if name not in ('__dict__', '__weakref__') and name not in names:
+                names.append(name)
+    return names
+
+
+def field_accessor(cls, name):
+    """Return the member descriptor of a slot, or the name of any other field"""
+    # Other fields are read with getattr and set with object.__setattr__, so
+    # frozen dataclasses can be filled too
+    for base in cls.__mro__:
+        if name in base.__dict__:
+            accessor = base.__dict__[name]
+            return accessor if isinstance(accessor, MemberDescriptorType) else name
+    return name
@@ -0,0 +1,32 @@
+"""Already encoded Packed Binary JSON, embedded as it is in a larger document
+
+The encoder writes a FRAGMENT token followed by the bytes, and decoders
+read the value after a FRAGMENT with a key table and remembered values of
+its own, restoring the enclosing document's afterwards. So a fragment can
+be any document produced by :func:`pbjson.dumps`, and it reads back the same
+wherever it is embedded, without being decoded and encoded again.
+"""
+from . import splice
+from .tokens import Enc_COMPRESSED
+
+__all__ = ['RawPBJSON']
+
+
+class RawPBJSON(object):
+    """Wrap the bytes of one uncompressed, encoded value. They are walked
+    once to check that they hold exactly one value, so that a truncated or
+    concatenated document can't change how the enclosing one reads."""
+    __slots__ = ('encoded_pbjson',)
+
+    def __init__(self, encoded_pbjson):
+        encoded_pbjson = bytes(encoded_pbjson)
+        if not encoded_pbjson:
+            raise ValueError('RawPBJSON needs an encoded value')
+        if encoded_pbjson[:1] == Enc_COMPRESSED:
+            raise ValueError('RawPBJSON cannot embed a compressed document')
+        if splice.value_length(encoded_pbjson) != len(encoded_pbjson):
+            raise ValueError('RawPBJSON needs exactly one encoded value')
+        self.encoded_pbjson = encoded_pbjson
+
+    def __repr__(self):
+        return 'RawPBJSON({!r})'.format(self.encoded_pbjson)
@@ -0,0 +1,374 @@
+from __future__ import absolute_import
+
+__author__ = 'Scott Maxwell'
+
+# noinspection PyStatementEffect
+"""Replacing one value of an encoded Packed Binary JSON document
+
+Container headers count items rather than bytes, so a value can be swapped
+for another of any size without touching the containers around it. What
+can change is the numbering of keys and remembered values: the decoder
+numbers the first 128 keys and every VALUE_DEF in the order they appear,
+and later tokens refer back to them by number. The new value is written
+for the tables in effect where it goes, and if the tables differ after it
+from what they were after the old value, the key and value reference
+tokens in the rest of the document are rewritten to match. Everything
+else is copied as it is.
+
+A FRAGMENT holds a document with tables of its own, so it is skipped with
+a fresh walker and never rewritten, and a path that leads into one
+replaces the value inside the embedded document instead.
+"""
+
+import struct
+from struct import pack
+from .compat import string_types
+from .decoder import PBJSONDecodeError
+from .tokens import *
+
+__all__ = ['splice']
+
+KEY_REFS = 128
+
+
+class _Missing(Exception):
+    """Carries a path lookup error out of the walk"""
+
+
+class _Fragment(Exception):
+    """Carries the position of a FRAGMENT on the path and the steps left
+    after it out of the walk"""
+
+
+def _token(data, pos):
+    """Return the token at pos, looking past a long length prefix to the
+    token it applies to"""
+    first_byte = data[pos]
+    if first_byte == LONG_LENGTH and pos + 1 < len(data) and data[pos + 1] & 0x1f == 0x1f and data[pos + 1] >= STRING:
+        return data[pos + 1]
+    return first_byte
+
+
+def _length(data, pos):
+    """Return the length of the token at pos and the position after it"""
+    first_byte = data[pos]
+    if first_byte == LONG_LENGTH:
+        if _token(data, pos) == first_byte:
+            raise PBJSONDecodeError("Invalid binary stream for Packed Binary JSON")
+        return struct.unpack_from('!Q', data, pos + 2)[0], pos + 10
+    length = first_byte & 0xf
+    if not first_byte & 0x10:
+        return length, pos + 1
+    if length == 0xf:
+        return struct.unpack_from('!I', data, pos + 1)[0], pos + 5
+    if first_byte & 0x8:
+        return ((length & 0x7) << 16) | (data[pos + 1] << 8) | data[pos + 2], pos + 3
+    return ((length & 0x7) << 8) | data[pos + 1], pos + 2
+
+
+def _container_length(data, pos, token):
+    if _token(data, pos) & 0xe0 != token:
+        raise PBJSONDecodeError('Invalid table in Packed Binary JSON')
+    return _length(data, pos)
+
+
+class _Target(object):
+    """Key table and remembered value count of the document being written"""
+
+    def __init__(self, keys, values):
+        self.keys = list(keys)
+        self.index = {}
+        for index, key in enumerate(self.keys):
+            self.index.setdefault(key, index)
+        self.values = values
+
+    def key(self, name):
+        index = self.index.get(name)
+        if index is not None:
+            return pack('B', 0x80 | index)
+        if len(self.keys) < KEY_REFS:
+            self.index[name] = len(self.keys)
+            self.keys.append(name)
+        encoded = name.encode()
+        return pack('B', len(encoded)) + encoded
+
+
+class _Walker(object):
+    """Walks encoded values, keeping the key table and remembered values as
+    the decoder would. With a target, the tokens that refer to either are
+    rewritten for the target's tables and the rest is copied as it is."""
+
+    def __init__(self, data, keys=(), values=0, target=None):
+        self.data = data
+        self.keys = list(keys)
+        # Values remembered before the walk keep their numbers; the rest
+        # are [VALUE_DEF token, number in the target or None]
+        self.base = values
+        self.values = []
+        self.target = target
+        self.chunks = []
+        self.mark = 0
+
+    def replace(self, start, end, token):
+        if token != self.data[start:end]:
+            self.chunks.append(self.data[self.mark:start])
+            self.chunks.append(token)
+            self.mark = end
+
+    def finish(self):
+        self.chunks.append(self.data[self.mark:])
+        return b''.join(self.chunks)
+
+    def key(self, pos, match=None):
+        """Return the position after the key at pos, and whether it is match"""
+        data = self.data
+        token = data[pos]
+        if token < 0x80:
+            end = pos + 1 + token
+            if end > len(data):
+                raise IndexError
+            name = data[pos + 1:end].decode()
+            if len(self.keys) < KEY_REFS:
+                self.keys.append(name)
+        else:
+            end = pos + 1
+            name = self.keys[token & 0x7f]
+        if self.target is not None:
+            self.replace(pos, end, self.target.key(name))
+        return end, name == match
+
+    def value(self, pos):
+        """Return the position after the value at pos"""
+        data = self.data
+        first_byte = _token(data, pos)
+        token = first_byte & 0xe0
+        if not token:
+            if first_byte <= NAN:
+                return pos + 1
+            if first_byte == TERMINATED_LIST:
+                pos += 1
+                while data[pos] != TERMINATOR:
+                    pos = self.value(pos)
+                return pos + 1
+            if first_byte == TERMINATED_DICT:
+                return self.items(pos + 1, True, -1)
+            if first_byte == CUSTOM:
+                return self.value(pos + 1)
+            if first_byte == TYPED_ARRAY or first_byte == EXT:
+                return self.value(pos + 2)
+            if first_byte == FRAGMENT:
+                return _Walker(data).value(pos + 1)
+            if first_byte == TABLE:
+                rows, pos = _container_length(data, pos + 1, LIST)
+                width, pos = _container_length(data, pos, DICT)
+                for _ in range(width):
+                    pos = self.key(pos)[0]
+                for _ in range(rows * width):
+                    pos = self.value(pos)
+                return pos
+            if first_byte == VALUE_DEF:
+                if data[pos + 1] & 0xe0 != STRING:
+                    raise PBJSONDecodeError('Invalid value reference in Packed Binary JSON')
+                end = self.value(pos + 1)
+                index = None
+                if self.target is not None:
+                    index = self.target.values
+                    self.target.values += 1
+                self.values.append([data[pos:end], index])
+                return end
+            if first_byte == VALUE_REF or first_byte == VALUE_REF16:
+                width = 1 if first_byte == VALUE_REF else 2
+                end = pos + 1 + width
+                if self.target is not None:
+                    index = data[pos + 1] if width == 1 else struct.unpack_from('!H', data, pos + 1)[0]
+                    self.replace(pos, end, self._value_ref(index))
+                return end
+            raise PBJSONDecodeError("Invalid binary stream for Packed Binary JSON")
+        length, pos = _length(data, pos)
+        if token == LIST:
+            for _ in range(length):
+                pos = self.value(pos)
+            return pos
+        if token == DICT:
+            for _ in range(length):
+                pos = self.value(self.key(pos)[0])
+            return pos
+        if pos + length > len(data):
+            raise IndexError
+        return pos + length
+
+    def _value_ref(self, index):
+        if index < self.base:
+            return pack('BB', VALUE_REF, index) if index < 0x100 else pack('!BH', VALUE_REF16, index)
+        entry = self.values[index - self.base]
+        if entry[1] is None:
+            # The value's definition was replaced, so this becomes it
+            entry[1] = self.target.values
+            self.target.values += 1
+            return entry[0]
+        index = entry[1]
+        return pack('BB', VALUE_REF, index) if index < 0x100 else pack('!BH', VALUE_REF16, index)
+
+    def items(self, pos, is_dict, remaining):
+        """Walk what is left of a container and return the position after it"""
+        data = self.data
+        if remaining < 0:
+            while data[pos] != TERMINATOR:
+                if is_dict:
+                    pos = self.key(pos)[0]
+                pos = self.value(pos)
+            return pos + 1
+        for _ in range(remaining):
+            if is_dict:
+                pos = self.key(pos)[0]
+            pos = self.value(pos)
+        return pos
+
+
+def _index(step, length):
+    if not isinstance(step, int) or isinstance(step, bool):
+        raise _Missing(TypeError('list indices must be integers, not {}'.format(type(step).__name__)))
+    if length is not None and step < 0:
+        step += length
+    if step < 0 or (length is not None and step >= length):
+        raise _Missing(IndexError('list index out of range'))
+    return step
+
+
+def _locate(walker, path):
+    data = walker.data
+    pos = 0
+    frames = []
+    steps = iter(path)
+    for step in steps:
+        first_byte = _token(data, pos)
+        token = first_byte & 0xe0
+        if first_byte == FRAGMENT:
+            raise _Fragment(pos, (step,) + tuple(steps))
+        if token == DICT or first_byte == TERMINATED_DICT:
+            if not isinstance(step, string_types):
+                raise _Missing(TypeError('object keys must be str, not {}'.format(type(step).__name__)))
+            if token:
+                length, pos = _length(data, pos)
+            else:
+                length, pos = None, pos + 1
+            member = 0
+            while member != length:
+                if length is None and data[pos] == TERMINATOR:
+                    raise _Missing(KeyError(step))
+                pos, found = walker.key(pos, step)
+                if found:
+                    break
+                pos = walker.value(pos)
+                member += 1
+            else:
+                raise _Missing(KeyError(step))
+            frames.append((DICT, -1 if length is None else length - member - 1))
+        elif token == LIST or first_byte == TERMINATED_LIST:
+            if token:
+                length, pos = _length(data, pos)
+            else:
+                length, pos = None, pos + 1
+            index = _index(step, length)
+            for _ in range(index):
+                if length is None and data[pos] == TERMINATOR:
+                    raise _Missing(IndexError('list index out of range'))
+                pos = walker.value(pos)
+            if length is None and data[pos] == TERMINATOR:
+                raise _Missing(IndexError('list index out of range'))
+            frames.append((LIST, -1 if length is None else length - index - 1))
+        elif first_byte == TABLE:
+            rows, pos = _container_length(data, pos + 1, LIST)
+            width, pos = _container_length(data, pos, DICT)
+            row = _index(step, rows)
+            column = next(steps, None)
+            if column is None:
+                raise _Missing(ValueError('a table row is not stored in one piece; give the key of one of its values'))
+            found = None
+            for index in range(width):
+                pos, matched = walker.key(pos, column)
+                if matched:
+                    found = index
+            if found is None:
+                raise _Missing(KeyError(column))
+            cell = row * width + found
+            for _ in range(cell):
+                pos = walker.value(pos)
+            frames.append((LIST, rows * width - cell - 1))
+        else:
+            raise _Missing(TypeError('path step {!r} does not index a list or object'.format(step)))
+    keys = list(walker.keys)
+    values = walker.base + len(walker.values)
+    end = walker.value(pos)
+    return pos, end, frames, keys, values, walker.keys, walker.base + len(walker.values)
+
+
+def locate(data, path):
+    """Find the value at path in data, returning its start and end, the
+    (DICT or LIST, items left) of the containers around it, outermost
+    first, and the key table and count of remembered values before and
+    after it"""
+    try:
+        return _locate(_Walker(data), path)
+    except _Missing as e:
+        error = e.args[0]
+    except (IndexError, struct.error):
+        raise PBJSONDecodeError("Invalid binary stream for Packed Binary JSON")
+    raise error
+
+
+def py_splice(data, path, value):
+    """Return data with the value at path replaced by the encoded value"""
+    if not isinstance(data, bytes):
+        data = bytes(data)
+    try:
+        start, end, frames, keys, values, keys_after, values_after = locate(data, path)
+    except _Fragment as e:
+        # The embedded document is patched on its own and its size is not
+        # recorded anywhere, so it is simply put back in its place
+        pos, rest = e.args
+        try:
+            end = _Walker(data).value(pos + 1)
+        except (IndexError, struct.error):
+            raise PBJSONDecodeError("Invalid binary stream for Packed Binary JSON")
+        return b''.join((data[:pos + 1], py_splice(data[pos + 1:end], rest, value), data[end:]))
+    target = _Target(keys, values)
+    try:
+        encoded = _Walker(value, target=target)
+        encoded.value(0)
+        value = encoded.finish()
+        if target.keys == keys_after and target.values == values == values_after:
+            return b''.join((data[:start], value, data[end:]))
+        # Keys or remembered values after the change are numbered
+        # differently, so their references in the rest are rewritten
+        walker = _Walker(data, keys, values)
+        walker.value(start)
+        walker.target = target
+        walker.mark = pos = end
+        for token, remaining in reversed(frames):
+            pos = walker.items(pos, token == DICT, remaining)
+        return b''.join((data[:start], value, walker.finish()))
+    except (IndexError, struct.error):
+        raise PBJSONDecodeError("Invalid binary stream for Packed Binary JSON")
+
+
+def py_value_length(data):
+    """Return the length of the encoded value at the start of data"""
+    try:
+        return _Walker(data).value(0)
+    except (IndexError, struct.error):
+        raise PBJSONDecodeError("Invalid binary stream for Packed Binary JSON")
+
+
+def _import_speedups():
+    try:
+        # noinspection PyUnresolvedReferences
+        from . import _speedups
+        return _speedups.splice, _speedups.value_length
+    except (ImportError, AttributeError):
+        return None, None
+
+
+c_splice, c_value_length = _import_speedups()
+splice = c_splice or py_splice
+value_length = c_value_length or py_value_length
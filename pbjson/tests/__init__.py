@@ -48,20 +48,37 @@ class TestMissingSpeedups(unittest.TestCase):
 
 def all_tests_suite(test_no_speedups=False):
     suite = unittest.TestLoader().loadTestsFromNames([
+        'pbjson.tests.test_canonical',
         'pbjson.tests.test_check_circular',
+        'pbjson.tests.test_compress',
         'pbjson.tests.test_custom',
         # 'pbjson.tests.test_decimal',
         'pbjson.tests.test_decode',
         'pbjson.tests.test_default',
         'pbjson.tests.test_encode',
+        'pbjson.tests.test_encoded_size',
+        'pbjson.tests.test_events',
+        'pbjson.tests.test_extensions',
+        'pbjson.tests.test_golden',
         'pbjson.tests.test_float',
         'pbjson.tests.test_for_json',
+        'pbjson.tests.test_leaks',
+        'pbjson.tests.test_long_length',
         'pbjson.tests.test_mapping',
         'pbjson.tests.test_pass1',
         'pbjson.tests.test_pass2',
+        'pbjson.tests.test_patch',
+        'pbjson.tests.test_raw_pbjson',
         # 'pbjson.tests.test_recursion',
+        'pbjson.tests.test_register_class',
+        'pbjson.tests.test_schema',
         'pbjson.tests.test_speedups',
+        'pbjson.tests.test_stats',
+        'pbjson.tests.test_tables',
         'pbjson.tests.test_tuple',
+        'pbjson.tests.test_typed_array',
+        'pbjson.tests.test_value_refs',
+        'pbjson.tests.test_writer',
     ])
     # suite = additional_tests(suite)
     return OptionalExtensionTestSuite([suite], test_no_speedups=test_no_speedups)
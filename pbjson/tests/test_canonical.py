@@ -0,0 +1,83 @@
+import hashlib
+import math
+import random
+from collections import OrderedDict
+from decimal import Decimal
+from unittest import TestCase, main
+
+import pbjson
+from pbjson.tests.test_decode import sample
+
+
+class Point(object):
+    def __init__(self, x, y):
+        self.x = x
+        self.y = y
+
+
+class TestCanonical(TestCase):
+    def test_key_order(self):
+        forward = OrderedDict([('b', 1), ('a', {'y': 2, 'x': [OrderedDict([('q', 3), ('p', 4)])]})])
+        backward = {'a': {'x': [{'p': 4, 'q': 3}], 'y': 2}, 'b': 1}
+        self.assertEqual(pbjson.canonical_dumps(forward), pbjson.canonical_dumps(backward))
+        self.assertEqual(pbjson.dumps(backward, sort_keys=True), pbjson.canonical_dumps(forward, digest=None))
+
+    def test_digest(self):
+        encoded, digest = pbjson.canonical_dumps(sample)
+        self.assertEqual(hashlib.blake2b(encoded).digest(), digest)
+        self.assertEqual(digest, pbjson.canonical_dumps(sample, output=False))
+        encoded, digest = pbjson.canonical_dumps(sample, digest='sha256')
+        self.assertEqual(hashlib.sha256(encoded).digest(), digest)
+        self.assertEqual(digest, pbjson.canonical_dumps(sample, digest=hashlib.sha256, output=False))
+        self.assertEqual(encoded, pbjson.canonical_dumps(sample, digest=None))
+        self.assertRaises(ValueError, pbjson.canonical_dumps, sample, digest=None, output=False)
+
+    def test_large(self):
+        # Several buffers' worth, so the digest is fed more than one chunk
+        rows = [{'id': i, 'name': 'row {}'.format(i), 'score': i / 7.0} for i in range(2000)]
+        encoded, digest = pbjson.canonical_dumps(rows)
+        self.assertGreater(len(encoded), 0x4000)
+        self.assertEqual(hashlib.blake2b(encoded).digest(), digest)
+        self.assertEqual(digest, pbjson.canonical_dumps(rows, output=False))
+        self.assertEqual(rows, pbjson.loads(encoded))
+
+    def test_floats(self):
+        rng = random.Random(0)
+        values = [rng.uniform(-1e6, 1e6) for _ in range(200)]
+        values += [0.1 + 0.2, 1e-7, 5e-324, 1.7976931348623157e308, 123456789.123, 1.0, 0.0, -0.0]
+        encoded = pbjson.canonical_dumps(values, digest=None)
+        self.assertEqual(values, pbjson.loads(encoded))
+        self.assertEqual(-1.0, math.copysign(1, pbjson.loads(encoded)[-1]))
+        # repr(0.1 + 0.2) is 0.30000000000000004
+        self.assertEqual(b'\x69\xd3' + b'\x00' * 7 + b'\x04', pbjson.canonical_dumps(0.1 + 0.2, digest=None))
+        special = pbjson.loads(pbjson.canonical_dumps([float('inf'), float('-inf'), float('nan')], digest=None))
+        self.assertEqual([float('inf'), float('-inf')], special[:2])
+        self.assertTrue(math.isnan(special[2]))
+        self.assertEqual(pbjson.dumps(Decimal('1.10')), pbjson.canonical_dumps(Decimal('1.10'), digest=None))
+
+    def test_sets(self):
+        words = ['toast', 'jelly', 'jam', 'butter', 'rye']
+        # Ordered by encoding, so shorter strings come first
+        expected = pbjson.dumps(sorted(words, key=lambda word: (len(word), word)))
+        self.assertEqual(expected, pbjson.canonical_dumps(set(words), digest=None))
+        self.assertEqual(expected, pbjson.canonical_dumps(frozenset(reversed(words)), digest=None))
+
+    def test_mixed_sets(self):
+        mixed = [None, 1, 'a', 2.5, -1, (1, 'x'), frozenset([3, 'b']), b'a']
+        expected = pbjson.canonical_dumps(set(mixed), digest=None)
+        self.assertEqual(expected, pbjson.canonical_dumps(set(reversed(mixed)), digest=None))
+        self.assertEqual(pbjson.loads(expected)[:3], [None, 1, -1])
+        self.assertEqual(sorted(map(repr, pbjson.loads(expected))), sorted(map(repr, [None, 1, 'a', 2.5, -1, [1, 'x'], [3, 'b'], b'a'])))
+        self.assertEqual(pbjson.canonical_dumps({'s': set(mixed)})[1], pbjson.canonical_dumps({'s': frozenset(mixed[::-1])})[1])
+
+    def test_hooks(self):
+        custom = (Point, lambda p: [p.x, p.y])
+        encoded = pbjson.canonical_dumps({'b': Point(1, 2), 'a': Point(3, 4)}, digest=None, custom=custom)
+        self.assertEqual(pbjson.dumps({'a': Point(3, 4), 'b': Point(1, 2)}, custom=custom), encoded)
+        self.assertEqual(
+            pbjson.canonical_dumps([[1, 2]], digest=None),
+            pbjson.canonical_dumps([Point(1, 2)], digest=None, convert=lambda p: [p.x, p.y]))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,87 @@
+import bz2
+import zlib
+from array import array
+from io import BytesIO
+from unittest import TestCase, main
+
+import pbjson
+from pbjson.compression import _codecs_by_id, _codecs_by_name
+from pbjson.tests.test_decode import sample
+
+rows = [{'id': i, 'name': 'row {}'.format(i), 'score': i * 0.5, 'blob': b'x' * (i % 7)} for i in range(5000)]
+
+
+class TrickleFile(object):
+    """Returns at most one byte per read to exercise refilling"""
+    def __init__(self, data):
+        self.data = BytesIO(data)
+        self.reads = 0
+
+    def read(self, size=-1):
+        self.reads += 1
+        return self.data.read(1)
+
+
+class TestCompress(TestCase):
+    def test_framing(self):
+        encoded = pbjson.dumps(sample, compress='zlib')
+        self.assertEqual(b'\x15\x01', encoded[:2])
+        self.assertEqual(pbjson.dumps(sample), zlib.decompress(encoded[2:]))
+
+    def test_true_is_zlib(self):
+        self.assertEqual(pbjson.dumps(sample, compress='zlib'), pbjson.dumps(sample, compress=True))
+
+    def test_loads(self):
+        self.assertEqual(pbjson.loads(pbjson.dumps(sample)), pbjson.loads(pbjson.dumps(sample, compress='zlib')))
+
+    def test_dump_load(self):
+        fp = BytesIO()
+        pbjson.dump(rows, fp, compress='zlib', tables=True)
+        self.assertLess(fp.tell(), len(pbjson.dumps(rows, tables=True)))
+        fp.seek(0)
+        self.assertEqual(rows, pbjson.load(fp))
+
+    def test_long_values_span_blocks(self):
+        obj = {'text': 'a' * 300000, 'array': array('d', range(50000)), 'rows': rows}
+        fp = BytesIO()
+        pbjson.dump(obj, fp, compress='zlib')
+        fp.seek(0)
+        self.assertEqual(obj, pbjson.load(fp))
+
+    def test_trickle_uncompressed(self):
+        encoded = pbjson.dumps(sample)
+        self.assertEqual(pbjson.loads(encoded), pbjson.load(TrickleFile(encoded)))
+
+    def test_trickle_compressed(self):
+        fp = TrickleFile(pbjson.dumps(rows, compress='zlib', value_refs=True))
+        self.assertEqual(rows, pbjson.load(fp))
+
+    def test_dump_writes_in_chunks(self):
+        chunks = []
+        pbjson.encoder.dump(rows, chunks.append)
+        self.assertGreater(len(chunks), 1)
+        self.assertEqual(pbjson.dumps(rows), b''.join(chunks))
+
+    def test_truncated(self):
+        encoded = pbjson.dumps(rows, compress='zlib')
+        self.assertRaises(pbjson.PBJSONDecodeError, pbjson.loads, encoded[:len(encoded) // 2])
+        self.assertRaises(pbjson.PBJSONDecodeError, pbjson.load, BytesIO(pbjson.dumps(rows)[:-1]))
+
+    def test_unknown_codec(self):
+        self.assertRaises(ValueError, pbjson.dumps, sample, compress='nope')
+        self.assertRaises(pbjson.PBJSONDecodeError, pbjson.loads, b'\x15\xff')
+
+    def test_register_codec(self):
+        pbjson.register_codec('bz2', 0x80, bz2.BZ2Compressor, bz2.BZ2Decompressor)
+        try:
+            encoded = pbjson.dumps(rows, compress='bz2')
+            self.assertEqual(b'\x15\x80', encoded[:2])
+            self.assertEqual(rows, pbjson.loads(encoded))
+            self.assertRaises(ValueError, pbjson.register_codec, 'other', 0x80, bz2.BZ2Compressor, bz2.BZ2Decompressor)
+        finally:
+            del _codecs_by_name['bz2']
+            del _codecs_by_id[0x80]
+
+
+if __name__ == '__main__':
+    main()
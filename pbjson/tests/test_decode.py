@@ -170,6 +170,10 @@ class TestDecode(TestCase):
         self.assertEqual(0x4000000000000000000000000000000, loads(b'\x30\x10\x04\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00'))
         self.assertEqual(-0x4000000000000000000000000000000, loads(b'\x50\x10\x04\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00'))
 
+    def test_big_int(self):
+        self.assertEqual(1 << 4095, loads(b'\x32\x00\x80' + b'\x00' * 511))
+        self.assertEqual(-(1 << 4095), loads(b'\x52\x00\x80' + b'\x00' * 511))
+
     def test_simple_list(self):
         self.assertEqual(['jelly', 'jam', 'butter'], loads(b'\xc3\x85jelly\x83jam\x86butter'))
 
@@ -216,6 +220,42 @@ class TestDecode(TestCase):
         self.assertIsInstance(decoded, OrderedDict)
         self.assertIsInstance(decoded['dimensions'], OrderedDict)
 
+    def test_object_pairs_hook(self):
+        encoded = pbjson.dumps(OrderedDict([('b', 1), ('a', OrderedDict([('y', [2]), ('x', 3)]))]))
+        calls = []
+
+        def hook(pairs):
+            calls.append(pairs)
+            return tuple(pairs)
+        self.assertEqual((('b', 1), ('a', (('y', [2]), ('x', 3)))), loads(encoded, object_pairs_hook=hook))
+        self.assertEqual([[('y', [2]), ('x', 3)], [('b', 1), ('a', (('y', [2]), ('x', 3)))]], calls)
+        decoded = loads(encoded, object_pairs_hook=OrderedDict)
+        self.assertIsInstance(decoded, OrderedDict)
+        self.assertIsInstance(decoded['a'], OrderedDict)
+        self.assertEqual(['b', 'a'], list(decoded))
+        self.assertEqual(['y', 'x'], list(decoded['a']))
+        # The hook takes precedence over document_class
+        self.assertIsInstance(loads(encoded, document_class=OrderedDict, object_pairs_hook=dict), dict)
+        self.assertIsInstance(loads(encoded, document_class=dict, object_pairs_hook=OrderedDict), OrderedDict)
+        self.assertEqual({}, loads(b'\xe0', object_pairs_hook=OrderedDict))
+        self.assertEqual([], loads(b'\xe0', object_pairs_hook=list))
+
+    def test_mapping_proxy(self):
+        if not PY3:
+            return
+        from types import MappingProxyType
+        decoded = loads(pbjson.dumps({'a': {'b': 1}}), object_pairs_hook=MappingProxyType)
+        self.assertIsInstance(decoded, MappingProxyType)
+        self.assertIsInstance(decoded['a'], MappingProxyType)
+        self.assertEqual({'a': {'b': 1}}, {'a': dict(decoded['a'])})
+        with self.assertRaises(TypeError):
+            decoded['c'] = 2
+
+    def test_object_pairs_hook_error(self):
+        def hook(pairs):
+            raise KeyError('rejected')
+        self.assertRaises(KeyError, loads, pbjson.dumps([{'a': 1}]), object_pairs_hook=hook)
+
     def test_dict_with_long_strings(self):
         encoded = {
             "burned": False,
@@ -240,6 +280,19 @@ class TestDecode(TestCase):
         }
         self.assertEqual(encoded, loads(b'\xe2\x09countries\xc3\xe2\x04code\x82us\x04name\x8DUnited States\xe2\x81\x82ca\x82\x86Canada\xe2\x81\x82mx\x82\x86Mexico\x06region\x21\x03'))
 
+    def test_truncated(self):
+        # Lengths and offsets past the end are errors, not silently shortened values
+        encoded = pbjson.dumps([sample, {'rows': [{'id': 1, 'name': 'same name'}] * 3}, pbjson.RawPBJSON(pbjson.dumps(sample))], tables=True, value_refs=True)
+        for end in range(len(encoded)):
+            self.assertRaises(pbjson.PBJSONDecodeError, loads, encoded[:end])
+            self.assertRaises(pbjson.PBJSONDecodeError, list, pbjson.parse_events(encoded[:end]))
+
+    def test_buffer_input(self):
+        encoded = pbjson.dumps({'blob': b'\x00\x01', 'text': 'same'})
+        for data in (bytearray(encoded), memoryview(encoded)):
+            self.assertEqual(loads(data), {'blob': b'\x00\x01', 'text': 'same'})
+            self.assertIs(type(loads(data)['blob']), bytes)
+
     def test_speed(self):
         if pbjson._has_decoder_speedups():
             encoded = json.dumps(sample)
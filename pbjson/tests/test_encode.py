@@ -127,6 +127,18 @@ class TestEncode(TestCase):
         self.assertEqual(b'\x30\x10\x04\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00', encode(0x4000000000000000000000000000000))
         self.assertEqual(b'\x50\x10\x04\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00', encode(-0x4000000000000000000000000000000))
 
+    def test_big_int_roundtrip(self):
+        for bits in (63, 64, 65, 127, 128, 129, 256, 1024, 4096):
+            for value in (1 << bits, (1 << bits) - 1, -(1 << bits), 0x1234567890abcdef << (bits - 60)):
+                encoded = encode(value)
+                self.assertEqual(value, pbjson.loads(encoded))
+                length = (abs(value).bit_length() + 7) >> 3
+                token = pbjson.tokens.NEGINT if value < 0 else pbjson.tokens.INT
+                self.assertEqual(pbjson.encoder.encode_type_and_content(token, abs(value).to_bytes(length, 'big')), encoded)
+
+    def test_min_long_long(self):
+        self.assertEqual(b'\x48\x80\x00\x00\x00\x00\x00\x00\x00', encode(-0x8000000000000000))
+
     def test_simple_list(self):
         self.assertEqual(b'\xc3\x85jelly\x83jam\x86butter', encode(['jelly', 'jam', 'butter']))
 
@@ -204,6 +216,64 @@ class TestEncode(TestCase):
             }, sort_keys=True)
         self.assertEqual(b'\xe2\x09countries\xc3\xe2\x04code\x82us\x04name\x8DUnited States\xe2\x81\x82ca\x82\x86Canada\xe2\x81\x82mx\x82\x86Mexico\x06region\x21\x03', encoded)
 
+    def test_sort_keys_order(self):
+        # Keys of every str storage width, including prefixes of each other
+        # and characters outside the Basic Multilingual Plane
+        keys = [u'b', u'a', u'ab', u'', u'A', u'\xe9', u'\xff', u'\u0100', u'\uffff', u'\u4e2d', u'\U0001f600', u'a\U0001f600', u'a\xe9']
+        a = dict((key, i) for i, key in enumerate(keys))
+        encoded = encode(a, sort_keys=True)
+        self.assertEqual(encode(a, sort_keys=lambda kv: kv[0]), encoded)
+        self.assertEqual(sorted(keys), list(pbjson.loads(encoded)))
+
+    def test_skip_illegal_keys(self):
+        a = {1: 2, u'a': 3, (4, 5): 6}
+        self.assertRaises(TypeError, pbjson.dumps, a)
+        self.assertEqual(b'\xe1\x01a\x21\x03', pbjson.dumps(a, skip_illegal_keys=True))
+        for sort_keys in (True, lambda kv: kv[0]):
+            self.assertEqual(b'\xe1\x01a\x21\x03', pbjson.dumps(a, skip_illegal_keys=True, sort_keys=sort_keys))
+        self.assertEqual(b'\xe0', pbjson.dumps({1: 2}, skip_illegal_keys=True))
+        rows = [{u'a': 1, 2: 3}, {u'a': 4, 2: 5}]
+        self.assertEqual([{u'a': 1}, {u'a': 4}], pbjson.loads(pbjson.dumps(rows, skip_illegal_keys=True, tables=True)))
+        self.assertEqual([{u'a': 1}, {u'a': 4}], pbjson.loads(pbjson.dumps(rows, skip_illegal_keys=True, tables=True, sort_keys=True)))
+        self.assertEqual(pbjson.encoded_size(a, skip_illegal_keys=True), 5)
+        self.assertRaises(ValueError, pbjson.dumps, {u'k' * 128: 1}, skip_illegal_keys=True)
+
+    def test_dump_buffered(self):
+        # A large document reaches the file a buffer at a time, split
+        # between values
+        doc = [sample, [u'x' * 100] * 200, dict((u'k%d' % i, [i, -i, i / 7.0]) for i in range(500))] * 10
+        chunks = []
+
+        class Sink(object):
+            write = chunks.append
+
+        pbjson.dump(doc, Sink())
+        self.assertTrue(len(chunks) > 1)
+        self.assertEqual(b''.join(chunks), pbjson.dumps(doc))
+        self.assertTrue(max(map(len, chunks)) < 2 * pbjson.encoder.BUFFER_SIZE)
+
+    def test_iterencode_streams(self):
+        # The pure-Python encoder hands over each buffer as it fills, before
+        # the rest of the input has been read
+        read = [0]
+
+        def rows(count):
+            for i in range(count):
+                read[0] += 1
+                yield {u'id': i, u'name': u'row', u'values': [i, -i]}
+
+        chunks = pbjson.encoder.iterencode(rows(200000))
+        first = next(chunks)
+        if pbjson.encoder.iterencoder is pbjson.encoder.py_iterencoder:
+            self.assertTrue(read[0] < 200000)
+            self.assertTrue(len(first) < 2 * pbjson.encoder.BUFFER_SIZE)
+        chunks.close()
+        doc = [sample, [u'x' * 100] * 200, dict((u'k%d' % i, [i, -i, i / 7.0]) for i in range(500)), rows(1000)]
+        streamed = list(pbjson.encoder.iterencode(doc))
+        doc[-1] = rows(1000)
+        self.assertEqual(b''.join(streamed), pbjson.dumps(doc))
+        self.assertEqual(b''.join(pbjson.encoder.iterencode({u'a': 1, 2: 3}, skip_illegal_keys=True, sort_keys=True)), b'\xe1\x01a\x21\x01')
+
 
 def cycle():
     sample = {
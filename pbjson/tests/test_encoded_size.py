@@ -0,0 +1,49 @@
+import uuid
+from array import array
+from collections import namedtuple
+from datetime import datetime
+from decimal import Decimal
+from unittest import TestCase
+
+import pbjson
+from pbjson.tests.test_decode import sample
+
+Pair = namedtuple('Pair', 'left right')
+
+
+class TestEncodedSize(TestCase):
+    def assertSize(self, obj, **kw):
+        if callable(obj):
+            # A fresh object for each encoding, for ones holding iterators
+            self.assertEqual(pbjson.encoded_size(obj(), **kw), len(pbjson.dumps(obj(), **kw)))
+        else:
+            self.assertEqual(pbjson.encoded_size(obj, **kw), len(pbjson.dumps(obj, **kw)))
+
+    def test_scalars(self):
+        for obj in (None, True, 0, 15, 16, -1 << 63, 1 << 100, -(1 << 100), 0.1, -2.5e-300, float('nan'),
+                    Decimal('1.25'), '', 'x' * 15, 'x' * 2047, 'x' * 2048, b'\x00' * 458752, bytearray(b'ab')):
+            self.assertSize(obj)
+
+    def test_containers(self):
+        self.assertSize(sample)
+        self.assertSize(sample, sort_keys=True)
+        self.assertSize([sample] * 3, tables=True, value_refs=True)
+        self.assertSize(lambda: {'pair': Pair(1, 'two'), 'gen': iter(range(20)), 'set': {1, 2}})
+        self.assertSize([{'key%d' % i: i} for i in range(300)])
+        self.assertSize(['repeated value'] * 300, value_refs=True)
+
+    def test_buffers(self):
+        self.assertSize(array('d', [1.5] * 1000))
+        self.assertSize(memoryview(array('h', range(20000)))[::3])
+        self.assertSize(memoryview(b'\x00\x01' * 50000)[::2])
+
+    def test_options(self):
+        self.assertSize({'when': datetime(2024, 5, 1), 'id': uuid.UUID(int=7)}, extensions=True)
+        self.assertSize({'c': 1j}, convert=lambda o: [o.real, o.imag])
+        self.assertSize({'c': 1j}, custom=(complex, lambda o: [o.real, o.imag]))
+        self.assertSize([pbjson.RawPBJSON(pbjson.dumps(sample)), sample])
+
+    def test_errors(self):
+        self.assertRaises(TypeError, pbjson.encoded_size, {'c': 1j})
+        self.assertRaises(TypeError, pbjson.encoded_size, {1: 2})
+        self.assertRaises(ValueError, pbjson.encoded_size, {'k' * 128: 1})
@@ -0,0 +1,112 @@
+from array import array
+from decimal import Decimal
+from io import BytesIO
+from unittest import TestCase
+
+import pbjson
+from pbjson.tests.test_decode import sample
+
+
+def build(events):
+    """Rebuild a document from its events, as a consumer of them would"""
+    stack = [[]]
+    keys = []
+    for event, value in events:
+        if event == 'start_map':
+            stack.append({})
+        elif event == 'start_array':
+            stack.append([])
+        elif event == 'map_key':
+            keys.append(value)
+            continue
+        elif event in ('end_map', 'end_array'):
+            value = stack.pop()
+        if event not in ('start_map', 'start_array'):
+            container = stack[-1]
+            if isinstance(container, dict):
+                container[keys.pop()] = value
+            else:
+                container.append(value)
+    return stack[0][0]
+
+
+class TestEvents(TestCase):
+    def test_events(self):
+        encoded = pbjson.dumps({'a': [1, -2.5, None, True, 'text', b'\x00'], 'b': {}})
+        self.assertEqual(list(pbjson.parse_events(encoded)), [
+            ('start_map', None),
+            ('map_key', 'a'),
+            ('start_array', None),
+            ('number', 1),
+            ('number', -2.5),
+            ('null', None),
+            ('boolean', True),
+            ('string', 'text'),
+            ('binary', b'\x00'),
+            ('end_array', None),
+            ('map_key', 'b'),
+            ('start_map', None),
+            ('end_map', None),
+            ('end_map', None),
+        ])
+
+    def test_scalar(self):
+        self.assertEqual(list(pbjson.parse_events(pbjson.dumps('only'))), [('string', 'only')])
+        self.assertEqual(list(pbjson.parse_events(pbjson.dumps(float('-inf')))), [('number', float('-inf'))])
+
+    def test_rebuild(self):
+        for kwargs in ({}, {'tables': True, 'value_refs': True}, {'compress': 'zlib'}):
+            encoded = pbjson.dumps(sample, **kwargs)
+            self.assertEqual(build(pbjson.parse_events(encoded)), pbjson.loads(encoded))
+
+    def test_tables(self):
+        rows = [{'x': 1, 'y': 'a'}, {'x': 2, 'y': 'b'}]
+        encoded = pbjson.dumps(rows, tables=True)
+        self.assertEqual(list(pbjson.parse_events(encoded))[:6], [
+            ('start_array', None),
+            ('start_map', None),
+            ('map_key', 'x'),
+            ('number', 1),
+            ('map_key', 'y'),
+            ('string', 'a'),
+        ])
+        self.assertEqual(build(pbjson.parse_events(encoded)), rows)
+
+    def test_terminated_list(self):
+        encoded = pbjson.dumps({'items': iter(range(3))})
+        self.assertEqual(build(pbjson.parse_events(encoded)), {'items': [0, 1, 2]})
+
+    def test_values(self):
+        encoded = pbjson.dumps([array('h', [1, 2]), Decimal('1.5')], extensions=True)
+        events = list(pbjson.parse_events(encoded))
+        self.assertEqual(events[1], ('typed_array', array('h', [1, 2])))
+        self.assertEqual(events[2], ('extension', Decimal('1.5')))
+        self.assertEqual(list(pbjson.parse_events(pbjson.dumps(1.5), float_class=Decimal)), [('number', Decimal('1.5'))])
+
+    def test_batches(self):
+        encoded = pbjson.dumps(list(range(10)))
+        batches = []
+        self.assertIsNone(pbjson.parse_events(encoded, batches.append, batch_size=4))
+        self.assertEqual([len(batch) for batch in batches], [4, 4, 4])
+        self.assertEqual([value for batch in batches for event, value in batch if event == 'number'], list(range(10)))
+
+    def test_stream(self):
+        fp = BytesIO()
+        pbjson.dump(sample, fp, compress='zlib')
+        fp.seek(0)
+        expected = pbjson.load(fp)
+        fp.seek(0)
+        self.assertEqual(build(pbjson.parse_events(fp)), expected)
+
+    def test_lazy(self):
+        # Events before the damage are still reported
+        encoded = pbjson.dumps([1, 2, 3])[:-1]
+        events = pbjson.parse_events(encoded, batch_size=1)
+        self.assertEqual(next(events), ('start_array', None))
+        self.assertEqual(next(events), ('number', 1))
+        self.assertEqual(next(events), ('number', 2))
+        self.assertRaises(pbjson.PBJSONDecodeError, next, events)
+
+    def test_errors(self):
+        for encoded in (b'', b'\xe1', b'\xe1\x01', b'\xc5\x21', b'\x11\xc2\xe0', b'\x0c\x21'):
+            self.assertRaises(pbjson.PBJSONDecodeError, list, pbjson.parse_events(encoded))
@@ -0,0 +1,103 @@
+import uuid
+from datetime import date, datetime, timedelta, timezone
+from decimal import Decimal
+from unittest import TestCase, main
+
+import pbjson
+from pbjson import extensions
+
+
+class Money(object):
+    def __init__(self, cents, currency):
+        self.cents = cents
+        self.currency = currency
+
+
+class TestExtensions(TestCase):
+    def tearDown(self):
+        extensions.encoders.pop(Money, None)
+        extensions.decoders.pop(0x40, None)
+
+    def assertRoundTrip(self, value):
+        decoded = pbjson.loads(pbjson.dumps(value, extensions=True))
+        self.assertEqual(value, decoded)
+        self.assertIs(type(value), type(decoded))
+        return decoded
+
+    def test_encoding(self):
+        self.assertEqual(b'\x16\x00\xa8\x00\x06\x17\xc3\xbbSJ\x80', pbjson.dumps(datetime(2024, 5, 6, 7, 8, 9, 123456), extensions=True))
+        aware = datetime(2024, 5, 6, 7, 8, 9, 123456, tzinfo=timezone(timedelta(hours=5, minutes=30)))
+        self.assertEqual(b"\x16\x00\xac\x00\x06\x17\xbf\x1f'D\x80\x00\x00MX", pbjson.dumps(aware, extensions=True))
+        self.assertEqual(b'\x16\x01\xa4\x00\x00,\\', pbjson.dumps(date(2001, 2, 3), extensions=True))
+        self.assertEqual(b'\x16\x02\xb0\x10' + b'\x124Vx' * 4, pbjson.dumps(uuid.UUID('12345678-1234-5678-1234-567812345678'), extensions=True))
+        self.assertEqual(b'\x16\x03\xa7\x01\xff\xff\xff\xfe\x11\x0f', pbjson.dumps(Decimal('-1.10'), extensions=True))
+
+    def test_datetime(self):
+        for value in (datetime(2024, 5, 6, 7, 8, 9, 123456), datetime(1969, 12, 31, 23, 59, 59, 999999),
+                      datetime.min, datetime.max, datetime(1970, 1, 1)):
+            self.assertRoundTrip(value)
+
+    def test_aware_datetime(self):
+        for offset in (timedelta(0), timedelta(hours=-5), timedelta(hours=13, minutes=45), timedelta(hours=23, minutes=59, seconds=59)):
+            value = datetime(2020, 2, 29, 12, 0, 0, 1, tzinfo=timezone(offset))
+            decoded = self.assertRoundTrip(value)
+            self.assertEqual(offset, decoded.utcoffset())
+        self.assertIs(timezone.utc, pbjson.loads(pbjson.dumps(datetime(2000, 1, 1, tzinfo=timezone.utc), extensions=True)).tzinfo)
+        self.assertRaises(ValueError, pbjson.dumps, datetime(2000, 1, 1, tzinfo=timezone(timedelta(microseconds=1))), extensions=True)
+
+    def test_date(self):
+        for value in (date(2001, 2, 3), date(1, 1, 1), date(9999, 12, 31), date(1969, 12, 31), date(2000, 2, 29)):
+            self.assertRoundTrip(value)
+
+    def test_uuid(self):
+        for value in (uuid.UUID(int=0), uuid.UUID(int=(1 << 128) - 1), uuid.uuid4()):
+            self.assertRoundTrip(value)
+
+    def test_decimal(self):
+        for text in ('-1.10', '0', '-0', '1E+999999', '123456789012345678901234567890.5', '1e-20', '5'):
+            self.assertEqual(text.upper(), str(self.assertRoundTrip(Decimal(text))).upper())
+        for text in ('Infinity', '-Infinity', 'NaN', '-NaN123', 'sNaN'):
+            self.assertEqual(str(Decimal(text)), str(pbjson.loads(pbjson.dumps(Decimal(text), extensions=True))))
+        self.assertRaises(OverflowError, pbjson.dumps, Decimal('1E+3000000000'), extensions=True)
+
+    def test_disabled(self):
+        self.assertEqual(pbjson.dumps(1.5), pbjson.dumps(Decimal('1.5')))
+        self.assertRaises(TypeError, pbjson.dumps, date(2001, 2, 3))
+
+    def test_nested(self):
+        value = {'when': datetime(2024, 1, 1), 'ids': [uuid.UUID(int=i) for i in range(3)], 'price': Decimal('9.99')}
+        self.assertEqual(value, pbjson.loads(pbjson.dumps(value, extensions=True, tables=True, sort_keys=True)))
+
+    def test_register(self):
+        pbjson.register_extension(0x40, Money, lambda m: [m.cents, m.currency], lambda v: Money(*v))
+        encoded = pbjson.dumps({'price': Money(999, 'USD')}, extensions=True)
+        self.assertEqual(b'\x16\x40\xc2\x22\x03\xe7\x83USD', encoded[-10:])
+        decoded = pbjson.loads(encoded)['price']
+        self.assertIsInstance(decoded, Money)
+        self.assertEqual((999, 'USD'), (decoded.cents, decoded.currency))
+        self.assertRaises(TypeError, pbjson.dumps, Money(1, 'USD'))
+
+    def test_register_errors(self):
+        self.assertRaises(ValueError, pbjson.register_extension, 3, Money, str, str)
+        self.assertRaises(ValueError, pbjson.register_extension, 0x100, Money, str, str)
+        self.assertRaises(TypeError, pbjson.register_extension, 0x40, Money(1, 'USD'), str, str)
+        self.assertRaises(ValueError, pbjson.register_extension, 0x40, date, str, str)
+
+    def test_circular(self):
+        money = Money(1, 'USD')
+        pbjson.register_extension(0x40, Money, lambda m: [m], lambda v: v)
+        self.assertRaises(ValueError, pbjson.dumps, money, extensions=True)
+
+    def test_invalid(self):
+        for encoded in (b'\x16\x41\x21\x01', b'\x16', b'\x16\x00\xa4\x00\x00\x00\x00', b'\x16\x00\x21\x01',
+                        b'\x16\x01\xa4\x7f\xff\xff\xff', b'\x16\x02\xa1\x00', b'\x16\x03\xa0', b'\x16\x03\xa2\x00\xaf',
+                        b'\x16\x03\xa1\x08', b'\x16\x00\xac\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01\x51\x80',
+                        # Microseconds so far out that adding the offset would overflow
+                        b'\x16\x00\xac\x7f\xff\xff\xff\xff\xff\xff\xff\x00\x00\x0e\x10',
+                        b'\x16\x00\xac\x80\x00\x00\x00\x00\x00\x00\x00\xff\xff\xf1\xf0',
+                        b'\x16\x00\xa8\x7f\xff\xff\xff\xff\xff\xff\xff'):
+            self.assertRaises(pbjson.PBJSONDecodeError, pbjson.loads, encoded)
+
+
+if __name__ == '__main__':
+    main()
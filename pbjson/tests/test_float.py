@@ -26,6 +26,10 @@ class TestFloat(TestCase):
             self.assertEqual(decoded, float(num))
             assert_type(length, len(encoded), num)
 
+    def test_decimal_exponent(self):
+        for text in ('1E+5', '-2.5E-7', '1' * 40):
+            self.assertEqual(Decimal(text), pbjson.loads(pbjson.dumps(Decimal(text)), float_class=Decimal))
+
     def test_ints(self):
         for num in [1, long_type(1), 1 << 32, 1 << 64]:
             self.assertEqual(pbjson.loads(pbjson.dumps(num)), num)
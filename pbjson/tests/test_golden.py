@@ -0,0 +1,68 @@
+"""The golden corpus shared with the C++ Writer.
+
+libpbjson/tests/golden.txt holds what dumps writes for each document
+below, one per line as ``name options hex``. This test checks dumps still
+writes those bytes, and libpbjson's test_pbjson reads every document back
+and writes it again with its Writer, which has to produce the same bytes.
+Run this module with ``update`` to rewrite the file after a deliberate
+change to the format.
+"""
+import os
+import sys
+import uuid
+from binascii import hexlify, unhexlify
+from unittest import TestCase, main, skipIf
+
+import pbjson
+from pbjson import RawPBJSON
+
+GOLDEN = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', '..', 'libpbjson', 'tests', 'golden.txt')
+
+
+def corpus():
+    """Return ``(name, options, document)`` for each golden document"""
+    keys = dict((u'key%d' % i, i) for i in range(200))
+    return [
+        ('scalars', '', [None, True, False, 0, 1, -1, 255, 256, -300, 1 << 40, -(1 << 63), (1 << 64) - 1, 1 << 70]),
+        ('floats', '', [1.5, -0.25, 0.1, 1e-07, 1e100, 123456.789, 5e-324, 2.2250738585072014e-308,
+                        1.7976931348623157e308, float('inf'), float('-inf'), float('nan')]),
+        ('strings', '', [u'', u'toast', u'caf\xe9 \u4e2d \U0001f600', u'x' * 15, u'x' * 16, u'y' * 2047, u'z' * 2048,
+                         b'\x00\x01', b'\xff' * 500]),
+        ('keys', '', [keys, dict((u'key%d' % i, [i]) for i in range(0, 200, 3)), {u'': {u'': None}}]),
+        ('nested', '', {u'name': u'toast', u'rows': [{u'id': 1, u'name': u'a'}, {u'id': 2, u'name': u'b'}],
+                        u'empty': [[], {}], u'deep': [[[[u'name']]]]}),
+        ('tables', 'tables', {u'rows': [{u'id': i, u'name': u'row%d' % i} for i in range(20)],
+                              u'after': {u'id': -1, u'name': u'none'}}),
+        ('value_refs', 'value_refs', [u'label%d' % (i % 300) for i in range(700)] + [u'ab', u'ab', u'x' * 100, u'x' * 100]),
+        ('unsized', '', [iter([1, u'two', {u'three': 3}]), iter([])]),
+        ('fragment', '', {u'id': RawPBJSON(pbjson.dumps({u'x': 1, u'id': 2})), u'n': {u'x': 2, u'id': 3}}),
+        ('extensions', 'extensions', [uuid.UUID(int=0x12345678123456781234567812345678), {u'tag': u'x'}]),
+    ]
+
+
+def golden_lines():
+    lines = []
+    for name, options, document in corpus():
+        kwargs = dict((option, True) for option in options.split(',') if option)
+        lines.append('%s %s %s\n' % (name, options or '-', hexlify(pbjson.dumps(document, **kwargs)).decode()))
+    return lines
+
+
+class TestGolden(TestCase):
+    @skipIf(not os.path.exists(GOLDEN), 'libpbjson is not next to the package')
+    @skipIf(sys.version_info < (3, 7), 'the corpus relies on dicts keeping insertion order')
+    def test_golden(self):
+        with open(GOLDEN) as fp:
+            expected = fp.readlines()
+        actual = golden_lines()
+        self.assertEqual([line.split()[:2] for line in expected], [line.split()[:2] for line in actual])
+        for want, got in zip(expected, actual):
+            self.assertEqual(unhexlify(want.split()[2]), unhexlify(got.split()[2]), want.split()[0])
+
+
+if __name__ == '__main__':
+    if sys.argv[1:] == ['update']:
+        with open(GOLDEN, 'w') as fp:
+            fp.writelines(golden_lines())
+    else:
+        main()
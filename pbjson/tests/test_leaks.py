@@ -0,0 +1,315 @@
+"""Allocation and reference count regression tests
+
+Each check runs a call in a loop once to warm up caches and free lists,
+then again, and fails if the number of allocated blocks (or
+sys.gettotalrefcount on a debug build of Python) grows by about one per
+call. Large buffers come from malloc rather than the small object
+allocator, so the total traced by tracemalloc is checked as well, with
+enough slack for blocks that were allocated before tracing started.
+"""
+import gc
+import sys
+import tracemalloc
+import uuid
+from array import array
+from collections import OrderedDict, namedtuple
+from datetime import date, datetime, timedelta, timezone
+from decimal import Decimal
+from io import BytesIO
+from unittest import TestCase, main
+
+import pbjson
+from pbjson import encoder
+from pbjson.compat import MappingProxyType
+from pbjson.tests.test_decode import sample
+
+try:
+    from benchmarks.corpus import CORPORA, generate
+except ImportError:
+    CORPORA = None
+
+LOOPS = 200
+SLACK = 16384
+ATTEMPTS = 3
+
+allocatedblocks = getattr(sys, 'getallocatedblocks', lambda: 0)
+totalrefcount = getattr(sys, 'gettotalrefcount', lambda: 0)
+
+Pair = namedtuple('Pair', 'left right')
+
+
+class Point(object):
+    def __init__(self, x, y):
+        self.x = x
+        self.y = y
+
+
+class Slotted(object):
+    __slots__ = ('x', 'y')
+
+    def __init__(self, x, y):
+        self.x = x
+        self.y = y
+
+
+class ForJson(object):
+    def for_json(self):
+        return {'for': 'json'}
+
+
+class BadForJson(object):
+    def for_json(self):
+        raise RuntimeError('for_json failed')
+
+
+class BadDocument(dict):
+    def __setitem__(self, key, value):
+        if key == 'bad':
+            raise KeyError(key)
+        dict.__setitem__(self, key, value)
+
+
+def fail(o):
+    raise TypeError('not serializable')
+
+
+class FailingWriter(object):
+    def __init__(self):
+        self.count = 0
+
+    def write(self, chunk):
+        self.count += 1
+        if self.count > 2:
+            raise IOError('disk full')
+
+
+def failing_read(size):
+    raise IOError('connection reset')
+
+
+def text_read(size):
+    return u'not bytes'
+
+
+mixed = {
+    'sample': sample,
+    'big': [1 << 70, -(1 << 90), 0x7fffffffffffffff],
+    'decimal': Decimal('-12.25'),
+    'pair': Pair(1, 'two'),
+    'array': array('d', [1.5, 2.5]),
+    'blob': b'\x00\x01',
+    'frames': [bytearray(b'frame'), memoryview(b'\x00\x01' * 5000)[::2]],
+    'rows': [{'name': 'same value', 'score': i} for i in range(20)],
+    'nested': [[{'deep': [None, True, False, float('inf')]}]],
+}
+
+
+class TestLeaks(TestCase):
+    def assertNoLeak(self, function, *args, **kwargs):
+        raises = kwargs.pop('raises', ())
+        loops = kwargs.pop('loops', LOOPS)
+
+        def run():
+            for _ in range(loops):
+                try:
+                    function(*args, **kwargs)
+                except raises:
+                    pass
+
+        arg_refs = [sys.getrefcount(arg) for arg in args]
+        tracemalloc.start()
+        try:
+            run()
+            # Interpreter caches can take a few passes to settle, but a leak
+            # grows on every pass
+            for _ in range(ATTEMPTS):
+                gc.collect()
+                refs = totalrefcount()
+                blocks = allocatedblocks()
+                before = tracemalloc.get_traced_memory()[0]
+                run()
+                gc.collect()
+                growth = tracemalloc.get_traced_memory()[0] - before
+                block_growth = allocatedblocks() - blocks
+                ref_growth = totalrefcount() - refs
+                if growth < SLACK and block_growth < loops // 2 and ref_growth < loops // 2:
+                    break
+        finally:
+            tracemalloc.stop()
+        name = getattr(function, '__name__', repr(function))
+        self.assertLess(block_growth, loops // 2, '{} leaked {} blocks over {} calls'.format(name, block_growth, loops))
+        self.assertLess(ref_growth, loops // 2, '{} leaked {} references over {} calls'.format(name, ref_growth, loops))
+        self.assertLess(growth, SLACK, '{} grew by {} bytes over {} calls'.format(name, growth, loops))
+        self.assertEqual(arg_refs, [sys.getrefcount(arg) for arg in args], '{} leaked references to its arguments'.format(name))
+
+    def roundtrip(self, obj, **kwargs):
+        return pbjson.loads(pbjson.dumps(obj, **kwargs))
+
+    def test_corpora(self):
+        if CORPORA is None:
+            self.skipTest('benchmarks are not importable')
+        if not pbjson._has_encoder_speedups():
+            self.skipTest('too slow to trace without the C extension')
+        for name in sorted(CORPORA):
+            doc = generate(name)
+            encoded = pbjson.dumps(doc)
+            self.assertNoLeak(pbjson.dumps, doc, loops=4)
+            self.assertNoLeak(pbjson.loads, encoded, loops=4)
+
+    def test_roundtrip(self):
+        self.assertNoLeak(self.roundtrip, mixed)
+        self.assertNoLeak(self.roundtrip, mixed, sort_keys=True)
+        self.assertNoLeak(self.roundtrip, mixed, tables=True, value_refs=True)
+        self.assertNoLeak(pbjson.dumps, [{1: 2, 'a': 3}] * 2, skip_illegal_keys=True, tables=True)
+        self.assertNoLeak(pbjson.dumps, {1: 2, 'a': 3}, skip_illegal_keys=True, sort_keys=True)
+        self.assertNoLeak(pbjson.loads, pbjson.dumps(mixed, tables=True), columnar=True, zero_copy=True)
+
+    def test_hooks(self):
+        self.assertNoLeak(pbjson.dumps, [Point(1, 2)], custom=(Point, lambda p: [p.x, p.y]))
+        self.assertNoLeak(pbjson.dumps, [Point(1, 2)], custom=[(Decimal, str), (Point, lambda p: [p.x, p.y])])
+        self.assertNoLeak(pbjson.dumps, [Point(1, 2), set()], convert=lambda p: 'converted')
+        self.assertNoLeak(pbjson.dumps, [ForJson()], use_for_json=True)
+        self.assertNoLeak(pbjson.dumps, iter(range(10)))
+        encoded = pbjson.dumps([Point(1, 2)], custom=(Point, lambda p: [p.x, p.y]))
+        self.assertNoLeak(pbjson.loads, encoded, custom=lambda o: tuple(o))
+        encoded = pbjson.dumps(mixed, tables=True)
+        self.assertNoLeak(pbjson.loads, encoded, object_pairs_hook=OrderedDict)
+        self.assertNoLeak(pbjson.loads, encoded, object_pairs_hook=tuple)
+        self.assertNoLeak(pbjson.loads, encoded, columnar=True, object_pairs_hook=OrderedDict)
+        if MappingProxyType is not None:
+            self.assertNoLeak(pbjson.loads, encoded, object_pairs_hook=MappingProxyType)
+        self.assertNoLeak(pbjson.loads, encoded, object_pairs_hook=fail, raises=TypeError)
+        self.assertNoLeak(pbjson.loads, encoded, schema=Slotted)
+        rows = pbjson.dumps([{'x': i, 'y': [i]} for i in range(20)])
+        self.assertNoLeak(pbjson.loads, rows, schema=Slotted)
+        self.assertNoLeak(pbjson.loads, pbjson.dumps({'x': 1, 'y': 2}, tables=True), schema=[Slotted])
+        self.assertNoLeak(pbjson.loads, pbjson.dumps([{'x': 1, 'y': 2}, {'x': 3, 'y': 4}], tables=True), schema=Slotted)
+
+    def test_registered_class(self):
+        pbjson.register_class(Slotted)
+        try:
+            self.assertNoLeak(pbjson.dumps, [Slotted(i, [i]) for i in range(20)])
+            self.assertNoLeak(pbjson.dumps, Slotted(1, 2), sort_keys=True)
+            self.assertNoLeak(pbjson.dumps, Slotted(1, 2), sort_keys=lambda kv: kv[0])
+            self.assertNoLeak(pbjson.dumps, Slotted(1, Point(1, 2)), raises=TypeError)
+            self.assertNoLeak(pbjson.dumps, Slotted.__new__(Slotted), raises=AttributeError)
+        finally:
+            del encoder.registered_classes[Slotted]
+
+    def test_extensions(self):
+        values = [datetime(2024, 5, 6, 7, 8, 9), datetime(2024, 5, 6, tzinfo=timezone(timedelta(hours=-5))),
+                  date(2001, 2, 3), uuid.UUID(int=12345), Decimal('-1.10'), Decimal('NaN')]
+        self.assertNoLeak(pbjson.dumps, values, extensions=True)
+        self.assertNoLeak(pbjson.loads, pbjson.dumps(values, extensions=True))
+        self.assertNoLeak(pbjson.loads, b'\x16\x03\xa2\x00\xaf', raises=pbjson.PBJSONDecodeError)
+        self.assertNoLeak(pbjson.loads, b'\x16\x41\x21\x01', raises=pbjson.PBJSONDecodeError)
+
+    def test_events(self):
+        encoded = pbjson.dumps(mixed, tables=True, value_refs=True)
+        self.assertNoLeak(lambda: list(pbjson.parse_events(encoded, batch_size=7)))
+        self.assertNoLeak(lambda: next(pbjson.parse_events(encoded)))
+        self.assertNoLeak(lambda: list(pbjson.parse_events(encoded[:-3])), raises=ValueError)
+        compressed = pbjson.dumps(mixed, compress='zlib')
+        self.assertNoLeak(lambda: pbjson.parse_events(BytesIO(compressed), lambda batch: None))
+
+    def test_patch(self):
+        encoded = pbjson.dumps(mixed, tables=True, value_refs=True)
+        self.assertNoLeak(pbjson.patch, encoded, ('rows', 3, 'name'), 'other value')
+        self.assertNoLeak(pbjson.patch, encoded, ('rows', 0, 'name'), {'new key': 1})
+        self.assertNoLeak(pbjson.patch, encoded, ('rows', 0, 'missing'), 1, raises=KeyError)
+        self.assertNoLeak(pbjson.patch, encoded[:-3], ('frames',), 1, raises=ValueError)
+
+    def test_encoded_size(self):
+        self.assertNoLeak(pbjson.encoded_size, mixed, tables=True, value_refs=True)
+        self.assertNoLeak(pbjson.encoded_size, {'c': 1j}, raises=TypeError)
+
+    def test_raw_pbjson(self):
+        cached = pbjson.RawPBJSON(pbjson.dumps(mixed, tables=True, value_refs=True))
+        encoded = pbjson.dumps([mixed, cached, mixed], value_refs=True)
+        self.assertNoLeak(pbjson.dumps, [mixed, cached, mixed], value_refs=True)
+        self.assertNoLeak(pbjson.loads, encoded)
+        self.assertNoLeak(lambda: list(pbjson.parse_events(encoded)))
+        self.assertNoLeak(pbjson.patch, encoded, (1, 'rows', 3, 'name'), 'other value')
+        self.assertNoLeak(pbjson.loads, encoded[:-40], raises=ValueError)
+        self.assertNoLeak(pbjson.RawPBJSON, cached.encoded_pbjson)
+        self.assertNoLeak(pbjson.RawPBJSON, cached.encoded_pbjson[:-1], raises=ValueError)
+
+    def test_writer(self):
+        def write(**kw):
+            writer = pbjson.PBJSONWriter(BytesIO(), **kw)
+            writer.begin_dict()
+            writer.key('rows')
+            writer.begin_list()
+            for row in (mixed, sample, mixed):
+                writer.value(row)
+            writer.end()
+            writer.end()
+            writer.close()
+
+        def fail():
+            writer = pbjson.PBJSONWriter(BytesIO())
+            writer.begin_list(2)
+            writer.value(mixed)
+            writer.value({'c': 1j})
+        self.assertNoLeak(write)
+        self.assertNoLeak(write, value_refs=True, compress='zlib')
+        self.assertNoLeak(fail, raises=TypeError)
+
+    def test_streams(self):
+        def dump_load(obj):
+            fp = BytesIO()
+            pbjson.dump(obj, fp, compress='zlib')
+            fp.seek(0)
+            return pbjson.load(fp)
+        self.assertNoLeak(dump_load, mixed)
+
+    def test_encode_errors(self):
+        self.assertNoLeak(pbjson.dumps, {'a': 1, 'b': Point(1, 2), 'c': 3}, convert=fail, raises=TypeError)
+        self.assertNoLeak(pbjson.dumps, {'a': [1, {'b': Point(1, 2)}]}, convert=fail, raises=TypeError)
+        self.assertNoLeak(pbjson.dumps, {'a': 1, 2: 'b'}, raises=TypeError)
+        self.assertNoLeak(pbjson.dumps, {'a': 1, 2: 'b'}, sort_keys=True, raises=TypeError)
+        self.assertNoLeak(pbjson.dumps, {'a': 1, 'k' * 128: 'b'}, raises=ValueError)
+        self.assertNoLeak(pbjson.dumps, [Point(1, 2)], custom=(Point, fail), raises=TypeError)
+        self.assertNoLeak(pbjson.dumps, [BadForJson()], use_for_json=True, raises=RuntimeError)
+        self.assertNoLeak(pbjson.dumps, [{'a': Point(1, 2)}, {'a': 1}], convert=fail, tables=True, raises=TypeError)
+        self.assertNoLeak(pbjson.dumps, {'a': 1}, sort_keys=lambda item: item[5], raises=IndexError)
+        self.assertNoLeak(lambda: pbjson.dump(sample, FailingWriter(), compress='zlib'), raises=IOError)
+        self.assertNoLeak(lambda: pbjson.encoder.dump(['x' * 5000] * 4, FailingWriter().write), raises=IOError)
+
+    def test_circular(self):
+        circular_list = []
+        circular_list.append(circular_list)
+        circular_dict = {}
+        circular_dict['self'] = circular_dict
+        point = Point(1, 2)
+        self.assertNoLeak(pbjson.dumps, circular_list, raises=ValueError)
+        self.assertNoLeak(pbjson.dumps, circular_dict, raises=ValueError)
+        self.assertNoLeak(pbjson.dumps, point, custom=(Point, lambda p: [p]), raises=ValueError)
+        self.assertNoLeak(pbjson.dumps, point, convert=lambda p: [p], raises=ValueError)
+        circular_dict.clear()
+        del circular_list[:]
+
+    def test_decode_errors(self):
+        # Every prefix is decoded, so keep this short
+        small = dict((key, value) for key, value in mixed.items() if key != 'sample')
+        small['rows'] = small['rows'][:3]
+        encoded = pbjson.dumps(small, tables=True, value_refs=True)
+
+        def truncated(data):
+            for end in range(len(data)):
+                try:
+                    pbjson.loads(data[:end])
+                except ValueError:
+                    pass
+        self.assertNoLeak(truncated, encoded, loops=20)
+        self.assertNoLeak(pbjson.loads, pbjson.dumps({'good': 1, 'bad': [1, 2], 'more': 3}), document_class=BadDocument, raises=KeyError)
+        self.assertNoLeak(pbjson.loads, b'\xe2\x01a\x21\x01\x01b\x0b', raises=ValueError)
+        self.assertNoLeak(pbjson.loads, b'\x0e\xc2\x21', raises=ValueError)
+        self.assertNoLeak(pbjson.loads, pbjson.dumps([Point(1, 2)], custom=(Point, lambda p: [p.x, p.y])), custom=fail, raises=TypeError)
+        self.assertNoLeak(pbjson.loads, b'\x13\x00', raises=ValueError)
+        self.assertNoLeak(lambda: pbjson.decoder.decode(b'\xc3\x21', None, None, None, 'strict', read=failing_read), raises=IOError)
+        self.assertNoLeak(lambda: pbjson.decoder.decode(b'\xc3\x21', None, None, None, 'strict', read=text_read), raises=(TypeError, ValueError))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,62 @@
+import mmap
+import sys
+import tempfile
+from struct import pack
+from unittest import TestCase, skipIf
+
+import pbjson
+from pbjson import encoder
+
+BIG = (1 << 32) + 5
+
+
+def long_header(token, length):
+    return pack('>BBQ', 0x18, token | 0x1f, length)
+
+
+class TestLongLength(TestCase):
+    def test_header(self):
+        self.assertEqual(encoder.encode_type_and_length(0x80, 0xffffffff), b'\x9f\xff\xff\xff\xff')
+        self.assertEqual(encoder.encode_type_and_length(0xa0, BIG), b'\x18\xbf\x00\x00\x00\x01\x00\x00\x00\x05')
+
+    def test_decode(self):
+        # Any length may be written in the long form, so small documents
+        # exercise the same paths as huge ones
+        encoded = (long_header(0xc0, 3) + long_header(0x80, 3) + b'abc' + long_header(0xa0, 2) + b'xy' +
+                   long_header(0xe0, 1) + b'\x01k\x10h' + long_header(0xa0, 4) + b'\x01\x00\x02\x00')
+        expected = ['abc', b'xy', {'k': [1, 2]}]
+        decoded = pbjson.loads(encoded)
+        self.assertEqual([decoded[0], decoded[1], {'k': decoded[2]['k'].tolist()}], expected)
+        self.assertEqual(len(list(pbjson.parse_events(encoded))), len(list(pbjson.parse_events(pbjson.dumps(decoded)))))
+        patched = pbjson.loads(pbjson.patch(encoded, (2, 'k'), 'new'))
+        self.assertEqual(patched, ['abc', b'xy', {'k': 'new'}])
+        self.assertEqual(pbjson.loads(pbjson.patch(encoded, (1,), 5)), ['abc', 5, decoded[2]])
+
+    def test_invalid(self):
+        for encoded in (b'\x18', b'\x18\x02', b'\x18\x9e\x00\x00\x00\x00\x00\x00\x00\x01', b'\x18\x3f' + b'\x00' * 8,
+                        b'\x18\x9f\x00\x00\x00', b'\x18\x9f\x00\x00\x00\x00\x00\x00\x00\x05ab'):
+            self.assertRaises(pbjson.PBJSONDecodeError, pbjson.loads, encoded)
+            self.assertRaises(pbjson.PBJSONDecodeError, list, pbjson.parse_events(encoded))
+
+    @skipIf(sys.maxsize < BIG, 'needs 64-bit sizes')
+    def test_sparse(self):
+        # A sparse file reads as zeros without taking up memory or disk, so
+        # the binary value below spans more than 4 GB without being copied
+        with tempfile.TemporaryFile() as fp:
+            header = b'\x10B' + long_header(0xa0, BIG)
+            fp.write(header)
+            fp.truncate(len(header) + BIG)
+            fp.flush()
+            mm = mmap.mmap(fp.fileno(), 0, access=mmap.ACCESS_READ)
+            try:
+                view = memoryview(mm)
+                decoded = pbjson.loads(view, zero_copy=True)
+                self.assertIsInstance(decoded, memoryview)
+                self.assertEqual(len(decoded), BIG)
+                self.assertEqual(decoded[BIG - 1], 0)
+                del decoded
+                self.assertEqual(pbjson.encoded_size(view[len(header):]), BIG + 10)
+                self.assertRaises(pbjson.PBJSONDecodeError, pbjson.loads, view[:-1], zero_copy=True)
+                view.release()
+            finally:
+                mm.close()
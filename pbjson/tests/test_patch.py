@@ -0,0 +1,96 @@
+from io import BytesIO
+from unittest import TestCase
+
+import pbjson
+from pbjson import splice
+from pbjson.tests.test_decode import sample
+
+
+def changed(obj, path, value):
+    obj = pbjson.loads(pbjson.dumps(obj))
+    if not path:
+        return value
+    container = obj
+    for step in path[:-1]:
+        container = container[step]
+    container[path[-1]] = value
+    return obj
+
+
+def document():
+    return {
+        'users': [{'name': 'ann', 'role': 'admin'}, {'name': 'bob', 'role': 'user'}],
+        'stream': iter([1, {'name': 'carl'}]),
+        'roles': ['admin', 'user', 'admin'],
+        'count': 2,
+    }
+
+
+class TestPatch(TestCase):
+    def assertPatched(self, encoded, path, value):
+        expected = changed(pbjson.loads(encoded), path, value)
+        patched = pbjson.patch(encoded, path, value)
+        self.assertEqual(pbjson.loads(patched), expected)
+        if splice.c_splice is not None:
+            value = pbjson.dumps(value)
+            self.assertEqual(splice.c_splice(encoded, tuple(path), value), splice.py_splice(encoded, tuple(path), value))
+        return patched
+
+    def test_scalar(self):
+        encoded = pbjson.dumps(document())
+        patched = self.assertPatched(encoded, ('users', 1, 'name'), 'robert')
+        self.assertEqual(len(patched), len(encoded) + 3)
+        self.assertEqual(pbjson.patch(encoded, ('count',), 2), encoded)
+        self.assertPatched(encoded, ['roles', -1], None)
+        self.assertPatched(encoded, ('stream', 1, 'name'), 'carla')
+
+    def test_whole(self):
+        self.assertEqual(pbjson.patch(pbjson.dumps(document()), (), [1]), pbjson.dumps([1]))
+
+    def test_keys(self):
+        encoded = pbjson.dumps(document())
+        # New keys and keys that are no longer defined first where they were
+        self.assertPatched(encoded, ('users', 0), {'email': 'ann@example.com', 'role': 'admin'})
+        self.assertPatched(encoded, ('users',), [])
+        self.assertPatched(encoded, ('count',), {'name': 1, 'total': 2})
+        wide = dict(('key%d' % i, i) for i in range(200))
+        self.assertPatched(pbjson.dumps([wide, wide]), (0, 'key5'), {'extra': 1})
+
+    def test_value_refs(self):
+        encoded = pbjson.dumps(document(), value_refs=True)
+        # 'admin' is defined by the first user and referred to by roles
+        self.assertPatched(encoded, ('users', 0, 'role'), 'owner')
+        self.assertPatched(encoded, ('users', 0), 1)
+        self.assertPatched(encoded, ('roles', 1), 'guest')
+
+    def test_tables(self):
+        encoded = pbjson.dumps(document(), tables=True, value_refs=True)
+        self.assertPatched(encoded, ('users', 1, 'role'), {'name': 'guest'})
+        self.assertPatched(encoded, ('users', 0, 'role'), 'owner')
+        self.assertRaises(ValueError, pbjson.patch, encoded, ('users', 1), None)
+        self.assertRaises(KeyError, pbjson.patch, encoded, ('users', 1, 'email'), None)
+
+    def test_sample(self):
+        encoded = pbjson.dumps(sample, tables=True, value_refs=True)
+        for key in sorted(sample):
+            self.assertPatched(encoded, (key,), {'patched': [key]})
+
+    def test_compressed(self):
+        encoded = pbjson.dumps(document(), compress='zlib')
+        patched = pbjson.patch(encoded, ('count',), 3)
+        self.assertEqual(patched[:1], encoded[:1])
+        self.assertEqual(pbjson.load(BytesIO(patched))['count'], 3)
+
+    def test_errors(self):
+        encoded = pbjson.dumps(document())
+        self.assertRaises(KeyError, pbjson.patch, encoded, ('missing',), 1)
+        self.assertRaises(IndexError, pbjson.patch, encoded, ('users', 2), 1)
+        self.assertRaises(IndexError, pbjson.patch, encoded, ('stream', 2), 1)
+        self.assertRaises(TypeError, pbjson.patch, encoded, ('users', 'name'), 1)
+        self.assertRaises(TypeError, pbjson.patch, encoded, ('count', 0), 1)
+        self.assertRaises(TypeError, pbjson.patch, encoded, (0,), 1)
+        for end in range(len(encoded)):
+            try:
+                pbjson.patch(encoded[:end], ('roles', 2), 1)
+            except (ValueError, LookupError):
+                pass
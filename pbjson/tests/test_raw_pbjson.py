@@ -0,0 +1,81 @@
+from unittest import TestCase
+
+import pbjson
+from pbjson import RawPBJSON, splice
+from pbjson.tests.test_decode import sample
+
+
+def events(encoded):
+    return list(pbjson.parse_events(encoded))
+
+
+class TestRawPBJSON(TestCase):
+    body = [{'id': 1, 'name': 'alpha'}, {'id': 2, 'name': 'alpha'}]
+
+    def envelope(self, body):
+        return {'name': 'beta', 'body': body, 'after': {'id': 3, 'name': 'beta'}}
+
+    def test_embedded_as_is(self):
+        cached = pbjson.dumps(self.body, value_refs=True)
+        encoded = pbjson.dumps(self.envelope(RawPBJSON(cached)), value_refs=True)
+        self.assertIn(b'\x17' + cached, encoded)
+        self.assertEqual(pbjson.loads(encoded), self.envelope(self.body))
+        self.assertEqual(events(encoded), events(pbjson.dumps(self.envelope(self.body))))
+
+    def test_own_tables(self):
+        # The fragment numbers its keys and values from zero, and the
+        # document around it goes on with its own numbering afterwards
+        cached = pbjson.dumps({'name': 'gamma', 'id': 'gamma'}, value_refs=True)
+        encoded = pbjson.dumps([{'id': 'gamma'}, RawPBJSON(cached), {'id': 'gamma', 'name': 'gamma'}], value_refs=True)
+        self.assertTrue(encoded.endswith(b'\xe2\x80\x13\x00\x04name\x13\x00'))
+        expected = [{'id': 'gamma'}, {'name': 'gamma', 'id': 'gamma'}, {'id': 'gamma', 'name': 'gamma'}]
+        self.assertEqual(pbjson.loads(encoded), expected)
+        self.assertEqual(events(encoded), events(pbjson.dumps(expected)))
+
+    def test_nested(self):
+        inner = pbjson.dumps({'x': [1, 2]})
+        middle = pbjson.dumps({'y': RawPBJSON(inner), 'x': 'z'})
+        encoded = pbjson.dumps([RawPBJSON(middle), {'x': RawPBJSON(inner)}], tables=True)
+        expected = [{'y': {'x': [1, 2]}, 'x': 'z'}, {'x': {'x': [1, 2]}}]
+        self.assertEqual(pbjson.loads(encoded), expected)
+        self.assertEqual(pbjson.loads(pbjson.dumps(RawPBJSON(middle))), expected[0])
+        self.assertEqual(events(encoded), events(pbjson.dumps(expected)))
+
+    def test_table(self):
+        rows = [{'id': i, 'body': RawPBJSON(pbjson.dumps({'id': str(i)}))} for i in range(3)]
+        encoded = pbjson.dumps(rows, tables=True, value_refs=True)
+        self.assertEqual(encoded[:1], b'\x11')
+        self.assertEqual(pbjson.loads(encoded), [{'id': i, 'body': {'id': str(i)}} for i in range(3)])
+
+    def test_sample(self):
+        cached = pbjson.dumps(sample, tables=True, value_refs=True)
+        encoded = pbjson.dumps([sample, RawPBJSON(cached), sample], value_refs=True, compress='zlib')
+        self.assertEqual(pbjson.loads(encoded), pbjson.loads(pbjson.dumps([sample] * 3)))
+
+    def test_patch(self):
+        cached = pbjson.dumps(self.body, value_refs=True)
+        encoded = pbjson.dumps(self.envelope(RawPBJSON(cached)), value_refs=True)
+        for path, value in ((('body', 1, 'name'), 'gamma'), (('body', 0), {'new': 1}), (('body',), None),
+                            (('name',), 'renamed'), (('after', 'name'), RawPBJSON(cached))):
+            expected = self.envelope(pbjson.loads(cached))
+            container = expected
+            for step in path[:-1]:
+                container = container[step]
+            container[path[-1]] = pbjson.loads(pbjson.dumps(value))
+            patched = pbjson.patch(encoded, path, value)
+            self.assertEqual(pbjson.loads(patched), expected)
+            if splice.c_splice is not None:
+                value = pbjson.dumps(value)
+                self.assertEqual(splice.c_splice(encoded, path, value), splice.py_splice(encoded, path, value))
+        self.assertRaises(KeyError, pbjson.patch, encoded, ('body', 0, 'missing'), 1)
+
+    def test_invalid(self):
+        self.assertRaises(ValueError, RawPBJSON, b'')
+        self.assertRaises(ValueError, RawPBJSON, pbjson.dumps(self.body, compress='zlib'))
+        self.assertEqual(RawPBJSON(bytearray(b'\x02')).encoded_pbjson, b'\x02')
+        self.assertRaises(pbjson.PBJSONDecodeError, RawPBJSON, b'\xc2\x01')
+        self.assertRaises(pbjson.PBJSONDecodeError, RawPBJSON, b'\x17')
+        # Trailing bytes would be read as the enclosing document's next value
+        self.assertRaises(ValueError, RawPBJSON, pbjson.dumps({'a': 1}) + b'\x21\x05')
+        self.assertRaises(ValueError, RawPBJSON, b'\x17\x02\x02')
+        self.assertEqual(RawPBJSON(b'\x17\x02').encoded_pbjson, b'\x17\x02')
@@ -0,0 +1,106 @@
+from unittest import TestCase, main, skipIf
+
+import pbjson
+from pbjson.encoder import registered_classes
+
+try:
+    import dataclasses
+except ImportError:
+    dataclasses = None
+
+
+class Point(object):
+    __slots__ = ('y', 'x')
+
+    def __init__(self, x, y):
+        self.x = x
+        self.y = y
+
+
+class Point3(Point):
+    __slots__ = 'z'
+
+    def __init__(self, x, y, z):
+        Point.__init__(self, x, y)
+        self.z = z
+
+
+class Node(object):
+    def __init__(self, name, child=None):
+        self.name = name
+        self.child = child
+
+    @property
+    def kind(self):
+        return 'leaf' if self.child is None else 'branch'
+
+
+if dataclasses is not None:
+    @dataclasses.dataclass
+    class Record(object):
+        id: int
+        name: str
+        tags: list
+
+
+class TestRegisterClass(TestCase):
+    def setUp(self):
+        pbjson.register_class(Point)
+        pbjson.register_class(Point3)
+        pbjson.register_class(Node, fields=('name', 'kind', 'child'))
+
+    def tearDown(self):
+        for cls in (Point, Point3, Node):
+            registered_classes.pop(cls, None)
+        if dataclasses is not None:
+            registered_classes.pop(Record, None)
+
+    def test_slots(self):
+        self.assertEqual(pbjson.dumps({'y': 2, 'x': 1}), pbjson.dumps(Point(1, 2)))
+        self.assertEqual(pbjson.dumps([{'y': 2, 'x': 1, 'z': 3}, {'y': 5, 'x': 4}]), pbjson.dumps([Point3(1, 2, 3), Point(4, 5)]))
+        decoded = pbjson.loads(pbjson.dumps([Point(1, 2), Point(3, 4)]), schema=Point)
+        self.assertEqual([(1, 2), (3, 4)], [(p.x, p.y) for p in decoded])
+
+    def test_fields(self):
+        tree = Node('root', Node('leaf'))
+        expected = {'name': 'root', 'kind': 'branch', 'child': {'name': 'leaf', 'kind': 'leaf', 'child': None}}
+        self.assertEqual(pbjson.dumps(expected), pbjson.dumps(tree))
+
+    @skipIf(dataclasses is None, 'dataclasses is not available')
+    def test_dataclass(self):
+        pbjson.register_class(Record)
+        records = [Record(i, 'row {}'.format(i), ['a'] * i) for i in range(3)]
+        self.assertEqual(pbjson.dumps([dataclasses.asdict(r) for r in records]), pbjson.dumps(records))
+
+    def test_sort_keys(self):
+        expected = pbjson.dumps({'x': 1, 'y': 2}, sort_keys=True)
+        self.assertEqual(expected, pbjson.dumps(Point(1, 2), sort_keys=True))
+        self.assertEqual(expected, pbjson.canonical_dumps(Point(1, 2), digest=None))
+        self.assertEqual(pbjson.dumps({'y': 2, 'x': 1}, sort_keys=lambda kv: -kv[1]), pbjson.dumps(Point(1, 2), sort_keys=lambda kv: -kv[1]))
+
+    def test_unregistered(self):
+        class Other(Point):
+            __slots__ = ()
+        self.assertRaises(TypeError, pbjson.dumps, Other(1, 2))
+        self.assertEqual(pbjson.dumps([1, 2]), pbjson.dumps(Other(1, 2), convert=lambda p: [p.x, p.y]))
+        # A custom handler takes precedence over the registration
+        self.assertEqual(pbjson.dumps([Point(1, 2)], custom=(Point, lambda p: p.x))[-3:], b'\x0e\x21\x01')
+
+    def test_errors(self):
+        self.assertRaises(TypeError, pbjson.register_class, Point(1, 2))
+        self.assertRaises(ValueError, pbjson.register_class, object)
+        self.assertRaises(ValueError, pbjson.register_class, Node, fields=('name', 'name'))
+        self.assertRaises(TypeError, pbjson.register_class, Node, fields=(1,))
+        self.assertRaises(ValueError, pbjson.register_class, Node, fields=('x' * 128,))
+        unset = Point.__new__(Point)
+        self.assertRaises(AttributeError, pbjson.dumps, unset)
+
+    def test_circular(self):
+        node = Node('loop')
+        node.child = node
+        self.assertRaises(ValueError, pbjson.dumps, node)
+        self.assertRaises((ValueError, RecursionError), pbjson.dumps, node, check_circular=False)
+
+
+if __name__ == '__main__':
+    main()
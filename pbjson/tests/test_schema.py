@@ -0,0 +1,149 @@
+import io
+from unittest import TestCase, main, skipIf
+
+import pbjson
+from pbjson.decoder import prepare_schema
+
+try:
+    import dataclasses
+except ImportError:
+    dataclasses = None
+
+
+class Point(object):
+    __slots__ = ('x', 'y')
+
+    def __init__(self, x, y):
+        raise AssertionError('__init__ is not called')
+
+
+class Point3(Point):
+    __slots__ = 'z'
+
+
+class Wide(object):
+    __slots__ = tuple('f{}'.format(i) for i in range(40))
+
+
+class Drip(io.RawIOBase):
+    """A raw stream that returns one byte per read"""
+
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def readable(self):
+        return True
+
+    def readinto(self, b):
+        if self.pos >= len(self.data) or not len(b):
+            return 0
+        b[0] = self.data[self.pos]
+        self.pos += 1
+        return 1
+
+
+if dataclasses is not None:
+    @dataclasses.dataclass
+    class Record(object):
+        id: int
+        name: str
+        tags: list
+
+        def __post_init__(self):
+            raise AssertionError('__post_init__ is not called')
+
+    @dataclasses.dataclass(frozen=True)
+    class Frozen(object):
+        a: int
+        b: int
+
+
+class TestSchema(TestCase):
+    def test_slots(self):
+        decoded = pbjson.loads(pbjson.dumps({'y': 2, 'x': 1}), schema=Point)
+        self.assertIsInstance(decoded, Point)
+        self.assertEqual((1, 2), (decoded.x, decoded.y))
+
+    def test_inherited_slots(self):
+        decoded = pbjson.loads(pbjson.dumps([{'x': 1, 'y': 2, 'z': 3}, {'x': 4, 'y': 5}]), schema=[Point, Point3])
+        self.assertIs(Point3, type(decoded[0]))
+        self.assertEqual((1, 2, 3), (decoded[0].x, decoded[0].y, decoded[0].z))
+        self.assertIs(Point, type(decoded[1]))
+        self.assertEqual((4, 5), (decoded[1].x, decoded[1].y))
+
+    @skipIf(dataclasses is None, 'dataclasses is not available')
+    def test_dataclass(self):
+        encoded = pbjson.dumps({'records': [{'id': 1, 'name': 'one', 'tags': ['a']}, {'id': 2, 'name': 'two', 'tags': []}]})
+        decoded = pbjson.loads(encoded, schema=Record)
+        self.assertEqual(['records'], list(decoded))
+        self.assertEqual([1, 2], [record.id for record in decoded['records']])
+        self.assertEqual(['one', 'two'], [record.name for record in decoded['records']])
+        self.assertEqual([['a'], []], [record.tags for record in decoded['records']])
+
+    @skipIf(dataclasses is None, 'dataclasses is not available')
+    def test_frozen(self):
+        decoded = pbjson.loads(pbjson.dumps([{'a': 1, 'b': 2}]), schema=Frozen)
+        self.assertEqual([Frozen(1, 2)], decoded)
+
+    def test_nested(self):
+        encoded = pbjson.dumps({'x': {'x': 1, 'y': 2}, 'y': [{'y': 4, 'x': 3}]})
+        decoded = pbjson.loads(encoded, schema=Point)
+        self.assertIsInstance(decoded, Point)
+        self.assertEqual((1, 2), (decoded.x.x, decoded.x.y))
+        self.assertEqual((3, 4), (decoded.y[0].x, decoded.y[0].y))
+
+    def test_unmatched(self):
+        documents = [{'x': 1}, {'x': 1, 'y': 2, 'w': 3}, {'x': 1, 'w': 2}, {}, {'a': {'x': 1, 'y': 2}}]
+        decoded = pbjson.loads(pbjson.dumps(documents), schema=Point)
+        self.assertEqual(documents[:4], decoded[:4])
+        self.assertIsInstance(decoded[4]['a'], Point)
+        decoded = pbjson.loads(pbjson.dumps(documents), schema=Point, object_pairs_hook=tuple)
+        self.assertEqual((('x', 1),), decoded[0])
+
+    def test_repeated_key(self):
+        # Keys are not checked for repeats when encoding
+        encoded = b'\xe2\x01x\x21\x01\x80\x21\x02'
+        self.assertEqual({'x': 2}, pbjson.loads(encoded))
+        self.assertEqual({'x': 2}, pbjson.loads(encoded, schema=Point))
+
+    def test_wide(self):
+        document = dict(('f{}'.format(i), i) for i in range(40))
+        decoded = pbjson.loads(pbjson.dumps([document, document]), schema=Wide)
+        self.assertEqual(list(range(40)), [getattr(decoded[1], 'f{}'.format(i)) for i in range(40)])
+
+    def test_streamed(self):
+        # Whether an object becomes a record must not depend on how much of
+        # the stream happens to be buffered
+        document = dict(('f{}'.format(i), i) for i in range(40))
+        encoded = pbjson.dumps({'a': document, 'b': [document]})
+        for fp in (io.BytesIO(encoded), Drip(encoded)):
+            decoded = pbjson.load(fp, schema=Wide)
+            self.assertIsInstance(decoded['a'], Wide)
+            self.assertIsInstance(decoded['b'][0], Wide)
+            self.assertEqual(39, decoded['b'][0].f39)
+        self.assertRaises(pbjson.PBJSONDecodeError, pbjson.load, Drip(b'\xff\xff\xff\xff\xff\x01a\x01'), schema=Wide)
+
+    def test_tables(self):
+        rows = [{'x': i, 'y': -i} for i in range(5)]
+        encoded = pbjson.dumps(rows, tables=True)
+        decoded = pbjson.loads(encoded, schema=Point)
+        self.assertEqual([(i, -i) for i in range(5)], [(p.x, p.y) for p in decoded])
+        self.assertEqual({'x': list(range(5)), 'y': [-i for i in range(5)]}, pbjson.loads(encoded, columnar=True, schema=Point))
+        rows = [{'x': i, 'w': i} for i in range(5)]
+        self.assertEqual(rows, pbjson.loads(pbjson.dumps(rows, tables=True), schema=Point))
+
+    def test_prepare(self):
+        self.assertIs(prepare_schema(Point), prepare_schema(Point))
+        classes, lookup = prepare_schema([Point, Point3])
+        self.assertEqual({'x': (0, 0), 'y': (1, 1), 'z': (-1, 2)}, lookup)
+        self.assertEqual([2, 3], [entry[1] for entry in classes])
+        self.assertRaises(TypeError, prepare_schema, object)
+        self.assertRaises(TypeError, prepare_schema, [Point, 1])
+        self.assertRaises(ValueError, prepare_schema, [Point, Point])
+        self.assertRaises(ValueError, prepare_schema, [])
+        self.assertRaises(TypeError, pbjson.decoder.decode, pbjson.dumps({}), None, None, None, 'strict', schema=Point)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,69 @@
+from decimal import Decimal
+from unittest import TestCase, main
+
+import pbjson
+
+
+class Point(object):
+    def __init__(self, x, y):
+        self.x = x
+        self.y = y
+
+
+class TestStats(TestCase):
+    def setUp(self):
+        if not pbjson._has_encoder_speedups() or not pbjson.stats():
+            self.skipTest('counters need the C extension')
+        self.was_enabled = pbjson.enable_stats()
+        pbjson.stats(reset=True)
+
+    def tearDown(self):
+        pbjson.enable_stats(self.was_enabled)
+
+    def test_bytes(self):
+        encoded = pbjson.dumps({'a': [1, 2, 3], 'b': 'text'})
+        pbjson.loads(encoded)
+        counters = pbjson.stats()
+        self.assertEqual(len(encoded), counters['bytes_encoded'])
+        self.assertEqual(len(encoded), counters['bytes_decoded'])
+        self.assertEqual(1, counters['chunk_flushes'])
+
+    def test_reset(self):
+        pbjson.dumps('text')
+        self.assertEqual(5, pbjson.stats(reset=True)['bytes_encoded'])
+        self.assertEqual(0, pbjson.stats()['bytes_encoded'])
+
+    def test_disabled(self):
+        pbjson.enable_stats(False)
+        pbjson.dumps('text')
+        self.assertEqual(0, pbjson.stats()['bytes_encoded'])
+
+    def test_key_memo(self):
+        pbjson.dumps([{'a': 1, 'b': 2}, {'a': 3, 'b': 4}])
+        counters = pbjson.stats(reset=True)
+        self.assertEqual(2, counters['key_memo_misses'])
+        self.assertEqual(2, counters['key_memo_hits'])
+        self.assertEqual(0, counters['key_memo_overflows'])
+        pbjson.dumps(dict(('k{}'.format(i), i) for i in range(130)))
+        counters = pbjson.stats()
+        self.assertEqual(130, counters['key_memo_misses'])
+        self.assertEqual(2, counters['key_memo_overflows'])
+
+    def test_fallbacks(self):
+        pbjson.dumps([Point(1, 2), Decimal('1.5')], custom=(Point, lambda p: [p.x, p.y]))
+        pbjson.dumps(Point(3, 4), convert=lambda p: [p.x, p.y])
+        pbjson.dumps(iter([1, 2]))
+        counters = pbjson.stats()
+        self.assertEqual(1, counters['custom_calls'])
+        self.assertEqual(1, counters['convert_calls'])
+        self.assertEqual(1, counters['terminated_lists'])
+
+    def test_bigint(self):
+        pbjson.loads(pbjson.dumps([1 << 40, 1 << 70, -(1 << 80)]))
+        counters = pbjson.stats()
+        self.assertEqual(2, counters['bigint_encodes'])
+        self.assertEqual(2, counters['bigint_decodes'])
+
+
+if __name__ == '__main__':
+    main()
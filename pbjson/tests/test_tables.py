@@ -0,0 +1,74 @@
+from collections import OrderedDict
+from unittest import TestCase, main
+
+import pbjson
+
+countries = [
+    {"code": "us", "name": "United States"},
+    {"code": "ca", "name": "Canada"},
+    {"code": "mx", "name": "Mexico"}
+]
+
+
+class TestTables(TestCase):
+    def test_encode(self):
+        self.assertEqual(b'\x11\xc3\xe2\x04code\x04name\x82us\x8dUnited States\x82ca\x86Canada\x82mx\x86Mexico', pbjson.dumps(countries, tables=True))
+
+    def test_default_is_list(self):
+        self.assertEqual(b'\xc3', pbjson.dumps(countries)[:1])
+
+    def test_keys_are_remembered(self):
+        encoded = pbjson.dumps({'countries': countries, 'more': {'code': 'fr'}}, sort_keys=True, tables=True)
+        self.assertEqual(b'\xe2\x09countries\x11\xc3\xe2\x04code\x04name\x82us\x8dUnited States\x82ca\x86Canada\x82mx\x86Mexico\x04more\xe1\x81\x82fr', encoded)
+        self.assertEqual({'countries': countries, 'more': {'code': 'fr'}}, pbjson.loads(encoded))
+
+    def test_sort_keys(self):
+        rows = [{'b': 1, 'a': 2}, {'a': 3, 'b': 4}]
+        self.assertEqual(b'\x11\xc2\xe2\x01a\x01b\x21\x02\x21\x01\x21\x03\x21\x04', pbjson.dumps(rows, sort_keys=True, tables=True))
+
+    def test_decode(self):
+        self.assertEqual(countries, pbjson.loads(pbjson.dumps(countries, tables=True)))
+
+    def test_decode_columnar(self):
+        decoded = pbjson.loads(pbjson.dumps(countries, tables=True), columnar=True)
+        self.assertEqual({'code': ['us', 'ca', 'mx'], 'name': ['United States', 'Canada', 'Mexico']}, decoded)
+
+    def test_document_class(self):
+        decoded = pbjson.loads(pbjson.dumps(countries, tables=True), document_class=OrderedDict)
+        self.assertEqual(countries, decoded)
+        self.assertIsInstance(decoded[0], OrderedDict)
+        self.assertEqual(['code', 'name'], list(decoded[2]))
+
+    def test_object_pairs_hook(self):
+        encoded = pbjson.dumps(countries, tables=True)
+        decoded = pbjson.loads(encoded, object_pairs_hook=tuple)
+        self.assertEqual((('code', 'us'), ('name', 'United States')), decoded[0])
+        self.assertEqual(3, len(decoded))
+        decoded = pbjson.loads(encoded, columnar=True, object_pairs_hook=OrderedDict)
+        self.assertIsInstance(decoded, OrderedDict)
+        self.assertEqual(['code', 'name'], list(decoded))
+        self.assertEqual(['us', 'ca', 'mx'], decoded['code'])
+
+    def test_not_a_table(self):
+        for rows in ([{'a': 1}], [{'a': 1}, {'b': 1}], [{'a': 1}, {'a': 1, 'b': 2}], [{'a': 1}, 3], [{}, {}]):
+            self.assertNotEqual(b'\x11', pbjson.dumps(rows, tables=True)[:1])
+
+    def test_nested(self):
+        rows = [{'id': i, 'tags': [{'k': 'x', 'v': i}, {'k': 'y', 'v': -i}]} for i in range(5)]
+        encoded = pbjson.dumps(rows, tables=True)
+        self.assertEqual(rows, pbjson.loads(encoded))
+        self.assertLess(len(encoded), len(pbjson.dumps(rows)))
+
+    def test_circular(self):
+        row = {'a': 1}
+        rows = [row, {'a': 2}]
+        row['a'] = rows
+        self.assertRaises(ValueError, pbjson.dumps, rows, tables=True)
+
+    def test_invalid(self):
+        self.assertRaises(ValueError, pbjson.loads, b'\x11\xc2\xe0')
+        self.assertRaises(ValueError, pbjson.loads, b'\x11\xcf\xe1\x01a\x01')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,83 @@
+import ctypes
+from array import array
+from unittest import TestCase, main
+
+import pbjson
+
+
+class TestTypedArray(TestCase):
+    def test_encode_doubles(self):
+        self.assertEqual(b'\x10d\xb0\x10\x00\x00\x00\x00\x00\x00\xf8?\x00\x00\x00\x00\x00\x00\x04@', pbjson.dumps(array('d', [1.5, 2.5])))
+
+    def test_encode_empty(self):
+        self.assertEqual(b'\x10i\xa0', pbjson.dumps(array('i')))
+
+    def test_roundtrip(self):
+        for code in 'bBhHiIqQfd':
+            values = array(code, [0, 1, 2, 100, 127])
+            decoded = pbjson.loads(pbjson.dumps(values))
+            self.assertIsInstance(decoded, array)
+            self.assertEqual(values, decoded)
+
+    def test_platform_sized_codes(self):
+        values = array('l', [-1, 2, 3])
+        decoded = pbjson.loads(pbjson.dumps(values))
+        self.assertEqual(values.itemsize, decoded.itemsize)
+        self.assertEqual(values.tolist(), decoded.tolist())
+
+    def test_zero_copy(self):
+        encoded = pbjson.dumps({'samples': array('f', [0.5, 1.5])})
+        decoded = pbjson.loads(encoded, zero_copy=True)['samples']
+        self.assertIsInstance(decoded, memoryview)
+        self.assertEqual('f', decoded.format)
+        self.assertEqual([0.5, 1.5], decoded.tolist())
+
+    def test_memoryview(self):
+        view = memoryview(array('H', range(10)))
+        self.assertEqual(pbjson.dumps(array('H', range(10))), pbjson.dumps(view))
+
+    def test_non_contiguous(self):
+        view = memoryview(array('q', range(10)))[::3]
+        self.assertEqual(array('q', [0, 3, 6, 9]), pbjson.loads(pbjson.dumps(view)))
+
+    def test_bytearray(self):
+        self.assertEqual(b'\xa3abc', pbjson.dumps(bytearray(b'abc')))
+        self.assertEqual({'frame': b'\x00\xff' * 5000}, pbjson.loads(pbjson.dumps({'frame': bytearray(b'\x00\xff' * 5000)})))
+
+    def test_byte_views(self):
+        self.assertEqual(b'\xa3abc', pbjson.dumps(memoryview(b'abc')))
+        self.assertEqual(b'\xa2ac', pbjson.dumps(memoryview(bytearray(b'abc'))[::2]))
+        self.assertEqual(b'\xa2ab', pbjson.dumps(memoryview(b'abc').cast('c')[:2]))
+        self.assertEqual(b'\x10b\xa3abc', pbjson.dumps(memoryview(b'abc').cast('b')))
+        self.assertEqual(b'\x10B\xa3abc', pbjson.dumps(array('B', b'abc')))
+        data = bytes(bytearray(range(256))) * 64
+        for view in (memoryview(data)[1::3], memoryview(data)[::-1], memoryview(data).cast('B', (128, 128))):
+            self.assertEqual(view.tobytes(), pbjson.loads(pbjson.dumps([view]))[0])
+
+    def test_untyped_format(self):
+        class Pair(ctypes.LittleEndianStructure):
+            _fields_ = [('a', ctypes.c_int16), ('b', ctypes.c_int16)]
+        values = (Pair * 2)(Pair(1, 2), Pair(3, 4))
+        self.assertEqual(b'\xa8\x01\x00\x02\x00\x03\x00\x04\x00', pbjson.dumps(values))
+        self.assertEqual(b'\xa6' + b'\x00' * 6, pbjson.dumps(memoryview(b'\x00' * 6).cast('B', (2, 3))))
+
+    def test_char_and_bool_formats(self):
+        # There is no typed array code for chars or bools, so they are binary
+        # rather than changing element type to unsigned bytes
+        self.assertEqual(b'\xa3\x01\x00\x01', pbjson.dumps((ctypes.c_bool * 3)(True, False, True)))
+        self.assertEqual(b'\xa2ab', pbjson.dumps((ctypes.c_char * 2)(b'a', b'b')))
+        self.assertEqual(b'\xa2\x00\x01', pbjson.dumps(memoryview(b'\x00\x01').cast('?')))
+        self.assertEqual(b'ab', pbjson.loads(pbjson.dumps((ctypes.c_char * 2)(b'a', b'b'))))
+
+    def test_big_endian_format(self):
+        values = (ctypes.c_uint16.__ctype_be__ * 3)(1, 2, 0x1234)
+        self.assertEqual(b'\x10H\xa6\x01\x00\x02\x00\x34\x12', pbjson.dumps(values))
+        self.assertEqual(array('H', [1, 2, 0x1234]), pbjson.loads(pbjson.dumps(values)))
+
+    def test_invalid(self):
+        self.assertRaises(ValueError, pbjson.loads, b'\x10z\xa0')
+        self.assertRaises(ValueError, pbjson.loads, b'\x10d\xa3abc')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,48 @@
+from unittest import TestCase, main
+
+import pbjson
+
+countries = [
+    {"code": "us", "name": "United States"},
+    {"code": "ca", "name": "Canada"},
+    {"code": "us", "name": "United States"}
+]
+
+
+class TestValueRefs(TestCase):
+    def test_encode(self):
+        self.assertEqual(b'\xc3\x12\x83foo\x82ba\x13\x00', pbjson.dumps(['foo', 'ba', 'foo'], value_refs=True))
+
+    def test_default_is_off(self):
+        self.assertEqual(b'\xc2\x83foo\x83foo', pbjson.dumps(['foo', 'foo']))
+
+    def test_dict_values(self):
+        encoded = pbjson.dumps(countries, value_refs=True)
+        self.assertEqual(b'\xc3\xe2\x04code\x82us\x04name\x12\x8dUnited States\xe2\x80\x82ca\x81\x12\x86Canada\xe2\x80\x82us\x81\x13\x00', encoded)
+        self.assertEqual(countries, pbjson.loads(encoded))
+
+    def test_same_object(self):
+        decoded = pbjson.loads(pbjson.dumps(countries, value_refs=True))
+        self.assertIs(decoded[0]['name'], decoded[2]['name'])
+
+    def test_keys_are_separate(self):
+        self.assertEqual({'abc': 'abc'}, pbjson.loads(pbjson.dumps({'abc': 'abc'}, value_refs=True)))
+
+    def test_wide_index(self):
+        values = ['value %d' % i for i in range(300)] * 2
+        encoded = pbjson.dumps(values, value_refs=True)
+        self.assertEqual(b'\x14\x01\x2b', encoded[-3:])
+        self.assertEqual(values, pbjson.loads(encoded))
+
+    def test_with_tables(self):
+        encoded = pbjson.dumps(countries, value_refs=True, tables=True)
+        self.assertEqual(countries, pbjson.loads(encoded))
+
+    def test_invalid(self):
+        self.assertRaises(ValueError, pbjson.loads, b'\x13\x00')
+        self.assertRaises(ValueError, pbjson.loads, b'\xc2\x12\x83foo\x13\x01')
+        self.assertRaises(ValueError, pbjson.loads, b'\x12\x21\x01')
+
+
+if __name__ == '__main__':
+    main()
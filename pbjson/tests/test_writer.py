@@ -0,0 +1,144 @@
+from io import BytesIO
+from unittest import TestCase
+
+import pbjson
+from pbjson import PBJSONWriter, RawPBJSON, encoder, splice
+from pbjson.tests.test_decode import sample
+
+
+def events(encoded):
+    return list(pbjson.parse_events(encoded))
+
+
+class TestWriter(TestCase):
+    def written(self, build, **kw):
+        fp = BytesIO()
+        with PBJSONWriter(fp, **kw) as writer:
+            build(writer)
+        return fp.getvalue()
+
+    def test_sized(self):
+        # Sized containers are written exactly as dumps writes them
+        def build(writer):
+            writer.begin_dict(2)
+            writer.key('name')
+            writer.value('toast')
+            writer.key('rows')
+            writer.begin_list(2)
+            writer.value({'id': 1, 'name': 'a'})
+            writer.value(sample)
+            writer.end()
+            writer.end()
+        expected = {'name': 'toast', 'rows': [{'id': 1, 'name': 'a'}, sample]}
+        self.assertEqual(self.written(build), pbjson.dumps(expected))
+        self.assertEqual(self.written(build, value_refs=True, tables=True), pbjson.dumps(expected, value_refs=True, tables=True))
+
+    def test_unsized(self):
+        def build(writer):
+            writer.begin_dict()
+            writer.key('rows')
+            writer.begin_list()
+            for i in range(3):
+                writer.value({'id': i, 'name': 'same name'})
+            writer.end()
+            writer.key('empty')
+            writer.begin_dict()
+            writer.end()
+            writer.end()
+        encoded = self.written(build, value_refs=True)
+        self.assertEqual(encoded[:7], b'\x0d\x04rows\x0c')
+        self.assertTrue(encoded.endswith(b'\x0f\x05empty\x0d\x0f\x0f'))
+        expected = {'rows': [{'id': i, 'name': 'same name'} for i in range(3)], 'empty': {}}
+        self.assertEqual(pbjson.loads(encoded), expected)
+        self.assertEqual(pbjson.loads(encoded, object_pairs_hook=list), [('rows', [[('id', i), ('name', 'same name')] for i in range(3)]), ('empty', [])])
+        self.assertEqual(events(encoded), events(pbjson.dumps(expected)))
+        self.assertEqual(pbjson.loads(pbjson.patch(encoded, ('rows', 2, 'name'), 'other')), dict(expected, rows=expected['rows'][:2] + [{'id': 2, 'name': 'other'}]))
+        self.assertEqual(pbjson.loads(pbjson.patch(encoded, ('empty',), {'new': 1})), dict(expected, empty={'new': 1}))
+        self.assertRaises(KeyError, pbjson.patch, encoded, ('missing',), 1)
+        if splice.c_splice is not None:
+            self.assertEqual(splice.c_splice(encoded, ('rows', 1), b'\x02'), splice.py_splice(encoded, ('rows', 1), b'\x02'))
+            self.assertEqual(splice.c_splice(encoded, ('rows', 0, 'name'), b'\x81x'), splice.py_splice(encoded, ('rows', 0, 'name'), b'\x81x'))
+
+    def test_shared_tables(self):
+        # Keys and values written in separate calls refer back to each other
+        def build(writer):
+            writer.begin_list()
+            writer.value({'name': 'repeated'})
+            writer.begin_dict(1)
+            writer.key('name')
+            writer.value('repeated')
+            writer.end()
+            writer.end()
+        self.assertEqual(self.written(build, value_refs=True), b'\x0c\xe1\x04name\x12\x88repeated\xe1\x80\x13\x00\x0f')
+
+    def test_buffered(self):
+        chunks = []
+
+        class Sink(object):
+            write = chunks.append
+
+        writer = PBJSONWriter(Sink())
+        writer.begin_list()
+        for i in range(20000):
+            writer.value(i)
+        self.assertTrue(chunks)
+        self.assertTrue(max(map(len, chunks)) <= encoder.BUFFER_SIZE)
+        written = len(chunks)
+        writer.value('tail')
+        writer.flush()
+        self.assertEqual(len(chunks), written + 1)
+        writer.end()
+        writer.close()
+        self.assertEqual(pbjson.loads(b''.join(chunks)), list(range(20000)) + ['tail'])
+
+    def test_options(self):
+        def build(writer):
+            writer.begin_list()
+            writer.value({'b': 1, 'a': 1j})
+            writer.value(RawPBJSON(pbjson.dumps({'a': 2})))
+            writer.end()
+        encoded = self.written(build, sort_keys=True, convert=lambda o: [o.real, o.imag], compress='zlib')
+        self.assertEqual(encoded[:1], b'\x15')
+        self.assertEqual(pbjson.loads(encoded), [{'a': [0.0, 1.0], 'b': 1}, {'a': 2}])
+        self.assertEqual(self.written(lambda writer: writer.value(sample)), pbjson.dumps(sample))
+
+    def test_misuse(self):
+        writer = PBJSONWriter(BytesIO())
+        self.assertRaises(ValueError, writer.end)
+        self.assertRaises(ValueError, writer.key, 'a')
+        self.assertRaises(ValueError, writer.close)
+        self.assertRaises(ValueError, writer.begin_list, -1)
+        writer.begin_dict(1)
+        self.assertRaises(ValueError, writer.value, 1)
+        self.assertRaises(ValueError, writer.end)
+        writer.key('a')
+        self.assertRaises(ValueError, writer.key, 'b')
+        self.assertRaises(ValueError, writer.end)
+        writer.begin_list(1)
+        writer.value(1)
+        self.assertRaises(ValueError, writer.value, 2)
+        writer.end()
+        self.assertRaises(ValueError, writer.key, 'b')
+        writer.end()
+        self.assertRaises(ValueError, writer.value, 3)
+        writer.close()
+        writer.close()
+        self.assertRaises(ValueError, writer.value, 3)
+
+    def test_failure(self):
+        fp = BytesIO()
+        writer = PBJSONWriter(fp)
+        writer.begin_list()
+        self.assertRaises(TypeError, writer.value, [1, 1j])
+        self.assertRaises(ValueError, writer.value, 1)
+        self.assertRaises(ValueError, writer.close)
+        with self.assertRaises(KeyError):
+            with PBJSONWriter(fp) as writer:
+                writer.begin_list()
+                raise KeyError
+        self.assertRaises(ValueError, writer.end)
+
+    def test_invalid(self):
+        for encoded in (b'\x0d\x01a\x02', b'\x0d\x01a', b'\x0d\x0c\x0f'):
+            self.assertRaises(pbjson.PBJSONDecodeError, pbjson.loads, encoded)
+            self.assertRaises(pbjson.PBJSONDecodeError, events, encoded)
@@ -12,10 +12,37 @@ NAN = 5
 Enc_NAN = b'\x05'
 TERMINATED_LIST = 0x0c
 Enc_TERMINATED_LIST = b'\x0c'
+TERMINATED_DICT = 0x0d
+Enc_TERMINATED_DICT = b'\x0d'
 CUSTOM = 0x0e
 Enc_CUSTOM = b'\x0e'
 TERMINATOR = 0x0f
 Enc_TERMINATOR = b'\x0f'
+TYPED_ARRAY = 0x10
+Enc_TYPED_ARRAY = b'\x10'
+TABLE = 0x11
+Enc_TABLE = b'\x11'
+VALUE_DEF = 0x12
+Enc_VALUE_DEF = b'\x12'
+VALUE_REF = 0x13
+Enc_VALUE_REF = b'\x13'
+VALUE_REF16 = 0x14
+Enc_VALUE_REF16 = b'\x14'
+COMPRESSED = 0x15
+Enc_COMPRESSED = b'\x15'
+EXT = 0x16
+Enc_EXT = b'\x16'
+FRAGMENT = 0x17
+Enc_FRAGMENT = b'\x17'
+# Before a string, binary, list or dict token with all its length bits set,
+# whose length then takes eight bytes instead of four
+LONG_LENGTH = 0x18
+Enc_LONG_LENGTH = b'\x18'
+
+# Strings with this many UTF-8 bytes are candidates for value references
+VALUE_REF_MIN = 3
+VALUE_REF_MAX = 127
+VALUE_REF_LIMIT = 0x10000
 INT = 0x20
 NEGINT = 0x40
 FLOAT = 0x60
@@ -24,6 +51,20 @@ BINARY = 0xA0
 LIST = 0xC0
 DICT = 0xE0
 
+# Typed array element codes are array module typecodes with fixed sizes
+typed_array_itemsize = {
+    'b': 1,
+    'B': 1,
+    'h': 2,
+    'H': 2,
+    'i': 4,
+    'I': 4,
+    'q': 8,
+    'Q': 8,
+    'f': 4,
+    'd': 8,
+}
+
 FltEnc_Plus = 0xa
 FltEnc_Minus = 0xb
 FltEnc_Decimal = 0xd
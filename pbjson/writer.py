@@ -0,0 +1,163 @@
+from __future__ import absolute_import
+
+__author__ = 'Scott Maxwell'
+
+# noinspection PyStatementEffect
+"""Writing a Packed Binary JSON document a piece at a time
+
+A PBJSONWriter streams a document whose structure is only known as it is
+produced, such as rows from a database cursor, without building the lists
+and dicts first. Containers opened without a size are written as terminated
+lists and dicts. The key table and remembered values are shared by the whole
+document, as they would be by dumps, and output goes to the file a buffer at
+a time.
+"""
+
+from decimal import Decimal
+from . import compression
+from . import encoder
+from . import extensions as ext
+from .compat import Mapping, integer_types
+from .tokens import *
+
+__all__ = ['PBJSONWriter']
+
+
+class PBJSONWriter(object):
+    """Write one document to the binary file-like object fp through calls
+    to begin_list, begin_dict, key, value and end, then close. The options
+    are those of :func:`pbjson.dump`.
+
+    Calls out of order, such as a value in a dict without a key first or
+    ending a sized container before all its items are written, raise
+    ValueError and leave the document as it was. Any other exception, such
+    as a TypeError for a value that cannot be encoded, may leave part of a
+    value written, so the writer then refuses every further call.
+
+    As a context manager, the writer is closed on leaving the block unless
+    an exception is raised in it. The file itself is left open.
+    """
+
+    def __init__(self, fp, skip_illegal_keys=False, check_circular=True, sort_keys=False, custom=None, convert=None, use_for_json=False, tables=False, value_refs=False, compress=None, extensions=False):
+        write = fp.write
+        self._compressor = None
+        if compress:
+            self._compressor = compression.CompressedWriter(write, compression.get_codec(compress))
+            write = self._compressor.write
+        self._session = encoder.encoder_session(write, Decimal, Mapping, skip_illegal_keys, check_circular, encoder._item_sort_key(sort_keys), custom, convert or encoder.default_converter, use_for_json, tables=tables, value_refs=value_refs, classes=encoder.registered_classes, extensions=ext.encoders if extensions else None)
+        # Each open container is [DICT or LIST, items left or None if
+        # unsized, key written]
+        self._stack = []
+        self._started = False
+        self._failed = False
+        self._closed = False
+
+    def begin_list(self, size=None):
+        """Open a list of size items, or a terminated list if size is None"""
+        self._open(LIST, size)
+
+    def begin_dict(self, size=None):
+        """Open a dict of size items, or a terminated dict if size is None"""
+        self._open(DICT, size)
+
+    def key(self, name):
+        """Write the key of the next value in the open dict"""
+        self._check()
+        frame = self._stack[-1] if self._stack else None
+        if frame is None or frame[0] != DICT:
+            raise ValueError('key() outside a dict')
+        if frame[2]:
+            raise ValueError('key() twice without a value')
+        if frame[1] == 0:
+            raise ValueError('the dict already has all its items')
+        self._call(self._session.key, name)
+        if frame[1] is not None:
+            frame[1] -= 1
+        frame[2] = True
+
+    def value(self, obj):
+        """Write a whole value, encoded as dumps would encode it"""
+        self._next()
+        self._call(self._session.value, obj)
+
+    def end(self):
+        """Close the innermost open list or dict"""
+        self._check()
+        if not self._stack:
+            raise ValueError('end() without an open list or dict')
+        token, remaining, key_written = self._stack[-1]
+        if key_written:
+            raise ValueError('end() after a key without a value')
+        if remaining:
+            raise ValueError('end() with {} items of the {} still to write'.format(remaining, 'dict' if token == DICT else 'list'))
+        if remaining is None:
+            self._call(self._session.token, Enc_TERMINATOR)
+        self._stack.pop()
+
+    def flush(self):
+        """Pass the output buffered so far to the file, or to the compressor,
+        which holds on to what it has not yet compressed until close"""
+        self._check()
+        self._call(self._session.flush)
+
+    def close(self):
+        """Finish the document, raising ValueError if it is incomplete"""
+        if self._closed:
+            return
+        self._check()
+        if self._stack or not self._started:
+            raise ValueError('the document is incomplete')
+        self._call(self._session.flush)
+        if self._compressor is not None:
+            self._call(self._compressor.close)
+        self._closed = True
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        if exc_type is None:
+            self.close()
+        else:
+            self._closed = True
+
+    def _check(self):
+        if self._closed:
+            raise ValueError('the writer is closed')
+        if self._failed:
+            raise ValueError('the writer failed earlier and the document is incomplete')
+
+    def _next(self):
+        """Account for the value about to be written"""
+        self._check()
+        if not self._stack:
+            if self._started:
+                raise ValueError('the document already has its value')
+            self._started = True
+            return
+        frame = self._stack[-1]
+        if frame[0] == DICT:
+            if not frame[2]:
+                raise ValueError('a value in a dict needs key() first')
+            frame[2] = False
+        elif frame[1] == 0:
+            raise ValueError('the list already has all its items')
+        elif frame[1] is not None:
+            frame[1] -= 1
+
+    def _open(self, token, size):
+        if size is not None and (not isinstance(size, integer_types) or isinstance(size, bool) or not 0 <= size <= 0xffffffffffffffff):
+            raise ValueError('size must be None or a count of items, not {!r}'.format(size))
+        self._next()
+        if size is None:
+            self._call(self._session.token, Enc_TERMINATED_DICT if token == DICT else Enc_TERMINATED_LIST)
+        else:
+            self._call(self._session.token, encoder.encode_type_and_length(token, size))
+        self._stack.append([token, size, False])
+
+    def _call(self, method, *args):
+        try:
+            method(*args)
+        except Exception:
+            self._failed = True
+            raise
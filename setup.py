@@ -98,9 +98,14 @@ class TestCommand(Command):
 def run_setup(with_binary):
     cmdclass = dict(test=TestCommand)
     if with_binary:
+        # PBJSON_STATS=0 leaves the stats() counters out, 1 starts them on
+        define_macros = []
+        if os.environ.get('PBJSON_STATS'):
+            define_macros.append(('PBJSON_STATS', os.environ['PBJSON_STATS']))
         kw = dict(
             ext_modules=[
-                Extension("pbjson._speedups", ["pbjson/_speedups.c"])
+                Extension("pbjson._speedups", ["pbjson/_speedups.c"], define_macros=define_macros,
+                          include_dirs=['libpbjson/include'], depends=['libpbjson/include/pbjson/pbjson.h'])
             ],
             cmdclass=dict(cmdclass, build_ext=ve_build_ext),
         )